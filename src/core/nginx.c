@@ -110,6 +110,13 @@ static ngx_command_t  ngx_core_commands[] = {
       0,
       NULL },
 
+    { ngx_string("worker_hugepages"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_core_conf_t, worker_hugepages),
+      NULL },
+
     { ngx_string("worker_rlimit_nofile"),
       NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_num_slot,
@@ -1058,8 +1065,10 @@ ngx_core_module_create_conf(ngx_cycle_t *cycle)
      *     ccf->oldpid = NULL;
      *     ccf->priority = 0;
      *     ccf->cpu_affinity_auto = 0;
+     *     ccf->cpu_affinity_numa = 0;
      *     ccf->cpu_affinity_n = 0;
      *     ccf->cpu_affinity = NULL;
+     *     ccf->numa_nodes = NULL;
      */
 
     ccf->daemon = NGX_CONF_UNSET;
@@ -1069,6 +1078,7 @@ ngx_core_module_create_conf(ngx_cycle_t *cycle)
 
     ccf->worker_processes = NGX_CONF_UNSET;
     ccf->debug_points = NGX_CONF_UNSET;
+    ccf->worker_hugepages = NGX_CONF_UNSET;
 
     ccf->rlimit_nofile = NGX_CONF_UNSET;
     ccf->rlimit_core = NGX_CONF_UNSET;
@@ -1091,6 +1101,10 @@ ngx_core_module_init_conf(ngx_cycle_t *cycle, void *conf)
 {
     ngx_core_conf_t  *ccf = conf;
 
+#if (NGX_HAVE_NUMA)
+    ngx_uint_t        i;
+#endif
+
     ngx_conf_init_value(ccf->daemon, 1);
     ngx_conf_init_value(ccf->master, 1);
     ngx_conf_init_msec_value(ccf->timer_resolution, 0);
@@ -1098,10 +1112,12 @@ ngx_core_module_init_conf(ngx_cycle_t *cycle, void *conf)
 
     ngx_conf_init_value(ccf->worker_processes, 1);
     ngx_conf_init_value(ccf->debug_points, 0);
+    ngx_conf_init_value(ccf->worker_hugepages, 0);
 
 #if (NGX_HAVE_CPU_AFFINITY)
 
     if (!ccf->cpu_affinity_auto
+        && !ccf->cpu_affinity_numa
         && ccf->cpu_affinity_n
         && ccf->cpu_affinity_n != 1
         && ccf->cpu_affinity_n != (ngx_uint_t) ccf->worker_processes)
@@ -1112,6 +1128,22 @@ ngx_core_module_init_conf(ngx_cycle_t *cycle, void *conf)
                       "using last mask for remaining worker processes");
     }
 
+#endif
+
+#if (NGX_HAVE_NUMA)
+
+    /* shared memory is spread over the nodes the workers run on */
+
+    ngx_numa_interleave = 0;
+
+    if (ccf->cpu_affinity_numa) {
+        for (i = 0; i < ccf->cpu_affinity_n; i++) {
+            if (ccf->numa_nodes[i] < 8 * sizeof(unsigned long)) {
+                ngx_numa_interleave |= 1UL << ccf->numa_nodes[i];
+            }
+        }
+    }
+
 #endif
 
 
@@ -1363,6 +1395,42 @@ ngx_set_cpu_affinity(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return "is duplicate";
     }
 
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "numa") == 0) {
+
+        if (cf->args->nelts > 2) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid number of arguments in "
+                               "\"worker_cpu_affinity\" directive");
+            return NGX_CONF_ERROR;
+        }
+
+#if (NGX_HAVE_NUMA)
+        {
+        ngx_int_t  rc;
+
+        rc = ngx_numa_topology(cf->pool, &ccf->cpu_affinity, &ccf->numa_nodes,
+                               cf->log);
+        if (rc == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "failed to read NUMA topology");
+            return NGX_CONF_ERROR;
+        }
+
+        ccf->cpu_affinity_numa = 1;
+        ccf->cpu_affinity_n = rc;
+
+        return NGX_CONF_OK;
+        }
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"worker_cpu_affinity numa\" is not supported "
+                           "on this platform");
+        return NGX_CONF_ERROR;
+#endif
+    }
+
     mask = ngx_palloc(cf->pool, (cf->args->nelts - 1) * sizeof(ngx_cpuset_t));
     if (mask == NULL) {
         return NGX_CONF_ERROR;
@@ -1371,8 +1439,6 @@ ngx_set_cpu_affinity(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ccf->cpu_affinity_n = cf->args->nelts - 1;
     ccf->cpu_affinity = mask;
 
-    value = cf->args->elts;
-
     if (ngx_strcmp(value[1].data, "auto") == 0) {
 
         if (cf->args->nelts > 3) {
@@ -1486,6 +1552,32 @@ ngx_get_cpu_affinity(ngx_uint_t n)
         return &result;
     }
 
+    if (ccf->cpu_affinity_numa) {
+
+        /*
+         * workers are split into contiguous groups, one group per node,
+         * and the workers of a group are bound to the node CPUs in turn
+         */
+
+        i = n * ccf->cpu_affinity_n / ccf->worker_processes;
+        mask = &ccf->cpu_affinity[i];
+
+        j = (i * ccf->worker_processes + ccf->cpu_affinity_n - 1)
+            / ccf->cpu_affinity_n;
+        j = (n - j) % CPU_COUNT(mask);
+
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            if (CPU_ISSET(i, mask) && j-- == 0) {
+                break;
+            }
+        }
+
+        CPU_ZERO(&result);
+        CPU_SET(i, &result);
+
+        return &result;
+    }
+
     if (ccf->cpu_affinity_n > n) {
         return &ccf->cpu_affinity[n];
     }
@@ -1500,6 +1592,25 @@ ngx_get_cpu_affinity(ngx_uint_t n)
 }
 
 
+ngx_int_t
+ngx_get_numa_node(ngx_uint_t n)
+{
+#if (NGX_HAVE_NUMA)
+    ngx_core_conf_t  *ccf;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
+                                           ngx_core_module);
+
+    if (ccf->cpu_affinity_numa) {
+        return ccf->numa_nodes[n * ccf->cpu_affinity_n
+                               / ccf->worker_processes];
+    }
+#endif
+
+    return NGX_ERROR;
+}
+
+
 static char *
 ngx_set_worker_processes(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
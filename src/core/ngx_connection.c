@@ -1241,6 +1241,10 @@ ngx_close_connection(ngx_connection_t *c)
     c->read->closed = 1;
     c->write->closed = 1;
 
+#if (NGX_HAVE_MSG_ZEROCOPY)
+    ngx_linux_zerocopy_close(c);
+#endif
+
     ngx_reusable_connection(c, 0);
 
     log_error = c->log_error;
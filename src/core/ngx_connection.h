@@ -197,6 +197,10 @@ struct ngx_connection_s {
 #if (NGX_THREADS || NGX_COMPAT)
     ngx_thread_task_t  *sendfile_task;
 #endif
+
+#if (NGX_HAVE_MSG_ZEROCOPY)
+    ngx_linux_zerocopy_t  *zerocopy;
+#endif
 };
 
 
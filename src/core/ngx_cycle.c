@@ -463,6 +463,7 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
 
             if (shm_zone[i].tag == oshm_zone[n].tag
                 && shm_zone[i].shm.size == oshm_zone[n].shm.size
+                && shm_zone[i].shm.hugepages == oshm_zone[n].shm.hugepages
                 && !shm_zone[i].noreuse)
             {
                 shm_zone[i].shm.addr = oshm_zone[n].shm.addr;
@@ -684,6 +685,7 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
 
             if (oshm_zone[i].tag == shm_zone[n].tag
                 && oshm_zone[i].shm.size == shm_zone[n].shm.size
+                && oshm_zone[i].shm.hugepages == shm_zone[n].shm.hugepages
                 && !oshm_zone[i].noreuse)
             {
                 goto live_shm_zone;
@@ -901,6 +903,7 @@ failed:
 
             if (shm_zone[i].tag == oshm_zone[n].tag
                 && shm_zone[i].shm.size == oshm_zone[n].shm.size
+                && shm_zone[i].shm.hugepages == oshm_zone[n].shm.hugepages
                 && !shm_zone[i].noreuse)
             {
                 goto old_shm_zone_found;
@@ -1354,14 +1357,84 @@ ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, void *tag)
     shm_zone->shm.size = size;
     shm_zone->shm.name = *name;
     shm_zone->shm.exists = 0;
+    shm_zone->shm.hugepages = 0;
     shm_zone->init = NULL;
     shm_zone->tag = tag;
     shm_zone->noreuse = 0;
+    shm_zone->nshards = 0;
+    shm_zone->shard_size = 0;
+    shm_zone->shards = NULL;
 
     return shm_zone;
 }
 
 
+u_char *
+ngx_shm_shards_init(ngx_shm_zone_t *shm_zone, ngx_uint_t n, size_t size,
+    u_char *shards)
+{
+    ngx_uint_t        i;
+    ngx_shm_shard_t  *shard;
+    ngx_slab_pool_t  *shpool;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    shm_zone->nshards = n;
+    shm_zone->shard_size = ngx_align(ngx_align(sizeof(ngx_shm_shard_t),
+                                               NGX_ALIGNMENT)
+                                     + size, NGX_CPU_CACHE_LINE);
+
+    if (shards) {
+        shm_zone->shards = shards;
+        return shards;
+    }
+
+    /*
+     * slab chunks are aligned to their power of two size and larger
+     * allocations are page aligned, so the shards start on a cache line
+     */
+
+    shards = ngx_slab_calloc(shpool, n * shm_zone->shard_size);
+    if (shards == NULL) {
+        return NULL;
+    }
+
+    shm_zone->shards = shards;
+
+    for (i = 0; i < n; i++) {
+        shard = ngx_shm_shard(shm_zone, i);
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+        if (ngx_shmtx_create(&shard->mutex, &shard->lock, NULL) != NGX_OK) {
+            return NULL;
+        }
+
+#else
+
+        /* file locks are not sharded, all shards use the zone lock */
+
+        shard->mutex = shpool->mutex;
+
+#endif
+    }
+
+    return shards;
+}
+
+
+void
+ngx_shm_shard_lock(ngx_shm_shard_t *shard)
+{
+    if (!ngx_shmtx_trylock(&shard->mutex)) {
+        ngx_shmtx_lock(&shard->mutex);
+        shard->contended++;
+    }
+
+    shard->locks++;
+}
+
+
 static void
 ngx_clean_old_cycles(ngx_event_t *ev)
 {
@@ -33,9 +33,35 @@ struct ngx_shm_zone_s {
     void                     *tag;
     void                     *sync;
     ngx_uint_t                noreuse;  /* unsigned  noreuse:1; */
+
+    ngx_uint_t                nshards;
+    size_t                    shard_size;
+    u_char                   *shards;
 };
 
 
+/*
+ * a zone may be split into shards, each with its own lock, lock statistics
+ * and module data, placed in separate cache lines
+ */
+
+typedef struct {
+    ngx_shmtx_sh_t            lock;
+    ngx_shmtx_t               mutex;
+    ngx_atomic_t              locks;
+    ngx_atomic_t              contended;
+} ngx_shm_shard_t;
+
+
+#define ngx_shm_shard(zone, n)                                                \
+    ((ngx_shm_shard_t *) ((zone)->shards + (n) * (zone)->shard_size))
+
+#define ngx_shm_shard_data(shard)                                             \
+    ((u_char *) (shard) + ngx_align(sizeof(ngx_shm_shard_t), NGX_ALIGNMENT))
+
+#define ngx_shm_shard_unlock(shard)  ngx_shmtx_unlock(&(shard)->mutex)
+
+
 struct ngx_cycle_s {
     void                  ****conf_ctx;
     ngx_pool_t               *pool;
@@ -96,14 +122,18 @@ typedef struct {
     ngx_int_t                 worker_processes;
     ngx_int_t                 debug_points;
 
+    ngx_flag_t                worker_hugepages;
+
     ngx_int_t                 rlimit_nofile;
     off_t                     rlimit_core;
 
     int                       priority;
 
     ngx_uint_t                cpu_affinity_auto;
+    ngx_uint_t                cpu_affinity_numa;
     ngx_uint_t                cpu_affinity_n;
     ngx_cpuset_t             *cpu_affinity;
+    ngx_uint_t               *numa_nodes;
 
     char                     *username;
     ngx_uid_t                 user;
@@ -133,8 +163,12 @@ void ngx_reopen_files(ngx_cycle_t *cycle, ngx_uid_t user);
 char **ngx_set_environment(ngx_cycle_t *cycle, ngx_uint_t *last);
 ngx_pid_t ngx_exec_new_binary(ngx_cycle_t *cycle, char *const *argv);
 ngx_cpuset_t *ngx_get_cpu_affinity(ngx_uint_t n);
+ngx_int_t ngx_get_numa_node(ngx_uint_t n);
 ngx_shm_zone_t *ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name,
     size_t size, void *tag);
+u_char *ngx_shm_shards_init(ngx_shm_zone_t *shm_zone, ngx_uint_t n,
+    size_t size, u_char *shards);
+void ngx_shm_shard_lock(ngx_shm_shard_t *shard);
 void ngx_set_shutdown_timer(ngx_cycle_t *cycle);
 
 
@@ -332,6 +332,8 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
 
             ngx_open_file_del_event(file);
 
+            ngx_file_aio_unregister(file->fd, pool->log);
+
             if (ngx_close_file(file->fd) == NGX_FILE_ERROR) {
                 ngx_log_error(NGX_LOG_ALERT, pool->log, ngx_errno,
                               ngx_close_file_n " \"%V\" failed", name);
@@ -418,6 +420,10 @@ update:
 
         if (!of->is_dir) {
             file->count++;
+
+            if (file->uses >= of->min_uses) {
+                ngx_file_aio_register(file->fd, pool->log);
+            }
         }
     }
 
@@ -460,6 +466,8 @@ failed:
         if (file->count == 0) {
 
             if (file->fd != NGX_INVALID_FILE) {
+                ngx_file_aio_unregister(file->fd, pool->log);
+
                 if (ngx_close_file(file->fd) == NGX_FILE_ERROR) {
                     ngx_log_error(NGX_LOG_ALERT, pool->log, ngx_errno,
                                   ngx_close_file_n " \"%s\" failed",
@@ -476,6 +484,8 @@ failed:
     }
 
     if (of->fd != NGX_INVALID_FILE) {
+        ngx_file_aio_unregister(of->fd, pool->log);
+
         if (ngx_close_file(of->fd) == NGX_FILE_ERROR) {
             ngx_log_error(NGX_LOG_ALERT, pool->log, ngx_errno,
                           ngx_close_file_n " \"%V\" failed", name);
@@ -1057,6 +1067,8 @@ ngx_close_cached_file(ngx_open_file_cache_t *cache,
 
     if (file->fd != NGX_INVALID_FILE) {
 
+        ngx_file_aio_unregister(file->fd, log);
+
         if (ngx_close_file(file->fd) == NGX_FILE_ERROR) {
             ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
                           ngx_close_file_n " \"%s\" failed", file->name);
@@ -69,10 +69,69 @@
 
 #endif
 
+#if (NGX_HAVE_ATOMIC_OPS)
+
+/*
+ * The pool is protected by a spinlock per size class and a spinlock for
+ * the list of free pages, so the allocator does not use the zone mutex,
+ * and the mutex only protects data structures of the zone user.  A class
+ * lock is always taken before the page lock.
+ *
+ * Worker processes additionally keep a few freed chunks of each class
+ * in per-process magazines, which are used without any locks.  The
+ * magazines are allocated from the pool and record the owner's pid.
+ * They are flushed and released on exit, and the master process returns
+ * the chunks of a worker that exited abnormally in ngx_unlock_mutexes().
+ * A chunk is stored in a magazine before the count is incremented, so
+ * the count never covers a stale entry.
+ */
+
+#define ngx_slab_class_lock(pool, slot)                                       \
+    ((ngx_atomic_t *) ((pool)->locks + (slot) * NGX_CPU_CACHE_LINE))
+
+#define ngx_slab_lock(lock)         ngx_spinlock(lock, ngx_pid, 1024)
+#define ngx_slab_unlock(lock)       (void) ngx_atomic_cmp_set(lock, ngx_pid, 0)
+
+#define NGX_SLAB_MAGAZINE_SIZE      8
+#define NGX_SLAB_MAGAZINES          32
+
+
+struct ngx_slab_magazine_s {
+    ngx_slab_magazine_t  *next;
+    ngx_atomic_t          pid;        /* owner, 0 if released */
+    ngx_uint_t           *n;
+    void                **chunks;
+};
+
+
+typedef struct {
+    ngx_slab_pool_t      *pool;
+    ngx_slab_magazine_t  *magazine;   /* NULL if not available */
+} ngx_slab_local_t;
+
+#else
+
+#define ngx_slab_lock(lock)
+#define ngx_slab_unlock(lock)
+
+#endif
+
+
+static uintptr_t ngx_slab_alloc_chunk(ngx_slab_pool_t *pool, ngx_uint_t slot,
+    ngx_uint_t shift);
+static void ngx_slab_free_chunk(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
+    void *p);
 static ngx_slab_page_t *ngx_slab_alloc_pages(ngx_slab_pool_t *pool,
-    ngx_uint_t pages);
+    ngx_uint_t pages, ngx_uint_t type);
 static void ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
     ngx_uint_t pages);
+#if (NGX_HAVE_ATOMIC_OPS)
+static ngx_slab_magazine_t *ngx_slab_magazine(ngx_slab_pool_t *pool);
+static ngx_uint_t ngx_slab_magazine_flush(ngx_slab_pool_t *pool,
+    ngx_slab_magazine_t *mg);
+static ngx_uint_t ngx_slab_chunk_busy(ngx_slab_page_t *page, void *p,
+    ngx_uint_t shift);
+#endif
 static void ngx_slab_error(ngx_slab_pool_t *pool, ngx_uint_t level,
     char *text);
 
@@ -81,6 +140,11 @@ static ngx_uint_t  ngx_slab_max_size;
 static ngx_uint_t  ngx_slab_exact_size;
 static ngx_uint_t  ngx_slab_exact_shift;
 
+#if (NGX_HAVE_ATOMIC_OPS)
+static ngx_slab_local_t  ngx_slab_magazines[NGX_SLAB_MAGAZINES];
+static ngx_uint_t        ngx_slab_nmagazines;
+#endif
+
 
 void
 ngx_slab_sizes_init(void)
@@ -129,7 +193,23 @@ ngx_slab_init(ngx_slab_pool_t *pool)
 
     p += n * sizeof(ngx_slab_stat_t);
 
-    size -= n * (sizeof(ngx_slab_page_t) + sizeof(ngx_slab_stat_t));
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    /* each class lock is placed on its own cache line */
+
+    p = ngx_align_ptr(p, NGX_CPU_CACHE_LINE);
+
+    pool->locks = p;
+    ngx_memzero(pool->locks, n * NGX_CPU_CACHE_LINE);
+
+    p += n * NGX_CPU_CACHE_LINE;
+
+    pool->page_lock = 0;
+    pool->magazines = NULL;
+
+#endif
+
+    size = pool->end - p;
 
     pages = (ngx_uint_t) (size / (ngx_pagesize + sizeof(ngx_slab_page_t)));
 
@@ -165,9 +245,16 @@ ngx_slab_init(ngx_slab_pool_t *pool)
 }
 
 
+
 void *
 ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size)
 {
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    return ngx_slab_alloc_locked(pool, size);
+
+#else
+
     void  *p;
 
     ngx_shmtx_lock(&pool->mutex);
@@ -177,48 +264,115 @@ ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size)
     ngx_shmtx_unlock(&pool->mutex);
 
     return p;
+
+#endif
 }
 
 
 void *
 ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
 {
-    size_t            s;
-    uintptr_t         p, m, mask, *bitmap;
-    ngx_uint_t        i, n, slot, shift, map;
-    ngx_slab_page_t  *page, *prev, *slots;
+    size_t                s;
+    uintptr_t             p;
+    ngx_uint_t            slot, shift;
+    ngx_slab_page_t      *page;
+#if (NGX_HAVE_ATOMIC_OPS)
+    ngx_slab_magazine_t  *mg;
+#endif
 
     if (size > ngx_slab_max_size) {
+        slot = 0;
+        shift = 0;
 
         ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
                        "slab alloc: %uz", size);
 
-        page = ngx_slab_alloc_pages(pool, (size >> ngx_pagesize_shift)
-                                          + ((size % ngx_pagesize) ? 1 : 0));
-        if (page) {
-            p = ngx_slab_page_addr(pool, page);
+    } else {
+
+        if (size > pool->min_size) {
+            shift = 1;
+            for (s = size - 1; s >>= 1; shift++) { /* void */ }
+            slot = shift - pool->min_shift;
 
         } else {
-            p = 0;
+            shift = pool->min_shift;
+            slot = 0;
         }
 
+        ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
+                       "slab alloc: %uz slot: %ui", size, slot);
+    }
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    mg = ngx_slab_magazine(pool);
+
+    if (shift && mg && mg->n[slot]) {
+        p = (uintptr_t) mg->chunks[slot * NGX_SLAB_MAGAZINE_SIZE
+                                   + --mg->n[slot]];
         goto done;
     }
 
-    if (size > pool->min_size) {
-        shift = 1;
-        for (s = size - 1; s >>= 1; shift++) { /* void */ }
-        slot = shift - pool->min_shift;
+#endif
 
-    } else {
-        shift = pool->min_shift;
-        slot = 0;
+    for ( ;; ) {
+
+        if (shift == 0) {
+            ngx_slab_lock(&pool->page_lock);
+
+            page = ngx_slab_alloc_pages(pool, (size >> ngx_pagesize_shift)
+                                              + ((size % ngx_pagesize) ? 1 : 0),
+                                        NGX_SLAB_PAGE);
+
+            ngx_slab_unlock(&pool->page_lock);
+
+            p = page ? ngx_slab_page_addr(pool, page) : 0;
+
+        } else {
+            ngx_slab_lock(ngx_slab_class_lock(pool, slot));
+
+            p = ngx_slab_alloc_chunk(pool, slot, shift);
+
+            ngx_slab_unlock(ngx_slab_class_lock(pool, slot));
+        }
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+        /* chunks cached in the magazines may keep pages busy */
+
+        if (p == 0 && mg && ngx_slab_magazine_flush(pool, mg)) {
+            continue;
+        }
+
+#endif
+
+        break;
     }
 
-    pool->stats[slot].reqs++;
+    if (p == 0 && pool->log_nomem) {
+        ngx_slab_error(pool, NGX_LOG_CRIT,
+                       "ngx_slab_alloc() failed: no memory");
+    }
+
+#if (NGX_HAVE_ATOMIC_OPS)
+done:
+#endif
+
+    ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
+                   "slab alloc: %p", (void *) p);
+
+    return (void *) p;
+}
 
-    ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
-                   "slab alloc: %uz slot: %ui", size, slot);
+
+static uintptr_t
+ngx_slab_alloc_chunk(ngx_slab_pool_t *pool, ngx_uint_t slot, ngx_uint_t shift)
+{
+    uintptr_t         p, m, mask, *bitmap;
+    ngx_uint_t        i, n, map;
+    ngx_slab_page_t  *page, *prev, *slots;
+
+    pool->stats[slot].reqs++;
 
     slots = ngx_slab_slots(pool);
     page = slots[slot].next;
@@ -329,7 +483,14 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
         ngx_debug_point();
     }
 
-    page = ngx_slab_alloc_pages(pool, 1);
+    ngx_slab_lock(&pool->page_lock);
+
+    page = ngx_slab_alloc_pages(pool, 1, shift < ngx_slab_exact_shift
+                                         ? NGX_SLAB_SMALL
+                                         : shift == ngx_slab_exact_shift
+                                           ? NGX_SLAB_EXACT : NGX_SLAB_BIG);
+
+    ngx_slab_unlock(&pool->page_lock);
 
     if (page) {
         if (shift < ngx_slab_exact_shift) {
@@ -410,16 +571,19 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
 
 done:
 
-    ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
-                   "slab alloc: %p", (void *) p);
-
-    return (void *) p;
+    return p;
 }
 
 
 void *
 ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size)
 {
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    return ngx_slab_calloc_locked(pool, size);
+
+#else
+
     void  *p;
 
     ngx_shmtx_lock(&pool->mutex);
@@ -429,6 +593,8 @@ ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size)
     ngx_shmtx_unlock(&pool->mutex);
 
     return p;
+
+#endif
 }
 
 
@@ -446,39 +612,176 @@ ngx_slab_calloc_locked(ngx_slab_pool_t *pool, size_t size)
 }
 
 
+
 void
 ngx_slab_free(ngx_slab_pool_t *pool, void *p)
 {
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    ngx_slab_free_locked(pool, p);
+
+#else
+
     ngx_shmtx_lock(&pool->mutex);
 
     ngx_slab_free_locked(pool, p);
 
     ngx_shmtx_unlock(&pool->mutex);
+
+#endif
 }
 
 
 void
 ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
 {
-    size_t            size;
-    uintptr_t         slab, m, *bitmap;
-    ngx_uint_t        i, n, type, slot, shift, map;
-    ngx_slab_page_t  *slots, *page;
+    size_t                size;
+    uintptr_t             slab;
+    ngx_uint_t            n;
+    ngx_slab_page_t      *page;
+#if (NGX_HAVE_ATOMIC_OPS)
+    void                **chunks;
+    ngx_uint_t            slot, shift;
+    ngx_slab_magazine_t  *mg;
+#endif
 
     ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0, "slab free: %p", p);
 
     if ((u_char *) p < pool->start || (u_char *) p > pool->end) {
         ngx_slab_error(pool, NGX_LOG_ALERT, "ngx_slab_free(): outside of pool");
-        goto fail;
+        return;
     }
 
     n = ((u_char *) p - pool->start) >> ngx_pagesize_shift;
     page = &pool->pages[n];
+
+    if (ngx_slab_page_type(page) != NGX_SLAB_PAGE) {
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+        mg = ngx_slab_magazine(pool);
+
+        if (mg) {
+            shift = (ngx_slab_page_type(page) == NGX_SLAB_EXACT)
+                    ? ngx_slab_exact_shift
+                    : (page->slab & NGX_SLAB_SHIFT_MASK);
+
+            size = (size_t) 1 << shift;
+            slot = shift - pool->min_shift;
+
+            if (((uintptr_t) p & (size - 1)) == 0
+                && mg->n[slot] < NGX_SLAB_MAGAZINE_SIZE)
+            {
+                /*
+                 * a chunk cached in a magazine stays busy in the page,
+                 * so a chunk freed to the pool is detected by its bit;
+                 * a chunk freed twice into the magazine is only detected
+                 * in debug builds
+                 */
+
+                if (!ngx_slab_chunk_busy(page, p, shift)) {
+                    ngx_slab_error(pool, NGX_LOG_ALERT,
+                                   "ngx_slab_free(): chunk is already free");
+                    return;
+                }
+
+                chunks = &mg->chunks[slot * NGX_SLAB_MAGAZINE_SIZE];
+
+#if (NGX_DEBUG)
+                for (n = 0; n < mg->n[slot]; n++) {
+                    if (chunks[n] == p) {
+                        ngx_slab_error(pool, NGX_LOG_ALERT,
+                                   "ngx_slab_free(): chunk is already free");
+                        return;
+                    }
+                }
+#endif
+
+                ngx_slab_junk(p, size);
+
+                chunks[mg->n[slot]] = p;
+
+                ngx_memory_barrier();
+
+                mg->n[slot]++;
+
+                return;
+            }
+        }
+
+#endif
+
+        ngx_slab_free_chunk(pool, page, p);
+        return;
+    }
+
+    if ((uintptr_t) p & (ngx_pagesize - 1)) {
+        ngx_slab_error(pool, NGX_LOG_ALERT,
+                       "ngx_slab_free(): pointer to wrong chunk");
+        return;
+    }
+
+    ngx_slab_lock(&pool->page_lock);
+
     slab = page->slab;
+
+    if (!(slab & NGX_SLAB_PAGE_START)) {
+        ngx_slab_unlock(&pool->page_lock);
+
+        ngx_slab_error(pool, NGX_LOG_ALERT,
+                       "ngx_slab_free(): page is already free");
+        return;
+    }
+
+    if (slab == NGX_SLAB_PAGE_BUSY) {
+        ngx_slab_unlock(&pool->page_lock);
+
+        ngx_slab_error(pool, NGX_LOG_ALERT,
+                       "ngx_slab_free(): pointer to wrong page");
+        return;
+    }
+
+    size = slab & ~NGX_SLAB_PAGE_START;
+
+    ngx_slab_junk(p, size << ngx_pagesize_shift);
+
+    ngx_slab_free_pages(pool, page, size);
+
+    ngx_slab_unlock(&pool->page_lock);
+}
+
+
+static void
+ngx_slab_free_chunk(ngx_slab_pool_t *pool, ngx_slab_page_t *page, void *p)
+{
+    size_t            size;
+    uintptr_t         slab, m, *bitmap;
+    ngx_uint_t        i, n, type, slot, shift, map;
+    ngx_slab_page_t  *slots;
+#if (NGX_HAVE_ATOMIC_OPS)
+    ngx_atomic_t     *lock;
+#endif
+
     type = ngx_slab_page_type(page);
 
-    switch (type) {
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    shift = (type == NGX_SLAB_EXACT) ? ngx_slab_exact_shift
+                                     : (page->slab & NGX_SLAB_SHIFT_MASK);
+
+    lock = ngx_slab_class_lock(pool, shift - pool->min_shift);
+
+    ngx_slab_lock(lock);
+
+    if (ngx_slab_page_type(page) != type) {
+        goto wrong_chunk;
+    }
+
+#endif
+
+    slab = page->slab;
 
+    switch (type) {
     case NGX_SLAB_SMALL:
 
         shift = slab & NGX_SLAB_SHIFT_MASK;
@@ -495,6 +798,8 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
                              ((uintptr_t) p & ~((uintptr_t) ngx_pagesize - 1));
 
         if (bitmap[n] & m) {
+            ngx_slab_junk(p, size);
+
             slot = shift - pool->min_shift;
 
             if (page->next == NULL) {
@@ -530,8 +835,12 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
                 }
             }
 
+            ngx_slab_lock(&pool->page_lock);
+
             ngx_slab_free_pages(pool, page, 1);
 
+            ngx_slab_unlock(&pool->page_lock);
+
             pool->stats[slot].total -= (ngx_pagesize >> shift) - n;
 
             goto done;
@@ -550,6 +859,8 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
         }
 
         if (slab & m) {
+            ngx_slab_junk(p, size);
+
             slot = ngx_slab_exact_shift - pool->min_shift;
 
             if (slab == NGX_SLAB_BUSY) {
@@ -568,8 +879,12 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
                 goto done;
             }
 
+            ngx_slab_lock(&pool->page_lock);
+
             ngx_slab_free_pages(pool, page, 1);
 
+            ngx_slab_unlock(&pool->page_lock);
+
             pool->stats[slot].total -= 8 * sizeof(uintptr_t);
 
             goto done;
@@ -590,6 +905,8 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
                               + NGX_SLAB_MAP_SHIFT);
 
         if (slab & m) {
+            ngx_slab_junk(p, size);
+
             slot = shift - pool->min_shift;
 
             if (page->next == NULL) {
@@ -608,8 +925,12 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
                 goto done;
             }
 
+            ngx_slab_lock(&pool->page_lock);
+
             ngx_slab_free_pages(pool, page, 1);
 
+            ngx_slab_unlock(&pool->page_lock);
+
             pool->stats[slot].total -= ngx_pagesize >> shift;
 
             goto done;
@@ -617,65 +938,39 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
 
         goto chunk_already_free;
 
-    case NGX_SLAB_PAGE:
-
-        if ((uintptr_t) p & (ngx_pagesize - 1)) {
-            goto wrong_chunk;
-        }
-
-        if (!(slab & NGX_SLAB_PAGE_START)) {
-            ngx_slab_error(pool, NGX_LOG_ALERT,
-                           "ngx_slab_free(): page is already free");
-            goto fail;
-        }
-
-        if (slab == NGX_SLAB_PAGE_BUSY) {
-            ngx_slab_error(pool, NGX_LOG_ALERT,
-                           "ngx_slab_free(): pointer to wrong page");
-            goto fail;
-        }
-
-        size = slab & ~NGX_SLAB_PAGE_START;
-
-        ngx_slab_free_pages(pool, page, size);
-
-        ngx_slab_junk(p, size << ngx_pagesize_shift);
-
-        return;
+    default:
+        goto wrong_chunk;
     }
 
-    /* not reached */
-
-    return;
-
 done:
 
     pool->stats[slot].used--;
 
-    ngx_slab_junk(p, size);
+    ngx_slab_unlock(lock);
 
     return;
 
 wrong_chunk:
 
+    ngx_slab_unlock(lock);
+
     ngx_slab_error(pool, NGX_LOG_ALERT,
                    "ngx_slab_free(): pointer to wrong chunk");
 
-    goto fail;
+    return;
 
 chunk_already_free:
 
+    ngx_slab_unlock(lock);
+
     ngx_slab_error(pool, NGX_LOG_ALERT,
                    "ngx_slab_free(): chunk is already free");
-
-fail:
-
-    return;
 }
 
 
 static ngx_slab_page_t *
-ngx_slab_alloc_pages(ngx_slab_pool_t *pool, ngx_uint_t pages)
+ngx_slab_alloc_pages(ngx_slab_pool_t *pool, ngx_uint_t pages,
+    ngx_uint_t type)
 {
     ngx_slab_page_t  *page, *p;
 
@@ -700,9 +995,14 @@ ngx_slab_alloc_pages(ngx_slab_pool_t *pool, ngx_uint_t pages)
                 page->next->prev = page->prev;
             }
 
+            /*
+             * the type is set under the page lock, as it tells concurrent
+             * ngx_slab_free_pages() not to join the page
+             */
+
             page->slab = pages | NGX_SLAB_PAGE_START;
             page->next = NULL;
-            page->prev = NGX_SLAB_PAGE;
+            page->prev = type;
 
             pool->pfree -= pages;
 
@@ -721,15 +1021,11 @@ ngx_slab_alloc_pages(ngx_slab_pool_t *pool, ngx_uint_t pages)
         }
     }
 
-    if (pool->log_nomem) {
-        ngx_slab_error(pool, NGX_LOG_CRIT,
-                       "ngx_slab_alloc() failed: no memory");
-    }
-
     return NULL;
 }
 
 
+
 static void
 ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
     ngx_uint_t pages)
@@ -810,6 +1106,266 @@ ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
 }
 
 
+ngx_uint_t
+ngx_slab_force_unlock(ngx_slab_pool_t *pool, ngx_pid_t pid)
+{
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    ngx_uint_t  i, n, unlocked;
+
+    unlocked = 0;
+
+    n = ngx_pagesize_shift - pool->min_shift;
+
+    for (i = 0; i < n; i++) {
+        if (ngx_atomic_cmp_set(ngx_slab_class_lock(pool, i), pid, 0)) {
+            unlocked = 1;
+        }
+    }
+
+    if (ngx_atomic_cmp_set(&pool->page_lock, pid, 0)) {
+        unlocked = 1;
+    }
+
+    return unlocked;
+
+#else
+
+    return 0;
+
+#endif
+}
+
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+static ngx_uint_t  ngx_slab_magazines_off;
+
+
+static ngx_slab_magazine_t *
+ngx_slab_magazine(ngx_slab_pool_t *pool)
+{
+    size_t                size;
+    ngx_uint_t            i, n;
+    ngx_slab_magazine_t  *mg;
+
+    if (ngx_process != NGX_PROCESS_WORKER || ngx_slab_magazines_off) {
+        return NULL;
+    }
+
+    for (i = 0; i < ngx_slab_nmagazines; i++) {
+        if (ngx_slab_magazines[i].pool == pool) {
+            return ngx_slab_magazines[i].magazine;
+        }
+    }
+
+    if (i == NGX_SLAB_MAGAZINES) {
+        return NULL;
+    }
+
+    /* the magazine is allocated from the pool without a magazine */
+
+    ngx_slab_magazines[i].pool = pool;
+    ngx_slab_magazines[i].magazine = NULL;
+
+    ngx_slab_nmagazines++;
+
+    /* reuse a magazine released by an exited process */
+
+    ngx_slab_lock(&pool->page_lock);
+
+    for (mg = pool->magazines; mg; mg = mg->next) {
+        if (mg->pid == 0) {
+            mg->pid = ngx_pid;
+            break;
+        }
+    }
+
+    ngx_slab_unlock(&pool->page_lock);
+
+    if (mg == NULL) {
+        n = ngx_pagesize_shift - pool->min_shift;
+        size = sizeof(ngx_slab_magazine_t)
+               + n * (sizeof(ngx_uint_t)
+                      + NGX_SLAB_MAGAZINE_SIZE * sizeof(void *));
+
+        mg = ngx_slab_alloc_locked(pool, size);
+        if (mg == NULL) {
+            return NULL;
+        }
+
+        mg->pid = ngx_pid;
+        mg->n = (ngx_uint_t *) &mg[1];
+        mg->chunks = (void **) (mg->n + n);
+
+        ngx_memzero(mg->n, n * sizeof(ngx_uint_t));
+
+        ngx_slab_lock(&pool->page_lock);
+
+        mg->next = pool->magazines;
+        pool->magazines = mg;
+
+        ngx_slab_unlock(&pool->page_lock);
+    }
+
+    ngx_slab_magazines[i].magazine = mg;
+
+    return mg;
+}
+
+
+static ngx_uint_t
+ngx_slab_magazine_flush(ngx_slab_pool_t *pool, ngx_slab_magazine_t *mg)
+{
+    void             *p;
+    ngx_uint_t        n, slot, shift, flushed;
+    ngx_slab_page_t  *page;
+
+    flushed = 0;
+
+    for (slot = 0; slot < ngx_pagesize_shift - pool->min_shift; slot++) {
+
+        if (mg->n[slot] > NGX_SLAB_MAGAZINE_SIZE) {
+            ngx_slab_error(pool, NGX_LOG_ALERT,
+                           "ngx_slab_free(): magazine is corrupted");
+            mg->n[slot] = 0;
+            continue;
+        }
+
+        shift = slot + pool->min_shift;
+
+        while (mg->n[slot]) {
+            p = mg->chunks[slot * NGX_SLAB_MAGAZINE_SIZE + --mg->n[slot]];
+
+            /* the magazine of a crashed process is not trusted */
+
+            if ((u_char *) p < pool->start || (u_char *) p >= pool->end
+                || ((uintptr_t) p & (((uintptr_t) 1 << shift) - 1)))
+            {
+                ngx_slab_error(pool, NGX_LOG_ALERT,
+                               "ngx_slab_free(): pointer to wrong chunk");
+                continue;
+            }
+
+            n = ((u_char *) p - pool->start) >> ngx_pagesize_shift;
+            page = &pool->pages[n];
+
+            if (!ngx_slab_chunk_busy(page, p, shift)) {
+                ngx_slab_error(pool, NGX_LOG_ALERT,
+                               "ngx_slab_free(): chunk is already free");
+                continue;
+            }
+
+            ngx_slab_free_chunk(pool, page, p);
+
+            flushed++;
+        }
+    }
+
+    return flushed;
+}
+
+
+static ngx_uint_t
+ngx_slab_chunk_busy(ngx_slab_page_t *page, void *p, ngx_uint_t shift)
+{
+    uintptr_t   m, *bitmap;
+    ngx_uint_t  n;
+
+    /* the bit of an allocated chunk is not changed by other processes */
+
+    n = ((uintptr_t) p & (ngx_pagesize - 1)) >> shift;
+
+    switch (ngx_slab_page_type(page)) {
+
+    case NGX_SLAB_SMALL:
+        m = (uintptr_t) 1 << (n % (8 * sizeof(uintptr_t)));
+        bitmap = (uintptr_t *)
+                             ((uintptr_t) p & ~((uintptr_t) ngx_pagesize - 1));
+
+        return (bitmap[n / (8 * sizeof(uintptr_t))] & m) != 0;
+
+    case NGX_SLAB_EXACT:
+        return (page->slab & ((uintptr_t) 1 << n)) != 0;
+
+    case NGX_SLAB_BIG:
+        return (page->slab & ((uintptr_t) 1 << (n + NGX_SLAB_MAP_SHIFT))) != 0;
+
+    default:
+        return 0;
+    }
+}
+
+#endif
+
+
+void
+ngx_slab_flush_magazines(void)
+{
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    ngx_uint_t            i;
+    ngx_slab_magazine_t  *mg;
+
+    ngx_slab_magazines_off = 1;
+
+    for (i = 0; i < ngx_slab_nmagazines; i++) {
+        mg = ngx_slab_magazines[i].magazine;
+
+        if (mg == NULL) {
+            continue;
+        }
+
+        (void) ngx_slab_magazine_flush(ngx_slab_magazines[i].pool, mg);
+
+        ngx_memory_barrier();
+
+        mg->pid = 0;
+    }
+
+#endif
+}
+
+
+ngx_uint_t
+ngx_slab_reclaim_magazines(ngx_slab_pool_t *pool, ngx_pid_t pid)
+{
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    ngx_uint_t            n;
+    ngx_slab_magazine_t  *mg;
+
+    /*
+     * magazines are only added to the list head and never removed,
+     * so the list is walked without the page lock; the allocator locks
+     * held by the exited process are expected to be unlocked already
+     */
+
+    n = 0;
+
+    for (mg = pool->magazines; mg; mg = mg->next) {
+
+        if ((ngx_pid_t) mg->pid != pid) {
+            continue;
+        }
+
+        n += ngx_slab_magazine_flush(pool, mg);
+
+        ngx_memory_barrier();
+
+        mg->pid = 0;
+    }
+
+    return n;
+
+#else
+
+    return 0;
+
+#endif
+}
+
+
 static void
 ngx_slab_error(ngx_slab_pool_t *pool, ngx_uint_t level, char *text)
 {
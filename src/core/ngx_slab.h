@@ -14,6 +14,7 @@
 
 
 typedef struct ngx_slab_page_s  ngx_slab_page_t;
+typedef struct ngx_slab_magazine_s  ngx_slab_magazine_t;
 
 struct ngx_slab_page_s {
     uintptr_t         slab;
@@ -32,30 +33,37 @@ typedef struct {
 
 
 typedef struct {
-    ngx_shmtx_sh_t    lock;
+    ngx_shmtx_sh_t        lock;
 
-    size_t            min_size;
-    size_t            min_shift;
+    size_t                min_size;
+    size_t                min_shift;
 
-    ngx_slab_page_t  *pages;
-    ngx_slab_page_t  *last;
-    ngx_slab_page_t   free;
+    ngx_slab_page_t      *pages;
+    ngx_slab_page_t      *last;
+    ngx_slab_page_t       free;
 
-    ngx_slab_stat_t  *stats;
-    ngx_uint_t        pfree;
+    ngx_slab_stat_t      *stats;
+    ngx_uint_t            pfree;
 
-    u_char           *start;
-    u_char           *end;
+#if (NGX_HAVE_ATOMIC_OPS)
+    ngx_atomic_t          page_lock;
+    u_char               *locks;
 
-    ngx_shmtx_t       mutex;
+    ngx_slab_magazine_t  *magazines;
+#endif
 
-    u_char           *log_ctx;
-    u_char            zero;
+    u_char               *start;
+    u_char               *end;
 
-    unsigned          log_nomem:1;
+    ngx_shmtx_t           mutex;
 
-    void             *data;
-    void             *addr;
+    u_char               *log_ctx;
+    u_char                zero;
+
+    unsigned              log_nomem:1;
+
+    void                 *data;
+    void                 *addr;
 } ngx_slab_pool_t;
 
 
@@ -67,6 +75,9 @@ void *ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size);
 void *ngx_slab_calloc_locked(ngx_slab_pool_t *pool, size_t size);
 void ngx_slab_free(ngx_slab_pool_t *pool, void *p);
 void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p);
+ngx_uint_t ngx_slab_force_unlock(ngx_slab_pool_t *pool, ngx_pid_t pid);
+ngx_uint_t ngx_slab_reclaim_magazines(ngx_slab_pool_t *pool, ngx_pid_t pid);
+void ngx_slab_flush_magazines(void);
 
 
 #endif /* _NGX_SLAB_H_INCLUDED_ */
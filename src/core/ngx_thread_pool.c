@@ -16,27 +16,59 @@ typedef struct {
 } ngx_thread_pool_conf_t;
 
 
+/*
+ * Each thread has a bounded ring of tasks.  The worker process puts
+ * tasks into the rings in turn, and a thread takes tasks from its own
+ * ring first and then steals them from the rings of other threads.
+ * The worker process is the only producer, so a ring needs no locks:
+ * the tail is advanced by the producer only, and the threads take
+ * tasks by moving the head with compare-and-swap.  The head, the tail
+ * and the thread counters are kept in separate cache lines.
+ *
+ * The mutex and the condition variable are used only to put idle
+ * threads to sleep and to wake them up.  On exit, a thread stops only
+ * when all rings are empty, so the tasks posted are run.  The number
+ * of tasks queued in all rings is limited by max_queue.
+ */
+
 typedef struct {
-    ngx_thread_task_t        *first;
-    ngx_thread_task_t       **last;
-} ngx_thread_pool_queue_t;
+    ngx_thread_task_t       **slots;
+    ngx_uint_t                mask;
+    ngx_thread_pool_t        *pool;
+    ngx_uint_t                n;
+    u_char                    pad0[NGX_CPU_CACHE_LINE - 4 * sizeof(void *)];
+
+    ngx_atomic_t              head;
+    u_char                    pad1[NGX_CPU_CACHE_LINE - sizeof(ngx_atomic_t)];
+
+    ngx_atomic_t              tail;
+    u_char                    pad2[NGX_CPU_CACHE_LINE - sizeof(ngx_atomic_t)];
 
-#define ngx_thread_pool_queue_init(q)                                         \
-    (q)->first = NULL;                                                        \
-    (q)->last = &(q)->first
+    ngx_atomic_t              tasks;
+    ngx_atomic_t              steals;
+    ngx_atomic_t              wait_time;
+    u_char                    pad3[NGX_CPU_CACHE_LINE
+                                   - 3 * sizeof(ngx_atomic_t)];
+} ngx_thread_pool_thread_t;
 
 
 struct ngx_thread_pool_s {
     ngx_thread_mutex_t        mtx;
-    ngx_thread_pool_queue_t   queue;
-    ngx_int_t                 waiting;
     ngx_thread_cond_t         cond;
+    ngx_atomic_t              sleeping;
+    ngx_atomic_t              queued;
+    ngx_atomic_t              running;
+    ngx_uint_t                exiting;    /* unsigned  exiting:1; */
+
+    ngx_thread_pool_thread_t *queues;
+    ngx_uint_t                next;
 
     ngx_log_t                *log;
 
     ngx_str_t                 name;
     ngx_uint_t                threads;
     ngx_int_t                 max_queue;
+    ngx_uint_t                helpers;    /* unsigned  helpers:1; */
 
     u_char                   *file;
     ngx_uint_t                line;
@@ -46,9 +78,9 @@ struct ngx_thread_pool_s {
 static ngx_int_t ngx_thread_pool_init(ngx_thread_pool_t *tp, ngx_log_t *log,
     ngx_pool_t *pool);
 static void ngx_thread_pool_destroy(ngx_thread_pool_t *tp);
-static void ngx_thread_pool_exit_handler(void *data, ngx_log_t *log);
 
 static void *ngx_thread_pool_cycle(void *data);
+static ngx_thread_task_t *ngx_thread_pool_take(ngx_thread_pool_thread_t *thr);
 static void ngx_thread_pool_handler(ngx_event_t *ev);
 
 static char *ngx_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
@@ -99,17 +131,20 @@ ngx_module_t  ngx_thread_pool_module = {
 static ngx_str_t  ngx_thread_pool_default = ngx_string("default");
 
 static ngx_uint_t               ngx_thread_pool_task_id;
-static ngx_atomic_t             ngx_thread_pool_done_lock;
-static ngx_thread_pool_queue_t  ngx_thread_pool_done;
+
+/* the completed tasks, linked in the reverse order */
+static ngx_atomic_t             ngx_thread_pool_done;
 
 
 static ngx_int_t
 ngx_thread_pool_init(ngx_thread_pool_t *tp, ngx_log_t *log, ngx_pool_t *pool)
 {
-    int             err;
-    pthread_t       tid;
-    ngx_uint_t      n;
-    pthread_attr_t  attr;
+    int                        err;
+    size_t                     size;
+    pthread_t                  tid;
+    ngx_uint_t                 n;
+    pthread_attr_t             attr;
+    ngx_thread_pool_thread_t  *thr;
 
     if (ngx_notify == NULL) {
         ngx_log_error(NGX_LOG_ALERT, log, 0,
@@ -117,7 +152,37 @@ ngx_thread_pool_init(ngx_thread_pool_t *tp, ngx_log_t *log, ngx_pool_t *pool)
         return NGX_ERROR;
     }
 
-    ngx_thread_pool_queue_init(&tp->queue);
+    tp->queues = ngx_pmemalign(pool,
+                               tp->threads * sizeof(ngx_thread_pool_thread_t),
+                               NGX_CPU_CACHE_LINE);
+    if (tp->queues == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(tp->queues, tp->threads * sizeof(ngx_thread_pool_thread_t));
+
+    /* the ring size is a power of two */
+
+    size = (tp->max_queue + tp->threads - 1) / tp->threads;
+
+    for (n = 1; n < size; n <<= 1) { /* void */ }
+
+    for (n--, thr = tp->queues; thr < tp->queues + tp->threads; thr++) {
+        thr->slots = ngx_palloc(pool, (n + 1) * sizeof(ngx_thread_task_t *));
+        if (thr->slots == NULL) {
+            return NGX_ERROR;
+        }
+
+        thr->mask = n;
+        thr->pool = tp;
+        thr->n = thr - tp->queues;
+    }
+
+    tp->sleeping = 0;
+    tp->queued = 0;
+    tp->running = 0;
+    tp->exiting = 0;
+    tp->next = 0;
 
     if (ngx_thread_mutex_create(&tp->mtx, log) != NGX_OK) {
         return NGX_ERROR;
@@ -154,8 +219,12 @@ ngx_thread_pool_init(ngx_thread_pool_t *tp, ngx_log_t *log, ngx_pool_t *pool)
 #endif
 
     for (n = 0; n < tp->threads; n++) {
-        err = pthread_create(&tid, &attr, ngx_thread_pool_cycle, tp);
+        (void) ngx_atomic_fetch_add(&tp->running, 1);
+
+        err = pthread_create(&tid, &attr, ngx_thread_pool_cycle,
+                             &tp->queues[n]);
         if (err) {
+            (void) ngx_atomic_fetch_add(&tp->running, -1);
             ngx_log_error(NGX_LOG_ALERT, log, err,
                           "pthread_create() failed");
             return NGX_ERROR;
@@ -171,27 +240,25 @@ ngx_thread_pool_init(ngx_thread_pool_t *tp, ngx_log_t *log, ngx_pool_t *pool)
 static void
 ngx_thread_pool_destroy(ngx_thread_pool_t *tp)
 {
-    ngx_uint_t           n;
-    ngx_thread_task_t    task;
-    volatile ngx_uint_t  lock;
-
-    ngx_memzero(&task, sizeof(ngx_thread_task_t));
+    if (ngx_thread_mutex_lock(&tp->mtx, tp->log) != NGX_OK) {
+        return;
+    }
 
-    task.handler = ngx_thread_pool_exit_handler;
-    task.ctx = (void *) &lock;
+    tp->exiting = 1;
 
-    for (n = 0; n < tp->threads; n++) {
-        lock = 1;
+    if (ngx_thread_cond_broadcast(&tp->cond, tp->log) != NGX_OK) {
+        (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+        return;
+    }
 
-        if (ngx_thread_task_post(tp, &task) != NGX_OK) {
-            return;
-        }
+    if (ngx_thread_mutex_unlock(&tp->mtx, tp->log) != NGX_OK) {
+        return;
+    }
 
-        while (lock) {
-            ngx_sched_yield();
-        }
+    /* the threads exit once the tasks posted are run */
 
-        task.event.active = 0;
+    while (tp->running) {
+        ngx_sched_yield();
     }
 
     (void) ngx_thread_cond_destroy(&tp->cond, tp->log);
@@ -200,17 +267,6 @@ ngx_thread_pool_destroy(ngx_thread_pool_t *tp)
 }
 
 
-static void
-ngx_thread_pool_exit_handler(void *data, ngx_log_t *log)
-{
-    ngx_uint_t *lock = data;
-
-    *lock = 0;
-
-    pthread_exit(0);
-}
-
-
 ngx_thread_task_t *
 ngx_thread_task_alloc(ngx_pool_t *pool, size_t size)
 {
@@ -230,22 +286,20 @@ ngx_thread_task_alloc(ngx_pool_t *pool, size_t size)
 ngx_int_t
 ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
 {
+    ngx_uint_t                 i;
+    ngx_atomic_uint_t          tail;
+    ngx_thread_pool_thread_t  *thr;
+
     if (task->event.active) {
         ngx_log_error(NGX_LOG_ALERT, tp->log, 0,
                       "task #%ui already active", task->id);
         return NGX_ERROR;
     }
 
-    if (ngx_thread_mutex_lock(&tp->mtx, tp->log) != NGX_OK) {
-        return NGX_ERROR;
-    }
-
-    if (tp->waiting >= tp->max_queue) {
-        (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
-
+    if (tp->queued >= (ngx_atomic_uint_t) tp->max_queue) {
         ngx_log_error(NGX_LOG_ERR, tp->log, 0,
-                      "thread pool \"%V\" queue overflow: %i tasks waiting",
-                      &tp->name, tp->waiting);
+                      "thread pool \"%V\" queue overflow: %ui tasks waiting",
+                      &tp->name, (ngx_uint_t) tp->queued);
         return NGX_ERROR;
     }
 
@@ -253,18 +307,52 @@ ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
 
     task->id = ngx_thread_pool_task_id++;
     task->next = NULL;
+    task->queued = ngx_monotonic_usec();
 
-    if (ngx_thread_cond_signal(&tp->cond, tp->log) != NGX_OK) {
-        (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
-        return NGX_ERROR;
+    (void) ngx_atomic_fetch_add(&tp->queued, 1);
+
+    for (i = 0; i < tp->threads; i++) {
+        thr = &tp->queues[tp->next++ % tp->threads];
+
+        tail = thr->tail;
+
+        if (tail - thr->head > thr->mask) {
+            continue;
+        }
+
+        thr->slots[tail & thr->mask] = task;
+
+        /* a full barrier: the task is visible before the sleepers check */
+
+        (void) ngx_atomic_fetch_add(&thr->tail, 1);
+
+        goto posted;
     }
 
-    *tp->queue.last = task;
-    tp->queue.last = &task->next;
+    task->event.active = 0;
 
-    tp->waiting++;
+    (void) ngx_atomic_fetch_add(&tp->queued, -1);
 
-    (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+    ngx_log_error(NGX_LOG_ERR, tp->log, 0,
+                  "thread pool \"%V\" queue overflow: %ui tasks waiting",
+                  &tp->name, (ngx_uint_t) tp->queued);
+
+    return NGX_ERROR;
+
+posted:
+
+    if (tp->sleeping) {
+        if (ngx_thread_mutex_lock(&tp->mtx, tp->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_thread_cond_signal(&tp->cond, tp->log) != NGX_OK) {
+            (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+            return NGX_ERROR;
+        }
+
+        (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+    }
 
     ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
                    "task #%ui added to thread pool \"%V\"",
@@ -277,11 +365,14 @@ ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
 static void *
 ngx_thread_pool_cycle(void *data)
 {
-    ngx_thread_pool_t *tp = data;
+    ngx_thread_pool_thread_t *thr = data;
 
     int                 err;
     sigset_t            set;
-    ngx_thread_task_t  *task;
+    ngx_thread_task_t  *task, *last;
+    ngx_thread_pool_t  *tp;
+
+    tp = thr->pool;
 
 #if 0
     ngx_time_update();
@@ -300,36 +391,56 @@ ngx_thread_pool_cycle(void *data)
     err = pthread_sigmask(SIG_BLOCK, &set, NULL);
     if (err) {
         ngx_log_error(NGX_LOG_ALERT, tp->log, err, "pthread_sigmask() failed");
-        return NULL;
+        goto exit;
     }
 
     for ( ;; ) {
-        if (ngx_thread_mutex_lock(&tp->mtx, tp->log) != NGX_OK) {
-            return NULL;
-        }
+        task = ngx_thread_pool_take(thr);
 
-        /* the number may become negative */
-        tp->waiting--;
+        if (task == NULL) {
+            if (ngx_thread_mutex_lock(&tp->mtx, tp->log) != NGX_OK) {
+                goto exit;
+            }
+
+            /*
+             * a full barrier: either the worker process sees the sleeper,
+             * or the thread sees the task posted
+             */
+
+            (void) ngx_atomic_fetch_add(&tp->sleeping, 1);
+
+            for ( ;; ) {
+                task = ngx_thread_pool_take(thr);
+
+                if (task) {
+                    break;
+                }
 
-        while (tp->queue.first == NULL) {
-            if (ngx_thread_cond_wait(&tp->cond, &tp->mtx, tp->log)
-                != NGX_OK)
-            {
-                (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
-                return NULL;
+                /* all rings are empty */
+
+                if (tp->exiting) {
+                    (void) ngx_atomic_fetch_add(&tp->sleeping, -1);
+                    (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+                    goto exit;
+                }
+
+                if (ngx_thread_cond_wait(&tp->cond, &tp->mtx, tp->log)
+                    != NGX_OK)
+                {
+                    (void) ngx_thread_mutex_unlock(&tp->mtx, tp->log);
+                    goto exit;
+                }
             }
-        }
 
-        task = tp->queue.first;
-        tp->queue.first = task->next;
+            (void) ngx_atomic_fetch_add(&tp->sleeping, -1);
 
-        if (tp->queue.first == NULL) {
-            tp->queue.last = &tp->queue.first;
+            if (ngx_thread_mutex_unlock(&tp->mtx, tp->log) != NGX_OK) {
+                goto exit;
+            }
         }
 
-        if (ngx_thread_mutex_unlock(&tp->mtx, tp->log) != NGX_OK) {
-            return NULL;
-        }
+        thr->tasks++;
+        thr->wait_time += ngx_monotonic_usec() - task->queued;
 
 #if 0
         ngx_time_update();
@@ -345,19 +456,78 @@ ngx_thread_pool_cycle(void *data)
                        "complete task #%ui in thread pool \"%V\"",
                        task->id, &tp->name);
 
-        task->next = NULL;
+        do {
+            last = (ngx_thread_task_t *) ngx_thread_pool_done;
+            task->next = last;
 
-        ngx_spinlock(&ngx_thread_pool_done_lock, 1, 2048);
+        } while (!ngx_atomic_cmp_set(&ngx_thread_pool_done,
+                                     (ngx_atomic_uint_t) last,
+                                     (ngx_atomic_uint_t) task));
 
-        *ngx_thread_pool_done.last = task;
-        ngx_thread_pool_done.last = &task->next;
+        /* the worker process is notified once per batch of tasks */
 
-        ngx_memory_barrier();
+        if (last == NULL) {
+            (void) ngx_notify(ngx_thread_pool_handler);
+        }
+    }
+
+exit:
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, tp->log, 0,
+                   "thread in pool \"%V\" exited", &tp->name);
+
+    (void) ngx_atomic_fetch_add(&tp->running, -1);
+
+    return NULL;
+}
 
-        ngx_unlock(&ngx_thread_pool_done_lock);
 
-        (void) ngx_notify(ngx_thread_pool_handler);
+static ngx_thread_task_t *
+ngx_thread_pool_take(ngx_thread_pool_thread_t *thr)
+{
+    ngx_uint_t                 i;
+    ngx_thread_pool_t         *tp;
+    ngx_thread_task_t         *task;
+    ngx_atomic_uint_t          head;
+    ngx_thread_pool_thread_t  *q;
+
+    tp = thr->pool;
+
+    for (i = 0; i < tp->threads; i++) {
+        q = &tp->queues[(thr->n + i) % tp->threads];
+
+        for ( ;; ) {
+            head = q->head;
+
+            ngx_memory_barrier();
+
+            if (head == q->tail) {
+                break;
+            }
+
+            ngx_memory_barrier();
+
+            /*
+             * the slot cannot be reused until the head is moved,
+             * so the compare-and-swap fails if the task was taken
+             */
+
+            task = q->slots[head & q->mask];
+
+            if (ngx_atomic_cmp_set(&q->head, head, head + 1)) {
+
+                (void) ngx_atomic_fetch_add(&tp->queued, -1);
+
+                if (i) {
+                    thr->steals++;
+                }
+
+                return task;
+            }
+        }
     }
+
+    return NULL;
 }
 
 
@@ -365,19 +535,28 @@ static void
 ngx_thread_pool_handler(ngx_event_t *ev)
 {
     ngx_event_t        *event;
-    ngx_thread_task_t  *task;
+    ngx_thread_task_t  *task, *next, *first;
 
     ngx_log_debug0(NGX_LOG_DEBUG_CORE, ev->log, 0, "thread pool handler");
 
-    ngx_spinlock(&ngx_thread_pool_done_lock, 1, 2048);
+    do {
+        task = (ngx_thread_task_t *) ngx_thread_pool_done;
+
+    } while (!ngx_atomic_cmp_set(&ngx_thread_pool_done,
+                                 (ngx_atomic_uint_t) task, 0));
+
+    /* restore the order of completion */
 
-    task = ngx_thread_pool_done.first;
-    ngx_thread_pool_done.first = NULL;
-    ngx_thread_pool_done.last = &ngx_thread_pool_done.first;
+    first = NULL;
 
-    ngx_memory_barrier();
+    while (task) {
+        next = task->next;
+        task->next = first;
+        first = task;
+        task = next;
+    }
 
-    ngx_unlock(&ngx_thread_pool_done_lock);
+    task = first;
 
     while (task) {
         ngx_log_debug1(NGX_LOG_DEBUG_CORE, ev->log, 0,
@@ -579,6 +758,13 @@ ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name)
 }
 
 
+void
+ngx_thread_pool_use_in_helpers(ngx_thread_pool_t *tp)
+{
+    tp->helpers = 1;
+}
+
+
 static ngx_int_t
 ngx_thread_pool_init_worker(ngx_cycle_t *cycle)
 {
@@ -587,7 +773,8 @@ ngx_thread_pool_init_worker(ngx_cycle_t *cycle)
     ngx_thread_pool_conf_t   *tcf;
 
     if (ngx_process != NGX_PROCESS_WORKER
-        && ngx_process != NGX_PROCESS_SINGLE)
+        && ngx_process != NGX_PROCESS_SINGLE
+        && ngx_process != NGX_PROCESS_HELPER)
     {
         return NGX_OK;
     }
@@ -599,11 +786,21 @@ ngx_thread_pool_init_worker(ngx_cycle_t *cycle)
         return NGX_OK;
     }
 
-    ngx_thread_pool_queue_init(&ngx_thread_pool_done);
+    ngx_thread_pool_done = 0;
 
     tpp = tcf->pools.elts;
 
     for (i = 0; i < tcf->pools.nelts; i++) {
+
+        /*
+         * the cache manager and cache loader processes start only
+         * the pools used by them
+         */
+
+        if (ngx_process == NGX_PROCESS_HELPER && !tpp[i]->helpers) {
+            continue;
+        }
+
         if (ngx_thread_pool_init(tpp[i], cycle->log, cycle->pool) != NGX_OK) {
             return NGX_ERROR;
         }
@@ -639,3 +836,44 @@ ngx_thread_pool_exit_worker(ngx_cycle_t *cycle)
         ngx_thread_pool_destroy(tpp[i]);
     }
 }
+
+
+ngx_int_t
+ngx_thread_pool_stat(ngx_cycle_t *cycle, ngx_uint_t n,
+    ngx_thread_pool_stat_t *stat)
+{
+    ngx_uint_t                 i;
+    ngx_thread_pool_t        **tpp, *tp;
+    ngx_thread_pool_conf_t    *tcf;
+    ngx_thread_pool_thread_t  *thr;
+
+    tcf = (ngx_thread_pool_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                  ngx_thread_pool_module);
+
+    if (tcf == NULL || n >= tcf->pools.nelts) {
+        return NGX_DECLINED;
+    }
+
+    tpp = tcf->pools.elts;
+    tp = tpp[n];
+
+    ngx_memzero(stat, sizeof(ngx_thread_pool_stat_t));
+
+    stat->name = &tp->name;
+    stat->threads = tp->threads;
+
+    if (tp->queues == NULL) {
+        return NGX_OK;
+    }
+
+    for (i = 0; i < tp->threads; i++) {
+        thr = &tp->queues[i];
+
+        stat->waiting += thr->tail - thr->head;
+        stat->tasks += thr->tasks;
+        stat->steals += thr->steals;
+        stat->wait_time += thr->wait_time;
+    }
+
+    return NGX_OK;
+}
@@ -20,17 +20,32 @@ struct ngx_thread_task_s {
     void                *ctx;
     void               (*handler)(void *data, ngx_log_t *log);
     ngx_event_t          event;
+    uint64_t             queued;
 };
 
 
 typedef struct ngx_thread_pool_s  ngx_thread_pool_t;
 
 
+typedef struct {
+    ngx_str_t           *name;
+    ngx_uint_t           threads;
+    ngx_uint_t           waiting;
+    ngx_atomic_uint_t    tasks;
+    ngx_atomic_uint_t    steals;
+    ngx_atomic_uint_t    wait_time;      /* microseconds */
+} ngx_thread_pool_stat_t;
+
+
 ngx_thread_pool_t *ngx_thread_pool_add(ngx_conf_t *cf, ngx_str_t *name);
 ngx_thread_pool_t *ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name);
+void ngx_thread_pool_use_in_helpers(ngx_thread_pool_t *tp);
 
 ngx_thread_task_t *ngx_thread_task_alloc(ngx_pool_t *pool, size_t size);
 ngx_int_t ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task);
 
+ngx_int_t ngx_thread_pool_stat(ngx_cycle_t *cycle, ngx_uint_t n,
+    ngx_thread_pool_stat_t *stat);
+
 
 #endif /* _NGX_THREAD_POOL_H_INCLUDED_ */
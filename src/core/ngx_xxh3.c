@@ -0,0 +1,521 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * An internal implementation of the 128-bit XXH3 hash with the default
+ * secret and a zero seed, based on Yann Collet's BSD-licensed xxHash:
+ * https://github.com/Cyan4973/xxHash
+ *
+ * The result is stored in the canonical (big-endian) form, as printed
+ * by xxh128sum.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_xxh3.h>
+
+
+#define NGX_XXH3_STRIPE_LEN      64
+#define NGX_XXH3_SECRET_LEN      192
+#define NGX_XXH3_BLOCK_STRIPES                                                \
+    ((NGX_XXH3_SECRET_LEN - NGX_XXH3_STRIPE_LEN) / 8)
+#define NGX_XXH3_BUFFER_STRIPES  (256 / NGX_XXH3_STRIPE_LEN)
+#define NGX_XXH3_MID_SIZE_MAX    240
+
+#define NGX_XXH_PRIME32_1        0x9e3779b1U
+#define NGX_XXH_PRIME32_2        0x85ebca77U
+#define NGX_XXH_PRIME32_3        0xc2b2ae3dU
+
+#define NGX_XXH_PRIME64_1        0x9e3779b185ebca87ULL
+#define NGX_XXH_PRIME64_2        0xc2b2ae3d27d4eb4fULL
+#define NGX_XXH_PRIME64_3        0x165667b19e3779f9ULL
+#define NGX_XXH_PRIME64_4        0x85ebca77c2b2ae63ULL
+#define NGX_XXH_PRIME64_5        0x27d4eb2f165667c5ULL
+
+
+typedef struct {
+    uint64_t  lo;
+    uint64_t  hi;
+} ngx_xxh3_128_t;
+
+
+static ngx_xxh3_128_t ngx_xxh3_short(const u_char *p, size_t len);
+static ngx_xxh3_128_t ngx_xxh3_mid(const u_char *p, size_t len);
+static void ngx_xxh3_stripes(ngx_xxh3_t *ctx, const u_char *p, size_t n);
+static void ngx_xxh3_accumulate(uint64_t *acc, const u_char *p,
+    const u_char *secret);
+static void ngx_xxh3_scramble(uint64_t *acc);
+static uint64_t ngx_xxh3_merge(uint64_t *acc, const u_char *secret,
+    uint64_t start);
+static void ngx_xxh3_mix32(uint64_t *acc, const u_char *p1, const u_char *p2,
+    const u_char *secret);
+static uint64_t ngx_xxh3_mix16(const u_char *p, const u_char *secret);
+static ngx_xxh3_128_t ngx_xxh3_mul128(uint64_t a, uint64_t b);
+
+
+static const u_char  ngx_xxh3_secret[NGX_XXH3_SECRET_LEN] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe,
+    0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+    0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78,
+    0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e,
+    0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+    0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e,
+    0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f,
+    0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+    0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3,
+    0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49,
+    0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+    0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28,
+    0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+
+/*
+ * GET32() and GET64() read input bytes in little-endian byte order.
+ *
+ * The check for little-endian architectures that tolerate unaligned
+ * memory accesses is just an optimization.  Nothing will break if it
+ * does not work.
+ */
+
+#if (NGX_HAVE_LITTLE_ENDIAN && NGX_HAVE_NONALIGNED)
+
+#define GET32(p)  (*(uint32_t *) (p))
+#define GET64(p)  (*(uint64_t *) (p))
+
+#else
+
+#define GET32(p)                                                              \
+    ((uint32_t) (p)[0] | ((uint32_t) (p)[1] << 8)                             \
+     | ((uint32_t) (p)[2] << 16) | ((uint32_t) (p)[3] << 24))
+
+#define GET64(p)  ((uint64_t) GET32(p) | ((uint64_t) GET32((p) + 4) << 32))
+
+#endif
+
+#define SWAP32(x)                                                             \
+    (((x) >> 24) | (((x) >> 8) & 0xff00) | (((x) << 8) & 0xff0000)           \
+     | ((x) << 24))
+
+#define SWAP64(x)                                                             \
+    (((uint64_t) SWAP32((uint32_t) (x)) << 32)                                \
+     | SWAP32((uint32_t) ((x) >> 32)))
+
+#define ROTL32(x, n)  (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define XORSHIFT(x, n)  ((x) ^ ((x) >> (n)))
+
+#define AVALANCHE(x)                                                          \
+    XORSHIFT(XORSHIFT(x, 37) * 0x165667919e3779f9ULL, 32)
+
+
+static ngx_inline uint64_t
+ngx_xxh64_avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= NGX_XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= NGX_XXH_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+
+void
+ngx_xxh3_init(ngx_xxh3_t *ctx)
+{
+    ctx->acc[0] = NGX_XXH_PRIME32_3;
+    ctx->acc[1] = NGX_XXH_PRIME64_1;
+    ctx->acc[2] = NGX_XXH_PRIME64_2;
+    ctx->acc[3] = NGX_XXH_PRIME64_3;
+    ctx->acc[4] = NGX_XXH_PRIME64_4;
+    ctx->acc[5] = NGX_XXH_PRIME32_2;
+    ctx->acc[6] = NGX_XXH_PRIME64_5;
+    ctx->acc[7] = NGX_XXH_PRIME32_1;
+
+    ctx->bytes = 0;
+    ctx->buffered = 0;
+    ctx->stripes = 0;
+}
+
+
+void
+ngx_xxh3_update(ngx_xxh3_t *ctx, const void *data, size_t size)
+{
+    size_t         free;
+    const u_char  *p;
+
+    p = data;
+    ctx->bytes += size;
+
+    if (ctx->buffered + size <= sizeof(ctx->buffer)) {
+        ngx_memcpy(&ctx->buffer[ctx->buffered], p, size);
+        ctx->buffered += size;
+        return;
+    }
+
+    /*
+     * at least one byte is always left in the buffer, as the last stripe
+     * is processed differently in ngx_xxh3_final()
+     */
+
+    if (ctx->buffered) {
+        free = sizeof(ctx->buffer) - ctx->buffered;
+
+        ngx_memcpy(&ctx->buffer[ctx->buffered], p, free);
+        p += free;
+        size -= free;
+
+        ngx_xxh3_stripes(ctx, ctx->buffer, NGX_XXH3_BUFFER_STRIPES);
+        ctx->buffered = 0;
+    }
+
+    if (size > sizeof(ctx->buffer)) {
+
+        do {
+            ngx_xxh3_stripes(ctx, p, NGX_XXH3_BUFFER_STRIPES);
+            p += sizeof(ctx->buffer);
+            size -= sizeof(ctx->buffer);
+
+        } while (size > sizeof(ctx->buffer));
+
+        ngx_memcpy(&ctx->buffer[sizeof(ctx->buffer) - NGX_XXH3_STRIPE_LEN],
+                   p - NGX_XXH3_STRIPE_LEN, NGX_XXH3_STRIPE_LEN);
+    }
+
+    ngx_memcpy(ctx->buffer, p, size);
+    ctx->buffered = size;
+}
+
+
+void
+ngx_xxh3_final(u_char result[16], ngx_xxh3_t *ctx)
+{
+    size_t          n;
+    u_char         *p;
+    ngx_xxh3_128_t  h;
+    u_char          last[NGX_XXH3_STRIPE_LEN];
+
+    if (ctx->bytes <= 16) {
+        h = ngx_xxh3_short(ctx->buffer, (size_t) ctx->bytes);
+
+    } else if (ctx->bytes <= NGX_XXH3_MID_SIZE_MAX) {
+        h = ngx_xxh3_mid(ctx->buffer, (size_t) ctx->bytes);
+
+    } else {
+
+        if (ctx->buffered >= NGX_XXH3_STRIPE_LEN) {
+            ngx_xxh3_stripes(ctx, ctx->buffer,
+                             (ctx->buffered - 1) / NGX_XXH3_STRIPE_LEN);
+            p = &ctx->buffer[ctx->buffered - NGX_XXH3_STRIPE_LEN];
+
+        } else {
+            n = NGX_XXH3_STRIPE_LEN - ctx->buffered;
+
+            ngx_memcpy(last, &ctx->buffer[sizeof(ctx->buffer) - n], n);
+            ngx_memcpy(&last[n], ctx->buffer, ctx->buffered);
+            p = last;
+        }
+
+        ngx_xxh3_accumulate(ctx->acc, p,
+                            &ngx_xxh3_secret[NGX_XXH3_SECRET_LEN
+                                             - NGX_XXH3_STRIPE_LEN - 7]);
+
+        h.lo = ngx_xxh3_merge(ctx->acc, &ngx_xxh3_secret[11],
+                              ctx->bytes * NGX_XXH_PRIME64_1);
+        h.hi = ngx_xxh3_merge(ctx->acc,
+                              &ngx_xxh3_secret[NGX_XXH3_SECRET_LEN - 64 - 11],
+                              ~(ctx->bytes * NGX_XXH_PRIME64_2));
+    }
+
+    for (n = 0; n < 8; n++) {
+        result[n] = (u_char) (h.hi >> (56 - 8 * n));
+        result[n + 8] = (u_char) (h.lo >> (56 - 8 * n));
+    }
+
+    ngx_memzero(ctx, sizeof(*ctx));
+}
+
+
+static ngx_xxh3_128_t
+ngx_xxh3_short(const u_char *p, size_t len)
+{
+    uint32_t         lo32, hi32;
+    uint64_t         lo, hi;
+    ngx_xxh3_128_t   h, m;
+    const u_char    *s;
+
+    s = ngx_xxh3_secret;
+
+    if (len > 8) {
+        lo = GET64(p);
+        hi = GET64(p + len - 8);
+
+        m = ngx_xxh3_mul128(lo ^ hi ^ (GET64(s + 32) ^ GET64(s + 40)),
+                            NGX_XXH_PRIME64_1);
+
+        m.lo += (uint64_t) (len - 1) << 54;
+        hi ^= GET64(s + 48) ^ GET64(s + 56);
+        m.hi += hi + (uint64_t) (uint32_t) hi * (NGX_XXH_PRIME32_2 - 1);
+        m.lo ^= SWAP64(m.hi);
+
+        h = ngx_xxh3_mul128(m.lo, NGX_XXH_PRIME64_2);
+        h.hi += m.hi * NGX_XXH_PRIME64_2;
+
+        h.lo = AVALANCHE(h.lo);
+        h.hi = AVALANCHE(h.hi);
+
+        return h;
+    }
+
+    if (len >= 4) {
+        lo = (uint64_t) GET32(p) + ((uint64_t) GET32(p + len - 4) << 32);
+        lo ^= GET64(s + 16) ^ GET64(s + 24);
+
+        m = ngx_xxh3_mul128(lo, NGX_XXH_PRIME64_1 + (len << 2));
+
+        m.hi += m.lo << 1;
+        m.lo ^= m.hi >> 3;
+
+        h.lo = XORSHIFT(m.lo, 35) * 0x9fb21c651e98df25ULL;
+        h.lo = XORSHIFT(h.lo, 28);
+        h.hi = AVALANCHE(m.hi);
+
+        return h;
+    }
+
+    if (len > 0) {
+        lo32 = ((uint32_t) p[0] << 16) | ((uint32_t) p[len >> 1] << 24)
+               | p[len - 1] | ((uint32_t) len << 8);
+        hi32 = SWAP32(lo32);
+        hi32 = ROTL32(hi32, 13);
+
+        h.lo = ngx_xxh64_avalanche(lo32 ^ (uint64_t) (GET32(s) ^ GET32(s + 4)));
+        h.hi = ngx_xxh64_avalanche(hi32
+                                   ^ (uint64_t) (GET32(s + 8) ^ GET32(s + 12)));
+
+        return h;
+    }
+
+    h.lo = ngx_xxh64_avalanche(GET64(s + 64) ^ GET64(s + 72));
+    h.hi = ngx_xxh64_avalanche(GET64(s + 80) ^ GET64(s + 88));
+
+    return h;
+}
+
+
+static ngx_xxh3_128_t
+ngx_xxh3_mid(const u_char *p, size_t len)
+{
+    size_t          i, rounds;
+    uint64_t        acc[2];
+    ngx_xxh3_128_t  h;
+
+    acc[0] = len * NGX_XXH_PRIME64_1;
+    acc[1] = 0;
+
+    if (len <= 128) {
+
+        if (len > 32) {
+            if (len > 64) {
+                if (len > 96) {
+                    ngx_xxh3_mix32(acc, p + 48, p + len - 64,
+                                   ngx_xxh3_secret + 96);
+                }
+
+                ngx_xxh3_mix32(acc, p + 32, p + len - 48,
+                               ngx_xxh3_secret + 64);
+            }
+
+            ngx_xxh3_mix32(acc, p + 16, p + len - 32, ngx_xxh3_secret + 32);
+        }
+
+        ngx_xxh3_mix32(acc, p, p + len - 16, ngx_xxh3_secret);
+
+    } else {
+        rounds = len / 32;
+
+        for (i = 0; i < 4; i++) {
+            ngx_xxh3_mix32(acc, p + 32 * i, p + 32 * i + 16,
+                           ngx_xxh3_secret + 32 * i);
+        }
+
+        acc[0] = AVALANCHE(acc[0]);
+        acc[1] = AVALANCHE(acc[1]);
+
+        for (i = 4; i < rounds; i++) {
+            ngx_xxh3_mix32(acc, p + 32 * i, p + 32 * i + 16,
+                           ngx_xxh3_secret + 3 + 32 * (i - 4));
+        }
+
+        ngx_xxh3_mix32(acc, p + len - 16, p + len - 32,
+                       ngx_xxh3_secret + 136 - 17 - 16);
+    }
+
+    h.lo = acc[0] + acc[1];
+    h.hi = acc[0] * NGX_XXH_PRIME64_1 + acc[1] * NGX_XXH_PRIME64_4
+           + len * NGX_XXH_PRIME64_2;
+
+    h.lo = AVALANCHE(h.lo);
+    h.hi = AVALANCHE(h.hi);
+    h.hi = 0 - h.hi;
+
+    return h;
+}
+
+
+static void
+ngx_xxh3_stripes(ngx_xxh3_t *ctx, const u_char *p, size_t n)
+{
+    size_t  i, left;
+
+    left = NGX_XXH3_BLOCK_STRIPES - ctx->stripes;
+
+    if (n < left) {
+        for (i = 0; i < n; i++) {
+            ngx_xxh3_accumulate(ctx->acc, p + i * NGX_XXH3_STRIPE_LEN,
+                                ngx_xxh3_secret + (ctx->stripes + i) * 8);
+        }
+
+        ctx->stripes += n;
+        return;
+    }
+
+    for (i = 0; i < left; i++) {
+        ngx_xxh3_accumulate(ctx->acc, p + i * NGX_XXH3_STRIPE_LEN,
+                            ngx_xxh3_secret + (ctx->stripes + i) * 8);
+    }
+
+    ngx_xxh3_scramble(ctx->acc);
+
+    p += left * NGX_XXH3_STRIPE_LEN;
+    n -= left;
+
+    for (i = 0; i < n; i++) {
+        ngx_xxh3_accumulate(ctx->acc, p + i * NGX_XXH3_STRIPE_LEN,
+                            ngx_xxh3_secret + i * 8);
+    }
+
+    ctx->stripes = n;
+}
+
+
+static void
+ngx_xxh3_accumulate(uint64_t *acc, const u_char *p, const u_char *secret)
+{
+    uint64_t    v, k;
+    ngx_uint_t  i;
+
+    for (i = 0; i < 8; i++) {
+        v = GET64(p + 8 * i);
+        k = v ^ GET64(secret + 8 * i);
+
+        acc[i ^ 1] += v;
+        acc[i] += (uint64_t) (uint32_t) k * (k >> 32);
+    }
+}
+
+
+static void
+ngx_xxh3_scramble(uint64_t *acc)
+{
+    uint64_t       a;
+    ngx_uint_t     i;
+    const u_char  *secret;
+
+    secret = ngx_xxh3_secret + NGX_XXH3_SECRET_LEN - NGX_XXH3_STRIPE_LEN;
+
+    for (i = 0; i < 8; i++) {
+        a = XORSHIFT(acc[i], 47) ^ GET64(secret + 8 * i);
+        acc[i] = a * NGX_XXH_PRIME32_1;
+    }
+}
+
+
+static uint64_t
+ngx_xxh3_merge(uint64_t *acc, const u_char *secret, uint64_t start)
+{
+    ngx_uint_t      i;
+    ngx_xxh3_128_t  m;
+
+    for (i = 0; i < 4; i++) {
+        m = ngx_xxh3_mul128(acc[2 * i] ^ GET64(secret + 16 * i),
+                            acc[2 * i + 1] ^ GET64(secret + 16 * i + 8));
+        start += m.lo ^ m.hi;
+    }
+
+    return AVALANCHE(start);
+}
+
+
+static void
+ngx_xxh3_mix32(uint64_t *acc, const u_char *p1, const u_char *p2,
+    const u_char *secret)
+{
+    acc[0] += ngx_xxh3_mix16(p1, secret);
+    acc[0] ^= GET64(p2) + GET64(p2 + 8);
+    acc[1] += ngx_xxh3_mix16(p2, secret + 16);
+    acc[1] ^= GET64(p1) + GET64(p1 + 8);
+}
+
+
+static uint64_t
+ngx_xxh3_mix16(const u_char *p, const u_char *secret)
+{
+    ngx_xxh3_128_t  m;
+
+    m = ngx_xxh3_mul128(GET64(p) ^ GET64(secret),
+                        GET64(p + 8) ^ GET64(secret + 8));
+
+    return m.lo ^ m.hi;
+}
+
+
+static ngx_inline ngx_xxh3_128_t
+ngx_xxh3_mul128(uint64_t a, uint64_t b)
+{
+    ngx_xxh3_128_t  r;
+
+#if (defined __SIZEOF_INT128__)
+
+    unsigned __int128  m;
+
+    m = (unsigned __int128) a * b;
+
+    r.lo = (uint64_t) m;
+    r.hi = (uint64_t) (m >> 64);
+
+#else
+
+    uint64_t  ll, hl, lh, hh, cross;
+
+    ll = (a & 0xffffffff) * (b & 0xffffffff);
+    hl = (a >> 32) * (b & 0xffffffff);
+    lh = (a & 0xffffffff) * (b >> 32);
+    hh = (a >> 32) * (b >> 32);
+
+    cross = (ll >> 32) + (hl & 0xffffffff) + lh;
+
+    r.lo = (cross << 32) | (ll & 0xffffffff);
+    r.hi = (hl >> 32) + (cross >> 32) + hh;
+
+#endif
+
+    return r;
+}
@@ -0,0 +1,29 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_XXH3_H_INCLUDED_
+#define _NGX_XXH3_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+typedef struct {
+    uint64_t  acc[8];
+    uint64_t  bytes;
+    size_t    buffered;
+    size_t    stripes;
+    u_char    buffer[256];
+} ngx_xxh3_t;
+
+
+void ngx_xxh3_init(ngx_xxh3_t *ctx);
+void ngx_xxh3_update(ngx_xxh3_t *ctx, const void *data, size_t size);
+void ngx_xxh3_final(u_char result[16], ngx_xxh3_t *ctx);
+
+
+#endif /* _NGX_XXH3_H_INCLUDED_ */
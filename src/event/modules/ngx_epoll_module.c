@@ -898,7 +898,7 @@ ngx_epoll_process_events(ngx_cycle_t *cycle, ngx_msec_t timer, ngx_uint_t flags)
                 ngx_post_event(rev, queue);
 
             } else {
-                rev->handler(rev);
+                ngx_event_handle(rev, NGX_EVENT_LATENCY_IO);
             }
         }
 
@@ -927,7 +927,7 @@ ngx_epoll_process_events(ngx_cycle_t *cycle, ngx_msec_t timer, ngx_uint_t flags)
                 ngx_post_event(wev, &ngx_posted_events);
 
             } else {
-                wev->handler(wev);
+                ngx_event_handle(wev, NGX_EVENT_LATENCY_IO);
             }
         }
     }
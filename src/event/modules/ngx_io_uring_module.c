@@ -0,0 +1,1685 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+/*
+ * The module keeps the readiness model of epoll, but delivers readiness
+ * through multishot IORING_OP_POLL_ADD requests.  Arming, modifying and
+ * removing of polls are queued as SQEs and submitted together with
+ * waiting for completions by a single io_uring_enter() call per event
+ * loop iteration instead of an epoll_ctl() call per change.  Since the
+ * events have the epoll semantics, the module sets NGX_USE_EPOLL_EVENT.
+ *
+ * A poll request holds a reference to the file, so closing a descriptor
+ * does not cancel it: the poll is always removed explicitly, even when
+ * the NGX_CLOSE_EVENT flag is set.
+ *
+ * Listening sockets added with NGX_EXCLUSIVE_EVENT are polled with
+ * EPOLLEXCLUSIVE, so that a connection wakes up one worker only.  Such
+ * a poll is oneshot and is rearmed after each completion; the event is
+ * marked by NGX_IO_URING_EXCLUSIVE in its index, which is not otherwise
+ * used by the module.
+ *
+ * io_uring_enter() may fail with EAGAIN or EBUSY when the kernel is short
+ * of memory or the completion queue has overflowed.  The completions are
+ * then reaped into a private backlog, which is processed before the ring
+ * on the next iteration, and the submission is retried.
+ *
+ * Listening stream sockets are not polled: NGX_IO_URING_ACCEPTS accept
+ * requests are kept pending on each of them instead.  A completion
+ * queues the accepted socket, ngx_event_accept() takes it with
+ * ngx_io_uring_accept() instead of calling accept4(), and the request
+ * is rearmed at once, so the accept is submitted with the next wait and
+ * a connection costs no syscall.  Multishot accept is not used since
+ * its requests share a single peer address buffer; each request here
+ * has its own.  Disabling accept events cancels the pending requests,
+ * the sockets already accepted stay queued until accept events are
+ * enabled again.
+ *
+ * File AIO reads are submitted to the same ring as IORING_OP_READ and do
+ * not require O_DIRECT.  The descriptors kept open by open file caches
+ * are registered in a sparse fixed file table, where the slot number is
+ * the descriptor itself, to avoid the file table lookup on each read.
+ */
+
+
+#define NGX_IO_URING_EVENTS     (EPOLLIN|EPOLLRDHUP|EPOLLOUT)
+
+#define NGX_IO_URING_FEATURES   (IORING_FEAT_NODROP|IORING_FEAT_EXT_ARG   \
+                                 |IORING_FEAT_RSRC_TAGS)
+
+/* user_data of file AIO requests is an ngx_event_t pointer with this bit */
+#define NGX_IO_URING_AIO        2
+
+/* user_data of accept requests is an ngx_io_uring_accept_t pointer */
+#define NGX_IO_URING_ACCEPT     4
+
+#define NGX_IO_URING_ACCEPTS    8
+
+#define NGX_IO_URING_MAX_FILES  65536
+
+#define NGX_IO_URING_EXCLUSIVE  1
+
+#define NGX_IO_URING_RETRIES    3
+
+
+typedef struct {
+    ngx_uint_t               entries;
+} ngx_io_uring_conf_t;
+
+
+typedef struct {
+    void                    *sq_ring;
+    void                    *cq_ring;
+    struct io_uring_sqe     *sqes;
+    size_t                   sq_ring_size;
+    size_t                   cq_ring_size;
+    size_t                   sqes_size;
+
+    volatile uint32_t       *sq_head;
+    volatile uint32_t       *sq_tail;
+    uint32_t                 sq_mask;
+    uint32_t                *sq_array;
+    uint32_t                 sq_entries;
+
+    volatile uint32_t       *cq_head;
+    volatile uint32_t       *cq_tail;
+    uint32_t                 cq_mask;
+    struct io_uring_cqe     *cqes;
+
+    uint8_t                  skip;
+} ngx_io_uring_t;
+
+
+typedef struct ngx_io_uring_listen_s  ngx_io_uring_listen_t;
+
+typedef struct {
+    ngx_io_uring_listen_t   *listen;
+    ngx_socket_t             fd;
+    ngx_err_t                err;
+    ngx_uint_t               state;
+    socklen_t                socklen;
+    ngx_sockaddr_t           sockaddr;
+} ngx_io_uring_accept_t;
+
+
+struct ngx_io_uring_listen_s {
+    ngx_connection_t        *connection;
+
+    ngx_uint_t               head;
+    ngx_uint_t               nready;
+    ngx_uint_t               ready[NGX_IO_URING_ACCEPTS];
+
+    ngx_io_uring_accept_t    accepts[NGX_IO_URING_ACCEPTS];
+
+    unsigned                 active:1;
+    unsigned                 closed:1;
+};
+
+
+#define NGX_IO_URING_ACCEPT_FREE      0
+#define NGX_IO_URING_ACCEPT_PENDING   1
+#define NGX_IO_URING_ACCEPT_CANCEL    2
+#define NGX_IO_URING_ACCEPT_READY     3
+
+
+static ngx_int_t ngx_io_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer);
+static ngx_int_t ngx_io_uring_setup(ngx_io_uring_conf_t *uccf,
+    ngx_log_t *log);
+static ngx_int_t ngx_io_uring_notify_init(ngx_log_t *log);
+static void ngx_io_uring_notify_handler(ngx_event_t *ev);
+static void ngx_io_uring_done(ngx_cycle_t *cycle);
+static ngx_int_t ngx_io_uring_add_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_io_uring_del_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_io_uring_add_connection(ngx_connection_t *c);
+static ngx_int_t ngx_io_uring_del_connection(ngx_connection_t *c,
+    ngx_uint_t flags);
+static ngx_int_t ngx_io_uring_notify(ngx_event_handler_pt handler);
+static ngx_int_t ngx_io_uring_process_events(ngx_cycle_t *cycle,
+    ngx_msec_t timer, ngx_uint_t flags);
+static void ngx_io_uring_event(struct io_uring_cqe *cqe, ngx_uint_t flags,
+    ngx_log_t *log);
+
+static ngx_int_t ngx_io_uring_poll(ngx_connection_t *c, ngx_uint_t instance,
+    uint32_t events, ngx_uint_t update, ngx_log_t *log);
+static ngx_int_t ngx_io_uring_poll_remove(ngx_connection_t *c,
+    ngx_uint_t instance, ngx_log_t *log);
+static struct io_uring_sqe *ngx_io_uring_get_sqe(ngx_log_t *log);
+static ngx_int_t ngx_io_uring_submit(ngx_log_t *log);
+static ngx_int_t ngx_io_uring_reap(ngx_log_t *log);
+static ngx_int_t ngx_io_uring_accept_add(ngx_event_t *ev);
+static ngx_int_t ngx_io_uring_accept_del(ngx_event_t *ev, ngx_uint_t flags);
+static ngx_int_t ngx_io_uring_accept_submit(ngx_io_uring_accept_t *a,
+    ngx_log_t *log);
+static void ngx_io_uring_accept_event(struct io_uring_cqe *cqe,
+    ngx_uint_t flags, ngx_log_t *log);
+#if (NGX_HAVE_FILE_AIO)
+static void ngx_io_uring_aio_init(ngx_cycle_t *cycle);
+static void ngx_io_uring_aio_event(struct io_uring_cqe *cqe, ngx_log_t *log);
+static ngx_int_t ngx_io_uring_update_file(ngx_fd_t fd, ngx_fd_t value,
+    ngx_log_t *log);
+#endif
+
+static void *ngx_io_uring_create_conf(ngx_cycle_t *cycle);
+static char *ngx_io_uring_init_conf(ngx_cycle_t *cycle, void *conf);
+
+
+static int                  uring = -1;
+static ngx_io_uring_t       ring;
+
+static struct io_uring_cqe *reaped;
+static ngx_uint_t           nreaped;
+static ngx_uint_t           nreaped_alloc;
+
+static int                  notify_fd = -1;
+static ngx_event_t          notify_event;
+static ngx_connection_t     notify_conn;
+
+#if (NGX_HAVE_FILE_AIO)
+
+ngx_uint_t                  ngx_io_uring_aio;
+
+static u_char              *files;
+static ngx_uint_t           nfiles;
+
+#endif
+
+
+extern ngx_module_t  ngx_epoll_module;
+
+
+static ngx_str_t      io_uring_name = ngx_string("io_uring");
+
+static ngx_command_t  ngx_io_uring_commands[] = {
+
+    { ngx_string("io_uring_entries"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_io_uring_conf_t, entries),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_event_module_t  ngx_io_uring_module_ctx = {
+    &io_uring_name,
+    ngx_io_uring_create_conf,            /* create configuration */
+    ngx_io_uring_init_conf,              /* init configuration */
+
+    {
+        ngx_io_uring_add_event,          /* add an event */
+        ngx_io_uring_del_event,          /* delete an event */
+        ngx_io_uring_add_event,          /* enable an event */
+        ngx_io_uring_del_event,          /* disable an event */
+        ngx_io_uring_add_connection,     /* add an connection */
+        ngx_io_uring_del_connection,     /* delete an connection */
+        ngx_io_uring_notify,             /* trigger a notify */
+        ngx_io_uring_process_events,     /* process the events */
+        ngx_io_uring_init,               /* init the events */
+        ngx_io_uring_done,               /* done the events */
+    }
+};
+
+ngx_module_t  ngx_io_uring_module = {
+    NGX_MODULE_V1,
+    &ngx_io_uring_module_ctx,            /* module context */
+    ngx_io_uring_commands,               /* module directives */
+    NGX_EVENT_MODULE,                    /* module type */
+    NULL,                                /* init master */
+    NULL,                                /* init module */
+    NULL,                                /* init process */
+    NULL,                                /* init thread */
+    NULL,                                /* exit thread */
+    NULL,                                /* exit process */
+    NULL,                                /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * io_uring_setup() and io_uring_enter() are called directly as syscalls,
+ * so the module does not depend on liburing
+ */
+
+static int
+io_uring_setup(u_int entries, struct io_uring_params *p)
+{
+    return syscall(SYS_io_uring_setup, entries, p);
+}
+
+
+static int
+io_uring_enter(int fd, u_int to_submit, u_int min_complete, u_int flags,
+    void *arg, size_t size)
+{
+    return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags,
+                   arg, size);
+}
+
+
+#if (NGX_HAVE_FILE_AIO)
+
+static int
+io_uring_register(int fd, u_int opcode, void *arg, u_int nr_args)
+{
+    return syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_io_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer)
+{
+    ngx_io_uring_conf_t  *uccf;
+
+    uccf = ngx_event_get_conf(cycle->conf_ctx, ngx_io_uring_module);
+
+    if (uring == -1) {
+
+        if (ngx_io_uring_setup(uccf, cycle->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_io_uring_notify_init(cycle->log) != NGX_OK) {
+            ngx_io_uring_module_ctx.actions.notify = NULL;
+        }
+
+#if (NGX_HAVE_FILE_AIO)
+        ngx_io_uring_aio_init(cycle);
+#endif
+
+#if (NGX_HAVE_EPOLLRDHUP)
+        ngx_use_epoll_rdhup = 1;
+#endif
+    }
+
+    ngx_io = ngx_os_io;
+
+    ngx_event_actions = ngx_io_uring_module_ctx.actions;
+
+    ngx_event_flags = NGX_USE_CLEAR_EVENT
+                      |NGX_USE_GREEDY_EVENT
+                      |NGX_USE_EPOLL_EVENT;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_setup(ngx_io_uring_conf_t *uccf, ngx_log_t *log)
+{
+    u_char                 *sq, *cq;
+    struct io_uring_params  p;
+
+    ngx_memzero(&p, sizeof(struct io_uring_params));
+
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = uccf->entries * 4;
+
+    uring = io_uring_setup(uccf->entries, &p);
+
+    if (uring == -1) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+                      "io_uring_setup() failed");
+        return NGX_ERROR;
+    }
+
+    if ((p.features & NGX_IO_URING_FEATURES) != NGX_IO_URING_FEATURES) {
+        ngx_log_error(NGX_LOG_EMERG, log, 0,
+                      "io_uring features 0x%xD are not sufficient",
+                      p.features);
+        goto failed;
+    }
+
+    ring.skip = (p.features & IORING_FEAT_CQE_SKIP)
+                ? IOSQE_CQE_SKIP_SUCCESS : 0;
+
+    ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    ring.cq_ring_size = p.cq_off.cqes
+                        + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.sq_ring_size = ngx_max(ring.sq_ring_size, ring.cq_ring_size);
+        ring.cq_ring_size = ring.sq_ring_size;
+    }
+
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ|PROT_WRITE,
+                        MAP_SHARED|MAP_POPULATE, uring, IORING_OFF_SQ_RING);
+
+    if (ring.sq_ring == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+                      "mmap(IORING_OFF_SQ_RING) failed");
+        goto failed;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ring = ring.sq_ring;
+
+    } else {
+        ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ|PROT_WRITE,
+                            MAP_SHARED|MAP_POPULATE, uring,
+                            IORING_OFF_CQ_RING);
+
+        if (ring.cq_ring == MAP_FAILED) {
+            ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+                          "mmap(IORING_OFF_CQ_RING) failed");
+            goto failed;
+        }
+    }
+
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, uring, IORING_OFF_SQES);
+
+    if (ring.sqes == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+                      "mmap(IORING_OFF_SQES) failed");
+        goto failed;
+    }
+
+    sq = ring.sq_ring;
+    cq = ring.cq_ring;
+
+    ring.sq_head = (uint32_t *) (sq + p.sq_off.head);
+    ring.sq_tail = (uint32_t *) (sq + p.sq_off.tail);
+    ring.sq_mask = *(uint32_t *) (sq + p.sq_off.ring_mask);
+    ring.sq_array = (uint32_t *) (sq + p.sq_off.array);
+    ring.sq_entries = p.sq_entries;
+
+    ring.cq_head = (uint32_t *) (cq + p.cq_off.head);
+    ring.cq_tail = (uint32_t *) (cq + p.cq_off.tail);
+    ring.cq_mask = *(uint32_t *) (cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "io_uring: fd:%d sq:%uD cq:%uD",
+                   uring, p.sq_entries, p.cq_entries);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_io_uring_done((ngx_cycle_t *) ngx_cycle);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_io_uring_notify_init(ngx_log_t *log)
+{
+#if (NGX_HAVE_SYS_EVENTFD_H)
+    notify_fd = eventfd(0, 0);
+#else
+    notify_fd = syscall(SYS_eventfd, 0);
+#endif
+
+    if (notify_fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, "eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "notify eventfd: %d", notify_fd);
+
+    notify_event.handler = ngx_io_uring_notify_handler;
+    notify_event.log = log;
+    notify_event.active = 1;
+
+    notify_conn.fd = notify_fd;
+    notify_conn.read = &notify_event;
+    notify_conn.log = log;
+
+    if (ngx_io_uring_poll(&notify_conn, 0, EPOLLIN, 0, log) != NGX_OK) {
+
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_io_uring_notify_handler(ngx_event_t *ev)
+{
+    ssize_t               n;
+    uint64_t              count;
+    ngx_err_t             err;
+    ngx_event_handler_pt  handler;
+
+    if (++ev->index == NGX_MAX_UINT32_VALUE) {
+        ev->index = 0;
+
+        n = read(notify_fd, &count, sizeof(uint64_t));
+
+        err = ngx_errno;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "read() eventfd %d: %z count:%uL", notify_fd, n, count);
+
+        if ((size_t) n != sizeof(uint64_t)) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                          "read() eventfd %d failed", notify_fd);
+        }
+    }
+
+    handler = ev->data;
+    handler(ev);
+}
+
+
+static void
+ngx_io_uring_done(ngx_cycle_t *cycle)
+{
+    if (ring.sqes && ring.sqes != MAP_FAILED) {
+        (void) munmap(ring.sqes, ring.sqes_size);
+    }
+
+    if (ring.cq_ring && ring.cq_ring != MAP_FAILED
+        && ring.cq_ring != ring.sq_ring)
+    {
+        (void) munmap(ring.cq_ring, ring.cq_ring_size);
+    }
+
+    if (ring.sq_ring && ring.sq_ring != MAP_FAILED) {
+        (void) munmap(ring.sq_ring, ring.sq_ring_size);
+    }
+
+    if (uring != -1 && close(uring) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "io_uring close() failed");
+    }
+
+    uring = -1;
+    ngx_memzero(&ring, sizeof(ngx_io_uring_t));
+
+    if (reaped) {
+        ngx_free(reaped);
+        reaped = NULL;
+    }
+
+    nreaped = 0;
+    nreaped_alloc = 0;
+
+#if (NGX_HAVE_FILE_AIO)
+
+    if (files) {
+        ngx_free(files);
+        files = NULL;
+    }
+
+    nfiles = 0;
+    ngx_io_uring_aio = 0;
+
+#endif
+
+    if (notify_fd != -1 && close(notify_fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "eventfd close() failed");
+    }
+
+    notify_fd = -1;
+}
+
+
+static ngx_int_t
+ngx_io_uring_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    uint32_t           events;
+    ngx_uint_t         update;
+    ngx_event_t       *e;
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    if (ev->accept && c->type == SOCK_STREAM) {
+        return ngx_io_uring_accept_add(ev);
+    }
+
+    if (event == NGX_READ_EVENT) {
+        e = c->write;
+        events = EPOLLIN|EPOLLRDHUP;
+
+        if (e->active) {
+            events |= EPOLLOUT;
+        }
+
+    } else {
+        e = c->read;
+        events = EPOLLOUT;
+
+        if (e->active) {
+            events |= EPOLLIN|EPOLLRDHUP;
+        }
+    }
+
+    update = e->active || ev->active;
+
+#if (NGX_HAVE_EPOLLEXCLUSIVE)
+
+    if (flags & NGX_EXCLUSIVE_EVENT) {
+        events |= EPOLLEXCLUSIVE;
+        ev->index = NGX_IO_URING_EXCLUSIVE;
+
+    } else if (ev->index == NGX_IO_URING_EXCLUSIVE) {
+        ev->index = NGX_INVALID_INDEX;
+    }
+
+#endif
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring add event: fd:%d update:%ui ev:%08XD",
+                   c->fd, update, events);
+
+    if (ngx_io_uring_poll(c, ev->instance, events, update, ev->log)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ev->active = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    uint32_t           events;
+    ngx_event_t       *e;
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    if (ev->accept && c->type == SOCK_STREAM) {
+        return ngx_io_uring_accept_del(ev, flags);
+    }
+
+    if (event == NGX_READ_EVENT) {
+        e = c->write;
+        events = EPOLLOUT;
+
+    } else {
+        e = c->read;
+        events = EPOLLIN|EPOLLRDHUP;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring del event: fd:%d other:%ui ev:%08XD",
+                   c->fd, e->active, events);
+
+    if (e->active) {
+        if (ngx_io_uring_poll(c, ev->instance, events, 1, ev->log)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+    } else if (ev->active) {
+        if (ngx_io_uring_poll_remove(c, ev->instance, ev->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    ev->active = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_add_connection(ngx_connection_t *c)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring add connection: fd:%d", c->fd);
+
+    if (ngx_io_uring_poll(c, c->read->instance, NGX_IO_URING_EVENTS, 0,
+                          c->log)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    c->read->active = 1;
+    c->write->active = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_del_connection(ngx_connection_t *c, ngx_uint_t flags)
+{
+    if (!c->read->active && !c->write->active) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring del connection: fd:%d", c->fd);
+
+    if (ngx_io_uring_poll_remove(c, c->read->instance, c->log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    c->read->active = 0;
+    c->write->active = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_notify(ngx_event_handler_pt handler)
+{
+    static uint64_t inc = 1;
+
+    notify_event.data = handler;
+
+    if ((size_t) write(notify_fd, &inc, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ngx_log_error(NGX_LOG_ALERT, notify_event.log, ngx_errno,
+                      "write() to eventfd %d failed", notify_fd);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
+    ngx_uint_t flags)
+{
+    int                             n;
+    uint32_t                        head, tail, submit;
+    ngx_uint_t                      i, level, events;
+    ngx_err_t                       err;
+    struct io_uring_cqe             cqe;
+    struct __kernel_timespec        ts;
+    struct io_uring_getevents_arg   ga;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring timer: %M", timer);
+
+    ngx_memzero(&ga, sizeof(struct io_uring_getevents_arg));
+
+    if (nreaped) {
+        /* completions reaped on submission are ready, do not wait */
+        timer = 0;
+    }
+
+    if (timer != NGX_TIMER_INFINITE) {
+        ts.tv_sec = timer / 1000;
+        ts.tv_nsec = (timer % 1000) * 1000000;
+        ga.ts = (uintptr_t) &ts;
+    }
+
+    submit = *ring.sq_tail - *ring.sq_head;
+
+    n = io_uring_enter(uring, submit, 1,
+                       IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+                       &ga, sizeof(struct io_uring_getevents_arg));
+
+    err = (n == -1) ? ngx_errno : 0;
+
+    if (flags & NGX_UPDATE_TIME || ngx_event_timer_alarm) {
+        ngx_time_update();
+    }
+
+    if (err && err != ETIME) {
+        if (err == NGX_EAGAIN || err == NGX_EBUSY) {
+
+            /*
+             * nothing was submitted, the completions are processed
+             * and the submission is retried on the next iteration
+             */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, err,
+                           "io_uring_enter() submit:%uD failed", submit);
+
+        } else {
+            if (err == NGX_EINTR) {
+
+                if (ngx_event_timer_alarm) {
+                    ngx_event_timer_alarm = 0;
+                    return NGX_OK;
+                }
+
+                level = NGX_LOG_INFO;
+
+            } else {
+                level = NGX_LOG_ALERT;
+            }
+
+            ngx_log_error(level, cycle->log, err, "io_uring_enter() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    /*
+     * handlers may submit requests, and a failed submission reaps
+     * completions: the backlog may grow and be reallocated while it is
+     * processed, and the ring head is advanced before each completion
+     * is handled
+     */
+
+    for (i = 0; i < nreaped; i++) {
+        cqe = reaped[i];
+        ngx_io_uring_event(&cqe, flags, cycle->log);
+    }
+
+    events = nreaped;
+    nreaped = 0;
+
+    head = *ring.cq_head;
+    tail = *ring.cq_tail;
+
+    ngx_memory_barrier();
+
+    if (head == tail && events == 0) {
+        if (timer != NGX_TIMER_INFINITE || submit || err) {
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                      "io_uring_enter() returned no events without timeout");
+        return NGX_ERROR;
+    }
+
+    for ( ;; ) {
+        head = *ring.cq_head;
+
+        if ((int32_t) (tail - head) <= 0) {
+            break;
+        }
+
+        cqe = ring.cqes[head & ring.cq_mask];
+
+        ngx_memory_barrier();
+
+        *ring.cq_head = head + 1;
+
+        events++;
+
+        ngx_io_uring_event(&cqe, flags, cycle->log);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: %ui events", events);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_io_uring_event(struct io_uring_cqe *cqe, ngx_uint_t flags, ngx_log_t *log)
+{
+    uint32_t           revents, mask;
+    ngx_int_t          instance;
+    ngx_event_t       *rev, *wev;
+    ngx_queue_t       *queue;
+    ngx_connection_t  *c;
+
+    c = (ngx_connection_t *) (uintptr_t) cqe->user_data;
+
+    if ((uintptr_t) c & NGX_IO_URING_ACCEPT) {
+        ngx_io_uring_accept_event(cqe, flags, log);
+        return;
+    }
+
+#if (NGX_HAVE_FILE_AIO)
+    if ((uintptr_t) c & NGX_IO_URING_AIO) {
+        ngx_io_uring_aio_event(cqe, log);
+        return;
+    }
+#endif
+
+    if (c == NULL) {
+
+        /* update and remove requests */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "io_uring: control res:%d", cqe->res);
+        return;
+    }
+
+    instance = (uintptr_t) c & 1;
+    c = (ngx_connection_t *) ((uintptr_t) c & (uintptr_t) ~1);
+
+    rev = c->read;
+
+    if (c->fd == -1 || rev->instance != instance) {
+
+        /*
+         * the stale event from a file descriptor
+         * that was just closed in this iteration
+         */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "io_uring: stale event %p", c);
+        return;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "io_uring: fd:%d res:%d fl:%uD d:%p",
+                   c->fd, cqe->res, cqe->flags, c);
+
+    if (cqe->res < 0) {
+        if (cqe->res == -NGX_ECANCELED) {
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, log, -cqe->res,
+                      "io_uring poll on fd:%d failed", c->fd);
+
+        revents = EPOLLIN|EPOLLOUT;
+
+    } else {
+        revents = (uint32_t) cqe->res;
+
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+
+            /*
+             * the multishot poll was terminated by kernel,
+             * or the oneshot exclusive poll completed, rearm it
+             */
+
+            mask = rev->active ? EPOLLIN|EPOLLRDHUP : 0;
+
+            if (c->write && c->write->active) {
+                mask |= EPOLLOUT;
+            }
+
+#if (NGX_HAVE_EPOLLEXCLUSIVE)
+            if (rev->index == NGX_IO_URING_EXCLUSIVE) {
+                mask |= EPOLLEXCLUSIVE;
+            }
+#endif
+
+            if (mask) {
+                (void) ngx_io_uring_poll(c, instance, mask, 0, log);
+            }
+        }
+    }
+
+    if (revents & (EPOLLERR|EPOLLHUP)) {
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "io_uring poll error on fd:%d ev:%04XD",
+                       c->fd, revents);
+
+        /*
+         * if the error events were returned, add EPOLLIN and EPOLLOUT
+         * to handle the events at least in one active handler
+         */
+
+        revents |= EPOLLIN|EPOLLOUT;
+    }
+
+    if ((revents & EPOLLIN) && rev->active) {
+
+        if (revents & EPOLLRDHUP) {
+            rev->pending_eof = 1;
+        }
+
+        rev->ready = 1;
+        rev->available = -1;
+
+        if (flags & NGX_POST_EVENTS) {
+            queue = rev->accept ? &ngx_posted_accept_events
+                                : &ngx_posted_events;
+
+            ngx_post_event(rev, queue);
+
+        } else {
+            ngx_event_handle(rev, NGX_EVENT_LATENCY_IO);
+        }
+    }
+
+    wev = c->write;
+
+    if ((revents & EPOLLOUT) && wev && wev->active) {
+
+        if (c->fd == -1 || wev->instance != instance) {
+
+            /*
+             * the stale event from a file descriptor
+             * that was just closed in this iteration
+             */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                           "io_uring: stale event %p", c);
+            return;
+        }
+
+        wev->ready = 1;
+#if (NGX_THREADS)
+        wev->complete = 1;
+#endif
+
+        if (flags & NGX_POST_EVENTS) {
+            ngx_post_event(wev, &ngx_posted_events);
+
+        } else {
+            ngx_event_handle(wev, NGX_EVENT_LATENCY_IO);
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_io_uring_poll(ngx_connection_t *c, ngx_uint_t instance, uint32_t events,
+    ngx_uint_t update, ngx_log_t *log)
+{
+    uint32_t              flags;
+    uint64_t              data;
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    data = (uintptr_t) c | instance;
+
+    flags = IORING_POLL_ADD_MULTI;
+
+#if (NGX_HAVE_EPOLLEXCLUSIVE)
+    if (events & EPOLLEXCLUSIVE) {
+        /* exclusive polls are oneshot */
+        flags = 0;
+    }
+#endif
+
+    if (update) {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->flags = ring.skip;
+        sqe->fd = -1;
+        sqe->addr = data;
+        sqe->len = IORING_POLL_UPDATE_EVENTS|flags;
+
+    } else {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = c->fd;
+        sqe->len = flags;
+        sqe->user_data = data;
+    }
+
+    sqe->poll32_events = events;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_poll_remove(ngx_connection_t *c, ngx_uint_t instance,
+    ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->flags = ring.skip;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) c | instance;
+
+    return NGX_OK;
+}
+
+
+static struct io_uring_sqe *
+ngx_io_uring_get_sqe(ngx_log_t *log)
+{
+    uint32_t              tail, index;
+    struct io_uring_sqe  *sqe;
+
+    tail = *ring.sq_tail;
+
+    if (tail - *ring.sq_head == ring.sq_entries) {
+
+        /* the submission queue is full, flush it */
+
+        if (ngx_io_uring_submit(log) != NGX_OK) {
+            return NULL;
+        }
+
+        if (tail - *ring.sq_head == ring.sq_entries) {
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                          "io_uring submission queue is full");
+            return NULL;
+        }
+    }
+
+    index = tail & ring.sq_mask;
+
+    sqe = &ring.sqes[index];
+    ngx_memzero(sqe, sizeof(struct io_uring_sqe));
+
+    ring.sq_array[index] = index;
+
+    ngx_memory_barrier();
+
+    *ring.sq_tail = tail + 1;
+
+    return sqe;
+}
+
+
+static ngx_int_t
+ngx_io_uring_submit(ngx_log_t *log)
+{
+    uint32_t    submit;
+    ngx_err_t   err;
+    ngx_uint_t  tries;
+
+    for (tries = 0; /* void */ ; tries++) {
+
+        submit = *ring.sq_tail - *ring.sq_head;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "io_uring submit: %uD", submit);
+
+        if (io_uring_enter(uring, submit, 0, 0, NULL, 0) != -1) {
+            return NGX_OK;
+        }
+
+        err = ngx_errno;
+
+        if (err != NGX_EAGAIN && err != NGX_EBUSY) {
+            ngx_log_error(NGX_LOG_ALERT, log, err, "io_uring_enter() failed");
+            return NGX_ERROR;
+        }
+
+        if (tries == NGX_IO_URING_RETRIES) {
+            ngx_log_error(NGX_LOG_ERR, log, err, "io_uring_enter() failed");
+            return NGX_ERROR;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, err,
+                       "io_uring_enter() submit:%uD failed, retrying",
+                       submit);
+
+        /* free the completion queue, the completions are handled later */
+
+        if (ngx_io_uring_reap(log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (err == NGX_EAGAIN) {
+            ngx_sched_yield();
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_io_uring_reap(ngx_log_t *log)
+{
+    uint32_t              head, tail;
+    ngx_uint_t            n;
+    struct io_uring_cqe  *cqes;
+
+    head = *ring.cq_head;
+    tail = *ring.cq_tail;
+
+    ngx_memory_barrier();
+
+    n = tail - head;
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    if (nreaped + n > nreaped_alloc) {
+        cqes = ngx_alloc((nreaped + n) * 2 * sizeof(struct io_uring_cqe), log);
+        if (cqes == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (reaped) {
+            ngx_memcpy(cqes, reaped, nreaped * sizeof(struct io_uring_cqe));
+            ngx_free(reaped);
+        }
+
+        reaped = cqes;
+        nreaped_alloc = (nreaped + n) * 2;
+    }
+
+    for ( /* void */ ; head != tail; head++) {
+        reaped[nreaped++] = ring.cqes[head & ring.cq_mask];
+    }
+
+    ngx_memory_barrier();
+
+    *ring.cq_head = head;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "io_uring reaped: %ui", n);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_accept_add(ngx_event_t *ev)
+{
+    ngx_uint_t              i;
+    ngx_connection_t       *c;
+    ngx_io_uring_listen_t  *l;
+
+    c = ev->data;
+    l = c->data;
+
+    if (l == NULL) {
+        l = ngx_pcalloc(ngx_cycle->pool, sizeof(ngx_io_uring_listen_t));
+        if (l == NULL) {
+            return NGX_ERROR;
+        }
+
+        l->connection = c;
+
+        for (i = 0; i < NGX_IO_URING_ACCEPTS; i++) {
+            l->accepts[i].listen = l;
+        }
+
+        c->data = l;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring add accept: fd:%d ready:%ui", c->fd, l->nready);
+
+    l->active = 1;
+    ev->active = 1;
+
+    for (i = 0; i < NGX_IO_URING_ACCEPTS; i++) {
+
+        /* the canceled requests are rearmed on completion */
+
+        if (l->accepts[i].state != NGX_IO_URING_ACCEPT_FREE) {
+            continue;
+        }
+
+        if (ngx_io_uring_accept_submit(&l->accepts[i], ev->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (l->nready) {
+        ev->ready = 1;
+        ngx_post_event(ev, &ngx_posted_accept_events);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_accept_del(ngx_event_t *ev, ngx_uint_t flags)
+{
+    ngx_uint_t              i;
+    ngx_connection_t       *c;
+    struct io_uring_sqe    *sqe;
+    ngx_io_uring_accept_t  *a;
+    ngx_io_uring_listen_t  *l;
+
+    c = ev->data;
+    l = c->data;
+
+    ev->active = 0;
+
+    if (l == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring del accept: fd:%d ready:%ui fl:%ui",
+                   c->fd, l->nready, flags);
+
+    l->active = 0;
+
+    for (i = 0; i < NGX_IO_URING_ACCEPTS; i++) {
+        a = &l->accepts[i];
+
+        if (a->state != NGX_IO_URING_ACCEPT_PENDING) {
+            continue;
+        }
+
+        sqe = ngx_io_uring_get_sqe(ev->log);
+        if (sqe == NULL) {
+            return NGX_ERROR;
+        }
+
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->flags = ring.skip;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t) a | NGX_IO_URING_ACCEPT;
+
+        a->state = NGX_IO_URING_ACCEPT_CANCEL;
+    }
+
+    if (flags & NGX_DISABLE_EVENT) {
+        return NGX_OK;
+    }
+
+    /*
+     * the listening socket is going to be closed, the sockets accepted
+     * but not yet handled are closed, as well as the ones accepted
+     * by the requests being canceled
+     */
+
+    for ( /* void */ ; l->nready; l->nready--) {
+        a = &l->accepts[l->ready[l->head]];
+        l->head = (l->head + 1) % NGX_IO_URING_ACCEPTS;
+
+        if (a->fd != (ngx_socket_t) -1 && ngx_close_socket(a->fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_socket_errno,
+                          ngx_close_socket_n " failed");
+        }
+
+        a->state = NGX_IO_URING_ACCEPT_FREE;
+    }
+
+    l->closed = 1;
+    c->data = NULL;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_accept_submit(ngx_io_uring_accept_t *a, ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    a->socklen = sizeof(ngx_sockaddr_t);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = a->listen->connection->fd;
+    sqe->addr = (uintptr_t) &a->sockaddr;
+    sqe->addr2 = (uintptr_t) &a->socklen;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = (uintptr_t) a | NGX_IO_URING_ACCEPT;
+
+    a->state = NGX_IO_URING_ACCEPT_PENDING;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_io_uring_accept_event(struct io_uring_cqe *cqe, ngx_uint_t flags,
+    ngx_log_t *log)
+{
+    ngx_event_t            *rev;
+    ngx_io_uring_accept_t  *a;
+    ngx_io_uring_listen_t  *l;
+
+    a = (ngx_io_uring_accept_t *)
+            ((uintptr_t) cqe->user_data & (uintptr_t) ~NGX_IO_URING_ACCEPT);
+    l = a->listen;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "io_uring accept: res:%d active:%ud closed:%ud",
+                   cqe->res, l->active, l->closed);
+
+    if (cqe->res == -NGX_ECANCELED) {
+        a->state = NGX_IO_URING_ACCEPT_FREE;
+
+        if (l->active) {
+            (void) ngx_io_uring_accept_submit(a, log);
+        }
+
+        return;
+    }
+
+    if (l->closed) {
+        if (cqe->res >= 0 && ngx_close_socket(cqe->res) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                          ngx_close_socket_n " failed");
+        }
+
+        a->state = NGX_IO_URING_ACCEPT_FREE;
+        return;
+    }
+
+    if (cqe->res < 0) {
+
+        if (!l->active) {
+            /* an error of the request being canceled */
+            a->state = NGX_IO_URING_ACCEPT_FREE;
+            return;
+        }
+
+        a->fd = (ngx_socket_t) -1;
+        a->err = -cqe->res;
+
+    } else {
+        a->fd = cqe->res;
+        a->err = 0;
+    }
+
+    a->state = NGX_IO_URING_ACCEPT_READY;
+
+    l->ready[(l->head + l->nready++) % NGX_IO_URING_ACCEPTS] = a - l->accepts;
+
+    if (!l->active) {
+        return;
+    }
+
+    rev = l->connection->read;
+    rev->ready = 1;
+
+    if (flags & NGX_POST_EVENTS) {
+        ngx_post_event(rev, &ngx_posted_accept_events);
+
+    } else {
+        ngx_event_handle(rev, NGX_EVENT_LATENCY_IO);
+    }
+}
+
+
+ngx_socket_t
+ngx_io_uring_accept(ngx_event_t *ev, struct sockaddr *sa, socklen_t *socklen)
+{
+    ngx_err_t               err;
+    ngx_socket_t            s;
+    ngx_connection_t       *c;
+    ngx_io_uring_accept_t  *a;
+    ngx_io_uring_listen_t  *l;
+
+    c = ev->data;
+    l = c->data;
+
+    if (l->nready == 0) {
+        ngx_set_socket_errno(NGX_EAGAIN);
+        return (ngx_socket_t) -1;
+    }
+
+    a = &l->accepts[l->ready[l->head]];
+    l->head = (l->head + 1) % NGX_IO_URING_ACCEPTS;
+    l->nready--;
+
+    s = a->fd;
+    err = a->err;
+
+    if (s != (ngx_socket_t) -1) {
+        ngx_memcpy(sa, &a->sockaddr, ngx_min(a->socklen, *socklen));
+        *socklen = a->socklen;
+    }
+
+    a->state = NGX_IO_URING_ACCEPT_FREE;
+
+    if (l->active) {
+        (void) ngx_io_uring_accept_submit(a, ev->log);
+    }
+
+    if (l->nready) {
+        /* handle the rest of the sockets already accepted */
+        ev->available = 1;
+    }
+
+    ngx_set_socket_errno(err);
+
+    return s;
+}
+
+
+#if (NGX_HAVE_FILE_AIO)
+
+static void
+ngx_io_uring_aio_init(ngx_cycle_t *cycle)
+{
+    int            *fds;
+    ngx_uint_t      n;
+    struct rlimit   rlmt;
+
+    ngx_io_uring_aio = 1;
+
+    if (getrlimit(RLIMIT_NOFILE, &rlmt) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "getrlimit(RLIMIT_NOFILE) failed");
+        return;
+    }
+
+    n = ngx_min((ngx_uint_t) rlmt.rlim_cur, NGX_IO_URING_MAX_FILES);
+
+    fds = ngx_alloc(n * sizeof(int), cycle->log);
+    if (fds == NULL) {
+        return;
+    }
+
+    /* -1 marks an empty slot */
+
+    ngx_memset(fds, 0xff, n * sizeof(int));
+
+    if (io_uring_register(uring, IORING_REGISTER_FILES, fds, n) == -1) {
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, ngx_errno,
+                      "io_uring_register(IORING_REGISTER_FILES) failed, "
+                      "fixed files are not used");
+        ngx_free(fds);
+        return;
+    }
+
+    ngx_free(fds);
+
+    files = ngx_calloc((n + 7) / 8, cycle->log);
+    if (files == NULL) {
+        return;
+    }
+
+    nfiles = n;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring fixed files: %ui", nfiles);
+}
+
+
+ngx_int_t
+ngx_io_uring_aio_read(ngx_event_aio_t *aio, u_char *buf, size_t size,
+    off_t offset)
+{
+    ngx_fd_t              fd;
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(aio->event.log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    fd = aio->file->fd;
+
+    if ((ngx_uint_t) fd < nfiles && (files[fd / 8] & (1 << (fd % 8)))) {
+        sqe->flags = IOSQE_FIXED_FILE;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = (uint32_t) ngx_min(size, NGX_MAX_INT32_VALUE);
+    sqe->off = offset;
+    sqe->user_data = (uintptr_t) &aio->event | NGX_IO_URING_AIO;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_EVENT, aio->event.log, 0,
+                   "io_uring read: fd:%d fixed:%d %O:%uz",
+                   fd, sqe->flags & IOSQE_FIXED_FILE, offset, size);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_io_uring_aio_event(struct io_uring_cqe *cqe, ngx_log_t *log)
+{
+    ngx_event_t      *e;
+    ngx_event_aio_t  *aio;
+
+    e = (ngx_event_t *) (uintptr_t) (cqe->user_data & ~NGX_IO_URING_AIO);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "io_uring aio event: %p res:%d", e, cqe->res);
+
+    e->complete = 1;
+    e->active = 0;
+    e->ready = 1;
+
+    aio = e->data;
+    aio->res = cqe->res;
+
+    ngx_post_event(e, &ngx_posted_events);
+}
+
+
+void
+ngx_io_uring_register_file(ngx_fd_t fd, ngx_log_t *log)
+{
+    if ((ngx_uint_t) fd >= nfiles || (files[fd / 8] & (1 << (fd % 8)))) {
+        return;
+    }
+
+    if (ngx_io_uring_update_file(fd, fd, log) == NGX_OK) {
+        files[fd / 8] |= 1 << (fd % 8);
+    }
+}
+
+
+void
+ngx_io_uring_unregister_file(ngx_fd_t fd, ngx_log_t *log)
+{
+    if ((ngx_uint_t) fd >= nfiles || !(files[fd / 8] & (1 << (fd % 8)))) {
+        return;
+    }
+
+    /*
+     * the bit is cleared even on failure, so a reused descriptor number
+     * is never read through the stale slot
+     */
+
+    files[fd / 8] &= ~(1 << (fd % 8));
+
+    (void) ngx_io_uring_update_file(fd, -1, log);
+}
+
+
+static ngx_int_t
+ngx_io_uring_update_file(ngx_fd_t fd, ngx_fd_t value, ngx_log_t *log)
+{
+    struct io_uring_files_update  up;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "io_uring fixed file: %d value:%d", fd, value);
+
+    ngx_memzero(&up, sizeof(struct io_uring_files_update));
+
+    up.offset = fd;
+    up.fds = (uintptr_t) &value;
+
+    if (io_uring_register(uring, IORING_REGISTER_FILES_UPDATE, &up, 1) != 1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "io_uring_register(IORING_REGISTER_FILES_UPDATE) "
+                      "failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static void *
+ngx_io_uring_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_io_uring_conf_t  *uccf;
+
+    uccf = ngx_palloc(cycle->pool, sizeof(ngx_io_uring_conf_t));
+    if (uccf == NULL) {
+        return NULL;
+    }
+
+    uccf->entries = NGX_CONF_UNSET;
+
+    return uccf;
+}
+
+
+static char *
+ngx_io_uring_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_io_uring_conf_t *uccf = conf;
+
+    int                      fd;
+    ngx_err_t                err;
+    ngx_event_conf_t        *ecf;
+    struct io_uring_params   p;
+
+    ngx_conf_init_uint_value(uccf->entries, 512);
+
+    if (uccf->entries == 0 || uccf->entries > 32768) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "\"io_uring_entries\" must be between 1 and 32768");
+        return NGX_CONF_ERROR;
+    }
+
+    ecf = ngx_event_get_conf(cycle->conf_ctx, ngx_event_core_module);
+
+    if (ecf->use != ngx_io_uring_module.ctx_index) {
+        return NGX_CONF_OK;
+    }
+
+    /*
+     * io_uring may be missing, too old, or disabled by seccomp
+     * or the kernel.io_uring_disabled sysctl: fall back to epoll
+     */
+
+    ngx_memzero(&p, sizeof(struct io_uring_params));
+
+    fd = io_uring_setup(1, &p);
+
+    if (fd != -1) {
+        (void) close(fd);
+
+        if ((p.features & NGX_IO_URING_FEATURES) == NGX_IO_URING_FEATURES) {
+            return NGX_CONF_OK;
+        }
+
+        err = 0;
+
+    } else {
+        err = ngx_errno;
+    }
+
+    ngx_log_error(NGX_LOG_WARN, cycle->log, err,
+                  "io_uring is not supported, using epoll");
+
+    ecf->use = ngx_epoll_module.ctx_index;
+    ecf->name = (u_char *) "epoll";
+
+    return NGX_CONF_OK;
+}
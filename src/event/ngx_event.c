@@ -74,9 +74,34 @@ ngx_atomic_t         *ngx_stat_writing = &ngx_stat_writing0;
 static ngx_atomic_t   ngx_stat_waiting0;
 ngx_atomic_t         *ngx_stat_waiting = &ngx_stat_waiting0;
 
+/*
+ * each worker process updates its own cache line of counters,
+ * the counters are summed by ngx_stat_sum() on read
+ */
+
+static u_char        *ngx_stat_shards;
+static ngx_uint_t     ngx_stat_nshards;
+static size_t         ngx_stat_shard_size;
+
+static void ngx_stat_set_shard(ngx_uint_t n);
+
 #endif
 
 
+ngx_event_latency_t  *ngx_event_latency;
+
+static ngx_event_latency_t   ngx_event_latency0;
+static u_char               *ngx_event_latency_shards;
+static ngx_uint_t            ngx_event_latency_nshards;
+static size_t                ngx_event_latency_shard_size;
+static uint64_t              ngx_event_latency_threshold;
+
+static char  *ngx_event_latency_kinds[] = { "io", "posted", "timer" };
+
+static u_char *ngx_event_latency_handler_name(u_char *buf, u_char *last,
+    ngx_event_handler_pt handler);
+
+
 
 static ngx_command_t  ngx_events_commands[] = {
 
@@ -154,6 +179,20 @@ static ngx_command_t  ngx_event_core_commands[] = {
       offsetof(ngx_event_conf_t, accept_mutex_delay),
       NULL },
 
+    { ngx_string("event_latency"),
+      NGX_EVENT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_event_conf_t, latency),
+      NULL },
+
+    { ngx_string("event_latency_threshold"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      0,
+      offsetof(ngx_event_conf_t, latency_threshold),
+      NULL },
+
     { ngx_string("debug_connection"),
       NGX_EVENT_CONF|NGX_CONF_TAKE1,
       ngx_event_debug_connection,
@@ -492,6 +531,7 @@ ngx_event_module_init(ngx_cycle_t *cycle)
     size_t               size, cl;
     ngx_shm_t            shm;
     ngx_time_t          *tp;
+    ngx_uint_t           nshards;
     ngx_core_conf_t     *ccf;
     ngx_event_conf_t    *ecf;
 
@@ -551,21 +591,25 @@ ngx_event_module_init(ngx_cycle_t *cycle)
            + cl          /* ngx_connection_counter */
            + cl;         /* ngx_temp_number */
 
+    /*
+     * the zone is not reallocated on reconfiguration, so the per-worker
+     * shards are also reserved for the number of CPUs
+     */
+
+    nshards = ngx_max(ccf->worker_processes, ngx_ncpu);
+
+    size += nshards * ngx_align(sizeof(ngx_event_latency_t), cl);
+
 #if (NGX_STAT_STUB)
 
-    size += cl           /* ngx_stat_accepted */
-           + cl          /* ngx_stat_handled */
-           + cl          /* ngx_stat_requests */
-           + cl          /* ngx_stat_active */
-           + cl          /* ngx_stat_reading */
-           + cl          /* ngx_stat_writing */
-           + cl;         /* ngx_stat_waiting */
+    size += nshards * cl;  /* ngx_stat_accepted ... ngx_stat_waiting */
 
 #endif
 
     shm.size = size;
     ngx_str_set(&shm.name, "nginx_shared_zone");
     shm.log = cycle->log;
+    shm.hugepages = 0;
 
     if (ngx_shm_alloc(&shm) != NGX_OK) {
         return NGX_ERROR;
@@ -597,15 +641,18 @@ ngx_event_module_init(ngx_cycle_t *cycle)
 
     ngx_random_number = (tp->msec << 16) + ngx_pid;
 
+    ngx_event_latency_shards = shared + 3 * cl;
+    ngx_event_latency_nshards = nshards;
+    ngx_event_latency_shard_size = ngx_align(sizeof(ngx_event_latency_t), cl);
+
 #if (NGX_STAT_STUB)
 
-    ngx_stat_accepted = (ngx_atomic_t *) (shared + 3 * cl);
-    ngx_stat_handled = (ngx_atomic_t *) (shared + 4 * cl);
-    ngx_stat_requests = (ngx_atomic_t *) (shared + 5 * cl);
-    ngx_stat_active = (ngx_atomic_t *) (shared + 6 * cl);
-    ngx_stat_reading = (ngx_atomic_t *) (shared + 7 * cl);
-    ngx_stat_writing = (ngx_atomic_t *) (shared + 8 * cl);
-    ngx_stat_waiting = (ngx_atomic_t *) (shared + 9 * cl);
+    ngx_stat_shards = ngx_event_latency_shards
+                      + nshards * ngx_event_latency_shard_size;
+    ngx_stat_nshards = nshards;
+    ngx_stat_shard_size = cl;
+
+    ngx_stat_set_shard(0);
 
 #endif
 
@@ -613,6 +660,232 @@ ngx_event_module_init(ngx_cycle_t *cycle)
 }
 
 
+void
+ngx_event_latency_handler(ngx_event_t *ev, ngx_uint_t kind)
+{
+    u_char                *p, name[256];
+    uint64_t               start, time;
+    ngx_str_t              addr;
+    ngx_log_t             *log, slow;
+    ngx_uint_t             n;
+    const char            *action, *op, *label;
+    ngx_connection_t      *c;
+    ngx_atomic_uint_t      number;
+    ngx_event_handler_pt   handler;
+
+    /*
+     * the event and its log may be freed by the handler,
+     * so the context for logging is saved beforehand
+     */
+
+    handler = ev->handler;
+    log = ev->log;
+
+    number = log ? log->connection : 0;
+    action = log ? log->action : NULL;
+
+    /* events of connections point to them */
+
+    c = ev->data;
+
+    if ((u_char *) c >= (u_char *) ngx_cycle->connections
+        && (u_char *) c < (u_char *) (ngx_cycle->connections
+                                      + ngx_cycle->connection_n)
+        && ((u_char *) c - (u_char *) ngx_cycle->connections)
+           % sizeof(ngx_connection_t) == 0)
+    {
+        number = c->number;
+        action = c->log ? c->log->action : action;
+        op = ev->accept ? "accept" : (ev->write ? "write" : "read");
+
+    } else {
+        c = NULL;
+        op = "";
+    }
+
+    start = ngx_monotonic_usec();
+
+    handler(ev);
+
+    time = ngx_monotonic_usec() - start;
+
+    for (n = 0; n < NGX_EVENT_LATENCY_BUCKETS - 1; n++) {
+        if (time <= (uint64_t) 1 << n) {
+            break;
+        }
+    }
+
+    (void) ngx_atomic_fetch_add(&ngx_event_latency->buckets[kind][n], 1);
+    (void) ngx_atomic_fetch_add(&ngx_event_latency->time[kind], time);
+
+    if (ngx_event_latency_threshold == 0
+        || time < ngx_event_latency_threshold)
+    {
+        return;
+    }
+
+    (void) ngx_atomic_fetch_add(&ngx_event_latency->slow[kind], 1);
+
+    /* the connection may have been closed and reused by the handler */
+
+    ngx_str_null(&addr);
+    label = "";
+
+    if (c && c->number == number && c->fd != (ngx_socket_t) -1) {
+        if (c->addr_text.len) {
+            addr = c->addr_text;
+            label = ", client: ";
+
+        } else if (c->listening) {
+            addr = c->listening->addr_text;
+            label = ", listening on ";
+        }
+    }
+
+    p = ngx_event_latency_handler_name(name, name + sizeof(name) - 1,
+                                       handler);
+    *p = '\0';
+
+    slow = *ngx_cycle->log;
+    slow.connection = number;
+    slow.handler = NULL;
+
+    ngx_log_error(NGX_LOG_WARN, &slow, 0,
+                  "slow %s %s%sevent handler %s took %uL.%03uL ms%s%s%s%V",
+                  ngx_event_latency_kinds[kind], op, *op ? " " : "", name,
+                  time / 1000, time % 1000,
+                  action ? " while " : "", action ? action : "",
+                  label, &addr);
+}
+
+
+static u_char *
+ngx_event_latency_handler_name(u_char *buf, u_char *last,
+    ngx_event_handler_pt handler)
+{
+#if (NGX_HAVE_DLADDR)
+
+    char     *file, *p;
+    Dl_info   info, self;
+
+    /*
+     * static functions are not exported, so unless the exact symbol is
+     * found, the offset in the object is logged to be used with addr2line;
+     * the name of the executable is taken from the saved argv, as the
+     * original one is overwritten by the process title
+     */
+
+    if (dladdr((void *) handler, &info) && info.dli_fname) {
+
+        if (info.dli_sname && info.dli_saddr == (void *) handler) {
+            return ngx_slprintf(buf, last, "%s()", info.dli_sname);
+        }
+
+        file = (char *) info.dli_fname;
+
+        if (dladdr((void *) ngx_event_latency_handler_name, &self)
+            && self.dli_fbase == info.dli_fbase
+            && ngx_argv && ngx_argv[0])
+        {
+            file = ngx_argv[0];
+        }
+
+        p = strrchr(file, '/');
+
+        if (p) {
+            file = p + 1;
+        }
+
+        return ngx_slprintf(buf, last, "%s+0x%xL", file,
+                            (uint64_t) ((u_char *) handler
+                                        - (u_char *) info.dli_fbase));
+    }
+
+#endif
+
+    return ngx_slprintf(buf, last, "%p", handler);
+}
+
+
+void
+ngx_event_latency_sum(ngx_event_latency_t *lt)
+{
+    ngx_uint_t     i, n;
+    ngx_atomic_t  *src, *dst;
+
+    dst = (ngx_atomic_t *) lt;
+
+    if (ngx_event_latency_nshards == 0) {
+        src = (ngx_atomic_t *) &ngx_event_latency0;
+
+        for (n = 0; n < sizeof(ngx_event_latency_t) / sizeof(ngx_atomic_t);
+             n++)
+        {
+            dst[n] += src[n];
+        }
+
+        return;
+    }
+
+    for (i = 0; i < ngx_event_latency_nshards; i++) {
+        src = (ngx_atomic_t *) (ngx_event_latency_shards
+                                + i * ngx_event_latency_shard_size);
+
+        for (n = 0; n < sizeof(ngx_event_latency_t) / sizeof(ngx_atomic_t);
+             n++)
+        {
+            dst[n] += src[n];
+        }
+    }
+}
+
+
+#if (NGX_STAT_STUB)
+
+static void
+ngx_stat_set_shard(ngx_uint_t n)
+{
+    ngx_atomic_t  *stat;
+
+    stat = (ngx_atomic_t *) (ngx_stat_shards
+                             + (n % ngx_stat_nshards) * ngx_stat_shard_size);
+
+    ngx_stat_accepted = &stat[0];
+    ngx_stat_handled = &stat[1];
+    ngx_stat_requests = &stat[2];
+    ngx_stat_active = &stat[3];
+    ngx_stat_reading = &stat[4];
+    ngx_stat_writing = &stat[5];
+    ngx_stat_waiting = &stat[6];
+}
+
+
+ngx_atomic_int_t
+ngx_stat_sum(ngx_atomic_t *stat)
+{
+    size_t            offset;
+    ngx_uint_t        i;
+    ngx_atomic_int_t  sum;
+
+    if (ngx_stat_nshards == 0) {
+        return *stat;
+    }
+
+    offset = ((u_char *) stat - ngx_stat_shards) % ngx_stat_shard_size;
+
+    sum = 0;
+
+    for (i = 0; i < ngx_stat_nshards; i++) {
+        sum += *(ngx_atomic_t *) (ngx_stat_shards + i * ngx_stat_shard_size
+                                  + offset);
+    }
+
+    return sum;
+}
+
+#endif
+
+
 #if !(NGX_WIN32)
 
 static void
@@ -662,6 +935,32 @@ ngx_event_process_init(ngx_cycle_t *cycle)
 
 #endif
 
+#if (NGX_STAT_STUB)
+
+    if (ngx_stat_nshards) {
+        ngx_stat_set_shard(ngx_worker);
+    }
+
+#endif
+
+    if (ecf->latency) {
+        if (ngx_event_latency_nshards) {
+            ngx_event_latency = (ngx_event_latency_t *)
+                (ngx_event_latency_shards
+                 + (ngx_worker % ngx_event_latency_nshards)
+                   * ngx_event_latency_shard_size);
+
+        } else {
+            ngx_event_latency = &ngx_event_latency0;
+        }
+
+        ngx_event_latency_threshold = (uint64_t) ecf->latency_threshold
+                                      * 1000;
+
+    } else {
+        ngx_event_latency = NULL;
+    }
+
     ngx_queue_init(&ngx_posted_accept_events);
     ngx_queue_init(&ngx_posted_next_events);
     ngx_queue_init(&ngx_posted_events);
@@ -746,15 +1045,15 @@ ngx_event_process_init(ngx_cycle_t *cycle)
 #endif
 
     cycle->connections =
-        ngx_alloc(sizeof(ngx_connection_t) * cycle->connection_n, cycle->log);
+        ngx_event_alloc(cycle, sizeof(ngx_connection_t) * cycle->connection_n);
     if (cycle->connections == NULL) {
         return NGX_ERROR;
     }
 
     c = cycle->connections;
 
-    cycle->read_events = ngx_alloc(sizeof(ngx_event_t) * cycle->connection_n,
-                                   cycle->log);
+    cycle->read_events = ngx_event_alloc(cycle,
+                                  sizeof(ngx_event_t) * cycle->connection_n);
     if (cycle->read_events == NULL) {
         return NGX_ERROR;
     }
@@ -765,8 +1064,8 @@ ngx_event_process_init(ngx_cycle_t *cycle)
         rev[i].instance = 1;
     }
 
-    cycle->write_events = ngx_alloc(sizeof(ngx_event_t) * cycle->connection_n,
-                                    cycle->log);
+    cycle->write_events = ngx_event_alloc(cycle,
+                                  sizeof(ngx_event_t) * cycle->connection_n);
     if (cycle->write_events == NULL) {
         return NGX_ERROR;
     }
@@ -930,6 +1229,23 @@ ngx_event_process_init(ngx_cycle_t *cycle)
 }
 
 
+void *
+ngx_event_alloc(ngx_cycle_t *cycle, size_t size)
+{
+    ngx_core_conf_t  *ccf;
+
+    /* large arrays which live as long as the worker process */
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    if (ccf->worker_hugepages) {
+        return ngx_alloc_huge(size, cycle->log);
+    }
+
+    return ngx_alloc(size, cycle->log);
+}
+
+
 ngx_int_t
 ngx_send_lowat(ngx_connection_t *c, size_t lowat)
 {
@@ -1257,6 +1573,8 @@ ngx_event_core_create_conf(ngx_cycle_t *cycle)
     ecf->multi_accept = NGX_CONF_UNSET;
     ecf->accept_mutex = NGX_CONF_UNSET;
     ecf->accept_mutex_delay = NGX_CONF_UNSET_MSEC;
+    ecf->latency = NGX_CONF_UNSET;
+    ecf->latency_threshold = NGX_CONF_UNSET_MSEC;
     ecf->name = (void *) NGX_CONF_UNSET;
 
 #if (NGX_DEBUG)
@@ -1356,6 +1674,8 @@ ngx_event_core_init_conf(ngx_cycle_t *cycle, void *conf)
     ngx_conf_init_value(ecf->multi_accept, 0);
     ngx_conf_init_value(ecf->accept_mutex, 0);
     ngx_conf_init_msec_value(ecf->accept_mutex_delay, 500);
+    ngx_conf_init_value(ecf->latency, 0);
+    ngx_conf_init_msec_value(ecf->latency_threshold, 50);
 
     return NGX_CONF_OK;
 }
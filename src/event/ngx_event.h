@@ -27,6 +27,12 @@ typedef struct {
 #endif
 
 
+typedef struct {
+    ngx_msec_t       key;
+    ngx_queue_t      queue;
+} ngx_event_timer_t;
+
+
 struct ngx_event_s {
     void            *data;
 
@@ -111,7 +117,7 @@ struct ngx_event_s {
 
     ngx_log_t       *log;
 
-    ngx_rbtree_node_t   timer;
+    ngx_event_timer_t   timer;
 
     /* the posted queue */
     ngx_queue_t      queue;
@@ -167,6 +173,34 @@ struct ngx_event_aio_s {
 #endif
 
 
+#if (NGX_HAVE_IO_URING)
+
+ngx_socket_t ngx_io_uring_accept(ngx_event_t *ev, struct sockaddr *sa,
+    socklen_t *socklen);
+
+#endif
+
+
+#if (NGX_HAVE_FILE_AIO && NGX_HAVE_IO_URING)
+
+extern ngx_uint_t  ngx_io_uring_aio;
+
+ngx_int_t ngx_io_uring_aio_read(ngx_event_aio_t *aio, u_char *buf,
+    size_t size, off_t offset);
+void ngx_io_uring_register_file(ngx_fd_t fd, ngx_log_t *log);
+void ngx_io_uring_unregister_file(ngx_fd_t fd, ngx_log_t *log);
+
+#define ngx_file_aio_register      ngx_io_uring_register_file
+#define ngx_file_aio_unregister    ngx_io_uring_unregister_file
+
+#else
+
+#define ngx_file_aio_register(fd, log)
+#define ngx_file_aio_unregister(fd, log)
+
+#endif
+
+
 typedef struct {
     ngx_int_t  (*add)(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags);
     ngx_int_t  (*del)(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags);
@@ -439,6 +473,9 @@ typedef struct {
 
     ngx_msec_t    accept_mutex_delay;
 
+    ngx_flag_t    latency;
+    ngx_msec_t    latency_threshold;
+
     u_char       *name;
 
 #if (NGX_DEBUG)
@@ -478,9 +515,48 @@ extern ngx_atomic_t  *ngx_stat_reading;
 extern ngx_atomic_t  *ngx_stat_writing;
 extern ngx_atomic_t  *ngx_stat_waiting;
 
+ngx_atomic_int_t ngx_stat_sum(ngx_atomic_t *stat);
+
 #endif
 
 
+#define NGX_EVENT_LATENCY_IO       0
+#define NGX_EVENT_LATENCY_POSTED   1
+#define NGX_EVENT_LATENCY_TIMER    2
+#define NGX_EVENT_LATENCY_KINDS    3
+
+/* handler time buckets: up to 1, 2, 4, ..., 262144 us, and +Inf */
+
+#define NGX_EVENT_LATENCY_BUCKETS  20
+
+
+typedef struct {
+    ngx_atomic_t              time[NGX_EVENT_LATENCY_KINDS];
+    ngx_atomic_t              slow[NGX_EVENT_LATENCY_KINDS];
+    ngx_atomic_t              buckets[NGX_EVENT_LATENCY_KINDS]
+                                     [NGX_EVENT_LATENCY_BUCKETS];
+} ngx_event_latency_t;
+
+
+extern ngx_event_latency_t   *ngx_event_latency;
+
+
+void ngx_event_latency_handler(ngx_event_t *ev, ngx_uint_t kind);
+void ngx_event_latency_sum(ngx_event_latency_t *lt);
+
+
+static ngx_inline void
+ngx_event_handle(ngx_event_t *ev, ngx_uint_t kind)
+{
+    if (ngx_event_latency) {
+        ngx_event_latency_handler(ev, kind);
+
+    } else {
+        ev->handler(ev);
+    }
+}
+
+
 #define NGX_UPDATE_TIME         1
 #define NGX_POST_EVENTS         2
 
@@ -518,6 +594,7 @@ u_char *ngx_acceptex_log_error(ngx_log_t *log, u_char *buf, size_t len);
 
 
 ngx_int_t ngx_send_lowat(ngx_connection_t *c, size_t lowat);
+void *ngx_event_alloc(ngx_cycle_t *cycle, size_t size);
 
 
 /* used in ngx_log_debugX() */
@@ -55,6 +55,13 @@ ngx_event_accept(ngx_event_t *ev)
     do {
         socklen = sizeof(ngx_sockaddr_t);
 
+#if (NGX_HAVE_IO_URING)
+        if (lc->data) {
+            /* the connection was accepted by io_uring */
+            s = ngx_io_uring_accept(ev, &sa.sockaddr, &socklen);
+
+        } else
+#endif
 #if (NGX_HAVE_ACCEPT4)
         if (use_accept4) {
             s = accept4(lc->fd, &sa.sockaddr, &socklen, SOCK_NONBLOCK);
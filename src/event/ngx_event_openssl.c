@@ -47,6 +47,9 @@ static void ngx_ssl_write_handler(ngx_event_t *wev);
 static ssize_t ngx_ssl_write_early(ngx_connection_t *c, u_char *data,
     size_t size);
 #endif
+#ifdef BIO_get_ktls_send
+static void ngx_ssl_ktls(ngx_connection_t *c);
+#endif
 static ssize_t ngx_ssl_sendfile(ngx_connection_t *c, ngx_buf_t *file,
     size_t size);
 static void ngx_ssl_read_handler(ngx_event_t *rev);
@@ -1767,13 +1770,7 @@ ngx_ssl_handshake(ngx_connection_t *c)
 #endif
 
 #ifdef BIO_get_ktls_send
-
-        if (BIO_get_ktls_send(SSL_get_wbio(c->ssl->connection)) == 1) {
-            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                           "BIO_get_ktls_send(): 1");
-            c->ssl->sendfile = 1;
-        }
-
+        ngx_ssl_ktls(c);
 #endif
 
         rc = ngx_ssl_ocsp_validate(c);
@@ -1912,13 +1909,7 @@ ngx_ssl_try_early_data(ngx_connection_t *c)
         c->write->ready = 1;
 
 #ifdef BIO_get_ktls_send
-
-        if (BIO_get_ktls_send(SSL_get_wbio(c->ssl->connection)) == 1) {
-            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                           "BIO_get_ktls_send(): 1");
-            c->ssl->sendfile = 1;
-        }
-
+        ngx_ssl_ktls(c);
 #endif
 
         rc = ngx_ssl_ocsp_validate(c);
@@ -2141,6 +2132,32 @@ ngx_ssl_recv_chain(ngx_connection_t *c, ngx_chain_t *cl, off_t limit)
 }
 
 
+#ifdef BIO_get_ktls_send
+
+static void
+ngx_ssl_ktls(ngx_connection_t *c)
+{
+    if (BIO_get_ktls_send(SSL_get_wbio(c->ssl->connection)) == 1) {
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "BIO_get_ktls_send(): 1");
+        c->ssl->sendfile = 1;
+    }
+
+    /*
+     * with kTLS receive the kernel decrypts data records, so plain data
+     * can be read from the socket while nothing is buffered by OpenSSL
+     */
+
+    if (BIO_get_ktls_recv(SSL_get_rbio(c->ssl->connection)) == 1) {
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "BIO_get_ktls_recv(): 1");
+        c->ssl->ktls_recv = 1;
+    }
+}
+
+#endif
+
+
 ssize_t
 ngx_ssl_recv(ngx_connection_t *c, u_char *buf, size_t size)
 {
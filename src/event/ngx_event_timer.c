@@ -10,117 +10,360 @@
 #include <ngx_event.h>
 
 
-ngx_rbtree_t              ngx_event_timer_rbtree;
-static ngx_rbtree_node_t  ngx_event_timer_sentinel;
-
 /*
- * the event timer rbtree may contain the duplicate keys, however,
- * it should not be a problem, because we use the rbtree to find
- * a minimum timer value only
+ * The event timers are kept in a hierarchical timer wheel.  Each level
+ * has 64 slots, a slot of the level n covers 64^n milliseconds, so six
+ * levels cover about 795 days.  A timer is placed on the level of the most
+ * significant 6-bit digit in which its key differs from the wheel time,
+ * into the slot selected by this digit of the key.  When the wheel time
+ * crosses a slot boundary of an upper level, the timers of the slot are
+ * cascaded down to lower levels, so the slot of the wheel time on upper
+ * levels is always empty.  Insertion and deletion are O(1), the
+ * expiration is O(1) per timer plus O(1) per 64 ms of elapsed time.
+ *
+ * The timers with keys in the past are kept in the separate queue and
+ * expire on the next ngx_event_expire_timers() call.
  */
 
+
+#define NGX_TIMER_WHEEL_BITS    6
+#define NGX_TIMER_WHEEL_SIZE    (1 << NGX_TIMER_WHEEL_BITS)
+#define NGX_TIMER_WHEEL_MASK    (NGX_TIMER_WHEEL_SIZE - 1)
+#define NGX_TIMER_WHEEL_LEVELS  6
+
+
+static void ngx_event_timer_expire(ngx_queue_t *queue);
+static void ngx_event_timer_cascade(void);
+static ngx_uint_t ngx_event_timer_first(uint64_t mask);
+static ngx_int_t ngx_event_timer_cancelable(ngx_queue_t *queue);
+
+
+static ngx_msec_t   ngx_event_timer_time;
+static ngx_queue_t  ngx_event_timer_expired;
+static ngx_queue_t  ngx_event_timer_wheel[NGX_TIMER_WHEEL_LEVELS]
+                                         [NGX_TIMER_WHEEL_SIZE];
+static uint64_t     ngx_event_timer_bitmap[NGX_TIMER_WHEEL_LEVELS];
+
+
 ngx_int_t
 ngx_event_timer_init(ngx_log_t *log)
 {
-    ngx_rbtree_init(&ngx_event_timer_rbtree, &ngx_event_timer_sentinel,
-                    ngx_rbtree_insert_timer_value);
+    ngx_uint_t  i, n;
+
+    ngx_event_timer_time = ngx_current_msec;
+
+    ngx_queue_init(&ngx_event_timer_expired);
+
+    for (i = 0; i < NGX_TIMER_WHEEL_LEVELS; i++) {
+        for (n = 0; n < NGX_TIMER_WHEEL_SIZE; n++) {
+            ngx_queue_init(&ngx_event_timer_wheel[i][n]);
+        }
+
+        ngx_event_timer_bitmap[i] = 0;
+    }
 
     return NGX_OK;
 }
 
 
+void
+ngx_event_timer_insert(ngx_event_t *ev)
+{
+    ngx_msec_t  key, diff;
+    ngx_uint_t  level, slot;
+
+    key = ev->timer.key;
+
+    if ((ngx_msec_int_t) (key - ngx_event_timer_time) < 0) {
+        ngx_queue_insert_tail(&ngx_event_timer_expired, &ev->timer.queue);
+        return;
+    }
+
+    diff = key ^ ngx_event_timer_time;
+
+    for (level = 0; level < NGX_TIMER_WHEEL_LEVELS - 1; level++) {
+        if ((diff >> ((level + 1) * NGX_TIMER_WHEEL_BITS)) == 0) {
+            break;
+        }
+    }
+
+    if ((uint64_t) diff >> (NGX_TIMER_WHEEL_LEVELS * NGX_TIMER_WHEEL_BITS)) {
+
+        /*
+         * the timer is beyond the wheel range: it is placed into the slot
+         * which will be cascaded last, and reinserted then
+         */
+
+        slot = (ngx_event_timer_time >> (level * NGX_TIMER_WHEEL_BITS))
+               + NGX_TIMER_WHEEL_MASK;
+
+    } else {
+        slot = key >> (level * NGX_TIMER_WHEEL_BITS);
+    }
+
+    slot &= NGX_TIMER_WHEEL_MASK;
+
+    ngx_queue_insert_tail(&ngx_event_timer_wheel[level][slot],
+                          &ev->timer.queue);
+
+    ngx_event_timer_bitmap[level] |= (uint64_t) 1 << slot;
+}
+
+
+void
+ngx_event_timer_delete(ngx_event_t *ev)
+{
+    ngx_uint_t    n;
+    ngx_queue_t  *q;
+
+    q = ev->timer.queue.next;
+
+    if (q != ev->timer.queue.prev) {
+        ngx_queue_remove(&ev->timer.queue);
+        return;
+    }
+
+    ngx_queue_remove(&ev->timer.queue);
+
+    if (q < &ngx_event_timer_wheel[0][0]
+        || q > &ngx_event_timer_wheel[NGX_TIMER_WHEEL_LEVELS - 1]
+                                     [NGX_TIMER_WHEEL_MASK])
+    {
+        return;
+    }
+
+    /* the slot became empty */
+
+    n = q - &ngx_event_timer_wheel[0][0];
+
+    ngx_event_timer_bitmap[n / NGX_TIMER_WHEEL_SIZE] &=
+                           ~((uint64_t) 1 << (n % NGX_TIMER_WHEEL_SIZE));
+}
+
+
 ngx_msec_t
 ngx_event_find_timer(void)
 {
-    ngx_msec_int_t      timer;
-    ngx_rbtree_node_t  *node, *root, *sentinel;
+    uint64_t        mask;
+    ngx_uint_t      level, slot, shift;
+    ngx_msec_t      start, round;
+    ngx_msec_int_t  timer;
 
-    if (ngx_event_timer_rbtree.root == &ngx_event_timer_sentinel) {
-        return NGX_TIMER_INFINITE;
+    if (!ngx_queue_empty(&ngx_event_timer_expired)) {
+        return 0;
     }
 
-    root = ngx_event_timer_rbtree.root;
-    sentinel = ngx_event_timer_rbtree.sentinel;
+    for (level = 0; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+
+        if (ngx_event_timer_bitmap[level] == 0) {
+            continue;
+        }
+
+        shift = level * NGX_TIMER_WHEEL_BITS;
+        slot = (ngx_event_timer_time >> shift) & NGX_TIMER_WHEEL_MASK;
+
+        round = (ngx_msec_t) NGX_TIMER_WHEEL_SIZE << shift;
+        start = ngx_event_timer_time & ~(round - 1);
 
-    node = ngx_rbtree_min(root, sentinel);
+        mask = ngx_event_timer_bitmap[level] & ~(((uint64_t) 1 << slot) - 1);
 
-    timer = (ngx_msec_int_t) (node->key - ngx_current_msec);
+        if (mask == 0) {
 
-    return (ngx_msec_t) (timer > 0 ? timer : 0);
+            /* the slots of the next round */
+
+            mask = ngx_event_timer_bitmap[level];
+            start += round;
+        }
+
+        /*
+         * the lowest non-empty level has the nearest timer: the start of
+         * its slot is exact for the first level, and it is the time when
+         * the slot should be cascaded for upper levels
+         */
+
+        start += (ngx_msec_t) ngx_event_timer_first(mask) << shift;
+
+        timer = (ngx_msec_int_t) (start - ngx_current_msec);
+
+        return (ngx_msec_t) (timer > 0 ? timer : 0);
+    }
+
+    return NGX_TIMER_INFINITE;
 }
 
 
 void
 ngx_event_expire_timers(void)
 {
-    ngx_event_t        *ev;
-    ngx_rbtree_node_t  *node, *root, *sentinel;
-
-    sentinel = ngx_event_timer_rbtree.sentinel;
+    uint64_t    mask;
+    ngx_uint_t  slot;
+    ngx_msec_t  next;
 
     for ( ;; ) {
-        root = ngx_event_timer_rbtree.root;
 
-        if (root == sentinel) {
+        ngx_event_timer_expire(&ngx_event_timer_expired);
+
+        if ((ngx_msec_int_t) (ngx_event_timer_time - ngx_current_msec) > 0) {
             return;
         }
 
-        node = ngx_rbtree_min(root, sentinel);
+        slot = ngx_event_timer_time & NGX_TIMER_WHEEL_MASK;
 
-        /* node->key > ngx_current_msec */
+        ngx_event_timer_expire(&ngx_event_timer_wheel[0][slot]);
 
-        if ((ngx_msec_int_t) (node->key - ngx_current_msec) > 0) {
-            return;
+        /* skip empty slots up to the current time */
+
+        mask = ngx_event_timer_bitmap[0] & ~(((uint64_t) 2 << slot) - 1);
+
+        if (mask) {
+            next = (ngx_event_timer_time & ~NGX_TIMER_WHEEL_MASK)
+                   + ngx_event_timer_first(mask);
+
+        } else {
+            next = (ngx_event_timer_time | NGX_TIMER_WHEEL_MASK) + 1;
         }
 
-        ev = ngx_rbtree_data(node, ngx_event_t, timer);
+        if ((ngx_msec_int_t) (next - ngx_current_msec) > 0) {
+            next = ngx_current_msec + 1;
+        }
+
+        ngx_event_timer_time = next;
+
+        if ((next & NGX_TIMER_WHEEL_MASK) == 0) {
+            ngx_event_timer_cascade();
+        }
+    }
+}
+
+
+static void
+ngx_event_timer_expire(ngx_queue_t *queue)
+{
+    ngx_queue_t  *q;
+    ngx_event_t  *ev;
+
+    while (!ngx_queue_empty(queue)) {
+        q = ngx_queue_head(queue);
+
+        ev = ngx_queue_data(q, ngx_event_t, timer.queue);
 
         ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                        "event timer del: %d: %M",
                        ngx_event_ident(ev->data), ev->timer.key);
 
-        ngx_rbtree_delete(&ngx_event_timer_rbtree, &ev->timer);
-
-#if (NGX_DEBUG)
-        ev->timer.left = NULL;
-        ev->timer.right = NULL;
-        ev->timer.parent = NULL;
-#endif
+        ngx_event_timer_delete(ev);
 
         ev->timer_set = 0;
 
         ev->timedout = 1;
 
-        ev->handler(ev);
+        ngx_event_handle(ev, NGX_EVENT_LATENCY_TIMER);
     }
 }
 
 
+static void
+ngx_event_timer_cascade(void)
+{
+    ngx_uint_t    level, slot;
+    ngx_queue_t   queue, *q;
+    ngx_event_t  *ev;
+
+    for (level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+
+        slot = (ngx_event_timer_time >> (level * NGX_TIMER_WHEEL_BITS))
+               & NGX_TIMER_WHEEL_MASK;
+
+        if (ngx_event_timer_bitmap[level] & ((uint64_t) 1 << slot)) {
+
+            ngx_queue_init(&queue);
+            ngx_queue_add(&queue, &ngx_event_timer_wheel[level][slot]);
+            ngx_queue_init(&ngx_event_timer_wheel[level][slot]);
+
+            ngx_event_timer_bitmap[level] &= ~((uint64_t) 1 << slot);
+
+            while (!ngx_queue_empty(&queue)) {
+                q = ngx_queue_head(&queue);
+                ngx_queue_remove(q);
+
+                ev = ngx_queue_data(q, ngx_event_t, timer.queue);
+
+                ngx_event_timer_insert(ev);
+            }
+        }
+
+        if (slot != 0) {
+            break;
+        }
+    }
+}
+
+
+static ngx_uint_t
+ngx_event_timer_first(uint64_t mask)
+{
+    ngx_uint_t  n;
+
+    /* mask is not zero */
+
+    n = 0;
+
+    while ((mask & 0xff) == 0) {
+        mask >>= 8;
+        n += 8;
+    }
+
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        n++;
+    }
+
+    return n;
+}
+
+
 ngx_int_t
 ngx_event_no_timers_left(void)
 {
-    ngx_event_t        *ev;
-    ngx_rbtree_node_t  *node, *root, *sentinel;
+    ngx_uint_t  level, slot;
+
+    if (ngx_event_timer_cancelable(&ngx_event_timer_expired) != NGX_OK) {
+        return NGX_AGAIN;
+    }
 
-    sentinel = ngx_event_timer_rbtree.sentinel;
-    root = ngx_event_timer_rbtree.root;
+    for (level = 0; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < NGX_TIMER_WHEEL_SIZE; slot++) {
 
-    if (root == sentinel) {
-        return NGX_OK;
+            if (ngx_event_timer_cancelable(&ngx_event_timer_wheel[level][slot])
+                != NGX_OK)
+            {
+                return NGX_AGAIN;
+            }
+        }
     }
 
-    for (node = ngx_rbtree_min(root, sentinel);
-         node;
-         node = ngx_rbtree_next(&ngx_event_timer_rbtree, node))
+    /* only cancelable timers left */
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_event_timer_cancelable(ngx_queue_t *queue)
+{
+    ngx_queue_t  *q;
+    ngx_event_t  *ev;
+
+    for (q = ngx_queue_head(queue);
+         q != ngx_queue_sentinel(queue);
+         q = ngx_queue_next(q))
     {
-        ev = ngx_rbtree_data(node, ngx_event_t, timer);
+        ev = ngx_queue_data(q, ngx_event_t, timer.queue);
 
         if (!ev->cancelable) {
             return NGX_AGAIN;
         }
     }
 
-    /* only cancelable timers left */
-
     return NGX_OK;
 }
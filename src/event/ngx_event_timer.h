@@ -23,9 +23,8 @@ ngx_int_t ngx_event_timer_init(ngx_log_t *log);
 ngx_msec_t ngx_event_find_timer(void);
 void ngx_event_expire_timers(void);
 ngx_int_t ngx_event_no_timers_left(void);
-
-
-extern ngx_rbtree_t  ngx_event_timer_rbtree;
+void ngx_event_timer_insert(ngx_event_t *ev);
+void ngx_event_timer_delete(ngx_event_t *ev);
 
 
 static ngx_inline void
@@ -35,13 +34,7 @@ ngx_event_del_timer(ngx_event_t *ev)
                    "event timer del: %d: %M",
                     ngx_event_ident(ev->data), ev->timer.key);
 
-    ngx_rbtree_delete(&ngx_event_timer_rbtree, &ev->timer);
-
-#if (NGX_DEBUG)
-    ev->timer.left = NULL;
-    ev->timer.right = NULL;
-    ev->timer.parent = NULL;
-#endif
+    ngx_event_timer_delete(ev);
 
     ev->timer_set = 0;
 }
@@ -60,7 +53,7 @@ ngx_event_add_timer(ngx_event_t *ev, ngx_msec_t timer)
         /*
          * Use a previous timer value if difference between it and a new
          * value is less than NGX_TIMER_LAZY_DELAY milliseconds: this allows
-         * to minimize the rbtree operations for fast connections.
+         * to minimize the timer wheel operations for fast connections.
          */
 
         diff = (ngx_msec_int_t) (key - ev->timer.key);
@@ -81,7 +74,7 @@ ngx_event_add_timer(ngx_event_t *ev, ngx_msec_t timer)
                    "event timer add: %d: %M:%M",
                     ngx_event_ident(ev->data), timer, ev->timer.key);
 
-    ngx_rbtree_insert(&ngx_event_timer_rbtree, &ev->timer);
+    ngx_event_timer_insert(ev);
 
     ev->timer_set = 1;
 }
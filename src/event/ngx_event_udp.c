@@ -335,9 +335,10 @@ ngx_event_recvmsg(ngx_event_t *ev)
     ngx_listening_t   *ls;
     ngx_event_conf_t  *ecf;
     ngx_connection_t  *lc;
-    static u_char      buffer[NGX_UDP_RECVMMSG_MAX][65535];
     ngx_int_t          i;
 
+    static u_char    (*buffer)[65535];
+
 #if (NGX_HAVE_ADDRINFO_CMSG)
     u_char             msg_control[NGX_UDP_RECVMMSG_MAX][CMSG_SPACE(sizeof(ngx_addrinfo_t))];
 #endif
@@ -356,6 +357,14 @@ ngx_event_recvmsg(ngx_event_t *ev)
         ev->available = ecf->multi_accept;
     }
 
+    if (buffer == NULL) {
+        buffer = ngx_event_alloc((ngx_cycle_t *) ngx_cycle,
+                                 NGX_UDP_RECVMMSG_MAX * 65535);
+        if (buffer == NULL) {
+            return;
+        }
+    }
+
     lc = ev->data;
     ls = lc->listening;
     ev->ready = 0;
@@ -151,8 +151,13 @@ ngx_quic_apply_transport_params(ngx_connection_t *c, ngx_quic_tp_t *ctp)
         ngx_log_error(NGX_LOG_INFO, c->log, 0,
                       "quic maximum packet size is invalid");
         return NGX_ERROR;
+    }
+
+#if (NGX_HAVE_IP_MTU_DISCOVER)
+    qc->mtu_max = ctp->max_udp_payload_size;
+#endif
 
-    } else if (ctp->max_udp_payload_size > ngx_quic_max_udp_payload(c)) {
+    if (ctp->max_udp_payload_size > ngx_quic_max_udp_payload(c)) {
         ctp->max_udp_payload_size = ngx_quic_max_udp_payload(c);
         ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
                        "quic client maximum packet size truncated");
@@ -299,6 +304,11 @@ ngx_quic_new_connection(ngx_connection_t *c, ngx_quic_conf_t *conf,
     qc->conf = conf;
     qc->tp = conf->tp;
 
+    qc->qlog = ngx_quic_qlog_start(c, conf);
+
+    ngx_quic_qlog(c, qc, NGX_QUIC_QLOG_CONNECTION_STARTED, 0,
+                  qc->version, 0, 0);
+
     ctp = &qc->ctp;
 
     /* defaults to be used before actual client parameters are received */
@@ -308,11 +318,7 @@ ngx_quic_new_connection(ngx_connection_t *c, ngx_quic_conf_t *conf,
     ctp->active_connection_id_limit = 2;
 
 #if (NGX_HAVE_IP_MTU_DISCOVER)
-    qc->mtu.min_probe_length = NGX_QUIC_MIN_INITIAL_SIZE;
-    qc->mtu.max_probe_length = qc->conf->mtu_target;
-    qc->mtu.remaining_probe_count = qc->conf->mtu_attemts;
-    qc->mtu.packets_between_probes = 100;
-    qc->mtu.next_probe_at = qc->mtu.packets_between_probes;
+    qc->mtu_max = ctp->max_udp_payload_size;
 #endif
 
     ngx_queue_init(&qc->streams.uninitialized);
@@ -623,6 +629,11 @@ ngx_quic_close_quic(ngx_connection_t *c, ngx_int_t rc)
         return NGX_AGAIN;
     }
 
+    ngx_quic_qlog(c, qc, NGX_QUIC_QLOG_CONNECTION_CLOSED, 0,
+                  qc->error, 0, 0);
+
+    ngx_quic_stats_close(c);
+
     ngx_quic_close_sockets(c);
 
     ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
@@ -902,6 +913,21 @@ ngx_quic_process_packet(ngx_connection_t *c, ngx_quic_conf_t *conf,
 
         rc = ngx_quic_validate_token(c, conf->av_token_key, pkt);
 
+        /* a token is rejected unless it is known to be new */
+
+        if (rc == NGX_OK && conf->anti_replay
+            && ngx_quic_replay_check(c, conf->anti_replay,
+                                     NGX_QUIC_REPLAY_TOKEN, pkt->token.data,
+                                     pkt->token.len)
+               != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "quic token rejected, possible replay");
+
+            pkt->validated = 0;
+            rc = NGX_DECLINED;
+        }
+
         if (rc == NGX_ERROR) {
             /* internal error */
             return NGX_ERROR;
@@ -1053,6 +1079,9 @@ ngx_quic_process_payload(ngx_connection_t *c, ngx_quic_header_t *pkt)
 
     pkt->received = ngx_current_msec;
 
+    ngx_quic_qlog(c, qc, NGX_QUIC_QLOG_PACKET_RECEIVED, pkt->level,
+                  pkt->pn, pkt->len, 0);
+
     c->log->action = "handling payload";
 
     if (pkt->level != ssl_encryption_application) {
@@ -1099,7 +1128,7 @@ ngx_quic_discard_ctx(ngx_connection_t *c, enum ssl_encryption_level_t level)
 
     ctx = ngx_quic_get_send_ctx(qc, level);
 
-    ngx_quic_free_bufs(c, ctx->crypto);
+    ngx_quic_free_buffer(c, &ctx->crypto);
 
     while (!ngx_queue_empty(&ctx->sent)) {
         q = ngx_queue_head(&ctx->sent);
@@ -1207,6 +1236,9 @@ ngx_quic_handle_frames(ngx_connection_t *c, ngx_quic_header_t *pkt)
 
         ngx_quic_log_frame(c->log, &frame, 0);
 
+        ngx_quic_qlog(c, qc, NGX_QUIC_QLOG_FRAME_PROCESSED, pkt->level,
+                      pkt->pn, frame.type, 0);
+
         c->log->action = "handling frames";
 
         p += len;
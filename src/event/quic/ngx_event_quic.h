@@ -29,6 +29,20 @@
 
 #define NGX_QUIC_STREAM_BUFSIZE              65536
 
+#define NGX_QUIC_NEW_TOKEN_LIFETIME          600 /* seconds */
+
+/* a token is remembered while it is valid */
+#define NGX_QUIC_REPLAY_WINDOW               NGX_QUIC_NEW_TOKEN_LIFETIME
+
+/* histogram buckets, the last one is unbounded */
+#define NGX_QUIC_STATS_RTT_BUCKETS           12  /* 1ms .. 1024ms */
+#define NGX_QUIC_STATS_CWND_BUCKETS          12  /* 4k .. 4m */
+
+#define NGX_QUIC_QLOG_SIZE                   4096 /* records per buffer */
+
+#define ngx_quic_stats_rtt_bound(i)          ((ngx_msec_t) 1 << (i))
+#define ngx_quic_stats_cwnd_bound(i)         ((size_t) 4096 << (i))
+
 
 typedef struct {
     /* configurable */
@@ -55,10 +69,25 @@ typedef struct {
 } ngx_quic_tp_t;
 
 
+typedef struct {
+    ngx_str_t                  path;
+    ngx_uint_t                 sample;      /* per 10000 connections */
+    ngx_array_t               *clients;     /* of ngx_cidr_t */
+    ngx_uint_t                 size;
+#if (NGX_THREADS)
+    struct ngx_thread_pool_s  *thread_pool;
+#endif
+    void                      *qlog;        /* per worker */
+} ngx_quic_qlog_conf_t;
+
+
 typedef struct {
     ngx_ssl_t                 *ssl;
     ngx_quic_tp_t              tp;
     ngx_flag_t                 retry;
+    ngx_shm_zone_t            *anti_replay;
+    ngx_shm_zone_t            *stats;
+    ngx_quic_qlog_conf_t      *qlog;
     ngx_flag_t                 gso_enabled;
     ngx_flag_t                 migration_close_connection;
     ngx_str_t                  host_key;
@@ -86,6 +115,29 @@ typedef struct {
 } ngx_quic_conf_t;
 
 
+typedef struct ngx_quic_hole_s  ngx_quic_hole_t;
+
+/* a range of not yet received data, kept as hole buffers in the chain */
+struct ngx_quic_hole_s {
+    ngx_quic_hole_t           *next;
+    ngx_quic_hole_t           *prev;
+    ngx_chain_t               *chain;        /* first buffer of the hole */
+    uint64_t                   start;
+    uint64_t                   end;
+};
+
+
+/* received data, ordered by offset, with holes */
+typedef struct {
+    ngx_chain_t               *chain;
+    ngx_chain_t               *last;         /* last buffer of the chain */
+    uint64_t                   last_offset;  /* end of the last buffer */
+    ngx_quic_hole_t           *holes;        /* sorted by offset */
+    ngx_quic_hole_t           *tail;         /* last hole */
+    ngx_quic_hole_t           *hint;         /* last filled hole */
+} ngx_quic_buffer_t;
+
+
 typedef struct {
     ngx_queue_t                queue;
     ngx_queue_t               *frames;
@@ -95,6 +147,44 @@ typedef struct {
 } ngx_quic_fqueue_t;
 
 
+/* aggregated over closed connections, kept in shared memory */
+typedef struct {
+    ngx_atomic_t               connections;
+    ngx_atomic_t               handshakes;
+    ngx_atomic_t               handshake_time;   /* ms, sum */
+    ngx_atomic_t               packets_sent;
+    ngx_atomic_t               packets_lost;
+    ngx_atomic_t               packets_retransmitted;
+    ngx_atomic_t               ptos;
+    ngx_atomic_t               path_changes;
+
+    ngx_atomic_t               rtt[NGX_QUIC_STATS_RTT_BUCKETS];
+    ngx_atomic_t               rtt_sum;          /* ms */
+    ngx_atomic_t               rtt_count;
+
+    ngx_atomic_t               cwnd[NGX_QUIC_STATS_CWND_BUCKETS];
+    ngx_atomic_t               cwnd_sum;         /* bytes */
+} ngx_quic_stats_t;
+
+
+/* snapshot of a live connection */
+typedef struct {
+    ngx_msec_t                 rtt;
+    ngx_msec_t                 min_rtt;
+    ngx_msec_t                 rttvar;
+    size_t                     cwnd;
+    size_t                     in_flight;
+    ngx_uint_t                 lost;
+    ngx_uint_t                 retransmitted;
+    ngx_uint_t                 pto_count;
+    ngx_uint_t                 path_changes;
+    ngx_msec_t                 handshake_time;
+
+    unsigned                   rtt_sampled:1;
+    unsigned                   handshaked:1;
+} ngx_quic_conn_stats_t;
+
+
 struct ngx_quic_stream_s {
     ngx_rbtree_node_t          node;
     ngx_queue_t                queue;
@@ -109,7 +199,7 @@ struct ngx_quic_stream_s {
     uint64_t                   recv_window;
     uint64_t                   recv_last;
     uint64_t                   final_size;
-    ngx_chain_t               *in;
+    ngx_quic_buffer_t          in;
     ngx_uint_t                 cancelable;  /* unsigned  cancelable:1; */
 };
 
@@ -132,6 +222,15 @@ ngx_int_t ngx_quic_derive_key(ngx_log_t *log, const char *label,
 
 void ngx_quic_add_exemptions(ngx_connection_t *c, size_t size);
 
+ngx_shm_zone_t *ngx_quic_replay_add_zone(ngx_conf_t *cf, ngx_str_t *name,
+    size_t size, time_t window);
+
+ngx_shm_zone_t *ngx_quic_stats_add_zone(ngx_conf_t *cf, ngx_str_t *name);
+ngx_quic_stats_t *ngx_quic_stats(ngx_shm_zone_t *shm_zone);
+ngx_int_t ngx_quic_conn_stats(ngx_connection_t *c, ngx_quic_conn_stats_t *st);
+
+void ngx_quic_qlog_exit(void);
+
 #if (NGX_HAVE_IP_MTU_DISCOVER)
 size_t ngx_quic_mtu(ngx_connection_t *c);
 #endif
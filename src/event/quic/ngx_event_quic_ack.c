@@ -348,6 +348,8 @@ ngx_quic_congestion_ack(ngx_connection_t *c, ngx_quic_frame_t *f)
         ngx_quic_mtu_ack(c, f);
         return;
     }
+
+    ngx_quic_mtu_packet_acked(c, f);
 #endif
 
     qc = ngx_quic_get_connection(c);
@@ -382,6 +384,9 @@ ngx_quic_congestion_ack(ngx_connection_t *c, ngx_quic_frame_t *f)
                        cg->window, cg->ssthresh, cg->in_flight);
     }
 
+    ngx_quic_qlog(c, qc, NGX_QUIC_QLOG_METRICS_UPDATED, 0,
+                  cg->window, cg->in_flight, cg->ssthresh);
+
     /* prevent recovery_start from wrapping */
 
     timer = cg->recovery_start - ngx_current_msec + qc->tp.max_idle_timeout * 2;
@@ -518,6 +523,11 @@ ngx_quic_detect_lost(ngx_connection_t *c, ngx_quic_ack_stat_t *st)
                 nlost++;
             }
 
+            qc->counters.lost++;
+
+            ngx_quic_qlog(c, qc, NGX_QUIC_QLOG_PACKET_LOST, ctx->level,
+                          start->pnum, start->plen, 0);
+
             ngx_quic_resend_frames(c, ctx);
         }
     }
@@ -580,6 +590,9 @@ ngx_quic_persistent_congestion(ngx_connection_t *c)
 
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
                    "quic persistent congestion win:%uz", cg->window);
+
+    ngx_quic_qlog(c, qc, NGX_QUIC_QLOG_METRICS_UPDATED, 0,
+                  cg->window, cg->in_flight, cg->ssthresh);
 }
 
 
@@ -598,6 +611,8 @@ ngx_quic_resend_frames(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx)
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
                    "quic resend packet pnum:%uL", start->pnum);
 
+    qc->counters.retransmitted++;
+
     ngx_quic_congestion_lost(c, start);
 
     do {
@@ -695,6 +710,8 @@ ngx_quic_congestion_lost(ngx_connection_t *c, ngx_quic_frame_t *f)
         ngx_quic_mtu_lost(c, f);
         return;
     }
+
+    ngx_quic_mtu_packet_lost(c, f);
 #endif
 
     qc = ngx_quic_get_connection(c);
@@ -732,6 +749,9 @@ ngx_quic_congestion_lost(ngx_connection_t *c, ngx_quic_frame_t *f)
                    "quic congestion lost win:%uz ss:%z if:%uz",
                    cg->window, cg->ssthresh, cg->in_flight);
 
+    ngx_quic_qlog(c, qc, NGX_QUIC_QLOG_METRICS_UPDATED, 0,
+                  cg->window, cg->in_flight, cg->ssthresh);
+
 done:
 
     if (blocked && !ngx_quic_is_blocked(c)) {
@@ -971,6 +991,7 @@ ngx_quic_pto_handler(ngx_event_t *ev)
     }
 
     qc->pto_count++;
+    qc->counters.ptos++;
 
     ngx_quic_connstate_dbg(c);
 }
@@ -33,6 +33,9 @@ typedef struct ngx_quic_keys_s        ngx_quic_keys_t;
 #include <ngx_event_quic_streams.h>
 #include <ngx_event_quic_ssl.h>
 #include <ngx_event_quic_tokens.h>
+#include <ngx_event_quic_replay.h>
+#include <ngx_event_quic_stats.h>
+#include <ngx_event_quic_qlog.h>
 #include <ngx_event_quic_ack.h>
 #include <ngx_event_quic_output.h>
 #include <ngx_event_quic_socket.h>
@@ -100,6 +103,9 @@ struct ngx_quic_path_s {
     time_t                            validated_at;
     ngx_str_t                         addr_text;
     u_char                            text[NGX_SOCKADDR_STRLEN];
+#if (NGX_HAVE_IP_MTU_DISCOVER)
+    ngx_quic_mtu_t                    mtu;
+#endif
 };
 
 
@@ -162,7 +168,7 @@ typedef struct {
 struct ngx_quic_send_ctx_s {
     enum ssl_encryption_level_t       level;
 
-    ngx_chain_t                      *crypto;
+    ngx_quic_buffer_t                 crypto;
     uint64_t                          crypto_received;
     uint64_t                          crypto_sent;
 
@@ -192,25 +198,6 @@ struct ngx_quic_send_ctx_s {
 };
 
 
-#if (NGX_HAVE_IP_MTU_DISCOVER)
-typedef struct {
-    size_t                            min_probe_length;
-    size_t                            max_probe_length;
-    size_t                            last_probe_length;
-
-    ngx_int_t                         remaining_probe_count;
-
-    /* The number of packets between MTU probes. */
-    uint64_t                          packets_between_probes;
-
-    /* The packet number of the packet after which the next MTU probe will be sent. */
-    uint64_t                          next_probe_at;
-
-    unsigned                          process:1;
-} ngx_quic_mtu_t;
-#endif
-
-
 struct ngx_quic_connection_s {
     uint32_t                          version;
 
@@ -218,7 +205,7 @@ struct ngx_quic_connection_s {
     ngx_quic_socket_t                *backup;
 
 #if (NGX_HAVE_IP_MTU_DISCOVER)
-    ngx_quic_mtu_t                    mtu;
+    size_t                            mtu_max;  /* peer max_udp_payload_size */
 #endif
 
     ngx_queue_t                       sockets;
@@ -258,9 +245,13 @@ struct ngx_quic_connection_s {
 
     ngx_uint_t                        pto_count;
 
+    ngx_quic_counters_t               counters;
+    ngx_quic_qlog_t                  *qlog;
+
     ngx_queue_t                       free_frames;
     ngx_chain_t                      *free_bufs;
     ngx_buf_t                        *free_shadow_bufs;
+    ngx_quic_hole_t                  *free_holes;
 
     ngx_uint_t                        nframes;
 #ifdef NGX_QUIC_DEBUG_ALLOC
@@ -15,6 +15,8 @@
 
 static ngx_chain_t *ngx_quic_split_bufs(ngx_connection_t *c, ngx_chain_t *in,
     size_t len);
+static ngx_quic_hole_t *ngx_quic_alloc_hole(ngx_connection_t *c);
+static void ngx_quic_free_hole(ngx_connection_t *c, ngx_quic_hole_t *h);
 
 
 ngx_quic_frame_t *
@@ -546,18 +548,48 @@ done:
 
 
 ngx_int_t
-ngx_quic_order_bufs(ngx_connection_t *c, ngx_chain_t **out, ngx_chain_t *in,
-    size_t offset)
+ngx_quic_order_bufs(ngx_connection_t *c, ngx_quic_buffer_t *qb,
+    ngx_chain_t *in, uint64_t base, uint64_t offset)
 {
-    u_char       *p;
-    size_t        n;
-    ngx_buf_t    *b;
-    ngx_chain_t  *cl, *sl;
+    u_char           *p;
+    size_t            n;
+    uint64_t          last, start, end, pos;
+    ngx_buf_t        *b;
+    ngx_chain_t      *cl, *sl, **ll;
+    ngx_quic_hole_t  *h, *nh;
+
+    /*
+     * base is the offset of the first buffer in the chain; offset is the
+     * offset of the data, which is never less than base
+     *
+     * Space beyond the end of the chain is appended as a hole, and data
+     * is only copied into holes.  Holes are found in the sorted hole list,
+     * so neither appending nor filling a gap walks the received data.
+     * The list is searched from the last hole, or from the hole filled
+     * last time, whichever is the closest one starting at or before the
+     * data, so that mostly ordered data does not walk the list either.
+     */
+
+    last = offset;
+
+    for (cl = in; cl; cl = cl->next) {
+        last += cl->buf->last - cl->buf->pos;
+    }
 
-    while (in) {
-        cl = *out;
+    if (qb->chain == NULL) {
+        qb->last = NULL;
+        qb->last_offset = base;
+    }
 
-        if (cl == NULL) {
+    if (last > qb->last_offset) {
+
+        /* append hole buffers to cover the data */
+
+        start = qb->last_offset;
+        ll = qb->last ? &qb->last->next : &qb->chain;
+        sl = NULL;
+
+        while (qb->last_offset < last) {
             cl = ngx_quic_alloc_buf(c);
             if (cl == NULL) {
                 return NGX_ERROR;
@@ -566,52 +598,201 @@ ngx_quic_order_bufs(ngx_connection_t *c, ngx_chain_t **out, ngx_chain_t *in,
             cl->buf->last = cl->buf->end;
             cl->buf->sync = 1; /* hole */
             cl->next = NULL;
-            *out = cl;
+
+            if (sl == NULL) {
+                sl = cl;
+            }
+
+            *ll = cl;
+            ll = &cl->next;
+
+            qb->last = cl;
+            qb->last_offset += cl->buf->last - cl->buf->pos;
         }
 
-        b = cl->buf;
-        n = b->last - b->pos;
+        h = qb->tail;
+
+        if (h && h->end == start) {
+            h->end = qb->last_offset;
+
+        } else {
+            h = ngx_quic_alloc_hole(c);
+            if (h == NULL) {
+                return NGX_ERROR;
+            }
+
+            h->next = NULL;
+            h->prev = qb->tail;
+            h->chain = sl;
+            h->start = start;
+            h->end = qb->last_offset;
+
+            if (qb->tail) {
+                qb->tail->next = h;
+
+            } else {
+                qb->holes = h;
+            }
+
+            qb->tail = h;
+        }
+    }
+
+    h = qb->tail;
+
+    if (h == NULL || h->start > offset) {
+        h = qb->hint;
 
-        if (n <= offset) {
-            offset -= n;
-            out = &cl->next;
+        if (h == NULL || h->start > offset) {
+            h = qb->holes;
+        }
+    }
+
+    pos = offset;
+
+    while (h && pos < last) {
+
+        if (h->end <= pos) {
+            h = h->next;
             continue;
         }
 
-        if (b->sync && offset > 0) {
-            sl = ngx_quic_split_bufs(c, cl, offset);
+        if (h->start >= last) {
+            break;
+        }
+
+        start = ngx_max(pos, h->start);
+        end = ngx_min(last, h->end);
+
+        /* skip data already received */
+
+        ngx_quic_trim_bufs(in, start - pos);
+        pos = start;
+
+        /* find the hole buffer at start, splitting it if needed */
+
+        cl = h->chain;
+        offset = h->start;
+
+        for ( ;; ) {
+            n = cl->buf->last - cl->buf->pos;
+
+            if (offset + n > start) {
+                break;
+            }
+
+            offset += n;
+            cl = cl->next;
+        }
+
+        if (offset < start) {
+            sl = ngx_quic_split_bufs(c, cl, start - offset);
             if (sl == NGX_CHAIN_ERROR) {
                 return NGX_ERROR;
             }
 
             cl->next = sl;
-            continue;
+            cl = sl;
         }
 
-        for (p = b->pos + offset; p != b->last && in; /* void */ ) {
-            n = ngx_min(b->last - p, in->buf->last - in->buf->pos);
+        /* fill the hole buffers up to end */
+
+        while (pos < end) {
+            b = cl->buf;
+            n = b->last - b->pos;
 
-            if (b->sync) {
-                ngx_memcpy(p, in->buf->pos, n);
+            if (pos + n > end) {
+                sl = ngx_quic_split_bufs(c, cl, end - pos);
+                if (sl == NGX_CHAIN_ERROR) {
+                    return NGX_ERROR;
+                }
+
+                cl->next = sl;
+                b = cl->buf;
+                n = end - pos;
             }
 
-            p += n;
-            in->buf->pos += n;
-            offset += n;
+            for (p = b->pos; p != b->last && in; /* void */ ) {
+                n = ngx_min(b->last - p, in->buf->last - in->buf->pos);
 
-            if (in->buf->pos == in->buf->last) {
-                in = in->next;
+                p = ngx_cpymem(p, in->buf->pos, n);
+                in->buf->pos += n;
+
+                if (in->buf->pos == in->buf->last) {
+                    in = in->next;
+                }
             }
+
+            b->sync = 0;
+            pos += b->last - b->pos;
+            cl = cl->next;
         }
 
-        if (b->sync && p != b->pos) {
-            sl = ngx_quic_split_bufs(c, cl, p - b->pos);
-            if (sl == NGX_CHAIN_ERROR) {
-                return NGX_ERROR;
+        /* cl is now the buffer at end */
+
+        if (start > h->start) {
+            qb->hint = h;
+
+            if (end < h->end) {
+                nh = ngx_quic_alloc_hole(c);
+                if (nh == NULL) {
+                    return NGX_ERROR;
+                }
+
+                nh->next = h->next;
+                nh->prev = h;
+                nh->chain = cl;
+                nh->start = end;
+                nh->end = h->end;
+
+                if (h->next) {
+                    h->next->prev = nh;
+
+                } else {
+                    qb->tail = nh;
+                }
+
+                h->next = nh;
+                qb->hint = nh;
             }
 
-            cl->next = sl;
-            cl->buf->sync = 0;
+            h->end = start;
+            h = h->next;
+
+        } else if (end < h->end) {
+            h->chain = cl;
+            h->start = end;
+            qb->hint = h;
+
+        } else {
+            nh = h->next;
+
+            if (h->prev) {
+                h->prev->next = nh;
+
+            } else {
+                qb->holes = nh;
+            }
+
+            if (nh) {
+                nh->prev = h->prev;
+
+            } else {
+                qb->tail = h->prev;
+            }
+
+            qb->hint = h->prev ? h->prev : nh;
+
+            ngx_quic_free_hole(c, h);
+            h = nh;
+        }
+    }
+
+    /* the last buffer may have been split */
+
+    if (qb->last) {
+        while (qb->last->next) {
+            qb->last = qb->last->next;
         }
     }
 
@@ -619,6 +800,56 @@ ngx_quic_order_bufs(ngx_connection_t *c, ngx_chain_t **out, ngx_chain_t *in,
 }
 
 
+void
+ngx_quic_free_buffer(ngx_connection_t *c, ngx_quic_buffer_t *qb)
+{
+    ngx_quic_hole_t  *h;
+
+    ngx_quic_free_bufs(c, qb->chain);
+
+    while (qb->holes) {
+        h = qb->holes;
+        qb->holes = h->next;
+        ngx_quic_free_hole(c, h);
+    }
+
+    qb->chain = NULL;
+    qb->last = NULL;
+    qb->tail = NULL;
+    qb->hint = NULL;
+}
+
+
+static ngx_quic_hole_t *
+ngx_quic_alloc_hole(ngx_connection_t *c)
+{
+    ngx_quic_hole_t        *h;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    if (qc->free_holes) {
+        h = qc->free_holes;
+        qc->free_holes = h->next;
+        return h;
+    }
+
+    return ngx_palloc(c->pool, sizeof(ngx_quic_hole_t));
+}
+
+
+static void
+ngx_quic_free_hole(ngx_connection_t *c, ngx_quic_hole_t *h)
+{
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    h->next = qc->free_holes;
+    qc->free_holes = h;
+}
+
+
 #if (NGX_DEBUG)
 
 void
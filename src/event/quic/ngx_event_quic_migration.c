@@ -276,6 +276,10 @@ ngx_quic_add_path(ngx_connection_t *c, struct sockaddr *sockaddr,
 
     ngx_queue_insert_tail(&qc->paths, &path->queue);
 
+#if (NGX_HAVE_IP_MTU_DISCOVER)
+    ngx_quic_mtu_init(c, path);
+#endif
+
     ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
                    "quic path #%uL created src:%V",
                    path->seqnum, &path->addr_text);
@@ -413,6 +417,10 @@ ngx_quic_set_connection_path(ngx_connection_t *c, ngx_quic_path_t *path)
         c->addr_text.len = len;
     }
 
+#if (NGX_HAVE_IP_MTU_DISCOVER)
+    ngx_quic_mtu_set_path(c, path);
+#endif
+
     ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
                    "quic send path set to #%uL addr:%V",
                    path->seqnum, &path->addr_text);
@@ -492,6 +500,8 @@ ngx_quic_handle_migration(ngx_connection_t *c, ngx_quic_header_t *pkt)
 
     ngx_quic_set_connection_path(c, next);
 
+    qc->counters.path_changes++;
+
     /*
      * RFC 9000, 9.5.  Privacy Implications of Connection Migration
      *
@@ -750,5 +760,7 @@ ngx_quic_path_restore(ngx_connection_t *c)
 
     ngx_quic_set_connection_path(c, qsock->path);
 
+    qc->counters.path_changes++;
+
     return NGX_OK;
 }
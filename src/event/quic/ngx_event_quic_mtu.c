@@ -1,101 +1,107 @@
 
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_event.h>
 #include <ngx_event_quic_connection.h>
 
 
-// @see https://source.chromium.org/chromium/chromium/src/+/master:net/third_party/quiche/src/quic/core/quic_mtu_discovery.cc
+/*
+ * RFC 8899  Packetization Layer Path MTU Discovery for Datagram Transports
+ *
+ * Each path keeps its own search state.  The search starts with an
+ * optimistic probe of the target size, then narrows the interval between
+ * the largest confirmed size and the smallest failed size by halving it.
+ * Probes are PING frames padded to the probed size and sent with the DF
+ * bit set; they are not counted in bytes in flight.
+ */
+
+
+static ngx_quic_path_t *ngx_quic_mtu_probe_path(ngx_connection_t *c,
+    ngx_quic_frame_t *frame);
+static ngx_quic_path_t *ngx_quic_mtu_packet_path(ngx_connection_t *c,
+    ngx_quic_frame_t *frame);
+static ngx_int_t ngx_quic_mtu_should_probe(ngx_connection_t *c,
+    ngx_quic_path_t *path, uint64_t pnum);
+static void ngx_quic_mtu_start_search(ngx_connection_t *c,
+    ngx_quic_path_t *path);
+static size_t ngx_quic_mtu_next_probe_length(ngx_quic_mtu_t *mtu);
+static void ngx_quic_mtu_probe_failed(ngx_connection_t *c,
+    ngx_quic_path_t *path);
+static void ngx_quic_mtu_check_complete(ngx_connection_t *c,
+    ngx_quic_path_t *path);
 
-static ngx_int_t
-ngx_quic_mtu_should_probe(ngx_quic_mtu_t *mtu, uint64_t largest_sent_packet)
-{
-    if (mtu->process) {
-        return 0;
-    }
 
-    if (mtu->min_probe_length >= mtu->max_probe_length) {
-        return 0;
-    }
+void
+ngx_quic_mtu_init(ngx_connection_t *c, ngx_quic_path_t *path)
+{
+    ngx_quic_mtu_t         *mtu;
+    ngx_quic_send_ctx_t    *ctx;
+    ngx_quic_connection_t  *qc;
 
-    if (mtu->remaining_probe_count == 0) {
-        return 0;
-    }
+    qc = ngx_quic_get_connection(c);
+    ctx = ngx_quic_get_send_ctx(qc, ssl_encryption_application);
 
-    if (largest_sent_packet < mtu->next_probe_at) {
-        return 0;
-    }
+    mtu = &path->mtu;
 
-    return 1;
+    mtu->state = NGX_QUIC_MTU_BASE;
+    mtu->base = ngx_quic_max_udp_payload(c);
+    mtu->plpmtu = mtu->base;
+    mtu->max_probe_length = qc->conf->mtu_target;
+    mtu->next_probe_at = ctx->pnum + NGX_QUIC_MTU_PROBE_INTERVAL;
 }
 
 
-static size_t
-ngx_quic_mtu_next_probe_packet_length(ngx_quic_mtu_t *mtu)
+void
+ngx_quic_mtu_set_path(ngx_connection_t *c, ngx_quic_path_t *path)
 {
-    size_t  normal_next_probe_length = (mtu->min_probe_length + mtu->max_probe_length + 1) / 2;
-
-    if (mtu->remaining_probe_count == 1 &&
-        normal_next_probe_length > mtu->last_probe_length)
-    {
-        /* If the previous probe succeeded, and there is only one last probe to
-         * end, use |max_probe_length_| for the last probe.
-         */
-        return mtu->max_probe_length;
-    }
-
-    return normal_next_probe_length;
-}
-
+    ngx_quic_connection_t  *qc;
 
-static size_t
-ngx_quic_mtu_get_updated_probe_size(ngx_quic_mtu_t *mtu, uint64_t largest_sent_packet)
-{
-    size_t  probe_packet_length = ngx_quic_mtu_next_probe_packet_length(mtu);
+    qc = ngx_quic_get_connection(c);
 
-    if (probe_packet_length == mtu->last_probe_length) {
-        /* The next probe packet is as big as the previous one. Assuming the
-         * previous one exceeded MTU, we need to decrease the probe packet length.
-         */
-        mtu->max_probe_length = probe_packet_length;
+    if (!qc->conf->mtu) {
+        return;
     }
 
-    mtu->last_probe_length = ngx_quic_mtu_next_probe_packet_length(mtu);
-    mtu->next_probe_at = largest_sent_packet + mtu->packets_between_probes + 1;
+    qc->ctp.max_udp_payload_size = ngx_min(path->mtu.plpmtu, qc->mtu_max);
 
-    if (mtu->remaining_probe_count > 0) {
-        --mtu->remaining_probe_count;
-    }
-
-    return mtu->last_probe_length;
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic mtu path #%uL %s size:%uz",
+                   path->seqnum, ngx_quic_mtu_state_str(&path->mtu),
+                   qc->ctp.max_udp_payload_size);
 }
 
 
 ngx_int_t
 ngx_quic_mtu_probe(ngx_connection_t *c)
 {
-    ngx_quic_connection_t  *qc;
-    ngx_quic_send_ctx_t    *ctx;
+    size_t                  len;
+    ssize_t                 n;
+    ngx_err_t               err;
+    ngx_quic_mtu_t         *mtu;
     ngx_quic_path_t        *path;
     ngx_quic_frame_t       *frame;
-    size_t                  len;
+    ngx_quic_send_ctx_t    *ctx;
+    ngx_quic_connection_t  *qc;
 
     qc = ngx_quic_get_connection(c);
     ctx = ngx_quic_get_send_ctx(qc, ssl_encryption_application);
 
-    if (!ngx_quic_mtu_should_probe(&qc->mtu, ctx->pnum)) {
-        return NGX_DECLINED;
-    }
-
-    path = ngx_quic_get_socket(c)->path;
+    path = qc->socket->path;
 
-    if (path == NULL) {
+    if (!ngx_quic_mtu_should_probe(c, path, ctx->pnum)) {
         return NGX_DECLINED;
     }
 
+    mtu = &path->mtu;
+
     frame = ngx_quic_alloc_frame(c);
     if (frame == NULL) {
-        return NGX_OK;
+        return NGX_ERROR;
     }
 
     frame->level = ctx->level;
@@ -104,17 +110,68 @@ ngx_quic_mtu_probe(ngx_connection_t *c)
     frame->need_ack = 1;
     frame->probe = 1;
 
-    len = ngx_quic_mtu_get_updated_probe_size(&qc->mtu, ctx->pnum);
+    len = ngx_quic_mtu_next_probe_length(mtu);
 
-    if (ngx_quic_frame_sendto_dont_fragment(c, frame, len, path->sockaddr,  path->socklen) == NGX_ERROR) {
-        return NGX_ERROR;
+    n = ngx_quic_frame_sendto_dont_fragment(c, frame, len, path->sockaddr,
+                                            path->socklen);
+
+    if (n == NGX_AGAIN) {
+
+        /* the probe was not sent, it is retried with the next output */
+
+        ngx_quic_free_frame(c, frame);
+        return NGX_AGAIN;
     }
 
-    qc->mtu.process = 1;
+    if (n < 0) {
+        err = ngx_socket_errno;
+
+        ngx_quic_free_frame(c, frame);
+
+        if (err != NGX_EMSGSIZE) {
+
+            /*
+             * setting the DF bit or sending failed, which says nothing
+             * about the size: keep the confirmed size until the next search
+             */
+
+            ngx_log_error(NGX_LOG_INFO, c->log, err,
+                          "quic mtu path #%uL probe not sent", path->seqnum);
+
+            mtu->state = NGX_QUIC_MTU_COMPLETE;
+            mtu->raise_at = ngx_current_msec + NGX_QUIC_MTU_RAISE_TIMER;
+
+            return NGX_DECLINED;
+        }
+    }
+
+    /* only a probe sent or rejected as too large counts as an attempt */
+
+    if (mtu->probe_count == 0) {
+        mtu->remaining_probe_count--;
+    }
+
+    mtu->last_probe_length = len;
+    mtu->next_probe_at = ctx->pnum + NGX_QUIC_MTU_PROBE_INTERVAL;
+
+    if (n < 0) {
+
+        /* EMSGSIZE, the probe exceeds the local interface MTU */
+
+        ngx_quic_mtu_probe_failed(c, path);
+        return NGX_DECLINED;
+    }
+
+    frame->path = path->seqnum;
+
+    mtu->process = 1;
+    mtu->probe_pnum = frame->pnum;
+
     ngx_queue_insert_tail(&ctx->sent, &frame->queue);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
-        "quic mtu discover sent new packet: %z", len);
+    ngx_log_debug4(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic mtu path #%uL probe pnum:%uL size:%uz tries:%ui",
+                   path->seqnum, frame->pnum, len, mtu->probe_count + 1);
 
     return NGX_OK;
 }
@@ -123,28 +180,334 @@ ngx_quic_mtu_probe(ngx_connection_t *c)
 void
 ngx_quic_mtu_ack(ngx_connection_t *c, ngx_quic_frame_t *frame)
 {
+    ngx_quic_mtu_t         *mtu;
+    ngx_quic_path_t        *path;
     ngx_quic_connection_t  *qc;
 
+    path = ngx_quic_mtu_probe_path(c, frame);
+    if (path == NULL) {
+        return;
+    }
+
     qc = ngx_quic_get_connection(c);
+    mtu = &path->mtu;
+
+    mtu->process = 0;
+    mtu->probe_count = 0;
+    mtu->lost = 0;
 
-    qc->mtu.min_probe_length = frame->plen;
-    qc->ctp.max_udp_payload_size = frame->plen;
+    mtu->plpmtu = mtu->last_probe_length;
+    mtu->min_probe_length = mtu->plpmtu;
 
-    qc->mtu.process = 0;
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic mtu path #%uL probe acked size:%uz",
+                   path->seqnum, mtu->plpmtu);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
-        "quic mtu discover ack packet: %z", qc->ctp.max_udp_payload_size);
+    if (path == qc->socket->path) {
+        ngx_quic_mtu_set_path(c, path);
+    }
+
+    ngx_quic_mtu_check_complete(c, path);
 }
 
 
 void
 ngx_quic_mtu_lost(ngx_connection_t *c, ngx_quic_frame_t *frame)
 {
+    ngx_quic_mtu_t   *mtu;
+    ngx_quic_path_t  *path;
+
+    path = ngx_quic_mtu_probe_path(c, frame);
+    if (path == NULL) {
+        return;
+    }
+
+    mtu = &path->mtu;
+
+    mtu->process = 0;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic mtu path #%uL probe lost size:%uz",
+                   path->seqnum, mtu->last_probe_length);
+
+    if (++mtu->probe_count < NGX_QUIC_MTU_MAX_PROBES) {
+        return;
+    }
+
+    ngx_quic_mtu_probe_failed(c, path);
+}
+
+
+void
+ngx_quic_mtu_packet_acked(ngx_connection_t *c, ngx_quic_frame_t *frame)
+{
+    ngx_quic_path_t        *path;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    if (!qc->conf->mtu) {
+        return;
+    }
+
+    path = ngx_quic_mtu_packet_path(c, frame);
+    if (path == NULL) {
+        return;
+    }
+
+    if (frame->plen > path->mtu.base) {
+        path->mtu.lost = 0;
+    }
+}
+
+
+void
+ngx_quic_mtu_packet_lost(ngx_connection_t *c, ngx_quic_frame_t *frame)
+{
+    ngx_quic_mtu_t         *mtu;
+    ngx_quic_path_t        *path;
+    ngx_quic_send_ctx_t    *ctx;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    if (!qc->conf->mtu) {
+        return;
+    }
+
+    path = ngx_quic_mtu_packet_path(c, frame);
+    if (path == NULL) {
+        return;
+    }
+
+    mtu = &path->mtu;
+
+    if (frame->plen <= mtu->base || mtu->plpmtu == mtu->base) {
+        return;
+    }
+
+    if (mtu->lost++ == 0) {
+        mtu->lost_since = frame->first;
+    }
+
+    if (mtu->lost < NGX_QUIC_MTU_BLACKHOLE_LOSSES) {
+        return;
+    }
+
+    /*
+     * RFC 8899, 4.3.  Confirmation of Connectivity across a Path
+     *
+     * Consecutive losses of packets larger than the base size, with no
+     * such packet acknowledged in between, are taken as a black hole
+     * below the confirmed size: fall back to the base size and search
+     * again later, since the actual PMTU might have only shrunk.
+     *
+     * Packets lost within one round trip are likely dropped by a single
+     * congestion event, so the losses must be spread over a longer time.
+     */
+
+    if ((ngx_msec_int_t) (frame->first - mtu->lost_since)
+        <= (ngx_msec_int_t) ngx_max(qc->avg_rtt, qc->latest_rtt))
+    {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                  "quic mtu path #%uL black hole detected at size:%uz",
+                  path->seqnum, mtu->plpmtu);
+
+    ctx = ngx_quic_get_send_ctx(qc, ssl_encryption_application);
+
+    mtu->state = NGX_QUIC_MTU_BASE;
+    mtu->plpmtu = mtu->base;
+    mtu->max_probe_length = qc->conf->mtu_target;
+    mtu->lost = 0;
+    mtu->next_probe_at = ctx->pnum + NGX_QUIC_MTU_PROBE_INTERVAL;
+
+    if (path == qc->socket->path) {
+        ngx_quic_mtu_set_path(c, path);
+    }
+}
+
+
+static ngx_quic_path_t *
+ngx_quic_mtu_probe_path(ngx_connection_t *c, ngx_quic_frame_t *frame)
+{
+    ngx_queue_t            *q;
+    ngx_quic_path_t        *path;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    for (q = ngx_queue_head(&qc->paths);
+         q != ngx_queue_sentinel(&qc->paths);
+         q = ngx_queue_next(q))
+    {
+        path = ngx_queue_data(q, ngx_quic_path_t, queue);
+
+        if (path->mtu.process && path->mtu.probe_pnum == frame->pnum) {
+            return path;
+        }
+    }
+
+    return NULL;
+}
+
+
+static ngx_quic_path_t *
+ngx_quic_mtu_packet_path(ngx_connection_t *c, ngx_quic_frame_t *frame)
+{
+    ngx_queue_t            *q;
+    ngx_quic_path_t        *path;
     ngx_quic_connection_t  *qc;
 
     qc = ngx_quic_get_connection(c);
-    qc->mtu.process = 0;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
-        "quic mtu discover lost packet: %z", qc->mtu.last_probe_length);
+    for (q = ngx_queue_head(&qc->paths);
+         q != ngx_queue_sentinel(&qc->paths);
+         q = ngx_queue_next(q))
+    {
+        path = ngx_queue_data(q, ngx_quic_path_t, queue);
+
+        if (path->seqnum == frame->path) {
+            return path;
+        }
+    }
+
+    /* the path is already gone */
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_quic_mtu_should_probe(ngx_connection_t *c, ngx_quic_path_t *path,
+    uint64_t pnum)
+{
+    ngx_quic_mtu_t         *mtu;
+    ngx_quic_connection_t  *qc;
+
+    mtu = &path->mtu;
+
+    if (mtu->process) {
+        return 0;
+    }
+
+    if (path->state != NGX_QUIC_PATH_VALIDATED) {
+        return 0;
+    }
+
+    if (pnum < mtu->next_probe_at) {
+        return 0;
+    }
+
+    switch (mtu->state) {
+
+    case NGX_QUIC_MTU_BASE:
+        ngx_quic_mtu_start_search(c, path);
+        break;
+
+    case NGX_QUIC_MTU_COMPLETE:
+
+        if ((ngx_msec_int_t) (mtu->raise_at - ngx_current_msec) > 0) {
+            return 0;
+        }
+
+        /* RFC 8899, 5.1.1.  PMTU_RAISE_TIMER: look for a larger PMTU */
+
+        qc = ngx_quic_get_connection(c);
+
+        mtu->max_probe_length = qc->conf->mtu_target;
+
+        ngx_quic_mtu_start_search(c, path);
+        break;
+    }
+
+    return mtu->state == NGX_QUIC_MTU_SEARCHING;
+}
+
+
+static void
+ngx_quic_mtu_start_search(ngx_connection_t *c, ngx_quic_path_t *path)
+{
+    ngx_quic_mtu_t         *mtu;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    mtu = &path->mtu;
+
+    mtu->state = NGX_QUIC_MTU_SEARCHING;
+    mtu->min_probe_length = mtu->plpmtu;
+    mtu->max_probe_length = ngx_min(mtu->max_probe_length, qc->mtu_max);
+    mtu->last_probe_length = 0;
+    mtu->probe_count = 0;
+    mtu->remaining_probe_count = qc->conf->mtu_attemts;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic mtu path #%uL search started %uz-%uz",
+                   path->seqnum, mtu->min_probe_length, mtu->max_probe_length);
+
+    ngx_quic_mtu_check_complete(c, path);
+}
+
+
+static size_t
+ngx_quic_mtu_next_probe_length(ngx_quic_mtu_t *mtu)
+{
+    if (mtu->probe_count) {
+        /* the previous probe was lost, retry the same size */
+        return mtu->last_probe_length;
+    }
+
+    if (mtu->last_probe_length == 0) {
+        /* first probe in a search, most paths support the target size */
+        return mtu->max_probe_length;
+    }
+
+    return (mtu->min_probe_length + mtu->max_probe_length + 1) / 2;
+}
+
+
+static void
+ngx_quic_mtu_probe_failed(ngx_connection_t *c, ngx_quic_path_t *path)
+{
+    ngx_quic_mtu_t  *mtu;
+
+    mtu = &path->mtu;
+
+    mtu->probe_count = 0;
+    mtu->max_probe_length = mtu->last_probe_length - 1;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic mtu path #%uL probe failed size:%uz",
+                   path->seqnum, mtu->last_probe_length);
+
+    ngx_quic_mtu_check_complete(c, path);
+}
+
+
+static void
+ngx_quic_mtu_check_complete(ngx_connection_t *c, ngx_quic_path_t *path)
+{
+    ngx_quic_mtu_t  *mtu;
+
+    mtu = &path->mtu;
+
+    if (mtu->state != NGX_QUIC_MTU_SEARCHING) {
+        return;
+    }
+
+    if (mtu->min_probe_length + NGX_QUIC_MTU_SEARCH_STEP
+        <= mtu->max_probe_length
+        && mtu->remaining_probe_count > 0)
+    {
+        return;
+    }
+
+    mtu->state = NGX_QUIC_MTU_COMPLETE;
+    mtu->raise_at = ngx_current_msec + NGX_QUIC_MTU_RAISE_TIMER;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic mtu path #%uL search complete size:%uz",
+                   path->seqnum, mtu->plpmtu);
 }
@@ -1,4 +1,9 @@
 
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
 #ifndef _NGX_EVENT_QUIC_MTU_H_INCLUDED_
 #define _NGX_EVENT_QUIC_MTU_H_INCLUDED_
 
@@ -7,14 +12,75 @@
 #include <ngx_core.h>
 
 
-ngx_int_t
-ngx_quic_mtu_probe(ngx_connection_t *c);
+/*
+ * RFC 8899, 5.2.  State Machine
+ *
+ * DISABLED and ERROR states are not needed: the base size is always
+ * usable for QUIC, and a black hole falls back to BASE directly.
+ */
+#define NGX_QUIC_MTU_BASE                0
+#define NGX_QUIC_MTU_SEARCHING           1
+#define NGX_QUIC_MTU_COMPLETE            2
+
+/* RFC 8899, 5.1.2.  Constants: MAX_PROBES */
+#define NGX_QUIC_MTU_MAX_PROBES          3
+
+/* RFC 8899, 5.1.1.  Timers: PMTU_RAISE_TIMER */
+#define NGX_QUIC_MTU_RAISE_TIMER         600000 /* ms */
+
+/* packets sent between two probes */
+#define NGX_QUIC_MTU_PROBE_INTERVAL      100
+
+/* search is complete when the interval is narrower than this */
+#define NGX_QUIC_MTU_SEARCH_STEP         16
+
+/*
+ * consecutive lost packets above the base size signalling a black hole,
+ * the losses must span more than a round trip to tell it from congestion
+ */
+#define NGX_QUIC_MTU_BLACKHOLE_LOSSES    3
+
+
+#define ngx_quic_mtu_state_str(m)                                             \
+    ((m)->state == NGX_QUIC_MTU_BASE) ? "base" :                              \
+        (((m)->state == NGX_QUIC_MTU_SEARCHING) ? "searching" : "complete")
+
+
+typedef struct {
+    ngx_uint_t                        state;
+
+    size_t                            base;     /* BASE_PLPMTU */
+    size_t                            plpmtu;   /* confirmed size */
+
+    /* search interval: low is confirmed, high is not yet known to fail */
+    size_t                            min_probe_length;
+    size_t                            max_probe_length;
+    size_t                            last_probe_length;
+
+    ngx_int_t                         remaining_probe_count;
+    ngx_uint_t                        probe_count;   /* of last size */
+    uint64_t                          probe_pnum;
+
+    /* the packet number after which the next probe will be sent */
+    uint64_t                          next_probe_at;
+
+    ngx_uint_t                        lost;     /* consecutive, full-size */
+    ngx_msec_t                        lost_since;   /* first loss sent */
+    ngx_msec_t                        raise_at;
+
+    unsigned                          process:1;
+} ngx_quic_mtu_t;
+
+
+void ngx_quic_mtu_init(ngx_connection_t *c, ngx_quic_path_t *path);
+void ngx_quic_mtu_set_path(ngx_connection_t *c, ngx_quic_path_t *path);
 
-void
-ngx_quic_mtu_ack(ngx_connection_t *c, ngx_quic_frame_t *frame);
+ngx_int_t ngx_quic_mtu_probe(ngx_connection_t *c);
+void ngx_quic_mtu_ack(ngx_connection_t *c, ngx_quic_frame_t *frame);
+void ngx_quic_mtu_lost(ngx_connection_t *c, ngx_quic_frame_t *frame);
 
-void
-ngx_quic_mtu_lost(ngx_connection_t *c, ngx_quic_frame_t *frame);
+void ngx_quic_mtu_packet_acked(ngx_connection_t *c, ngx_quic_frame_t *frame);
+void ngx_quic_mtu_packet_lost(ngx_connection_t *c, ngx_quic_frame_t *frame);
 
 
 #endif /* _NGX_EVENT_QUIC_MTU_H_INCLUDED_ */
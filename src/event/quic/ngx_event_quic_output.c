@@ -17,7 +17,6 @@
 #define NGX_QUIC_MAX_SEGMENTS            64 /* UDP_MAX_SEGMENTS */
 
 #define NGX_QUIC_RETRY_TOKEN_LIFETIME     3 /* seconds */
-#define NGX_QUIC_NEW_TOKEN_LIFETIME     600 /* seconds */
 #define NGX_QUIC_RETRY_BUFFER_SIZE      256
     /* 1 flags + 4 version + 3 x (1 + 20) s/o/dcid + itag + token(64) */
 
@@ -946,10 +945,16 @@ ngx_quic_output_packet(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx,
         return NGX_ERROR;
     }
 
+    ngx_quic_qlog(c, qc, NGX_QUIC_QLOG_PACKET_SENT, ctx->level,
+                  ctx->pnum, res.len, 0);
+
     ctx->pnum++;
 
     if (pkt.need_ack) {
         first->plen = res.len;
+#if (NGX_HAVE_IP_MTU_DISCOVER)
+        first->path = qsock->path->seqnum;
+#endif
     }
 
     for (q = &first->queue; q != ngx_queue_sentinel(&ctx->sending); q = ngx_queue_next(q)) {
@@ -1527,6 +1532,9 @@ ngx_quic_frame_sendto(ngx_connection_t *c, ngx_quic_frame_t *frame,
         return -1;
     }
 
+    ngx_quic_qlog(c, qc, NGX_QUIC_QLOG_PACKET_SENT, ctx->level,
+                  ctx->pnum, res.len, 0);
+
     frame->plen = res.len;
     frame->pnum = ctx->pnum;
     frame->first = ngx_current_msec;
@@ -1544,6 +1552,7 @@ ngx_quic_frame_sendto_dont_fragment(ngx_connection_t *c, ngx_quic_frame_t *frame
     size_t min, struct sockaddr *sockaddr, socklen_t socklen)
 {
     ssize_t    n;
+    ngx_err_t  err;
     int        optval = IP_PMTUDISC_DO, v6_only = 0;
     socklen_t  v6_only_len = sizeof(v6_only);
 
@@ -1567,6 +1576,10 @@ ngx_quic_frame_sendto_dont_fragment(ngx_connection_t *c, ngx_quic_frame_t *frame
 
     n = ngx_quic_frame_sendto(c, frame, min, sockaddr, socklen);
 
+    /* the caller tells EMSGSIZE from other errors */
+
+    err = ngx_socket_errno;
+
     optval = IP_PMTUDISC_DONT;
 
     if (!v6_only) {
@@ -1581,6 +1594,8 @@ ngx_quic_frame_sendto_dont_fragment(ngx_connection_t *c, ngx_quic_frame_t *frame
     }
 #endif
 
+    ngx_set_socket_errno(err);
+
     return n;
 }
 #endif
@@ -0,0 +1,558 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_quic_connection.h>
+
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
+
+/*
+ * Sampled qlog tracing.
+ *
+ * Events of traced connections are recorded as fixed-size binary records
+ * into the active half of a per-worker double buffer, which costs a few
+ * stores and no system calls.  A timer, or the active half becoming full,
+ * swaps the halves and hands the filled one to a writer which converts
+ * the records to qlog JSON-SEQ and appends them to "<path>/<pid>.sqlog".
+ * The writer runs in a thread pool if available.  While the writer is
+ * busy and the active half is full, new events are dropped and counted.
+ */
+
+
+#define NGX_QUIC_QLOG_FLUSH_INTERVAL  1000    /* ms */
+#define NGX_QUIC_QLOG_LINE_LEN        256
+
+
+typedef struct {
+    ngx_msec_t                        time;
+    ngx_atomic_uint_t                 number;
+    ngx_uint_t                        type;
+    ngx_uint_t                        level;
+    uint64_t                          v[3];
+} ngx_quic_qlog_record_t;
+
+
+typedef struct {
+    ngx_quic_qlog_record_t           *records;
+    ngx_uint_t                        nrecords;
+} ngx_quic_qlog_buf_t;
+
+
+struct ngx_quic_qlog_s {
+    ngx_quic_qlog_conf_t             *conf;
+
+    ngx_quic_qlog_buf_t               bufs[2];
+    ngx_uint_t                        active;
+    ngx_uint_t                        dropped;
+
+    /* owned by the writer while busy */
+    ngx_quic_qlog_buf_t              *out;
+    ngx_uint_t                        out_dropped;
+    uint64_t                          out_base;   /* ms since epoch at 0 */
+    ngx_msec_t                        out_time;
+    u_char                           *text;
+    ngx_str_t                         name;
+    ngx_fd_t                          fd;
+    ngx_log_t                        *log;
+
+    ngx_event_t                       flush;
+#if (NGX_THREADS)
+    ngx_thread_task_t                *task;
+#endif
+
+    ngx_quic_qlog_t                  *next;
+
+    unsigned                          busy:1;
+};
+
+
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_quic_qlog_t                  *qlog;
+} ngx_quic_qlog_task_ctx_t;
+
+static void ngx_quic_qlog_thread_handler(void *data, ngx_log_t *log);
+static void ngx_quic_qlog_thread_event_handler(ngx_event_t *ev);
+#endif
+
+static ngx_quic_qlog_t *ngx_quic_qlog_create(ngx_quic_qlog_conf_t *qcf,
+    ngx_log_t *log);
+static void ngx_quic_qlog_flush_handler(ngx_event_t *ev);
+static void ngx_quic_qlog_swap(ngx_quic_qlog_t *qlog);
+static void ngx_quic_qlog_write(ngx_quic_qlog_t *qlog);
+static u_char *ngx_quic_qlog_record(u_char *p, ngx_quic_qlog_record_t *rec,
+    uint64_t base);
+static const char *ngx_quic_qlog_frame_name(uint64_t type);
+
+
+static ngx_str_t  ngx_quic_qlog_header = ngx_string(
+    "\x1e{\"qlog_version\":\"0.3\",\"qlog_format\":\"JSON-SEQ\","
+    "\"title\":\"nginx\",\"trace\":{\"vantage_point\":{\"type\":\"server\"},"
+    "\"common_fields\":{\"time_format\":\"absolute\"}}}\n");
+
+
+/* the qlogs of this worker, to be flushed at exit */
+static ngx_quic_qlog_t  *ngx_quic_qlogs;
+
+
+static const char  *ngx_quic_qlog_packet_types[] = {
+    "initial",
+    "0RTT",
+    "handshake",
+    "1RTT"
+};
+
+
+ngx_quic_qlog_t *
+ngx_quic_qlog_start(ngx_connection_t *c, ngx_quic_conf_t *conf)
+{
+    ngx_quic_qlog_conf_t  *qcf;
+
+    qcf = conf->qlog;
+
+    if (qcf == NULL) {
+        return NULL;
+    }
+
+    if (qcf->clients == NULL
+        || ngx_cidr_match(c->sockaddr, qcf->clients) != NGX_OK)
+    {
+        if (qcf->sample == 0
+            || (ngx_uint_t) ngx_random() % 10000 >= qcf->sample)
+        {
+            return NULL;
+        }
+    }
+
+    if (qcf->qlog == NULL) {
+        qcf->qlog = ngx_quic_qlog_create(qcf, ngx_cycle->log);
+        if (qcf->qlog == NULL) {
+            /* tracing is not essential */
+            qcf->sample = 0;
+            qcf->clients = NULL;
+            return NULL;
+        }
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0, "quic qlog enabled");
+
+    return qcf->qlog;
+}
+
+
+static ngx_quic_qlog_t *
+ngx_quic_qlog_create(ngx_quic_qlog_conf_t *qcf, ngx_log_t *log)
+{
+    size_t            size;
+    ngx_uint_t        i;
+    ngx_quic_qlog_t  *qlog;
+#if (NGX_THREADS)
+    ngx_quic_qlog_task_ctx_t  *ctx;
+#endif
+
+    /* allocated once per worker, lives as long as the cycle */
+
+    qlog = ngx_pcalloc(ngx_cycle->pool, sizeof(ngx_quic_qlog_t));
+    if (qlog == NULL) {
+        return NULL;
+    }
+
+    qlog->conf = qcf;
+    qlog->fd = NGX_INVALID_FILE;
+    qlog->log = log;
+
+    size = qcf->size * sizeof(ngx_quic_qlog_record_t);
+
+    for (i = 0; i < 2; i++) {
+        qlog->bufs[i].records = ngx_palloc(ngx_cycle->pool, size);
+        if (qlog->bufs[i].records == NULL) {
+            return NULL;
+        }
+    }
+
+    qlog->text = ngx_palloc(ngx_cycle->pool,
+                            ngx_quic_qlog_header.len
+                            + (qcf->size + 1) * NGX_QUIC_QLOG_LINE_LEN);
+    if (qlog->text == NULL) {
+        return NULL;
+    }
+
+    size = qcf->path.len + 1 + NGX_INT64_LEN + sizeof(".sqlog");
+
+    qlog->name.data = ngx_pnalloc(ngx_cycle->pool, size);
+    if (qlog->name.data == NULL) {
+        return NULL;
+    }
+
+    qlog->name.len = ngx_sprintf(qlog->name.data, "%V/%P.sqlog%Z",
+                                 &qcf->path, ngx_pid)
+                     - qlog->name.data - 1;
+
+    qlog->flush.data = qlog;
+    qlog->flush.handler = ngx_quic_qlog_flush_handler;
+    qlog->flush.log = log;
+    qlog->flush.cancelable = 1;
+
+#if (NGX_THREADS)
+    if (qcf->thread_pool) {
+        qlog->task = ngx_thread_task_alloc(ngx_cycle->pool,
+                                           sizeof(ngx_quic_qlog_task_ctx_t));
+        if (qlog->task == NULL) {
+            return NULL;
+        }
+
+        ctx = qlog->task->ctx;
+        ctx->qlog = qlog;
+
+        qlog->task->handler = ngx_quic_qlog_thread_handler;
+        qlog->task->event.data = qlog;
+        qlog->task->event.handler = ngx_quic_qlog_thread_event_handler;
+    }
+#endif
+
+    qlog->next = ngx_quic_qlogs;
+    ngx_quic_qlogs = qlog;
+
+    return qlog;
+}
+
+
+void
+ngx_quic_qlog_exit(void)
+{
+    ngx_quic_qlog_t  *qlog;
+
+    /*
+     * thread pools are already destroyed, so a writer which was busy
+     * has completed, and the pending records are written synchronously
+     */
+
+    for (qlog = ngx_quic_qlogs; qlog; qlog = qlog->next) {
+
+        if (qlog->bufs[qlog->active].nrecords || qlog->dropped) {
+            ngx_quic_qlog_swap(qlog);
+            ngx_quic_qlog_write(qlog);
+        }
+
+        if (qlog->fd != NGX_INVALID_FILE) {
+            if (ngx_close_file(qlog->fd) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_ALERT, qlog->log, ngx_errno,
+                              ngx_close_file_n " \"%s\" failed",
+                              qlog->name.data);
+            }
+
+            qlog->fd = NGX_INVALID_FILE;
+        }
+    }
+
+    ngx_quic_qlogs = NULL;
+}
+
+
+void
+ngx_quic_qlog_event(ngx_quic_qlog_t *qlog, ngx_atomic_uint_t number,
+    ngx_uint_t type, ngx_uint_t level, uint64_t v0, uint64_t v1, uint64_t v2)
+{
+    ngx_quic_qlog_buf_t     *b;
+    ngx_quic_qlog_record_t  *rec;
+
+    b = &qlog->bufs[qlog->active];
+
+    if (b->nrecords == qlog->conf->size) {
+        qlog->dropped++;
+        return;
+    }
+
+    rec = &b->records[b->nrecords++];
+
+    rec->time = ngx_current_msec;
+    rec->number = number;
+    rec->type = type;
+    rec->level = level;
+    rec->v[0] = v0;
+    rec->v[1] = v1;
+    rec->v[2] = v2;
+
+    if (b->nrecords == qlog->conf->size) {
+        if (!qlog->busy && !qlog->flush.posted) {
+            ngx_post_event(&qlog->flush, &ngx_posted_events);
+        }
+
+    } else if (!qlog->flush.timer_set) {
+        ngx_add_timer(&qlog->flush, NGX_QUIC_QLOG_FLUSH_INTERVAL);
+    }
+}
+
+
+static void
+ngx_quic_qlog_flush_handler(ngx_event_t *ev)
+{
+    ngx_quic_qlog_t  *qlog;
+
+    qlog = ev->data;
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    if (qlog->busy) {
+        /* rescheduled on completion */
+        return;
+    }
+
+    if (qlog->bufs[qlog->active].nrecords == 0 && qlog->dropped == 0) {
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "quic qlog flush records:%ui dropped:%ui",
+                   qlog->bufs[qlog->active].nrecords, qlog->dropped);
+
+    ngx_quic_qlog_swap(qlog);
+
+#if (NGX_THREADS)
+    if (qlog->task) {
+        qlog->busy = 1;
+
+        if (ngx_thread_task_post(qlog->conf->thread_pool, qlog->task)
+            == NGX_OK)
+        {
+            return;
+        }
+
+        qlog->busy = 0;
+    }
+#endif
+
+    ngx_quic_qlog_write(qlog);
+}
+
+
+static void
+ngx_quic_qlog_swap(ngx_quic_qlog_t *qlog)
+{
+    ngx_time_t  *tp;
+
+    tp = ngx_timeofday();
+
+    qlog->out = &qlog->bufs[qlog->active];
+    qlog->out_dropped = qlog->dropped;
+    qlog->out_base = (uint64_t) tp->sec * 1000 + tp->msec - ngx_current_msec;
+    qlog->out_time = ngx_current_msec;
+
+    qlog->active ^= 1;
+    qlog->bufs[qlog->active].nrecords = 0;
+    qlog->dropped = 0;
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_quic_qlog_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_quic_qlog_task_ctx_t *ctx = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, log, 0, "quic qlog thread handler");
+
+    ngx_quic_qlog_write(ctx->qlog);
+}
+
+
+static void
+ngx_quic_qlog_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_quic_qlog_t  *qlog;
+
+    qlog = ev->data;
+
+    qlog->busy = 0;
+
+    if (qlog->bufs[qlog->active].nrecords == qlog->conf->size) {
+        ngx_post_event(&qlog->flush, &ngx_posted_events);
+
+    } else if ((qlog->bufs[qlog->active].nrecords || qlog->dropped)
+               && !qlog->flush.timer_set)
+    {
+        ngx_add_timer(&qlog->flush, NGX_QUIC_QLOG_FLUSH_INTERVAL);
+    }
+}
+
+#endif
+
+
+static void
+ngx_quic_qlog_write(ngx_quic_qlog_t *qlog)
+{
+    u_char               *p;
+    ngx_uint_t            i;
+    ngx_quic_qlog_buf_t  *b;
+
+    p = qlog->text;
+
+    if (qlog->fd == NGX_INVALID_FILE) {
+        qlog->fd = ngx_open_file(qlog->name.data, NGX_FILE_APPEND,
+                                 NGX_FILE_CREATE_OR_OPEN,
+                                 NGX_FILE_DEFAULT_ACCESS);
+
+        if (qlog->fd == NGX_INVALID_FILE) {
+            ngx_log_error(NGX_LOG_ALERT, qlog->log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed", qlog->name.data);
+            return;
+        }
+
+        p = ngx_cpymem(p, ngx_quic_qlog_header.data, ngx_quic_qlog_header.len);
+    }
+
+    b = qlog->out;
+
+    for (i = 0; i < b->nrecords; i++) {
+        p = ngx_quic_qlog_record(p, &b->records[i], qlog->out_base);
+    }
+
+    if (qlog->out_dropped) {
+        p = ngx_sprintf(p, "\x1e{\"time\":%uL,"
+                        "\"name\":\"nginx:events_dropped\","
+                        "\"data\":{\"count\":%ui}}\n",
+                        qlog->out_base + qlog->out_time, qlog->out_dropped);
+    }
+
+    if (ngx_write_fd(qlog->fd, qlog->text, p - qlog->text) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, qlog->log, ngx_errno,
+                      ngx_write_fd_n " to \"%s\" failed", qlog->name.data);
+    }
+}
+
+
+static u_char *
+ngx_quic_qlog_record(u_char *p, ngx_quic_qlog_record_t *rec, uint64_t base)
+{
+    const char  *pt;
+
+    pt = ngx_quic_qlog_packet_types[rec->level & 3];
+
+    p = ngx_sprintf(p, "\x1e{\"time\":%uL,\"group_id\":\"%uA\",",
+                    base + rec->time, rec->number);
+
+    switch (rec->type) {
+
+    case NGX_QUIC_QLOG_CONNECTION_STARTED:
+        p = ngx_sprintf(p, "\"name\":\"connectivity:connection_started\","
+                        "\"data\":{\"version\":\"%xL\"}}\n", rec->v[0]);
+        break;
+
+    case NGX_QUIC_QLOG_CONNECTION_CLOSED:
+        p = ngx_sprintf(p, "\"name\":\"connectivity:connection_closed\","
+                        "\"data\":{\"error_code\":%uL}}\n", rec->v[0]);
+        break;
+
+    case NGX_QUIC_QLOG_PACKET_SENT:
+    case NGX_QUIC_QLOG_PACKET_RECEIVED:
+        p = ngx_sprintf(p, "\"name\":\"transport:%s\","
+                        "\"data\":{\"header\":{\"packet_type\":\"%s\","
+                        "\"packet_number\":%uL},\"raw\":{\"length\":%uL}}}\n",
+                        rec->type == NGX_QUIC_QLOG_PACKET_SENT
+                        ? "packet_sent" : "packet_received",
+                        pt, rec->v[0], rec->v[1]);
+        break;
+
+    case NGX_QUIC_QLOG_PACKET_LOST:
+        p = ngx_sprintf(p, "\"name\":\"recovery:packet_lost\","
+                        "\"data\":{\"header\":{\"packet_type\":\"%s\","
+                        "\"packet_number\":%uL},\"raw\":{\"length\":%uL}}}\n",
+                        pt, rec->v[0], rec->v[1]);
+        break;
+
+    case NGX_QUIC_QLOG_FRAME_PROCESSED:
+        p = ngx_sprintf(p, "\"name\":\"transport:frames_processed\","
+                        "\"data\":{\"packet_number\":%uL,\"frames\":"
+                        "[{\"frame_type\":\"%s\"}]}}\n",
+                        rec->v[0], ngx_quic_qlog_frame_name(rec->v[1]));
+        break;
+
+    case NGX_QUIC_QLOG_METRICS_UPDATED:
+        p = ngx_sprintf(p, "\"name\":\"recovery:metrics_updated\","
+                        "\"data\":{\"congestion_window\":%uL,"
+                        "\"bytes_in_flight\":%uL",
+                        rec->v[0], rec->v[1]);
+
+        if (rec->v[2] != (uint64_t) (size_t) -1) {
+            p = ngx_sprintf(p, ",\"ssthresh\":%uL", rec->v[2]);
+        }
+
+        p = ngx_cpymem(p, "}}\n", 3);
+        break;
+
+    default:
+        p = ngx_cpymem(p, "\"name\":\"nginx:unknown\"}\n",
+                       sizeof("\"name\":\"nginx:unknown\"}\n") - 1);
+        break;
+    }
+
+    return p;
+}
+
+
+static const char *
+ngx_quic_qlog_frame_name(uint64_t type)
+{
+    if (type >= NGX_QUIC_FT_STREAM && type <= NGX_QUIC_FT_STREAM7) {
+        return "stream";
+    }
+
+    switch (type) {
+    case NGX_QUIC_FT_PADDING:
+        return "padding";
+    case NGX_QUIC_FT_PING:
+        return "ping";
+    case NGX_QUIC_FT_ACK:
+    case NGX_QUIC_FT_ACK_ECN:
+        return "ack";
+    case NGX_QUIC_FT_RESET_STREAM:
+        return "reset_stream";
+    case NGX_QUIC_FT_STOP_SENDING:
+        return "stop_sending";
+    case NGX_QUIC_FT_CRYPTO:
+        return "crypto";
+    case NGX_QUIC_FT_NEW_TOKEN:
+        return "new_token";
+    case NGX_QUIC_FT_MAX_DATA:
+        return "max_data";
+    case NGX_QUIC_FT_MAX_STREAM_DATA:
+        return "max_stream_data";
+    case NGX_QUIC_FT_MAX_STREAMS:
+    case NGX_QUIC_FT_MAX_STREAMS2:
+        return "max_streams";
+    case NGX_QUIC_FT_DATA_BLOCKED:
+        return "data_blocked";
+    case NGX_QUIC_FT_STREAM_DATA_BLOCKED:
+        return "stream_data_blocked";
+    case NGX_QUIC_FT_STREAMS_BLOCKED:
+    case NGX_QUIC_FT_STREAMS_BLOCKED2:
+        return "streams_blocked";
+    case NGX_QUIC_FT_NEW_CONNECTION_ID:
+        return "new_connection_id";
+    case NGX_QUIC_FT_RETIRE_CONNECTION_ID:
+        return "retire_connection_id";
+    case NGX_QUIC_FT_PATH_CHALLENGE:
+        return "path_challenge";
+    case NGX_QUIC_FT_PATH_RESPONSE:
+        return "path_response";
+    case NGX_QUIC_FT_CONNECTION_CLOSE:
+    case NGX_QUIC_FT_CONNECTION_CLOSE_APP:
+        return "connection_close";
+    case NGX_QUIC_FT_HANDSHAKE_DONE:
+        return "handshake_done";
+    default:
+        return "unknown";
+    }
+}
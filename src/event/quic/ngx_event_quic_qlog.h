@@ -0,0 +1,41 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_EVENT_QUIC_QLOG_H_INCLUDED_
+#define _NGX_EVENT_QUIC_QLOG_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#define NGX_QUIC_QLOG_CONNECTION_STARTED  0
+#define NGX_QUIC_QLOG_CONNECTION_CLOSED   1
+#define NGX_QUIC_QLOG_PACKET_SENT         2  /* pnum, size */
+#define NGX_QUIC_QLOG_PACKET_RECEIVED     3  /* pnum, size */
+#define NGX_QUIC_QLOG_PACKET_LOST         4  /* pnum, size */
+#define NGX_QUIC_QLOG_FRAME_PROCESSED     5  /* pnum, frame type */
+#define NGX_QUIC_QLOG_METRICS_UPDATED     6  /* cwnd, in flight, ssthresh */
+
+
+typedef struct ngx_quic_qlog_s  ngx_quic_qlog_t;
+
+
+#define ngx_quic_qlog(c, qc, type, level, v0, v1, v2)                         \
+    do {                                                                      \
+        if ((qc)->qlog) {                                                     \
+            ngx_quic_qlog_event((qc)->qlog, (c)->number, type, level,         \
+                                v0, v1, v2);                                  \
+        }                                                                     \
+    } while (0)
+
+
+ngx_quic_qlog_t *ngx_quic_qlog_start(ngx_connection_t *c,
+    ngx_quic_conf_t *conf);
+void ngx_quic_qlog_event(ngx_quic_qlog_t *qlog, ngx_atomic_uint_t number,
+    ngx_uint_t type, ngx_uint_t level, uint64_t v0, uint64_t v1, uint64_t v2);
+
+#endif /* _NGX_EVENT_QUIC_QLOG_H_INCLUDED_ */
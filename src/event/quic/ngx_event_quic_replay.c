@@ -0,0 +1,297 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_md5.h>
+#include <ngx_event_quic_connection.h>
+
+
+/*
+ * Strike register shared by all workers: address validation tokens and
+ * ClientHello randoms seen within the replay window.
+ *
+ * The register is an open addressing table of keyed fingerprints.  The low
+ * bits of each slot tag the window the entry was added in; entries of the
+ * current and the previous window are live, so an entry is remembered for
+ * at least one window.  Older entries are not cleared, their slots are
+ * simply reused by inserts.  Slots are claimed with compare-and-swap, so
+ * there are no locks and no worker ever holds the register in a state
+ * other workers depend on.  When a definite answer is not possible because
+ * all probed slots are live, NGX_BUSY is returned and the caller is
+ * expected to fail safe.
+ */
+
+
+#define NGX_QUIC_REPLAY_PROBES       8
+#define NGX_QUIC_REPLAY_KEY_LEN      16
+
+/* window tags are 1..255, 0 marks an empty slot */
+#define NGX_QUIC_REPLAY_TAG_MASK     0xff
+#define NGX_QUIC_REPLAY_TAGS         255
+
+#define ngx_quic_replay_tag(epoch)                                            \
+    ((ngx_atomic_uint_t) ((epoch) % NGX_QUIC_REPLAY_TAGS + 1))
+
+
+typedef struct {
+    u_char                           key[NGX_QUIC_REPLAY_KEY_LEN];
+    ngx_uint_t                       nslots;
+    ngx_atomic_t                    *slots;
+} ngx_quic_replay_shctx_t;
+
+
+typedef struct {
+    ngx_quic_replay_shctx_t         *sh;
+    ngx_slab_pool_t                 *shpool;
+    time_t                           window;
+} ngx_quic_replay_ctx_t;
+
+
+static ngx_int_t ngx_quic_replay_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_uint_t ngx_quic_replay_lookup(ngx_quic_replay_shctx_t *sh,
+    ngx_atomic_uint_t fp, ngx_uint_t hash, ngx_atomic_uint_t cur,
+    ngx_atomic_uint_t prev);
+static ngx_int_t ngx_quic_replay_insert(ngx_quic_replay_shctx_t *sh,
+    ngx_atomic_uint_t fp, ngx_uint_t hash, ngx_atomic_uint_t cur,
+    ngx_atomic_uint_t prev);
+
+
+extern ngx_module_t  ngx_quic_module;
+
+
+ngx_shm_zone_t *
+ngx_quic_replay_add_zone(ngx_conf_t *cf, ngx_str_t *name, size_t size,
+    time_t window)
+{
+    ngx_shm_zone_t         *shm_zone;
+    ngx_quic_replay_ctx_t  *ctx;
+
+    shm_zone = ngx_shared_memory_add(cf, name, size, &ngx_quic_module);
+    if (shm_zone == NULL) {
+        return NULL;
+    }
+
+    if (shm_zone->init && shm_zone->init != ngx_quic_replay_init_zone) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is already used for another purpose",
+                           name);
+        return NULL;
+    }
+
+    if (shm_zone->data) {
+        ctx = shm_zone->data;
+
+        if (ctx->window != window) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "quic anti-replay zone \"%V\" is already "
+                               "used with a different window", name);
+            return NULL;
+        }
+
+        return shm_zone;
+    }
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_quic_replay_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    ctx->window = window;
+
+    shm_zone->init = ngx_quic_replay_init_zone;
+    shm_zone->data = ctx;
+
+    return shm_zone;
+}
+
+
+time_t
+ngx_quic_replay_window(ngx_shm_zone_t *shm_zone)
+{
+    ngx_quic_replay_ctx_t  *ctx;
+
+    ctx = shm_zone->data;
+
+    return ctx->window;
+}
+
+
+static ngx_int_t
+ngx_quic_replay_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_quic_replay_ctx_t  *octx = data;
+
+    size_t                    size;
+    ngx_quic_replay_ctx_t    *ctx;
+    ngx_quic_replay_shctx_t  *sh;
+
+    ctx = shm_zone->data;
+
+    if (octx) {
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_quic_replay_shctx_t));
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(sh, sizeof(ngx_quic_replay_shctx_t));
+
+    ctx->sh = sh;
+    ctx->shpool->data = sh;
+
+    if (RAND_bytes(sh->key, NGX_QUIC_REPLAY_KEY_LEN) <= 0) {
+        return NGX_ERROR;
+    }
+
+    size = (ctx->shpool->pfree - 1) * ngx_pagesize;
+
+    if (size < NGX_QUIC_REPLAY_PROBES * sizeof(ngx_atomic_t)) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                      "quic anti-replay zone \"%V\" is too small",
+                      &shm_zone->shm.name);
+        return NGX_ERROR;
+    }
+
+    sh->nslots = size / sizeof(ngx_atomic_t);
+
+    sh->slots = ngx_slab_alloc(ctx->shpool, size);
+    if (sh->slots == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero((void *) sh->slots, size);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_quic_replay_check(ngx_connection_t *c, ngx_shm_zone_t *shm_zone,
+    ngx_uint_t type, u_char *data, size_t len)
+{
+    u_char                    t;
+    ngx_int_t                 rc;
+    ngx_md5_t                 md5;
+    ngx_uint_t                hash;
+    ngx_atomic_uint_t         fp, epoch, cur, prev;
+    ngx_quic_replay_ctx_t    *ctx;
+    ngx_quic_replay_shctx_t  *sh;
+
+    u_char                    digest[16];
+
+    ctx = shm_zone->data;
+    sh = ctx->sh;
+
+    t = (u_char) type;
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, sh->key, NGX_QUIC_REPLAY_KEY_LEN);
+    ngx_md5_update(&md5, &t, 1);
+    ngx_md5_update(&md5, data, len);
+    ngx_md5_final(digest, &md5);
+
+    ngx_memcpy(&fp, digest, sizeof(ngx_atomic_uint_t));
+    ngx_memcpy(&hash, digest + 8, sizeof(ngx_uint_t));
+
+    fp &= ~(ngx_atomic_uint_t) NGX_QUIC_REPLAY_TAG_MASK;
+
+    epoch = ngx_time() / ctx->window;
+
+    cur = ngx_quic_replay_tag(epoch);
+    prev = ngx_quic_replay_tag(epoch + NGX_QUIC_REPLAY_TAGS - 1);
+
+    if (ngx_quic_replay_lookup(sh, fp, hash, cur, prev)) {
+        rc = NGX_DECLINED;
+
+    } else {
+        rc = ngx_quic_replay_insert(sh, fp, hash, cur, prev);
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic anti-replay \"%V\" type:%ui rc:%i",
+                   &shm_zone->shm.name, type, rc);
+
+    return rc;
+}
+
+
+static ngx_uint_t
+ngx_quic_replay_lookup(ngx_quic_replay_shctx_t *sh, ngx_atomic_uint_t fp,
+    ngx_uint_t hash, ngx_atomic_uint_t cur, ngx_atomic_uint_t prev)
+{
+    ngx_uint_t          i;
+    ngx_atomic_uint_t   v, tag;
+
+    /*
+     * reused slots may precede live entries in the probe sequence,
+     * so all probed slots are checked
+     */
+
+    for (i = 0; i < NGX_QUIC_REPLAY_PROBES; i++) {
+        v = sh->slots[(hash + i) % sh->nslots];
+        tag = v & NGX_QUIC_REPLAY_TAG_MASK;
+
+        if ((tag == cur || tag == prev) && v - tag == fp) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_quic_replay_insert(ngx_quic_replay_shctx_t *sh, ngx_atomic_uint_t fp,
+    ngx_uint_t hash, ngx_atomic_uint_t cur, ngx_atomic_uint_t prev)
+{
+    ngx_uint_t          i;
+    ngx_atomic_t       *slot;
+    ngx_atomic_uint_t   v, tag;
+
+    for (i = 0; i < NGX_QUIC_REPLAY_PROBES; i++) {
+        slot = &sh->slots[(hash + i) % sh->nslots];
+
+        for ( ;; ) {
+            v = *slot;
+            tag = v & NGX_QUIC_REPLAY_TAG_MASK;
+
+            if (tag == cur || tag == prev) {
+
+                if (v - tag == fp) {
+                    return NGX_DECLINED;
+                }
+
+                break;
+            }
+
+            /* the slot is empty or left from an older window */
+
+            if (ngx_atomic_cmp_set(slot, v, fp | cur)) {
+                return NGX_OK;
+            }
+
+            /* the slot was claimed concurrently, check by whom */
+        }
+    }
+
+    return NGX_BUSY;
+}
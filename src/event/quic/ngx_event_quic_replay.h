@@ -0,0 +1,23 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_EVENT_QUIC_REPLAY_H_INCLUDED_
+#define _NGX_EVENT_QUIC_REPLAY_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#define NGX_QUIC_REPLAY_TOKEN            1
+#define NGX_QUIC_REPLAY_CLIENT_HELLO     2
+
+
+ngx_int_t ngx_quic_replay_check(ngx_connection_t *c, ngx_shm_zone_t *shm_zone,
+    ngx_uint_t type, u_char *data, size_t len);
+time_t ngx_quic_replay_window(ngx_shm_zone_t *shm_zone);
+
+#endif /* _NGX_EVENT_QUIC_REPLAY_H_INCLUDED_ */
@@ -37,6 +37,8 @@ static int ngx_quic_flush_flight(ngx_ssl_conn_t *ssl_conn);
 static int ngx_quic_send_alert(ngx_ssl_conn_t *ssl_conn,
     enum ssl_encryption_level_t level, uint8_t alert);
 static ngx_int_t ngx_quic_crypto_input(ngx_connection_t *c, ngx_chain_t *data);
+static ngx_uint_t ngx_quic_early_data_replayed(ngx_connection_t *c,
+    ngx_ssl_conn_t *ssl_conn);
 
 
 static SSL_QUIC_METHOD quic_method = {
@@ -73,6 +75,12 @@ ngx_quic_set_read_secret(ngx_ssl_conn_t *ssl_conn,
                    secret_len, rsecret);
 #endif
 
+    if (level == ssl_encryption_early_data
+        && ngx_quic_early_data_replayed(c, ssl_conn))
+    {
+        return 1;
+    }
+
     if (ngx_quic_keys_set_encryption_secret(c->pool, 0, qc->keys, level,
                                             cipher, rsecret, secret_len)
         != 1)
@@ -137,6 +145,12 @@ ngx_quic_set_encryption_secrets(ngx_ssl_conn_t *ssl_conn,
 
     cipher = SSL_get_current_cipher(ssl_conn);
 
+    if (level == ssl_encryption_early_data
+        && ngx_quic_early_data_replayed(c, ssl_conn))
+    {
+        return 1;
+    }
+
     if (ngx_quic_keys_set_encryption_secret(c->pool, 0, qc->keys, level,
                                             cipher, rsecret, secret_len)
         != 1)
@@ -165,6 +179,62 @@ ngx_quic_set_encryption_secrets(ngx_ssl_conn_t *ssl_conn,
 #endif
 
 
+static ngx_uint_t
+ngx_quic_early_data_replayed(ngx_connection_t *c, ngx_ssl_conn_t *ssl_conn)
+{
+    size_t                  len;
+    time_t                  age;
+    SSL_SESSION            *session;
+    ngx_quic_connection_t  *qc;
+
+    u_char                  random[SSL3_RANDOM_SIZE];
+
+    qc = ngx_quic_get_connection(c);
+
+    if (qc->conf->anti_replay == NULL) {
+        return 0;
+    }
+
+    /*
+     * a ClientHello is remembered for at least one window, so early data
+     * with an older ticket are rejected (RFC 8446, 8.3)
+     */
+
+    session = SSL_get_session(ssl_conn);
+
+    if (session) {
+        age = ngx_time() - (time_t) SSL_SESSION_get_time(session);
+
+        if (age > ngx_quic_replay_window(qc->conf->anti_replay)) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "quic early data rejected, ticket age %T", age);
+            return 1;
+        }
+    }
+
+    len = SSL_get_client_random(ssl_conn, random, SSL3_RANDOM_SIZE);
+
+    if (len == SSL3_RANDOM_SIZE
+        && ngx_quic_replay_check(c, qc->conf->anti_replay,
+                                 NGX_QUIC_REPLAY_CLIENT_HELLO, random, len)
+           == NGX_OK)
+    {
+        return 0;
+    }
+
+    /*
+     * 0-RTT keys are not installed: early data is dropped as undecryptable
+     * and the client retransmits it in 1-RTT packets as lost once the
+     * handshake completes.
+     */
+
+    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                  "quic early data rejected, possible replay");
+
+    return 1;
+}
+
+
 static int
 ngx_quic_add_handshake_data(ngx_ssl_conn_t *ssl_conn,
     enum ssl_encryption_level_t level, const uint8_t *data, size_t len)
@@ -358,19 +428,29 @@ ngx_quic_handle_crypto_frame(ngx_connection_t *c, ngx_quic_header_t *pkt,
 
     if (f->offset > ctx->crypto_received) {
         return ngx_quic_order_bufs(c, &ctx->crypto, frame->data,
-                                   f->offset - ctx->crypto_received);
+                                   ctx->crypto_received, f->offset);
     }
 
     ngx_quic_trim_bufs(frame->data, ctx->crypto_received - f->offset);
 
-    if (ngx_quic_crypto_input(c, frame->data) != NGX_OK) {
-        return NGX_ERROR;
+    if (ctx->crypto.chain == NULL) {
+        if (ngx_quic_crypto_input(c, frame->data) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ctx->crypto_received = last;
+
+        return NGX_OK;
     }
 
-    ngx_quic_trim_bufs(ctx->crypto, last - ctx->crypto_received);
-    ctx->crypto_received = last;
+    if (ngx_quic_order_bufs(c, &ctx->crypto, frame->data,
+                            ctx->crypto_received, ctx->crypto_received)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
 
-    cl = ctx->crypto;
+    cl = ctx->crypto.chain;
     ll = &cl;
     len = 0;
 
@@ -387,7 +467,7 @@ ngx_quic_handle_crypto_frame(ngx_connection_t *c, ngx_quic_header_t *pkt,
     }
 
     ctx->crypto_received += len;
-    ctx->crypto = *ll;
+    ctx->crypto.chain = *ll;
     *ll = NULL;
 
     if (cl) {
@@ -469,6 +549,8 @@ ngx_quic_crypto_input(ngx_connection_t *c, ngx_chain_t *data)
 
     c->ssl->handshaked = 1;
 
+    ngx_quic_stats_handshake(c);
+
     frame = ngx_quic_alloc_frame(c);
     if (frame == NULL) {
         return NGX_ERROR;
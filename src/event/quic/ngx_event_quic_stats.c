@@ -0,0 +1,199 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_quic_connection.h>
+
+
+/*
+ * Connection counters are kept in ngx_quic_connection_t while the
+ * connection is alive and folded into the shared zone once, when it is
+ * closed, so the hot path never touches shared memory.
+ */
+
+
+static ngx_int_t ngx_quic_stats_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
+
+extern ngx_module_t  ngx_quic_module;
+
+
+ngx_shm_zone_t *
+ngx_quic_stats_add_zone(ngx_conf_t *cf, ngx_str_t *name)
+{
+    ngx_shm_zone_t  *shm_zone;
+
+    shm_zone = ngx_shared_memory_add(cf, name, 8 * ngx_pagesize,
+                                     &ngx_quic_module);
+    if (shm_zone == NULL) {
+        return NULL;
+    }
+
+    if (shm_zone->init && shm_zone->init != ngx_quic_stats_init_zone) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is already used for another purpose",
+                           name);
+        return NULL;
+    }
+
+    shm_zone->init = ngx_quic_stats_init_zone;
+
+    return shm_zone;
+}
+
+
+static ngx_int_t
+ngx_quic_stats_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_slab_pool_t   *shpool;
+    ngx_quic_stats_t  *stats;
+
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    stats = ngx_slab_calloc(shpool, sizeof(ngx_quic_stats_t));
+    if (stats == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = stats;
+    shm_zone->data = stats;
+
+    return NGX_OK;
+}
+
+
+ngx_quic_stats_t *
+ngx_quic_stats(ngx_shm_zone_t *shm_zone)
+{
+    return shm_zone->data;
+}
+
+
+ngx_int_t
+ngx_quic_conn_stats(ngx_connection_t *c, ngx_quic_conn_stats_t *st)
+{
+    ngx_connection_t       *pc;
+    ngx_quic_connection_t  *qc;
+
+    if (c->quic == NULL) {
+        return NGX_DECLINED;
+    }
+
+    pc = c->quic->parent;
+    qc = ngx_quic_get_connection(pc);
+
+    st->rtt_sampled = (qc->min_rtt != NGX_TIMER_INFINITE);
+    st->rtt = qc->avg_rtt;
+    st->min_rtt = st->rtt_sampled ? qc->min_rtt : 0;
+    st->rttvar = qc->rttvar;
+
+    st->cwnd = qc->congestion.window;
+    st->in_flight = qc->congestion.in_flight;
+
+    st->lost = qc->counters.lost;
+    st->retransmitted = qc->counters.retransmitted;
+    st->pto_count = qc->counters.ptos;
+    st->path_changes = qc->counters.path_changes;
+
+    st->handshaked = (pc->ssl && pc->ssl->handshaked);
+    st->handshake_time = qc->counters.handshake_time;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_quic_stats_handshake(ngx_connection_t *c)
+{
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    qc->counters.handshake_time = ngx_current_msec - c->start_time;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic handshake time:%M", qc->counters.handshake_time);
+}
+
+
+void
+ngx_quic_stats_close(ngx_connection_t *c)
+{
+    size_t                  cwnd;
+    uint64_t                sent;
+    ngx_uint_t              i;
+    ngx_msec_t              rtt;
+    ngx_quic_stats_t       *stats;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    if (qc->conf->stats == NULL) {
+        return;
+    }
+
+    stats = qc->conf->stats->data;
+
+    (void) ngx_atomic_fetch_add(&stats->connections, 1);
+
+    if (c->ssl && c->ssl->handshaked) {
+        (void) ngx_atomic_fetch_add(&stats->handshakes, 1);
+        (void) ngx_atomic_fetch_add(&stats->handshake_time,
+                                    qc->counters.handshake_time);
+    }
+
+    sent = 0;
+
+    for (i = 0; i < NGX_QUIC_SEND_CTX_LAST; i++) {
+        sent += qc->send_ctx[i].pnum;
+    }
+
+    (void) ngx_atomic_fetch_add(&stats->packets_sent, sent);
+    (void) ngx_atomic_fetch_add(&stats->packets_lost, qc->counters.lost);
+    (void) ngx_atomic_fetch_add(&stats->packets_retransmitted,
+                                qc->counters.retransmitted);
+    (void) ngx_atomic_fetch_add(&stats->ptos, qc->counters.ptos);
+    (void) ngx_atomic_fetch_add(&stats->path_changes,
+                                qc->counters.path_changes);
+
+    if (qc->min_rtt != NGX_TIMER_INFINITE) {
+        rtt = qc->avg_rtt;
+
+        for (i = 0; i < NGX_QUIC_STATS_RTT_BUCKETS - 1; i++) {
+            if (rtt <= ngx_quic_stats_rtt_bound(i)) {
+                break;
+            }
+        }
+
+        (void) ngx_atomic_fetch_add(&stats->rtt[i], 1);
+        (void) ngx_atomic_fetch_add(&stats->rtt_sum, rtt);
+        (void) ngx_atomic_fetch_add(&stats->rtt_count, 1);
+    }
+
+    cwnd = qc->congestion.window;
+
+    for (i = 0; i < NGX_QUIC_STATS_CWND_BUCKETS - 1; i++) {
+        if (cwnd <= ngx_quic_stats_cwnd_bound(i)) {
+            break;
+        }
+    }
+
+    (void) ngx_atomic_fetch_add(&stats->cwnd[i], 1);
+    (void) ngx_atomic_fetch_add(&stats->cwnd_sum, cwnd);
+}
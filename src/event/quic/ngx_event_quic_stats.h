@@ -0,0 +1,27 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_EVENT_QUIC_STATS_H_INCLUDED_
+#define _NGX_EVENT_QUIC_STATS_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+typedef struct {
+    ngx_uint_t                        lost;           /* packets */
+    ngx_uint_t                        retransmitted;  /* packets */
+    ngx_uint_t                        ptos;           /* total PTO expirations */
+    ngx_uint_t                        path_changes;
+    ngx_msec_t                        handshake_time;
+} ngx_quic_counters_t;
+
+
+void ngx_quic_stats_handshake(ngx_connection_t *c);
+void ngx_quic_stats_close(ngx_connection_t *c);
+
+#endif /* _NGX_EVENT_QUIC_STATS_H_INCLUDED_ */
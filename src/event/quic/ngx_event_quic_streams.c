@@ -687,7 +687,7 @@ ngx_quic_stream_recv(ngx_connection_t *c, u_char *buf, size_t size)
                    "quic stream id:0x%xL recv eof:%d buf:%uz",
                    qs->id, rev->pending_eof, size);
 
-    if (qs->in == NULL || qs->in->buf->sync) {
+    if (qs->in.chain == NULL || qs->in.chain->buf->sync) {
         rev->ready = 0;
 
         if (qs->recv_offset == qs->final_size) {
@@ -701,7 +701,7 @@ ngx_quic_stream_recv(ngx_connection_t *c, u_char *buf, size_t size)
     }
 
     len = 0;
-    cl = qs->in;
+    cl = qs->in.chain;
 
     for (ll = &cl; *ll; ll = &(*ll)->next) {
         b = (*ll)->buf;
@@ -723,12 +723,12 @@ ngx_quic_stream_recv(ngx_connection_t *c, u_char *buf, size_t size)
         }
     }
 
-    qs->in = *ll;
+    qs->in.chain = *ll;
     *ll = NULL;
 
     ngx_quic_free_bufs(pc, cl);
 
-    if (qs->in == NULL) {
+    if (qs->in.chain == NULL) {
         rev->ready = rev->pending_eof;
     }
 
@@ -957,7 +957,7 @@ ngx_quic_stream_cleanup_handler(void *data)
                    "quic stream id:0x%xL cleanup", qs->id);
 
     ngx_rbtree_delete(&qc->streams.tree, &qs->node);
-    ngx_quic_free_bufs(pc, qs->in);
+    ngx_quic_free_buffer(pc, &qs->in);
 
     if (qc->closing) {
         /* schedule handler call to continue ngx_quic_close_connection() */
@@ -1113,7 +1113,9 @@ ngx_quic_handle_stream_frame(ngx_connection_t *c, ngx_quic_header_t *pkt,
             sc->read->ready = 1;
         }
 
-        if (ngx_quic_order_bufs(c, &qs->in, frame->data, f->offset) != NGX_OK) {
+        if (ngx_quic_order_bufs(c, &qs->in, frame->data, 0, f->offset)
+            != NGX_OK)
+        {
             goto cleanup;
         }
 
@@ -1164,8 +1166,13 @@ ngx_quic_handle_stream_frame(ngx_connection_t *c, ngx_quic_header_t *pkt,
         qs->final_size = last;
     }
 
-    if (ngx_quic_order_bufs(c, &qs->in, frame->data,
-                            f->offset - qs->recv_offset)
+    /*
+     * in-order data is copied as well: frame data references the packet
+     * payload, which is reused for the next packet
+     */
+
+    if (ngx_quic_order_bufs(c, &qs->in, frame->data, qs->recv_offset,
+                            f->offset)
         != NGX_OK)
     {
         return NGX_ERROR;
@@ -275,6 +275,9 @@ struct ngx_quic_frame_s {
     unsigned                                    flush:1;
 #if (NGX_HAVE_IP_MTU_DISCOVER)
     unsigned                                    probe:1;
+
+    /* the path the packet was sent on, set with plen */
+    uint64_t                                    path;
 #endif
 
     ngx_chain_t                                *data;
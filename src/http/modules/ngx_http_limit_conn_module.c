@@ -26,6 +26,7 @@ typedef struct {
 typedef struct {
     ngx_shm_zone_t               *shm_zone;
     ngx_rbtree_node_t            *node;
+    ngx_shm_shard_t              *shard;
 } ngx_http_limit_conn_cleanup_t;
 
 
@@ -36,8 +37,8 @@ typedef struct {
 
 
 typedef struct {
-    ngx_http_limit_conn_shctx_t  *sh;
     ngx_slab_pool_t              *shpool;
+    ngx_uint_t                    nshards;
     ngx_http_complex_value_t      key;
 } ngx_http_limit_conn_ctx_t;
 
@@ -91,7 +92,7 @@ static ngx_conf_num_bounds_t  ngx_http_limit_conn_status_bounds = {
 static ngx_command_t  ngx_http_limit_conn_commands[] = {
 
     { ngx_string("limit_conn_zone"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE23|NGX_CONF_TAKE4,
       ngx_http_limit_conn_zone,
       0,
       0,
@@ -185,10 +186,12 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
     ngx_uint_t                      i;
     ngx_rbtree_node_t              *node;
     ngx_pool_cleanup_t             *cln;
+    ngx_shm_shard_t                *shard;
     ngx_http_limit_conn_ctx_t      *ctx;
     ngx_http_limit_conn_node_t     *lc;
     ngx_http_limit_conn_conf_t     *lccf;
     ngx_http_limit_conn_limit_t    *limits;
+    ngx_http_limit_conn_shctx_t    *sh;
     ngx_http_limit_conn_cleanup_t  *lccln;
 
     if (r->main->limit_conn_status) {
@@ -221,9 +224,12 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
 
         hash = ngx_crc32_short(key.data, key.len);
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        shard = ngx_shm_shard(limits[i].shm_zone, hash % ctx->nshards);
+        sh = (ngx_http_limit_conn_shctx_t *) ngx_shm_shard_data(shard);
+
+        ngx_shm_shard_lock(shard);
 
-        node = ngx_http_limit_conn_lookup(&ctx->sh->rbtree, &key, hash);
+        node = ngx_http_limit_conn_lookup(&sh->rbtree, &key, hash);
 
         if (node == NULL) {
 
@@ -234,7 +240,7 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
             node = ngx_slab_alloc_locked(ctx->shpool, n);
 
             if (node == NULL) {
-                ngx_shmtx_unlock(&ctx->shpool->mutex);
+                ngx_shm_shard_unlock(shard);
                 ngx_http_limit_conn_cleanup_all(r->pool);
 
                 if (lccf->dry_run) {
@@ -255,7 +261,7 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
             lc->conn = 1;
             ngx_memcpy(lc->data, key.data, key.len);
 
-            ngx_rbtree_insert(&ctx->sh->rbtree, node);
+            ngx_rbtree_insert(&sh->rbtree, node);
 
         } else {
 
@@ -263,7 +269,7 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
 
             if ((ngx_uint_t) lc->conn >= limits[i].conn) {
 
-                ngx_shmtx_unlock(&ctx->shpool->mutex);
+                ngx_shm_shard_unlock(shard);
 
                 ngx_log_error(lccf->log_level, r->connection->log, 0,
                               "limiting connections%s by zone \"%V\"",
@@ -289,7 +295,7 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
         ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "limit conn: %08Xi %d", node->key, lc->conn);
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_shm_shard_unlock(shard);
 
         cln = ngx_pool_cleanup_add(r->pool,
                                    sizeof(ngx_http_limit_conn_cleanup_t));
@@ -301,6 +307,7 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
         lccln = cln->data;
 
         lccln->shm_zone = limits[i].shm_zone;
+        lccln->shard = shard;
         lccln->node = node;
     }
 
@@ -393,15 +400,16 @@ ngx_http_limit_conn_cleanup(void *data)
 {
     ngx_http_limit_conn_cleanup_t  *lccln = data;
 
-    ngx_rbtree_node_t           *node;
-    ngx_http_limit_conn_ctx_t   *ctx;
-    ngx_http_limit_conn_node_t  *lc;
+    ngx_rbtree_node_t            *node;
+    ngx_http_limit_conn_ctx_t    *ctx;
+    ngx_http_limit_conn_node_t   *lc;
+    ngx_http_limit_conn_shctx_t  *sh;
 
     ctx = lccln->shm_zone->data;
     node = lccln->node;
     lc = (ngx_http_limit_conn_node_t *) &node->color;
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    ngx_shm_shard_lock(lccln->shard);
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, lccln->shm_zone->shm.log, 0,
                    "limit conn cleanup: %08Xi %d", node->key, lc->conn);
@@ -409,11 +417,14 @@ ngx_http_limit_conn_cleanup(void *data)
     lc->conn--;
 
     if (lc->conn == 0) {
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+        sh = (ngx_http_limit_conn_shctx_t *)
+                 ngx_shm_shard_data(lccln->shard);
+
+        ngx_rbtree_delete(&sh->rbtree, node);
         ngx_slab_free_locked(ctx->shpool, node);
     }
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_shm_shard_unlock(lccln->shard);
 }
 
 
@@ -438,8 +449,11 @@ ngx_http_limit_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_limit_conn_ctx_t  *octx = data;
 
-    size_t                      len;
-    ngx_http_limit_conn_ctx_t  *ctx;
+    size_t                        len;
+    u_char                       *shards;
+    ngx_uint_t                    i;
+    ngx_http_limit_conn_ctx_t    *ctx;
+    ngx_http_limit_conn_shctx_t  *sh;
 
     ctx = shm_zone->data;
 
@@ -457,29 +471,48 @@ ngx_http_limit_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
             return NGX_ERROR;
         }
 
-        ctx->sh = octx->sh;
+        if (ctx->nshards != octx->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_conn_zone \"%V\" uses %ui shards "
+                          "while previously it used %ui shards",
+                          &shm_zone->shm.name, ctx->nshards, octx->nshards);
+            return NGX_ERROR;
+        }
+
         ctx->shpool = octx->shpool;
 
+        (void) ngx_shm_shards_init(shm_zone, ctx->nshards,
+                                   sizeof(ngx_http_limit_conn_shctx_t),
+                                   ctx->shpool->data);
+
         return NGX_OK;
     }
 
     ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
     if (shm_zone->shm.exists) {
-        ctx->sh = ctx->shpool->data;
+        (void) ngx_shm_shards_init(shm_zone, ctx->nshards,
+                                   sizeof(ngx_http_limit_conn_shctx_t),
+                                   ctx->shpool->data);
 
         return NGX_OK;
     }
 
-    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_limit_conn_shctx_t));
-    if (ctx->sh == NULL) {
+    shards = ngx_shm_shards_init(shm_zone, ctx->nshards,
+                                 sizeof(ngx_http_limit_conn_shctx_t), NULL);
+    if (shards == NULL) {
         return NGX_ERROR;
     }
 
-    ctx->shpool->data = ctx->sh;
+    ctx->shpool->data = shards;
+
+    for (i = 0; i < ctx->nshards; i++) {
+        sh = (ngx_http_limit_conn_shctx_t *)
+                 ngx_shm_shard_data(ngx_shm_shard(shm_zone, i));
 
-    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
-                    ngx_http_limit_conn_rbtree_insert_value);
+        ngx_rbtree_init(&sh->rbtree, &sh->sentinel,
+                        ngx_http_limit_conn_rbtree_insert_value);
+    }
 
     len = sizeof(" in limit_conn_zone \"\"") + shm_zone->shm.name.len;
 
@@ -564,7 +597,8 @@ ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     u_char                            *p;
     ssize_t                            size;
     ngx_str_t                         *value, name, s;
-    ngx_uint_t                         i;
+    ngx_int_t                          shards;
+    ngx_uint_t                         i, hugepages;
     ngx_shm_zone_t                    *shm_zone;
     ngx_http_limit_conn_ctx_t         *ctx;
     ngx_http_compile_complex_value_t   ccv;
@@ -587,6 +621,8 @@ ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     size = 0;
+    hugepages = 0;
+    shards = 1;
     name.len = 0;
 
     for (i = 2; i < cf->args->nelts; i++) {
@@ -625,6 +661,24 @@ ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (shards <= 0 || shards > 1024) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid number of shards \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "hugepages") == 0) {
+            hugepages = 1;
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -652,6 +706,9 @@ ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    ctx->nshards = shards;
+
+    shm_zone->shm.hugepages = hugepages;
     shm_zone->init = ngx_http_limit_conn_init_zone;
     shm_zone->data = ctx;
 
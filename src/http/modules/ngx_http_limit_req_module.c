@@ -37,13 +37,43 @@ typedef struct {
 } ngx_http_limit_req_shctx_t;
 
 
+/*
+ * In the local mode each worker keeps its own tree of nodes, the excess
+ * consumed by the worker since the last synchronization is accumulated
+ * in the "pending" field and merged into the shared zone by a timer.
+ * Nodes with pending excess are linked into the "dirty" list, so
+ * the timer only visits keys used since the last synchronization.
+ */
+
+typedef struct {
+    ngx_queue_t                  dirty;
+    ngx_uint_t                   pending;
+    ngx_rbtree_node_t            node;
+} ngx_http_limit_req_local_t;
+
+
+#define ngx_http_limit_req_local(lr)                                          \
+    ((ngx_http_limit_req_local_t *) ((u_char *) (lr)                          \
+        - offsetof(ngx_rbtree_node_t, color)                                  \
+        - offsetof(ngx_http_limit_req_local_t, node)))
+
+
 typedef struct {
-    ngx_http_limit_req_shctx_t  *sh;
     ngx_slab_pool_t             *shpool;
+    ngx_uint_t                   nshards;
     /* integer value, 1 corresponds to 0.001 r/s */
     ngx_uint_t                   rate;
     ngx_http_complex_value_t     key;
     ngx_http_limit_req_node_t   *node;
+    ngx_shm_shard_t             *shard;
+    ngx_shm_zone_t              *shm_zone;
+
+    ngx_msec_t                   sync;
+    ngx_uint_t                   nlocal;
+    ngx_uint_t                   max_local;
+    ngx_http_limit_req_shctx_t   local;
+    ngx_queue_t                  dirty;
+    ngx_event_t                  sync_event;
 } ngx_http_limit_req_ctx_t;
 
 
@@ -66,13 +96,27 @@ typedef struct {
 
 static void ngx_http_limit_req_delay(ngx_http_request_t *r);
 static ngx_int_t ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
-    ngx_uint_t hash, ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account);
+    ngx_shm_shard_t *shard, ngx_uint_t hash, ngx_str_t *key, ngx_uint_t *ep,
+    ngx_uint_t account);
 static ngx_msec_t ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits,
     ngx_uint_t n, ngx_uint_t *ep, ngx_http_limit_req_limit_t **limit);
 static void ngx_http_limit_req_unlock(ngx_http_limit_req_limit_t *limits,
     ngx_uint_t n);
 static void ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
-    ngx_uint_t n);
+    ngx_http_limit_req_shctx_t *sh, ngx_uint_t n);
+static ngx_rbtree_node_t *ngx_http_limit_req_alloc(
+    ngx_http_limit_req_ctx_t *ctx, ngx_http_limit_req_shctx_t *sh,
+    size_t size);
+static ngx_rbtree_node_t *ngx_http_limit_req_local_alloc(
+    ngx_http_limit_req_ctx_t *ctx, size_t size);
+static void ngx_http_limit_req_local_free(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_node_t *lr);
+static void ngx_http_limit_req_pending(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_node_t *lr);
+static void ngx_http_limit_req_sync_handler(ngx_event_t *ev);
+static void ngx_http_limit_req_flush(ngx_http_limit_req_ctx_t *ctx);
+static ngx_int_t ngx_http_limit_req_sync(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_node_t *lr);
 
 static ngx_int_t ngx_http_limit_req_status_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
@@ -85,6 +129,8 @@ static char *ngx_http_limit_req(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_http_limit_req_add_variables(ngx_conf_t *cf);
 static ngx_int_t ngx_http_limit_req_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_limit_req_init_process(ngx_cycle_t *cycle);
+static void ngx_http_limit_req_exit_process(ngx_cycle_t *cycle);
 
 
 static ngx_conf_enum_t  ngx_http_limit_req_log_levels[] = {
@@ -104,7 +150,7 @@ static ngx_conf_num_bounds_t  ngx_http_limit_req_status_bounds = {
 static ngx_command_t  ngx_http_limit_req_commands[] = {
 
     { ngx_string("limit_req_zone"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
       ngx_http_limit_req_zone,
       0,
       0,
@@ -164,10 +210,10 @@ ngx_module_t  ngx_http_limit_req_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_limit_req_init_process,       /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_limit_req_exit_process,       /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -199,6 +245,7 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
     ngx_int_t                    rc;
     ngx_uint_t                   n, excess;
     ngx_msec_t                   delay;
+    ngx_shm_shard_t             *shard;
     ngx_http_limit_req_ctx_t    *ctx;
     ngx_http_limit_req_conf_t   *lrcf;
     ngx_http_limit_req_limit_t  *limit, *limits;
@@ -243,12 +290,20 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
 
         hash = ngx_crc32_short(key.data, key.len);
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        if (ctx->sync) {
+            rc = ngx_http_limit_req_lookup(limit, NULL, hash, &key, &excess,
+                                           (n == lrcf->limits.nelts - 1));
+
+        } else {
+            shard = ngx_shm_shard(limit->shm_zone, hash % ctx->nshards);
 
-        rc = ngx_http_limit_req_lookup(limit, hash, &key, &excess,
-                                       (n == lrcf->limits.nelts - 1));
+            ngx_shm_shard_lock(shard);
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+            rc = ngx_http_limit_req_lookup(limit, shard, hash, &key, &excess,
+                                           (n == lrcf->limits.nelts - 1));
+
+            ngx_shm_shard_unlock(shard);
+        }
 
         ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "limit_req[%ui]: %i %ui.%03ui",
@@ -402,23 +457,32 @@ ngx_http_limit_req_rbtree_insert_value(ngx_rbtree_node_t *temp,
 
 
 static ngx_int_t
-ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
-    ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account)
+ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
+    ngx_shm_shard_t *shard, ngx_uint_t hash, ngx_str_t *key, ngx_uint_t *ep,
+    ngx_uint_t account)
 {
-    size_t                      size;
-    ngx_int_t                   rc, excess;
-    ngx_msec_t                  now;
-    ngx_msec_int_t              ms;
-    ngx_rbtree_node_t          *node, *sentinel;
-    ngx_http_limit_req_ctx_t   *ctx;
-    ngx_http_limit_req_node_t  *lr;
+    size_t                       size;
+    ngx_int_t                    rc, excess;
+    ngx_msec_t                   now;
+    ngx_msec_int_t               ms;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_node_t   *lr;
+    ngx_http_limit_req_shctx_t  *sh;
 
     now = ngx_current_msec;
 
     ctx = limit->shm_zone->data;
 
-    node = ctx->sh->rbtree.root;
-    sentinel = ctx->sh->rbtree.sentinel;
+    if (shard) {
+        sh = (ngx_http_limit_req_shctx_t *) ngx_shm_shard_data(shard);
+
+    } else {
+        sh = &ctx->local;
+    }
+
+    node = sh->rbtree.root;
+    sentinel = sh->rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -440,7 +504,7 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
         if (rc == 0) {
             ngx_queue_remove(&lr->queue);
-            ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+            ngx_queue_insert_head(&sh->queue, &lr->queue);
 
             ms = (ngx_msec_int_t) (now - lr->last);
 
@@ -470,12 +534,17 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
                     lr->last = now;
                 }
 
+                if (shard == NULL) {
+                    ngx_http_limit_req_pending(ctx, lr);
+                }
+
                 return NGX_OK;
             }
 
             lr->count++;
 
             ctx->node = lr;
+            ctx->shard = shard;
 
             return NGX_AGAIN;
         }
@@ -489,19 +558,15 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
            + offsetof(ngx_http_limit_req_node_t, data)
            + key->len;
 
-    ngx_http_limit_req_expire(ctx, 1);
+    if (shard) {
+        node = ngx_http_limit_req_alloc(ctx, sh, size);
 
-    node = ngx_slab_alloc_locked(ctx->shpool, size);
+    } else {
+        node = ngx_http_limit_req_local_alloc(ctx, size);
+    }
 
     if (node == NULL) {
-        ngx_http_limit_req_expire(ctx, 0);
-
-        node = ngx_slab_alloc_locked(ctx->shpool, size);
-        if (node == NULL) {
-            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                          "could not allocate node%s", ctx->shpool->log_ctx);
-            return NGX_ERROR;
-        }
+        return NGX_ERROR;
     }
 
     node->key = hash;
@@ -513,13 +578,18 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     ngx_memcpy(lr->data, key->data, key->len);
 
-    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+    ngx_rbtree_insert(&sh->rbtree, node);
 
-    ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+    ngx_queue_insert_head(&sh->queue, &lr->queue);
 
     if (account) {
         lr->last = now;
         lr->count = 0;
+
+        if (shard == NULL) {
+            ngx_http_limit_req_pending(ctx, lr);
+        }
+
         return NGX_OK;
     }
 
@@ -527,6 +597,7 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
     lr->count = 1;
 
     ctx->node = lr;
+    ctx->shard = shard;
 
     return NGX_AGAIN;
 }
@@ -560,7 +631,9 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
             continue;
         }
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        if (ctx->shard) {
+            ngx_shm_shard_lock(ctx->shard);
+        }
 
         now = ngx_current_msec;
         ms = (ngx_msec_int_t) (now - lr->last);
@@ -585,7 +658,12 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
         lr->excess = excess;
         lr->count--;
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        if (ctx->shard) {
+            ngx_shm_shard_unlock(ctx->shard);
+
+        } else {
+            ngx_http_limit_req_pending(ctx, lr);
+        }
 
         ctx->node = NULL;
 
@@ -618,11 +696,17 @@ ngx_http_limit_req_unlock(ngx_http_limit_req_limit_t *limits, ngx_uint_t n)
             continue;
         }
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        if (ctx->shard == NULL) {
+            ctx->node->count--;
+            ctx->node = NULL;
+            continue;
+        }
+
+        ngx_shm_shard_lock(ctx->shard);
 
         ctx->node->count--;
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_shm_shard_unlock(ctx->shard);
 
         ctx->node = NULL;
     }
@@ -630,7 +714,8 @@ ngx_http_limit_req_unlock(ngx_http_limit_req_limit_t *limits, ngx_uint_t n)
 
 
 static void
-ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
+ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *sh, ngx_uint_t n)
 {
     ngx_int_t                   excess;
     ngx_msec_t                  now;
@@ -649,11 +734,11 @@ ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
 
     while (n < 3) {
 
-        if (ngx_queue_empty(&ctx->sh->queue)) {
+        if (ngx_queue_empty(&sh->queue)) {
             return;
         }
 
-        q = ngx_queue_last(&ctx->sh->queue);
+        q = ngx_queue_last(&sh->queue);
 
         lr = ngx_queue_data(q, ngx_http_limit_req_node_t, queue);
 
@@ -688,20 +773,332 @@ ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
         node = (ngx_rbtree_node_t *)
                    ((u_char *) lr - offsetof(ngx_rbtree_node_t, color));
 
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+        ngx_rbtree_delete(&sh->rbtree, node);
 
         ngx_slab_free_locked(ctx->shpool, node);
     }
 }
 
 
+static ngx_rbtree_node_t *
+ngx_http_limit_req_alloc(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *sh, size_t size)
+{
+    ngx_rbtree_node_t  *node;
+
+    ngx_http_limit_req_expire(ctx, sh, 1);
+
+    node = ngx_slab_alloc_locked(ctx->shpool, size);
+
+    if (node == NULL) {
+        ngx_http_limit_req_expire(ctx, sh, 0);
+
+        node = ngx_slab_alloc_locked(ctx->shpool, size);
+        if (node == NULL) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "could not allocate node%s", ctx->shpool->log_ctx);
+            return NULL;
+        }
+    }
+
+    return node;
+}
+
+
+static ngx_rbtree_node_t *
+ngx_http_limit_req_local_alloc(ngx_http_limit_req_ctx_t *ctx, size_t size)
+{
+    ngx_queue_t                 *q;
+    ngx_http_limit_req_node_t   *lr;
+    ngx_http_limit_req_local_t  *local;
+
+    if (ctx->nlocal >= ctx->max_local) {
+
+        /* the oldest node is merged into the zone ahead of time */
+
+        q = ngx_queue_last(&ctx->local.queue);
+        lr = ngx_queue_data(q, ngx_http_limit_req_node_t, queue);
+
+        if (lr->count) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "could not allocate local node in zone \"%V\"",
+                          &ctx->shm_zone->shm.name);
+            return NULL;
+        }
+
+        (void) ngx_http_limit_req_sync(ctx, lr);
+        ngx_http_limit_req_local_free(ctx, lr);
+    }
+
+    local = ngx_alloc(offsetof(ngx_http_limit_req_local_t, node) + size,
+                      ngx_cycle->log);
+    if (local == NULL) {
+        return NULL;
+    }
+
+    local->pending = 0;
+    ngx_queue_init(&local->dirty);
+
+    ctx->nlocal++;
+
+    return &local->node;
+}
+
+
+static void
+ngx_http_limit_req_local_free(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_node_t *lr)
+{
+    ngx_http_limit_req_local_t  *local;
+
+    local = ngx_http_limit_req_local(lr);
+
+    if (local->pending) {
+        ngx_queue_remove(&local->dirty);
+    }
+
+    ngx_queue_remove(&lr->queue);
+    ngx_rbtree_delete(&ctx->local.rbtree, &local->node);
+
+    ngx_free(local);
+
+    ctx->nlocal--;
+}
+
+
+static void
+ngx_http_limit_req_pending(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_node_t *lr)
+{
+    ngx_http_limit_req_local_t  *local;
+
+    local = ngx_http_limit_req_local(lr);
+
+    if (local->pending == 0) {
+        ngx_queue_insert_tail(&ctx->dirty, &local->dirty);
+    }
+
+    local->pending += 1000;
+}
+
+
+static void
+ngx_http_limit_req_sync_handler(ngx_event_t *ev)
+{
+    ngx_int_t                   excess;
+    ngx_msec_t                  now;
+    ngx_queue_t                *q;
+    ngx_msec_int_t              ms;
+    ngx_http_limit_req_ctx_t   *ctx;
+    ngx_http_limit_req_node_t  *lr;
+
+    ctx = ev->data;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "limit_req sync \"%V\": %ui nodes",
+                   &ctx->shm_zone->shm.name, ctx->nlocal);
+
+    ngx_http_limit_req_flush(ctx);
+
+    /* clean nodes which excess has expired are freed from the tail */
+
+    now = ngx_current_msec;
+
+    while (!ngx_queue_empty(&ctx->local.queue)) {
+
+        q = ngx_queue_last(&ctx->local.queue);
+        lr = ngx_queue_data(q, ngx_http_limit_req_node_t, queue);
+
+        if (lr->count || ngx_http_limit_req_local(lr)->pending) {
+            break;
+        }
+
+        ms = (ngx_msec_int_t) (now - lr->last);
+        ms = ngx_abs(ms);
+
+        excess = lr->excess - ctx->rate * ms / 1000;
+
+        if (excess > 0) {
+            break;
+        }
+
+        ngx_http_limit_req_local_free(ctx, lr);
+    }
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_add_timer(ev, ctx->sync);
+}
+
+
+static void
+ngx_http_limit_req_flush(ngx_http_limit_req_ctx_t *ctx)
+{
+    ngx_queue_t                 *q, *next;
+    ngx_http_limit_req_node_t   *lr;
+    ngx_http_limit_req_local_t  *local;
+
+    for (q = ngx_queue_head(&ctx->dirty);
+         q != ngx_queue_sentinel(&ctx->dirty);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        local = ngx_queue_data(q, ngx_http_limit_req_local_t, dirty);
+        lr = (ngx_http_limit_req_node_t *) &local->node.color;
+
+        /* a node the zone has no room for stays dirty till the next run */
+
+        if (ngx_http_limit_req_sync(ctx, lr) == NGX_DONE && lr->count == 0) {
+            ngx_http_limit_req_local_free(ctx, lr);
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_limit_req_sync(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_node_t *lr)
+{
+    size_t                       size;
+    ngx_int_t                    rc, excess;
+    ngx_msec_t                   now;
+    ngx_msec_int_t               ms;
+    ngx_shm_shard_t             *shard;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_limit_req_node_t   *slr;
+    ngx_http_limit_req_local_t  *local;
+    ngx_http_limit_req_shctx_t  *sh;
+
+    now = ngx_current_msec;
+    local = ngx_http_limit_req_local(lr);
+
+    shard = ngx_shm_shard(ctx->shm_zone, local->node.key % ctx->nshards);
+    sh = (ngx_http_limit_req_shctx_t *) ngx_shm_shard_data(shard);
+
+    ngx_shm_shard_lock(shard);
+
+    node = sh->rbtree.root;
+    sentinel = sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (local->node.key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (local->node.key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* local->node.key == node->key */
+
+        slr = (ngx_http_limit_req_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(lr->data, slr->data, (size_t) lr->len,
+                          (size_t) slr->len);
+
+        if (rc == 0) {
+            break;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    if (node == sentinel) {
+
+        if (local->pending == 0) {
+            ngx_shm_shard_unlock(shard);
+
+            lr->excess = 0;
+
+            return NGX_DONE;
+        }
+
+        size = offsetof(ngx_rbtree_node_t, color)
+               + offsetof(ngx_http_limit_req_node_t, data)
+               + lr->len;
+
+        node = ngx_http_limit_req_alloc(ctx, sh, size);
+
+        if (node == NULL) {
+            ngx_shm_shard_unlock(shard);
+            return NGX_ERROR;
+        }
+
+        node->key = local->node.key;
+
+        slr = (ngx_http_limit_req_node_t *) &node->color;
+
+        slr->len = lr->len;
+        slr->excess = 0;
+        slr->last = now;
+        slr->count = 0;
+
+        ngx_memcpy(slr->data, lr->data, lr->len);
+
+        ngx_rbtree_insert(&sh->rbtree, node);
+
+    } else {
+        ngx_queue_remove(&slr->queue);
+    }
+
+    ngx_queue_insert_head(&sh->queue, &slr->queue);
+
+    ms = (ngx_msec_int_t) (now - slr->last);
+
+    if (ms < -60000) {
+        ms = 1;
+
+    } else if (ms < 0) {
+        ms = 0;
+    }
+
+    excess = slr->excess - ctx->rate * ms / 1000;
+
+    if (excess < 0) {
+        excess = 0;
+    }
+
+    excess += local->pending;
+
+    slr->excess = excess;
+
+    if (ms) {
+        slr->last = now;
+    }
+
+    /* the worker continues from the state of all workers */
+
+    lr->excess = excess;
+    lr->last = slr->last;
+
+    if (local->pending) {
+        ngx_queue_remove(&local->dirty);
+        ngx_queue_init(&local->dirty);
+        local->pending = 0;
+    }
+
+    ngx_shm_shard_unlock(shard);
+
+    return (excess == 0) ? NGX_DONE : NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_limit_req_ctx_t  *octx = data;
 
-    size_t                     len;
-    ngx_http_limit_req_ctx_t  *ctx;
+    size_t                       len;
+    u_char                      *shards;
+    ngx_uint_t                   i;
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_shctx_t  *sh;
 
     ctx = shm_zone->data;
 
@@ -719,31 +1116,50 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
             return NGX_ERROR;
         }
 
-        ctx->sh = octx->sh;
+        if (ctx->nshards != octx->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_req \"%V\" uses %ui shards "
+                          "while previously it used %ui shards",
+                          &shm_zone->shm.name, ctx->nshards, octx->nshards);
+            return NGX_ERROR;
+        }
+
         ctx->shpool = octx->shpool;
 
+        (void) ngx_shm_shards_init(shm_zone, ctx->nshards,
+                                   sizeof(ngx_http_limit_req_shctx_t),
+                                   ctx->shpool->data);
+
         return NGX_OK;
     }
 
     ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
     if (shm_zone->shm.exists) {
-        ctx->sh = ctx->shpool->data;
+        (void) ngx_shm_shards_init(shm_zone, ctx->nshards,
+                                   sizeof(ngx_http_limit_req_shctx_t),
+                                   ctx->shpool->data);
 
         return NGX_OK;
     }
 
-    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_limit_req_shctx_t));
-    if (ctx->sh == NULL) {
+    shards = ngx_shm_shards_init(shm_zone, ctx->nshards,
+                                 sizeof(ngx_http_limit_req_shctx_t), NULL);
+    if (shards == NULL) {
         return NGX_ERROR;
     }
 
-    ctx->shpool->data = ctx->sh;
+    ctx->shpool->data = shards;
 
-    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
-                    ngx_http_limit_req_rbtree_insert_value);
+    for (i = 0; i < ctx->nshards; i++) {
+        sh = (ngx_http_limit_req_shctx_t *)
+                 ngx_shm_shard_data(ngx_shm_shard(shm_zone, i));
 
-    ngx_queue_init(&ctx->sh->queue);
+        ngx_rbtree_init(&sh->rbtree, &sh->sentinel,
+                        ngx_http_limit_req_rbtree_insert_value);
+
+        ngx_queue_init(&sh->queue);
+    }
 
     len = sizeof(" in limit_req zone \"\"") + shm_zone->shm.name.len;
 
@@ -836,8 +1252,9 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size_t                             len;
     ssize_t                            size;
     ngx_str_t                         *value, name, s;
-    ngx_int_t                          rate, scale;
-    ngx_uint_t                         i;
+    ngx_int_t                          rate, scale, shards;
+    ngx_uint_t                         i, hugepages, local;
+    ngx_msec_t                         sync;
     ngx_shm_zone_t                    *shm_zone;
     ngx_http_limit_req_ctx_t          *ctx;
     ngx_http_compile_complex_value_t   ccv;
@@ -860,6 +1277,10 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     size = 0;
+    hugepages = 0;
+    shards = 1;
+    local = 0;
+    sync = NGX_CONF_UNSET_MSEC;
     rate = 1;
     scale = 1;
     name.len = 0;
@@ -924,6 +1345,50 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (shards <= 0 || shards > 1024) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid number of shards \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "mode=shared") == 0) {
+            local = 0;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "mode=local") == 0) {
+            local = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "sync=", 5) == 0) {
+
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            sync = ngx_parse_time(&s, 0);
+            if (sync == (ngx_msec_t) NGX_ERROR || sync == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid sync interval \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "hugepages") == 0) {
+            hugepages = 1;
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -936,7 +1401,28 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (sync != NGX_CONF_UNSET_MSEC && !local) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"sync\" requires \"mode=local\"");
+        return NGX_CONF_ERROR;
+    }
+
     ctx->rate = rate * 1000 / scale;
+    ctx->nshards = shards;
+
+    if (local) {
+        ctx->sync = (sync == NGX_CONF_UNSET_MSEC) ? 100 : sync;
+
+        /* a worker does not need more keys than the zone can hold */
+
+        ctx->max_local = size / 128;
+
+        ngx_rbtree_init(&ctx->local.rbtree, &ctx->local.sentinel,
+                        ngx_http_limit_req_rbtree_insert_value);
+
+        ngx_queue_init(&ctx->local.queue);
+        ngx_queue_init(&ctx->dirty);
+    }
 
     shm_zone = ngx_shared_memory_add(cf, &name, size,
                                      &ngx_http_limit_req_module);
@@ -953,6 +1439,9 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    ctx->shm_zone = shm_zone;
+
+    shm_zone->shm.hugepages = hugepages;
     shm_zone->init = ngx_http_limit_req_init_zone;
     shm_zone->data = ctx;
 
@@ -1100,3 +1589,100 @@ ngx_http_limit_req_init(ngx_conf_t *cf)
 
     return NGX_OK;
 }
+
+
+static ngx_int_t
+ngx_http_limit_req_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                 i;
+    ngx_shm_zone_t            *shm_zone;
+    ngx_list_part_t           *part;
+    ngx_http_limit_req_ctx_t  *ctx;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].tag != &ngx_http_limit_req_module) {
+            continue;
+        }
+
+        ctx = shm_zone[i].data;
+
+        if (ctx->sync == 0) {
+            continue;
+        }
+
+        ctx->sync_event.handler = ngx_http_limit_req_sync_handler;
+        ctx->sync_event.data = ctx;
+        ctx->sync_event.log = cycle->log;
+        ctx->sync_event.cancelable = 1;
+
+        ngx_add_timer(&ctx->sync_event, ctx->sync);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_limit_req_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                 i;
+    ngx_shm_zone_t            *shm_zone;
+    ngx_list_part_t           *part;
+    ngx_http_limit_req_ctx_t  *ctx;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return;
+    }
+
+    /* the excess accumulated since the last synchronization is not lost */
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].tag != &ngx_http_limit_req_module) {
+            continue;
+        }
+
+        ctx = shm_zone[i].data;
+
+        if (ctx->sync == 0) {
+            continue;
+        }
+
+        ngx_http_limit_req_flush(ctx);
+    }
+}
@@ -10,13 +10,25 @@
 #include <ngx_http.h>
 
 
+typedef struct {
+    ngx_array_t                stats;    /* of ngx_shm_zone_t * */
+} ngx_http_quic_main_conf_t;
+
+
 static ngx_int_t ngx_http_variable_quic(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_variable_quic_stats(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 #if (NGX_HAVE_IP_MTU_DISCOVER)
 static ngx_int_t ngx_http_variable_quic_mtu(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 #endif
 static ngx_int_t ngx_http_quic_add_variables(ngx_conf_t *cf);
+static void ngx_http_quic_exit_process(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_quic_stats_handler(ngx_http_request_t *r);
+static u_char *ngx_http_quic_stats_zone_status(u_char *p,
+    ngx_shm_zone_t *shm_zone);
+static void *ngx_http_quic_create_main_conf(ngx_conf_t *cf);
 static void *ngx_http_quic_create_srv_conf(ngx_conf_t *cf);
 static char *ngx_http_quic_merge_srv_conf(ngx_conf_t *cf, void *parent,
     void *child);
@@ -26,6 +38,14 @@ static char *ngx_http_quic_max_udp_payload_size(ngx_conf_t *cf, void *post,
     void *data);
 static char *ngx_http_quic_host_key(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_quic_anti_replay(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_quic_stats_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_quic_stats(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_quic_qlog(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 static ngx_conf_post_t  ngx_http_quic_max_ack_delay_post =
     { ngx_http_quic_max_ack_delay };
@@ -186,6 +206,34 @@ static ngx_command_t  ngx_http_quic_commands[] = {
       0,
       NULL },
 
+    { ngx_string("quic_anti_replay"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE12,
+      ngx_http_quic_anti_replay,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("quic_stats_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_http_quic_stats_zone,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("quic_qlog"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_1MORE,
+      ngx_http_quic_qlog,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("quic_stats"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_quic_stats,
+      0,
+      0,
+      NULL },
+
 #if (NGX_HAVE_IP_MTU_DISCOVER)
     { ngx_string("quic_mtu_discovery"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_FLAG,
@@ -226,7 +274,7 @@ static ngx_http_module_t  ngx_http_quic_module_ctx = {
     ngx_http_quic_add_variables,           /* preconfiguration */
     NULL,                                  /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
+    ngx_http_quic_create_main_conf,        /* create main configuration */
     NULL,                                  /* init main configuration */
 
     ngx_http_quic_create_srv_conf,         /* create server configuration */
@@ -247,7 +295,7 @@ ngx_module_t  ngx_http_quic_module = {
     NULL,                                  /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_quic_exit_process,            /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -257,6 +305,36 @@ static ngx_http_variable_t  ngx_http_quic_vars[] = {
 
     { ngx_string("quic"), NULL, ngx_http_variable_quic, 0, 0, 0 },
 
+    { ngx_string("quic_rtt"), NULL, ngx_http_variable_quic_stats,
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("quic_min_rtt"), NULL, ngx_http_variable_quic_stats,
+      1, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("quic_rttvar"), NULL, ngx_http_variable_quic_stats,
+      2, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("quic_cwnd"), NULL, ngx_http_variable_quic_stats,
+      3, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("quic_bytes_in_flight"), NULL, ngx_http_variable_quic_stats,
+      4, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("quic_lost"), NULL, ngx_http_variable_quic_stats,
+      5, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("quic_retransmitted"), NULL, ngx_http_variable_quic_stats,
+      6, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("quic_pto_count"), NULL, ngx_http_variable_quic_stats,
+      7, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("quic_path_changes"), NULL, ngx_http_variable_quic_stats,
+      8, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("quic_handshake_time"), NULL, ngx_http_variable_quic_stats,
+      9, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
 #if (NGX_HAVE_IP_MTU_DISCOVER)
     { ngx_string("quic_mtu"), NULL, ngx_http_variable_quic_mtu, 0, 0, 0 },
 #endif
@@ -357,6 +435,91 @@ ngx_http_variable_quic(ngx_http_request_t *r,
 }
 
 
+static ngx_int_t
+ngx_http_variable_quic_stats(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                 *p;
+    ngx_uint_t              value;
+    ngx_quic_conn_stats_t   st;
+
+    if (ngx_quic_conn_stats(r->connection, &st) != NGX_OK) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    switch (data) {
+    case 0:
+        value = st.rtt;
+        break;
+
+    case 1:
+        if (!st.rtt_sampled) {
+            v->not_found = 1;
+            return NGX_OK;
+        }
+
+        value = st.min_rtt;
+        break;
+
+    case 2:
+        value = st.rttvar;
+        break;
+
+    case 3:
+        value = st.cwnd;
+        break;
+
+    case 4:
+        value = st.in_flight;
+        break;
+
+    case 5:
+        value = st.lost;
+        break;
+
+    case 6:
+        value = st.retransmitted;
+        break;
+
+    case 7:
+        value = st.pto_count;
+        break;
+
+    case 8:
+        value = st.path_changes;
+        break;
+
+    case 9:
+        if (!st.handshaked) {
+            v->not_found = 1;
+            return NGX_OK;
+        }
+
+        value = st.handshake_time;
+        break;
+
+    /* suppress warning */
+    default:
+        value = 0;
+        break;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui", value) - p;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
 #if (NGX_HAVE_IP_MTU_DISCOVER)
 static ngx_int_t
 ngx_http_variable_quic_mtu(ngx_http_request_t *r,
@@ -407,6 +570,177 @@ ngx_http_quic_add_variables(ngx_conf_t *cf)
 }
 
 
+static void
+ngx_http_quic_exit_process(ngx_cycle_t *cycle)
+{
+    /* runs after the thread pools are destroyed */
+
+    ngx_quic_qlog_exit();
+}
+
+
+static ngx_int_t
+ngx_http_quic_stats_handler(ngx_http_request_t *r)
+{
+    size_t                      size;
+    ngx_int_t                   rc;
+    ngx_buf_t                  *b;
+    ngx_uint_t                  i;
+    ngx_chain_t                 out;
+    ngx_shm_zone_t            **zone;
+    ngx_http_quic_main_conf_t  *qmcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    r->headers_out.content_type_len = sizeof("text/plain") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_lowcase = NULL;
+
+    qmcf = ngx_http_get_module_main_conf(r, ngx_http_quic_module);
+
+    zone = qmcf->stats.elts;
+    size = 0;
+
+    /* a line per counter and histogram bucket, none longer than this */
+
+    for (i = 0; i < qmcf->stats.nelts; i++) {
+        size += (NGX_QUIC_STATS_RTT_BUCKETS + NGX_QUIC_STATS_CWND_BUCKETS + 12)
+                * (sizeof("quic_packets_retransmitted_total{zone=\"\","
+                          "le=\"\"} \n")
+                   + zone[i]->shm.name.len + 2 * NGX_ATOMIC_T_LEN);
+    }
+
+    if (size == 0) {
+        r->header_only = 1;
+        r->headers_out.content_length_n = 0;
+        r->headers_out.status = NGX_HTTP_OK;
+
+        return ngx_http_send_header(r);
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    for (i = 0; i < qmcf->stats.nelts; i++) {
+        b->last = ngx_http_quic_stats_zone_status(b->last, zone[i]);
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static u_char *
+ngx_http_quic_stats_zone_status(u_char *p, ngx_shm_zone_t *shm_zone)
+{
+    ngx_str_t          *name;
+    ngx_uint_t          i;
+    ngx_atomic_uint_t   n;
+    ngx_quic_stats_t   *stats;
+
+    name = &shm_zone->shm.name;
+    stats = ngx_quic_stats(shm_zone);
+
+    p = ngx_sprintf(p, "quic_connections_total{zone=\"%V\"} %uA\n",
+                    name, stats->connections);
+    p = ngx_sprintf(p, "quic_handshakes_total{zone=\"%V\"} %uA\n",
+                    name, stats->handshakes);
+    p = ngx_sprintf(p, "quic_handshake_time_ms_sum{zone=\"%V\"} %uA\n",
+                    name, stats->handshake_time);
+    p = ngx_sprintf(p, "quic_packets_sent_total{zone=\"%V\"} %uA\n",
+                    name, stats->packets_sent);
+    p = ngx_sprintf(p, "quic_packets_lost_total{zone=\"%V\"} %uA\n",
+                    name, stats->packets_lost);
+    p = ngx_sprintf(p, "quic_packets_retransmitted_total{zone=\"%V\"} %uA\n",
+                    name, stats->packets_retransmitted);
+    p = ngx_sprintf(p, "quic_pto_total{zone=\"%V\"} %uA\n",
+                    name, stats->ptos);
+    p = ngx_sprintf(p, "quic_path_changes_total{zone=\"%V\"} %uA\n",
+                    name, stats->path_changes);
+
+    /* histogram buckets are cumulative on output */
+
+    n = 0;
+
+    for (i = 0; i < NGX_QUIC_STATS_RTT_BUCKETS - 1; i++) {
+        n += stats->rtt[i];
+        p = ngx_sprintf(p, "quic_rtt_ms_bucket{zone=\"%V\",le=\"%M\"} %uA\n",
+                        name, ngx_quic_stats_rtt_bound(i), n);
+    }
+
+    n += stats->rtt[i];
+    p = ngx_sprintf(p, "quic_rtt_ms_bucket{zone=\"%V\",le=\"+Inf\"} %uA\n",
+                    name, n);
+    p = ngx_sprintf(p, "quic_rtt_ms_sum{zone=\"%V\"} %uA\n",
+                    name, stats->rtt_sum);
+    p = ngx_sprintf(p, "quic_rtt_ms_count{zone=\"%V\"} %uA\n",
+                    name, stats->rtt_count);
+
+    n = 0;
+
+    for (i = 0; i < NGX_QUIC_STATS_CWND_BUCKETS - 1; i++) {
+        n += stats->cwnd[i];
+        p = ngx_sprintf(p,
+                        "quic_cwnd_bytes_bucket{zone=\"%V\",le=\"%uz\"} %uA\n",
+                        name, ngx_quic_stats_cwnd_bound(i), n);
+    }
+
+    n += stats->cwnd[i];
+    p = ngx_sprintf(p, "quic_cwnd_bytes_bucket{zone=\"%V\",le=\"+Inf\"} %uA\n",
+                    name, n);
+    p = ngx_sprintf(p, "quic_cwnd_bytes_sum{zone=\"%V\"} %uA\n",
+                    name, stats->cwnd_sum);
+    p = ngx_sprintf(p, "quic_cwnd_bytes_count{zone=\"%V\"} %uA\n",
+                    name, stats->connections);
+
+    return p;
+}
+
+
+static void *
+ngx_http_quic_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_quic_main_conf_t  *qmcf;
+
+    qmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_quic_main_conf_t));
+    if (qmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&qmcf->stats, cf->pool, 1, sizeof(ngx_shm_zone_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return qmcf;
+}
+
+
 static void *
 ngx_http_quic_create_srv_conf(ngx_conf_t *cf)
 {
@@ -447,6 +781,9 @@ ngx_http_quic_create_srv_conf(ngx_conf_t *cf)
     conf->initial_window = NGX_CONF_UNSET_SIZE;
     conf->min_window = NGX_CONF_UNSET_SIZE;
     conf->retry = NGX_CONF_UNSET;
+    conf->anti_replay = NGX_CONF_UNSET_PTR;
+    conf->stats = NGX_CONF_UNSET_PTR;
+    conf->qlog = NGX_CONF_UNSET_PTR;
     conf->gso_enabled = NGX_CONF_UNSET;
 #if (NGX_HTTP_V3)
     conf->stream_close_code = NGX_HTTP_V3_ERR_NO_ERROR;
@@ -530,6 +867,9 @@ ngx_http_quic_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_size_value(conf->min_window, prev->min_window, 0);
 
     ngx_conf_merge_value(conf->retry, prev->retry, 0);
+    ngx_conf_merge_ptr_value(conf->anti_replay, prev->anti_replay, NULL);
+    ngx_conf_merge_ptr_value(conf->stats, prev->stats, NULL);
+    ngx_conf_merge_ptr_value(conf->qlog, prev->qlog, NULL);
     ngx_conf_merge_value(conf->gso_enabled, prev->gso_enabled, 0);
     ngx_conf_merge_value(conf->migration_close_connection, prev->migration_close_connection, 0);
 
@@ -727,3 +1067,344 @@ failed:
 
     return NGX_CONF_ERROR;
 }
+
+
+static char *
+ngx_http_quic_anti_replay(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_quic_conf_t  *qcf = conf;
+
+    u_char      *p;
+    time_t       window;
+    ssize_t      size;
+    ngx_str_t   *value, name, s;
+    ngx_uint_t   i;
+
+    if (qcf->anti_replay != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+
+        if (cf->args->nelts != 2) {
+            return "is invalid";
+        }
+
+        qcf->anti_replay = NULL;
+        return NGX_CONF_OK;
+    }
+
+    ngx_str_null(&name);
+    size = 0;
+    window = NGX_QUIC_REPLAY_WINDOW;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "window=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            window = ngx_parse_time(&s, 1);
+
+            if (window == (time_t) NGX_ERROR || window == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid window \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (window < NGX_QUIC_NEW_TOKEN_LIFETIME) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "\"%V\" is less than the address "
+                                   "validation token lifetime of %ds",
+                                   &value[i], NGX_QUIC_NEW_TOKEN_LIFETIME);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    qcf->anti_replay = ngx_quic_replay_add_zone(cf, &name, size, window);
+    if (qcf->anti_replay == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_quic_stats_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_quic_conf_t  *qcf = conf;
+
+    ngx_str_t                  *value;
+    ngx_uint_t                  i;
+    ngx_shm_zone_t             *shm_zone, **zone;
+    ngx_http_quic_main_conf_t  *qmcf;
+
+    if (qcf->stats != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        qcf->stats = NULL;
+        return NGX_CONF_OK;
+    }
+
+    shm_zone = ngx_quic_stats_add_zone(cf, &value[1]);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    qcf->stats = shm_zone;
+
+    qmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_quic_module);
+
+    zone = qmcf->stats.elts;
+
+    for (i = 0; i < qmcf->stats.nelts; i++) {
+        if (zone[i] == shm_zone) {
+            return NGX_CONF_OK;
+        }
+    }
+
+    zone = ngx_array_push(&qmcf->stats);
+    if (zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *zone = shm_zone;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_quic_stats(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_quic_stats_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_quic_qlog(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_quic_conf_t  *qcf = conf;
+
+    ngx_int_t              n;
+    ngx_str_t             *value, s;
+    ngx_uint_t             i;
+    ngx_cidr_t            *cidr;
+    ngx_quic_qlog_conf_t  *qlcf;
+#if (NGX_THREADS)
+    ngx_str_t             *pool;
+
+    pool = NULL;
+#endif
+
+    if (qcf->qlog != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+
+        if (cf->args->nelts != 2) {
+            return "is invalid";
+        }
+
+        qcf->qlog = NULL;
+        return NGX_CONF_OK;
+    }
+
+    qlcf = ngx_pcalloc(cf->pool, sizeof(ngx_quic_qlog_conf_t));
+    if (qlcf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    qlcf->path = value[1];
+
+    if (qlcf->path.len > 1 && qlcf->path.data[qlcf->path.len - 1] == '/') {
+        qlcf->path.len--;
+    }
+
+    if (ngx_conf_full_name(cf->cycle, &qlcf->path, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    qlcf->size = NGX_QUIC_QLOG_SIZE;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "sample=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            if (s.len < 2 || s.data[s.len - 1] != '%') {
+                goto invalid;
+            }
+
+            n = ngx_atofp(s.data, s.len - 1, 2);
+
+            if (n == NGX_ERROR || n > 10000) {
+                goto invalid;
+            }
+
+            qlcf->sample = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "client=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            if (qlcf->clients == NULL) {
+                qlcf->clients = ngx_array_create(cf->pool, 2,
+                                                 sizeof(ngx_cidr_t));
+                if (qlcf->clients == NULL) {
+                    return NGX_CONF_ERROR;
+                }
+            }
+
+            cidr = ngx_array_push(qlcf->clients);
+            if (cidr == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            n = ngx_ptocidr(&s, cidr);
+
+            if (n == NGX_ERROR) {
+                goto invalid;
+            }
+
+            if (n == NGX_DONE) {
+                ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                                   "low address bits of %V are meaningless",
+                                   &s);
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "buffer=", 7) == 0) {
+
+            n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            qlcf->size = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "threads=", 8) == 0) {
+#if (NGX_THREADS)
+            pool = ngx_palloc(cf->pool, sizeof(ngx_str_t));
+            if (pool == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            pool->len = value[i].len - 8;
+            pool->data = value[i].data + 8;
+
+            continue;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"threads\" parameter requires "
+                               "thread pools support");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
+        goto invalid;
+    }
+
+    if (qlcf->sample == 0 && qlcf->clients == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"sample\" or \"client\" "
+                           "parameter", &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+#if (NGX_THREADS)
+    /* the default thread pool is used unless specified */
+
+    qlcf->thread_pool = ngx_thread_pool_add(cf, pool);
+    if (qlcf->thread_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+#endif
+
+    qcf->qlog = qlcf;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
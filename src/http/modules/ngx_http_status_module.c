@@ -0,0 +1,1217 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
+
+/*
+ * The counters of server zones and upstream peers are kept in shared
+ * memory as one shard per worker process.  Each shard is aligned to
+ * the cache line size, so a worker process updates its counters without
+ * locks and without sharing cache lines with other workers.  The shards
+ * are summed when the status is requested.  If there are more workers
+ * than the zone was sized for, the shards are shared; the counters are
+ * updated atomically, so this is only slower.
+ */
+
+
+#define NGX_HTTP_STATUS_SHARD_ALIGN  128
+
+/* request time buckets: up to 1, 2, 4, ..., 16384 ms, and +Inf */
+
+#define NGX_HTTP_STATUS_BUCKETS      16
+
+
+typedef struct {
+    ngx_atomic_t                     requests;
+    ngx_atomic_t                     received;
+    ngx_atomic_t                     sent;
+    ngx_atomic_t                     responses[5];
+    ngx_atomic_t                     time;
+    ngx_atomic_t                     buckets[NGX_HTTP_STATUS_BUCKETS];
+} ngx_http_status_counters_t;
+
+
+typedef struct {
+    uint32_t                         layout;
+    ngx_uint_t                       nshards;
+    u_char                          *shards;
+} ngx_http_status_shctx_t;
+
+
+typedef struct {
+    ngx_array_t                      zones;       /* of ngx_str_t */
+    ngx_uint_t                       ncounters;
+    ngx_uint_t                       nshards;
+    ngx_uint_t                       max_shards;
+    size_t                           shard_size;
+    uint32_t                         layout;
+    ngx_core_conf_t                 *ccf;
+    ngx_http_status_shctx_t         *sh;
+    ngx_slab_pool_t                 *shpool;
+    ngx_shm_zone_t                  *shm_zone;
+} ngx_http_status_main_conf_t;
+
+
+typedef struct {
+    ngx_uint_t                       zone;
+    ngx_uint_t                       upstream;    /* the first peer counters */
+} ngx_http_status_srv_conf_t;
+
+
+static ngx_int_t ngx_http_status_handler(ngx_http_request_t *r);
+static u_char *ngx_http_status_metrics(u_char *p, char *prefix, char *time,
+    ngx_http_status_counters_t *counters, ngx_str_t *labels, ngx_uint_t n);
+static u_char *ngx_http_status_event_latency(u_char *p);
+static u_char *ngx_http_status_escape(u_char *p, ngx_str_t *value);
+static size_t ngx_http_status_shm_shards_size(ngx_cycle_t *cycle);
+static u_char *ngx_http_status_shm_shards(u_char *p, ngx_cycle_t *cycle);
+#if (NGX_THREADS)
+static size_t ngx_http_status_thread_pools_size(ngx_cycle_t *cycle);
+static u_char *ngx_http_status_thread_pools(u_char *p, ngx_cycle_t *cycle);
+#endif
+#if (NGX_HTTP_CACHE)
+static size_t ngx_http_status_caches_size(ngx_cycle_t *cycle);
+static u_char *ngx_http_status_caches(u_char *p, ngx_cycle_t *cycle);
+#endif
+static ngx_int_t ngx_http_status_log_handler(ngx_http_request_t *r);
+static void ngx_http_status_count(ngx_http_status_counters_t *counters,
+    ngx_uint_t status, off_t received, off_t sent, ngx_msec_int_t ms);
+static ngx_int_t ngx_http_status_upstream_peer(
+    ngx_http_upstream_srv_conf_t *uscf, ngx_str_t *name);
+static ngx_int_t ngx_http_status_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static void *ngx_http_status_create_main_conf(ngx_conf_t *cf);
+static void *ngx_http_status_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_http_status_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_status_prometheus(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_status_init(ngx_conf_t *cf);
+
+
+static ngx_command_t  ngx_http_status_commands[] = {
+
+    { ngx_string("status_zone"),
+      NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_http_status_zone,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("status_prometheus"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_status_prometheus,
+      0,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_status_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_status_init,                  /* postconfiguration */
+
+    ngx_http_status_create_main_conf,      /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_status_create_srv_conf,       /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_status_module = {
+    NGX_MODULE_V1,
+    &ngx_http_status_module_ctx,           /* module context */
+    ngx_http_status_commands,              /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static char  *ngx_http_status_buckets[] = {
+    "0.001", "0.002", "0.004", "0.008", "0.016", "0.032", "0.064", "0.128",
+    "0.256", "0.512", "1.024", "2.048", "4.096", "8.192", "16.384", "+Inf"
+};
+
+
+static ngx_int_t
+ngx_http_status_handler(ngx_http_request_t *r)
+{
+    u_char                         *p;
+    size_t                          size;
+    ngx_int_t                       rc;
+    ngx_buf_t                      *b;
+    ngx_str_t                      *labels, *zone;
+    ngx_uint_t                      i, j, k, n, nzones;
+    ngx_chain_t                     out;
+    ngx_atomic_t                   *src, *dst;
+    ngx_http_status_counters_t     *counters;
+    ngx_http_upstream_rr_peer_t    *peer;
+    ngx_http_upstream_rr_peers_t   *peers;
+    ngx_http_status_srv_conf_t     *sscf;
+    ngx_http_status_main_conf_t    *smcf;
+    ngx_http_upstream_srv_conf_t  **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_status_module);
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    n = smcf->ncounters;
+    nzones = smcf->zones.nelts;
+
+    counters = ngx_pcalloc(r->pool, n * sizeof(ngx_http_status_counters_t));
+    labels = ngx_palloc(r->pool, n * sizeof(ngx_str_t));
+
+    if (n && (counters == NULL || labels == NULL)) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* sum the shards */
+
+    for (i = 0; i < smcf->nshards; i++) {
+        src = (ngx_atomic_t *) (smcf->sh->shards + i * smcf->shard_size);
+        dst = (ngx_atomic_t *) counters;
+
+        for (j = 0;
+             j < n * sizeof(ngx_http_status_counters_t) / sizeof(ngx_atomic_t);
+             j++)
+        {
+            dst[j] += src[j];
+        }
+    }
+
+    size = 0;
+    zone = smcf->zones.elts;
+
+    for (i = 0; i < nzones; i++) {
+
+        labels[i].data = ngx_pnalloc(r->pool,
+                                     sizeof("zone=\"\"") - 1 + 2 * zone[i].len);
+        if (labels[i].data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        p = ngx_cpymem(labels[i].data, "zone=\"", sizeof("zone=\"") - 1);
+        p = ngx_http_status_escape(p, &zone[i]);
+        *p++ = '"';
+
+        labels[i].len = p - labels[i].data;
+
+        size += labels[i].len;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        sscf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                               ngx_http_status_module);
+
+        if (sscf->upstream == NGX_CONF_UNSET_UINT) {
+            continue;
+        }
+
+        k = sscf->upstream;
+
+        for (peers = uscfp[i]->peer.data; peers; peers = peers->next) {
+            for (peer = peers->peer; peer && k < n; peer = peer->next, k++) {
+
+                labels[k].data = ngx_pnalloc(r->pool,
+                                      sizeof("upstream=\"\",peer=\"\"") - 1
+                                      + 2 * (uscfp[i]->host.len
+                                             + peer->name.len));
+                if (labels[k].data == NULL) {
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                }
+
+                p = ngx_cpymem(labels[k].data, "upstream=\"",
+                               sizeof("upstream=\"") - 1);
+                p = ngx_http_status_escape(p, &uscfp[i]->host);
+                p = ngx_cpymem(p, "\",peer=\"", sizeof("\",peer=\"") - 1);
+                p = ngx_http_status_escape(p, &peer->name);
+                *p++ = '"';
+
+                labels[k].len = p - labels[k].data;
+
+                size += labels[k].len;
+            }
+        }
+    }
+
+    /* a metric line is less than 128 bytes without labels */
+
+    size = size * 26 + n * 26 * (128 + NGX_ATOMIC_T_LEN)
+           + 14 * (128 + NGX_ATOMIC_T_LEN)
+           + (NGX_EVENT_LATENCY_KINDS * (NGX_EVENT_LATENCY_BUCKETS + 3) + 2)
+             * (128 + NGX_ATOMIC_T_LEN);
+
+    size += ngx_http_status_shm_shards_size((ngx_cycle_t *) ngx_cycle);
+
+#if (NGX_THREADS)
+    size += ngx_http_status_thread_pools_size((ngx_cycle_t *) ngx_cycle);
+#endif
+
+#if (NGX_HTTP_CACHE)
+    size += ngx_http_status_caches_size((ngx_cycle_t *) ngx_cycle);
+#endif
+
+    r->headers_out.content_type_len = sizeof("text/plain; version=0.0.4") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+    r->headers_out.content_type_lowcase = NULL;
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    p = b->last;
+
+#if (NGX_STAT_STUB)
+
+    p = ngx_sprintf(p, "# TYPE nginx_connections_accepted_total counter\n"
+                       "nginx_connections_accepted_total %uA\n"
+                       "# TYPE nginx_connections_handled_total counter\n"
+                       "nginx_connections_handled_total %uA\n"
+                       "# TYPE nginx_http_requests_total counter\n"
+                       "nginx_http_requests_total %uA\n",
+                    ngx_stat_sum(ngx_stat_accepted),
+                    ngx_stat_sum(ngx_stat_handled),
+                    ngx_stat_sum(ngx_stat_requests));
+
+    p = ngx_sprintf(p, "# TYPE nginx_connections_active gauge\n"
+                       "nginx_connections_active %uA\n"
+                       "# TYPE nginx_connections_reading gauge\n"
+                       "nginx_connections_reading %uA\n"
+                       "# TYPE nginx_connections_writing gauge\n"
+                       "nginx_connections_writing %uA\n"
+                       "# TYPE nginx_connections_waiting gauge\n"
+                       "nginx_connections_waiting %uA\n",
+                    ngx_stat_sum(ngx_stat_active),
+                    ngx_stat_sum(ngx_stat_reading),
+                    ngx_stat_sum(ngx_stat_writing),
+                    ngx_stat_sum(ngx_stat_waiting));
+
+#endif
+
+    if (ngx_event_latency) {
+        p = ngx_http_status_event_latency(p);
+    }
+
+    p = ngx_http_status_shm_shards(p, (ngx_cycle_t *) ngx_cycle);
+
+#if (NGX_THREADS)
+    p = ngx_http_status_thread_pools(p, (ngx_cycle_t *) ngx_cycle);
+#endif
+
+#if (NGX_HTTP_CACHE)
+    p = ngx_http_status_caches(p, (ngx_cycle_t *) ngx_cycle);
+#endif
+
+    p = ngx_http_status_metrics(p, "nginx_server_zone",
+                                "request_duration_seconds",
+                                counters, labels, nzones);
+
+    p = ngx_http_status_metrics(p, "nginx_upstream_peer",
+                                "response_duration_seconds",
+                                counters + nzones, labels + nzones,
+                                n - nzones);
+
+    b->last = p;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static u_char *
+ngx_http_status_metrics(u_char *p, char *prefix, char *time,
+    ngx_http_status_counters_t *counters, ngx_str_t *labels, ngx_uint_t n)
+{
+    ngx_uint_t         i, k;
+    ngx_atomic_uint_t  count;
+
+    if (n == 0) {
+        return p;
+    }
+
+    p = ngx_sprintf(p, "# TYPE %s_requests_total counter\n", prefix);
+
+    for (i = 0; i < n; i++) {
+        p = ngx_sprintf(p, "%s_requests_total{%V} %uA\n",
+                        prefix, &labels[i], counters[i].requests);
+    }
+
+    p = ngx_sprintf(p, "# TYPE %s_responses_total counter\n", prefix);
+
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < 5; k++) {
+            p = ngx_sprintf(p, "%s_responses_total{%V,code=\"%uixx\"} %uA\n",
+                            prefix, &labels[i], k + 1,
+                            counters[i].responses[k]);
+        }
+    }
+
+    p = ngx_sprintf(p, "# TYPE %s_received_bytes_total counter\n", prefix);
+
+    for (i = 0; i < n; i++) {
+        p = ngx_sprintf(p, "%s_received_bytes_total{%V} %uA\n",
+                        prefix, &labels[i], counters[i].received);
+    }
+
+    p = ngx_sprintf(p, "# TYPE %s_sent_bytes_total counter\n", prefix);
+
+    for (i = 0; i < n; i++) {
+        p = ngx_sprintf(p, "%s_sent_bytes_total{%V} %uA\n",
+                        prefix, &labels[i], counters[i].sent);
+    }
+
+    p = ngx_sprintf(p, "# TYPE %s_%s histogram\n", prefix, time);
+
+    for (i = 0; i < n; i++) {
+        count = 0;
+
+        for (k = 0; k < NGX_HTTP_STATUS_BUCKETS; k++) {
+            count += counters[i].buckets[k];
+
+            p = ngx_sprintf(p, "%s_%s_bucket{%V,le=\"%s\"} %uA\n",
+                            prefix, time, &labels[i],
+                            ngx_http_status_buckets[k], count);
+        }
+
+        p = ngx_sprintf(p, "%s_%s_sum{%V} %uA.%03uA\n"
+                           "%s_%s_count{%V} %uA\n",
+                        prefix, time, &labels[i],
+                        counters[i].time / 1000, counters[i].time % 1000,
+                        prefix, time, &labels[i], count);
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_status_event_latency(u_char *p)
+{
+    ngx_uint_t           i, k;
+    ngx_atomic_uint_t    count, bound;
+    ngx_event_latency_t  lt;
+
+    static char  *kinds[] = { "io", "posted", "timer" };
+
+    ngx_memzero(&lt, sizeof(ngx_event_latency_t));
+
+    ngx_event_latency_sum(&lt);
+
+    p = ngx_cpymem(p, "# TYPE nginx_event_handler_duration_seconds histogram\n",
+                   sizeof("# TYPE nginx_event_handler_duration_seconds "
+                          "histogram\n") - 1);
+
+    for (i = 0; i < NGX_EVENT_LATENCY_KINDS; i++) {
+        count = 0;
+
+        for (k = 0; k < NGX_EVENT_LATENCY_BUCKETS; k++) {
+            count += lt.buckets[i][k];
+
+            if (k == NGX_EVENT_LATENCY_BUCKETS - 1) {
+                p = ngx_sprintf(p, "nginx_event_handler_duration_seconds_bucket"
+                                   "{kind=\"%s\",le=\"+Inf\"} %uA\n",
+                                kinds[i], count);
+                break;
+            }
+
+            bound = (ngx_atomic_uint_t) 1 << k;
+
+            p = ngx_sprintf(p, "nginx_event_handler_duration_seconds_bucket"
+                               "{kind=\"%s\",le=\"%uA.%06uA\"} %uA\n",
+                            kinds[i], bound / 1000000, bound % 1000000,
+                            count);
+        }
+
+        p = ngx_sprintf(p, "nginx_event_handler_duration_seconds_sum"
+                           "{kind=\"%s\"} %uA.%06uA\n"
+                           "nginx_event_handler_duration_seconds_count"
+                           "{kind=\"%s\"} %uA\n",
+                        kinds[i], lt.time[i] / 1000000, lt.time[i] % 1000000,
+                        kinds[i], count);
+    }
+
+    p = ngx_cpymem(p, "# TYPE nginx_event_slow_handlers_total counter\n",
+                   sizeof("# TYPE nginx_event_slow_handlers_total counter\n")
+                   - 1);
+
+    for (i = 0; i < NGX_EVENT_LATENCY_KINDS; i++) {
+        p = ngx_sprintf(p, "nginx_event_slow_handlers_total{kind=\"%s\"} %uA\n",
+                        kinds[i], lt.slow[i]);
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_status_escape(u_char *p, ngx_str_t *value)
+{
+    u_char  ch, *s, *last;
+
+    /* a label value may contain backslashes, quotes and line feeds */
+
+    last = value->data + value->len;
+
+    for (s = value->data; s < last; s++) {
+        ch = *s;
+
+        switch (ch) {
+
+        case '\\':
+        case '"':
+            *p++ = '\\';
+            *p++ = ch;
+            break;
+
+        case LF:
+            *p++ = '\\';
+            *p++ = 'n';
+            break;
+
+        default:
+            *p++ = ch;
+            break;
+        }
+    }
+
+    return p;
+}
+
+
+static size_t
+ngx_http_status_shm_shards_size(ngx_cycle_t *cycle)
+{
+    size_t            size;
+    ngx_uint_t        i;
+    ngx_shm_zone_t   *shm_zone;
+    ngx_list_part_t  *part;
+
+    size = 2 * 64;
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        size += shm_zone[i].nshards * 2
+                * (128 + 2 * shm_zone[i].shm.name.len + NGX_INT_T_LEN
+                   + NGX_ATOMIC_T_LEN);
+    }
+
+    return size;
+}
+
+
+static u_char *
+ngx_http_status_shm_shards(u_char *p, ngx_cycle_t *cycle)
+{
+    ngx_uint_t        i, n, k, header;
+    ngx_shm_zone_t   *shm_zone;
+    ngx_shm_shard_t  *shard;
+    ngx_list_part_t  *part;
+
+    static char  *metrics[] = {
+        "# TYPE nginx_shm_zone_lock_acquisitions_total counter\n",
+        "# TYPE nginx_shm_zone_lock_contentions_total counter\n"
+    };
+
+    static char  *names[] = {
+        "nginx_shm_zone_lock_acquisitions_total",
+        "nginx_shm_zone_lock_contentions_total"
+    };
+
+    for (k = 0; k < 2; k++) {
+
+        header = 0;
+
+        part = &cycle->shared_memory.part;
+        shm_zone = part->elts;
+
+        for (i = 0; /* void */ ; i++) {
+
+            if (i >= part->nelts) {
+                if (part->next == NULL) {
+                    break;
+                }
+
+                part = part->next;
+                shm_zone = part->elts;
+                i = 0;
+            }
+
+            for (n = 0; n < shm_zone[i].nshards; n++) {
+
+                if (!header) {
+                    p = ngx_cpymem(p, metrics[k], ngx_strlen(metrics[k]));
+                    header = 1;
+                }
+
+                shard = ngx_shm_shard(&shm_zone[i], n);
+
+                p = ngx_sprintf(p, "%s{zone=\"", names[k]);
+                p = ngx_http_status_escape(p, &shm_zone[i].shm.name);
+                p = ngx_sprintf(p, "\",shard=\"%ui\"} %uA\n",
+                                n, k ? shard->contended : shard->locks);
+            }
+        }
+    }
+
+    return p;
+}
+
+
+#if (NGX_THREADS)
+
+static size_t
+ngx_http_status_thread_pools_size(ngx_cycle_t *cycle)
+{
+    size_t                  size;
+    ngx_uint_t              i;
+    ngx_thread_pool_stat_t  stat;
+
+    size = 4 * 64;
+
+    for (i = 0; ngx_thread_pool_stat(cycle, i, &stat) == NGX_OK; i++) {
+        size += 4 * (128 + 2 * stat.name->len + NGX_INT_T_LEN
+                     + NGX_ATOMIC_T_LEN);
+    }
+
+    return size;
+}
+
+
+static u_char *
+ngx_http_status_thread_pools(u_char *p, ngx_cycle_t *cycle)
+{
+    ngx_uint_t              i, n;
+    ngx_thread_pool_stat_t  stat;
+
+    /* thread pools are per worker process */
+
+    static char  *metrics[] = {
+        "# TYPE nginx_thread_pool_waiting gauge\n",
+        "# TYPE nginx_thread_pool_tasks_total counter\n",
+        "# TYPE nginx_thread_pool_steals_total counter\n",
+        "# TYPE nginx_thread_pool_wait_seconds_total counter\n"
+    };
+
+    static char  *names[] = {
+        "nginx_thread_pool_waiting",
+        "nginx_thread_pool_tasks_total",
+        "nginx_thread_pool_steals_total",
+        "nginx_thread_pool_wait_seconds_total"
+    };
+
+    for (n = 0; n < 4; n++) {
+
+        for (i = 0; ngx_thread_pool_stat(cycle, i, &stat) == NGX_OK; i++) {
+
+            if (i == 0) {
+                p = ngx_cpymem(p, metrics[n], ngx_strlen(metrics[n]));
+            }
+
+            p = ngx_sprintf(p, "%s{pool=\"", names[n]);
+            p = ngx_http_status_escape(p, stat.name);
+            p = ngx_sprintf(p, "\",worker=\"%ui\"} ", ngx_worker);
+
+            switch (n) {
+
+            case 0:
+                p = ngx_sprintf(p, "%ui\n", stat.waiting);
+                break;
+
+            case 1:
+                p = ngx_sprintf(p, "%uA\n", stat.tasks);
+                break;
+
+            case 2:
+                p = ngx_sprintf(p, "%uA\n", stat.steals);
+                break;
+
+            default: /* 3 */
+                p = ngx_sprintf(p, "%uA.%06uA\n",
+                                stat.wait_time / 1000000,
+                                stat.wait_time % 1000000);
+                break;
+            }
+        }
+    }
+
+    return p;
+}
+
+#endif
+
+
+#if (NGX_HTTP_CACHE)
+
+static size_t
+ngx_http_status_caches_size(ngx_cycle_t *cycle)
+{
+    size_t                      size;
+    ngx_uint_t                  i;
+    ngx_http_file_cache_stat_t  stat;
+
+    size = 3 * 64;
+
+    for (i = 0; ngx_http_file_cache_stat(cycle, i, &stat) == NGX_OK; i++) {
+        size += (NGX_HTTP_FILE_CACHE_UNLINK_BUCKETS + 4)
+                * (128 + 2 * stat.name->len + NGX_ATOMIC_T_LEN);
+    }
+
+    return size;
+}
+
+
+static u_char *
+ngx_http_status_caches(u_char *p, ngx_cycle_t *cycle)
+{
+    ngx_uint_t                  i, k;
+    ngx_atomic_uint_t           count, bound;
+    ngx_http_file_cache_stat_t  stat;
+
+    for (i = 0; ngx_http_file_cache_stat(cycle, i, &stat) == NGX_OK; i++) {
+
+        if (i == 0) {
+            p = ngx_cpymem(p, "# TYPE nginx_cache_unlink_backlog gauge\n",
+                           sizeof("# TYPE nginx_cache_unlink_backlog gauge\n")
+                           - 1);
+        }
+
+        p = ngx_sprintf(p, "nginx_cache_unlink_backlog{zone=\"");
+        p = ngx_http_status_escape(p, stat.name);
+        p = ngx_sprintf(p, "\"} %uA\n", stat.backlog);
+    }
+
+    for (i = 0; ngx_http_file_cache_stat(cycle, i, &stat) == NGX_OK; i++) {
+
+        if (i == 0) {
+            p = ngx_cpymem(p, "# TYPE nginx_cache_unlink_backlog_bytes gauge\n",
+                           sizeof("# TYPE nginx_cache_unlink_backlog_bytes "
+                                  "gauge\n") - 1);
+        }
+
+        p = ngx_sprintf(p, "nginx_cache_unlink_backlog_bytes{zone=\"");
+        p = ngx_http_status_escape(p, stat.name);
+        p = ngx_sprintf(p, "\"} %uA\n", stat.backlog_size);
+    }
+
+    for (i = 0; ngx_http_file_cache_stat(cycle, i, &stat) == NGX_OK; i++) {
+
+        if (i == 0) {
+            p = ngx_cpymem(p, "# TYPE nginx_cache_unlink_duration_seconds "
+                              "histogram\n",
+                           sizeof("# TYPE nginx_cache_unlink_duration_seconds "
+                                  "histogram\n") - 1);
+        }
+
+        count = 0;
+
+        for (k = 0; k < NGX_HTTP_FILE_CACHE_UNLINK_BUCKETS; k++) {
+            count += stat.buckets[k];
+
+            p = ngx_sprintf(p, "nginx_cache_unlink_duration_seconds_bucket"
+                               "{zone=\"");
+            p = ngx_http_status_escape(p, stat.name);
+
+            if (k == NGX_HTTP_FILE_CACHE_UNLINK_BUCKETS - 1) {
+                p = ngx_sprintf(p, "\",le=\"+Inf\"} %uA\n", count);
+                break;
+            }
+
+            bound = (ngx_atomic_uint_t) 1 << (2 * k);
+
+            p = ngx_sprintf(p, "\",le=\"%uA.%06uA\"} %uA\n",
+                            bound / 1000000, bound % 1000000, count);
+        }
+
+        p = ngx_sprintf(p, "nginx_cache_unlink_duration_seconds_sum{zone=\"");
+        p = ngx_http_status_escape(p, stat.name);
+        p = ngx_sprintf(p, "\"} %uA.%06uA\n",
+                        stat.unlink_time / 1000000,
+                        stat.unlink_time % 1000000);
+
+        p = ngx_sprintf(p, "nginx_cache_unlink_duration_seconds_count"
+                           "{zone=\"");
+        p = ngx_http_status_escape(p, stat.name);
+        p = ngx_sprintf(p, "\"} %uA\n", count);
+    }
+
+    return p;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_status_log_handler(ngx_http_request_t *r)
+{
+    u_char                       *shard;
+    ngx_int_t                     peer;
+    ngx_uint_t                    i, status;
+    ngx_time_t                   *tp;
+    ngx_msec_int_t                ms;
+    ngx_http_upstream_t          *u;
+    ngx_http_upstream_state_t    *state;
+    ngx_http_status_counters_t   *counters;
+    ngx_http_status_srv_conf_t   *sscf;
+    ngx_http_status_main_conf_t  *smcf;
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_status_module);
+
+    shard = smcf->sh->shards + (ngx_worker % smcf->nshards) * smcf->shard_size;
+    counters = (ngx_http_status_counters_t *) shard;
+
+    sscf = ngx_http_get_module_srv_conf(r, ngx_http_status_module);
+
+    if (sscf->zone != NGX_CONF_UNSET_UINT) {
+
+        if (r->err_status) {
+            status = r->err_status;
+
+        } else {
+            status = r->headers_out.status;
+        }
+
+        tp = ngx_timeofday();
+
+        ms = (ngx_msec_int_t)
+                 ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+
+        ngx_http_status_count(&counters[sscf->zone], status,
+                              r->request_length, r->connection->sent, ms);
+    }
+
+    u = r->upstream;
+
+    if (u == NULL || u->upstream == NULL || u->upstream->srv_conf == NULL
+        || r->upstream_states == NULL)
+    {
+        return NGX_OK;
+    }
+
+    sscf = ngx_http_conf_upstream_srv_conf(u->upstream, ngx_http_status_module);
+
+    if (sscf->upstream == NGX_CONF_UNSET_UINT) {
+        return NGX_OK;
+    }
+
+    state = r->upstream_states->elts;
+
+    for (i = 0; i < r->upstream_states->nelts; i++) {
+
+        if (state[i].peer == NULL) {
+            continue;
+        }
+
+        peer = ngx_http_status_upstream_peer(u->upstream, state[i].peer);
+
+        if (peer == NGX_ERROR || sscf->upstream + peer >= smcf->ncounters) {
+            continue;
+        }
+
+        ngx_http_status_count(&counters[sscf->upstream + peer],
+                              state[i].status, state[i].bytes_received,
+                              state[i].bytes_sent,
+                              state[i].response_time == (ngx_msec_t) -1
+                              ? -1 : (ngx_msec_int_t) state[i].response_time);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_status_count(ngx_http_status_counters_t *counters, ngx_uint_t status,
+    off_t received, off_t sent, ngx_msec_int_t ms)
+{
+    ngx_uint_t  n;
+
+    (void) ngx_atomic_fetch_add(&counters->requests, 1);
+    (void) ngx_atomic_fetch_add(&counters->received, received);
+    (void) ngx_atomic_fetch_add(&counters->sent, sent);
+
+    if (status >= 100 && status < 600) {
+        (void) ngx_atomic_fetch_add(&counters->responses[status / 100 - 1], 1);
+    }
+
+    if (ms < 0) {
+        return;
+    }
+
+    for (n = 0; n < NGX_HTTP_STATUS_BUCKETS - 1; n++) {
+        if (ms <= (ngx_msec_int_t) 1 << n) {
+            break;
+        }
+    }
+
+    (void) ngx_atomic_fetch_add(&counters->time, ms);
+    (void) ngx_atomic_fetch_add(&counters->buckets[n], 1);
+}
+
+
+static ngx_int_t
+ngx_http_status_upstream_peer(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_str_t *name)
+{
+    ngx_int_t                      n;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    /* the state keeps a pointer to the name of the round robin peer */
+
+    n = 0;
+
+    for (peers = uscf->peer.data; peers; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            if (&peer->name == name) {
+                return n;
+            }
+
+            n++;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_status_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_status_main_conf_t  *osmcf = data;
+
+    size_t                        size;
+    ngx_http_status_main_conf_t  *smcf;
+
+    smcf = shm_zone->data;
+
+    /* the core configuration is complete by now */
+
+    smcf->nshards = ngx_min((ngx_uint_t) smcf->ccf->worker_processes,
+                            smcf->max_shards);
+
+    if (smcf->nshards == 0) {
+        smcf->nshards = 1;
+    }
+
+    size = smcf->max_shards * smcf->shard_size;
+
+    if (osmcf) {
+        smcf->sh = osmcf->sh;
+        smcf->shpool = osmcf->shpool;
+
+        /* the counters are kept if servers, peers and shards are the same */
+
+        if (smcf->sh->layout != smcf->layout
+            || smcf->sh->nshards != smcf->nshards)
+        {
+            ngx_memzero(smcf->sh->shards, size);
+            smcf->sh->layout = smcf->layout;
+            smcf->sh->nshards = smcf->nshards;
+        }
+
+        return NGX_OK;
+    }
+
+    smcf->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        smcf->sh = smcf->shpool->data;
+        return NGX_OK;
+    }
+
+    smcf->sh = ngx_slab_alloc(smcf->shpool, sizeof(ngx_http_status_shctx_t));
+    if (smcf->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    smcf->shpool->data = smcf->sh;
+
+    /* a slab chunk is aligned to its size, and a page to the page size */
+
+    smcf->sh->shards = ngx_slab_calloc(smcf->shpool, size);
+    if (smcf->sh->shards == NULL) {
+        return NGX_ERROR;
+    }
+
+    smcf->sh->layout = smcf->layout;
+    smcf->sh->nshards = smcf->nshards;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_status_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_status_main_conf_t  *smcf;
+
+    smcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_status_main_conf_t));
+    if (smcf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     smcf->ncounters = 0;
+     *     smcf->sh = NULL;
+     *     smcf->shm_zone = NULL;
+     */
+
+    if (ngx_array_init(&smcf->zones, cf->pool, 4, sizeof(ngx_str_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return smcf;
+}
+
+
+static void *
+ngx_http_status_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_http_status_srv_conf_t  *sscf;
+
+    sscf = ngx_palloc(cf->pool, sizeof(ngx_http_status_srv_conf_t));
+    if (sscf == NULL) {
+        return NULL;
+    }
+
+    sscf->zone = NGX_CONF_UNSET_UINT;
+    sscf->upstream = NGX_CONF_UNSET_UINT;
+
+    return sscf;
+}
+
+
+static char *
+ngx_http_status_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_status_srv_conf_t *sscf = conf;
+
+    ngx_str_t                    *value, *zone;
+    ngx_uint_t                    i;
+    ngx_http_status_main_conf_t  *smcf;
+
+    if (sscf->zone != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_status_module);
+
+    zone = smcf->zones.elts;
+
+    for (i = 0; i < smcf->zones.nelts; i++) {
+        if (zone[i].len == value[1].len
+            && ngx_strncmp(zone[i].data, value[1].data, value[1].len) == 0)
+        {
+            sscf->zone = i;
+            return NGX_CONF_OK;
+        }
+    }
+
+    zone = ngx_array_push(&smcf->zones);
+    if (zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *zone = value[1];
+
+    sscf->zone = i;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_status_prometheus(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_status_init(ngx_conf_t *cf)
+{
+    size_t                          size;
+    uint32_t                        layout;
+    ngx_str_t                      *zone, name;
+    ngx_uint_t                      i, n;
+    ngx_core_conf_t                *ccf;
+    ngx_http_handler_pt            *h;
+    ngx_http_core_main_conf_t      *cmcf;
+    ngx_http_upstream_rr_peer_t    *peer;
+    ngx_http_upstream_rr_peers_t   *peers;
+    ngx_http_status_srv_conf_t     *sscf;
+    ngx_http_status_main_conf_t    *smcf;
+    ngx_http_upstream_srv_conf_t  **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_status_module);
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    ngx_crc32_init(layout);
+
+    zone = smcf->zones.elts;
+
+    for (i = 0; i < smcf->zones.nelts; i++) {
+        ngx_crc32_update(&layout, zone[i].data, zone[i].len);
+    }
+
+    n = smcf->zones.nelts;
+
+    /* the peers of upstream blocks are counted in the configuration order */
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL || uscfp[i]->peer.data == NULL) {
+            continue;
+        }
+
+        sscf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                               ngx_http_status_module);
+        sscf->upstream = n;
+
+        ngx_crc32_update(&layout, uscfp[i]->host.data, uscfp[i]->host.len);
+
+        for (peers = uscfp[i]->peer.data; peers; peers = peers->next) {
+            for (peer = peers->peer; peer; peer = peer->next) {
+                ngx_crc32_update(&layout, peer->name.data, peer->name.len);
+                n++;
+            }
+        }
+    }
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    /*
+     * worker_processes may be specified after the http block, so the zone
+     * is sized for the number of CPUs then, and the number of shards used
+     * is resolved when the zone is initialized
+     */
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                           ngx_core_module);
+
+    smcf->ccf = ccf;
+    smcf->ncounters = n;
+    smcf->max_shards = (ccf->worker_processes == NGX_CONF_UNSET)
+                       ? ngx_ncpu : ccf->worker_processes;
+
+    if (smcf->max_shards == 0) {
+        smcf->max_shards = 1;
+    }
+
+    smcf->shard_size = ngx_align(n * sizeof(ngx_http_status_counters_t),
+                                 NGX_HTTP_STATUS_SHARD_ALIGN);
+
+    ngx_crc32_final(layout);
+
+    smcf->layout = layout;
+
+    size = smcf->max_shards * smcf->shard_size;
+    size += size / 64 + 8 * ngx_pagesize;
+
+    ngx_str_set(&name, "ngx_http_status");
+
+    smcf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                           &ngx_http_status_module);
+    if (smcf->shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    smcf->shm_zone->init = ngx_http_status_init_zone;
+    smcf->shm_zone->data = smcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_status_log_handler;
+
+    return NGX_OK;
+}
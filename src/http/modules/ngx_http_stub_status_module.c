@@ -116,13 +116,13 @@ ngx_http_stub_status_handler(ngx_http_request_t *r)
     out.buf = b;
     out.next = NULL;
 
-    ap = *ngx_stat_accepted;
-    hn = *ngx_stat_handled;
-    ac = *ngx_stat_active;
-    rq = *ngx_stat_requests;
-    rd = *ngx_stat_reading;
-    wr = *ngx_stat_writing;
-    wa = *ngx_stat_waiting;
+    ap = ngx_stat_sum(ngx_stat_accepted);
+    hn = ngx_stat_sum(ngx_stat_handled);
+    ac = ngx_stat_sum(ngx_stat_active);
+    rq = ngx_stat_sum(ngx_stat_requests);
+    rd = ngx_stat_sum(ngx_stat_reading);
+    wr = ngx_stat_sum(ngx_stat_writing);
+    wa = ngx_stat_sum(ngx_stat_waiting);
 
     b->last = ngx_sprintf(b->last, "Active connections: %uA \n", ac);
 
@@ -164,19 +164,19 @@ ngx_http_stub_status_variable(ngx_http_request_t *r,
 
     switch (data) {
     case 0:
-        value = *ngx_stat_active;
+        value = ngx_stat_sum(ngx_stat_active);
         break;
 
     case 1:
-        value = *ngx_stat_reading;
+        value = ngx_stat_sum(ngx_stat_reading);
         break;
 
     case 2:
-        value = *ngx_stat_writing;
+        value = ngx_stat_sum(ngx_stat_writing);
         break;
 
     case 3:
-        value = *ngx_stat_waiting;
+        value = ngx_stat_sum(ngx_stat_waiting);
         break;
 
     /* suppress warning */
@@ -28,6 +28,14 @@
 #define NGX_HTTP_CACHE_VARY_LEN      128
 
 #define NGX_HTTP_CACHE_VERSION       5
+#define NGX_HTTP_CACHE_XXH3_VERSION  6
+
+#define NGX_HTTP_CACHE_KEY_MD5       0
+#define NGX_HTTP_CACHE_KEY_XXH3      1
+
+/* unlink time buckets: up to 1, 4, 16, ..., 1048576 us, and +Inf */
+
+#define NGX_HTTP_FILE_CACHE_UNLINK_BUCKETS  12
 
 
 typedef struct {
@@ -36,6 +44,10 @@ typedef struct {
 } ngx_http_cache_valid_t;
 
 
+typedef struct ngx_http_file_cache_object_s  ngx_http_file_cache_object_t;
+typedef struct ngx_http_file_cache_snapshot_s  ngx_http_file_cache_snapshot_t;
+
+
 typedef struct {
     ngx_rbtree_node_t                node;
     ngx_queue_t                      queue;
@@ -51,7 +63,11 @@ typedef struct {
     unsigned                         updating:1;
     unsigned                         deleting:1;
     unsigned                         purged:1;
-                                     /* 10 unused bits */
+    unsigned                         referenced:1;
+    unsigned                         unverified:1;
+    unsigned                         unlinking:1;
+    unsigned                         unlink_tag:5;
+                                     /* 2 unused bits */
 
     ngx_file_uniq_t                  uniq;
     time_t                           expire;
@@ -59,9 +75,35 @@ typedef struct {
     size_t                           body_start;
     off_t                            fs_size;
     ngx_msec_t                       lock_time;
+    ngx_http_file_cache_object_t    *object;
 } ngx_http_file_cache_node_t;
 
 
+struct ngx_http_file_cache_object_s {
+    ngx_queue_t                      queue;
+    ngx_http_file_cache_node_t      *node;
+    ngx_atomic_t                     count;
+    size_t                           length;
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_uint_t                       referenced;
+                                     /* unsigned referenced:1 */
+};
+
+
+typedef struct {
+    ngx_queue_t                      queue;
+    ngx_atomic_t                     count;
+    off_t                            written;
+    ngx_pid_t                        pid;
+    ngx_msec_t                       lock_time;
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    unsigned                         done:1;
+    unsigned                         failed:1;
+    unsigned                         detached:1;
+    u_char                           name[1];
+} ngx_http_file_cache_fill_t;
+
+
 struct ngx_http_cache_s {
     ngx_file_t                       file;
     ngx_array_t                      keys;
@@ -95,6 +137,12 @@ struct ngx_http_cache_s {
 
     ngx_http_file_cache_t           *file_cache;
     ngx_http_file_cache_node_t      *node;
+    ngx_http_file_cache_object_t    *object;
+    ngx_http_file_cache_fill_t      *fill;
+
+    ngx_queue_t                      queue;
+    ngx_chain_t                     *free;
+    ngx_chain_t                     *busy;
 
 #if (NGX_THREADS || NGX_COMPAT)
     ngx_thread_task_t               *thread_task;
@@ -122,6 +170,9 @@ struct ngx_http_cache_s {
 
     unsigned                         stale_updating:1;
     unsigned                         stale_error:1;
+
+    unsigned                         stream:1;
+    unsigned                         notify:1;
 };
 
 
@@ -148,14 +199,51 @@ typedef struct {
     ngx_rbtree_t                     rbtree;
     ngx_rbtree_node_t                sentinel;
     ngx_queue_t                      queue;
+    ngx_queue_t                      fills;
+    ngx_atomic_t                     generation;
+} ngx_http_file_cache_shard_t;
+
+
+typedef struct {
     ngx_atomic_t                     cold;
     ngx_atomic_t                     loading;
-    off_t                            size;
-    ngx_uint_t                       count;
+    ngx_atomic_t                     size;
+    ngx_atomic_t                     count;
     ngx_uint_t                       watermark;
+    u_char                          *shards;
+    time_t                           snapshot;
+    ngx_uint_t                       unverified;
+    ngx_atomic_t                     restoring;
+
+    ngx_shmtx_sh_t                   memory_lock;
+    ngx_shmtx_t                      memory_mutex;
+    ngx_queue_t                      memory;
+    ngx_atomic_t                     memory_size;
+    ngx_atomic_t                     samples;
+    ngx_uint_t                       sketch_mask;
+    u_char                          *sketch;
+
+    ngx_atomic_t                     unlinker;
+    ngx_atomic_t                     unlink_generation;
+    ngx_atomic_t                     unlink_heartbeat;
+    ngx_atomic_t                     unlink_backlog;
+    ngx_atomic_t                     unlink_backlog_size;
+    ngx_atomic_t                     unlink_time;
+    ngx_atomic_t                     unlink_buckets[
+                                         NGX_HTTP_FILE_CACHE_UNLINK_BUCKETS];
 } ngx_http_file_cache_sh_t;
 
 
+typedef struct {
+    ngx_str_t                       *name;
+    ngx_atomic_uint_t                backlog;
+    ngx_atomic_uint_t                backlog_size;
+    ngx_atomic_uint_t                unlink_time;      /* microseconds */
+    ngx_atomic_uint_t                buckets[
+                                         NGX_HTTP_FILE_CACHE_UNLINK_BUCKETS];
+} ngx_http_file_cache_stat_t;
+
+
 struct ngx_http_file_cache_s {
     ngx_http_file_cache_sh_t        *sh;
     ngx_slab_pool_t                 *shpool;
@@ -181,6 +269,32 @@ struct ngx_http_file_cache_s {
     ngx_msec_t                       manager_threshold;
 
     ngx_shm_zone_t                  *shm_zone;
+    ngx_uint_t                       nshards;
+    ngx_uint_t                       shard;
+
+    time_t                           snapshot;
+    ngx_str_t                        snapshot_name;
+    ngx_str_t                        snapshot_temp;
+    ngx_http_file_cache_snapshot_t  *snapshot_state;
+    u_char                          *unmodified;
+
+    size_t                           memory;
+    size_t                           memory_max_object;
+
+    ngx_queue_t                      waiters;
+    ngx_event_t                      notify;
+    ngx_atomic_uint_t               *generations;
+
+    ngx_uint_t                       key_hash;
+    ngx_uint_t                       version;
+
+#if (NGX_THREADS)
+    ngx_thread_pool_t               *thread_pool;
+    ngx_thread_task_t               *unlink;
+#endif
+    ngx_uint_t                       unlinking;
+    off_t                            unlink_size;
+    ngx_uint_t                       unlink_generation;
 
     ngx_uint_t                       use_temp_path;
                                      /* unsigned use_temp_path:1 */
@@ -194,10 +308,14 @@ ngx_int_t ngx_http_file_cache_open(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
 void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
 void ngx_http_file_cache_update_header(ngx_http_request_t *r);
+void ngx_http_file_cache_fill(ngx_http_request_t *r, ngx_temp_file_t *tf);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
 void ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf);
 time_t ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status);
 
+ngx_int_t ngx_http_file_cache_stat(ngx_cycle_t *cycle, ngx_uint_t n,
+    ngx_http_file_cache_stat_t *stat);
+
 char *ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 char *ngx_http_file_cache_valid_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
@@ -402,6 +402,24 @@ static ngx_command_t  ngx_http_core_commands[] = {
       offsetof(ngx_http_core_loc_conf_t, sendfile_max_chunk),
       NULL },
 
+#if (NGX_HAVE_MSG_ZEROCOPY)
+
+    { ngx_string("zerocopy"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_core_loc_conf_t, zerocopy),
+      NULL },
+
+    { ngx_string("zerocopy_min_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_core_loc_conf_t, zerocopy_min_size),
+      NULL },
+
+#endif
+
     { ngx_string("subrequest_output_buffer_size"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_size_slot,
@@ -1322,6 +1340,13 @@ ngx_http_update_location_config(ngx_http_request_t *r)
         r->connection->sendfile = 0;
     }
 
+#if (NGX_HAVE_MSG_ZEROCOPY)
+    if (clcf->zerocopy || r->connection->zerocopy) {
+        (void) ngx_linux_zerocopy(r->connection,
+                                  clcf->zerocopy ? clcf->zerocopy_min_size : 0);
+    }
+#endif
+
     if (clcf->client_body_in_file_only) {
         r->request_body_in_file_only = 1;
         r->request_body_in_persistent_file = 1;
@@ -3496,6 +3521,10 @@ ngx_http_core_create_loc_conf(ngx_conf_t *cf)
     clcf->internal = NGX_CONF_UNSET;
     clcf->sendfile = NGX_CONF_UNSET;
     clcf->sendfile_max_chunk = NGX_CONF_UNSET_SIZE;
+#if (NGX_HAVE_MSG_ZEROCOPY)
+    clcf->zerocopy = NGX_CONF_UNSET;
+    clcf->zerocopy_min_size = NGX_CONF_UNSET_SIZE;
+#endif
     clcf->subrequest_output_buffer_size = NGX_CONF_UNSET_SIZE;
     clcf->aio = NGX_CONF_UNSET;
     clcf->aio_write = NGX_CONF_UNSET;
@@ -3721,6 +3750,17 @@ ngx_http_core_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->sendfile, prev->sendfile, 0);
     ngx_conf_merge_size_value(conf->sendfile_max_chunk,
                               prev->sendfile_max_chunk, 2 * 1024 * 1024);
+#if (NGX_HAVE_MSG_ZEROCOPY)
+    ngx_conf_merge_value(conf->zerocopy, prev->zerocopy, 0);
+    ngx_conf_merge_size_value(conf->zerocopy_min_size,
+                              prev->zerocopy_min_size, 16384);
+
+    if (conf->zerocopy_min_size == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"zerocopy_min_size\" must not be zero");
+        return NGX_CONF_ERROR;
+    }
+#endif
     ngx_conf_merge_size_value(conf->subrequest_output_buffer_size,
                               prev->subrequest_output_buffer_size,
                               (size_t) ngx_pagesize);
@@ -422,6 +422,11 @@ struct ngx_http_core_loc_conf_s {
     ngx_http_complex_value_t  *thread_pool_value;
 #endif
 
+#if (NGX_HAVE_MSG_ZEROCOPY)
+    ngx_flag_t    zerocopy;                /* zerocopy */
+    size_t        zerocopy_min_size;       /* zerocopy_min_size */
+#endif
+
 #if (NGX_HAVE_OPENAT)
     ngx_uint_t    disable_symlinks;        /* disable_symlinks */
     ngx_http_complex_value_t  *disable_symlinks_from;
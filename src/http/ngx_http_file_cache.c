@@ -9,6 +9,132 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 #include <ngx_md5.h>
+#include <ngx_xxh3.h>
+
+
+/*
+ * the snapshot of the keys zone consists of a header and blocks of entries,
+ * each block has its own checksum
+ */
+
+#define NGX_HTTP_FILE_CACHE_SNAPSHOT_MAGIC    0x53434e4e
+#define NGX_HTTP_FILE_CACHE_SNAPSHOT_VERSION  1
+#define NGX_HTTP_FILE_CACHE_SNAPSHOT_BLOCK    1024
+
+
+typedef struct {
+    uint32_t                         magic;
+    uint32_t                         version;
+    uint32_t                         entry_size;
+    uint32_t                         crc32;
+    uint64_t                         bsize;
+    uint64_t                         time;
+} ngx_http_file_cache_snapshot_header_t;
+
+
+typedef struct {
+    uint32_t                         entries;
+    uint32_t                         crc32;
+} ngx_http_file_cache_snapshot_block_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_file_uniq_t                  uniq;
+    time_t                           expire;
+    off_t                            fs_size;
+    size_t                           body_start;
+} ngx_http_file_cache_snapshot_entry_t;
+
+
+/*
+ * the cache manager restores and writes the snapshot in slices
+ * between its runs, the state is kept in the process
+ */
+
+struct ngx_http_file_cache_snapshot_s {
+    ngx_file_t                       file;
+    u_char                          *buf;
+    off_t                            offset;
+    time_t                           time;
+    ngx_uint_t                       entries;
+    ngx_uint_t                       shard;
+    ngx_uint_t                       next;     /* unsigned  next:1; */
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+};
+
+
+typedef struct {
+    ngx_uint_t                       type;
+
+    union {
+        ngx_md5_t                    md5;
+        ngx_xxh3_t                   xxh3;
+    } u;
+} ngx_http_file_cache_hash_t;
+
+
+/*
+ * the cache manager may delete evicted files in batches in a thread pool,
+ * the files are accounted in the cache size until they are deleted
+ */
+
+#define NGX_HTTP_FILE_CACHE_UNLINK_BATCH      64
+#define NGX_HTTP_FILE_CACHE_UNLINK_BACKLOG    1024
+
+
+/*
+ * the owner of the deletion in threads is replaced if it did not queue
+ * files for the stale time, in seconds, as its pid may have been reused;
+ * the nodes queued are tagged with the low bits of its generation
+ */
+
+#define NGX_HTTP_FILE_CACHE_UNLINK_STALE      60
+
+#define ngx_http_file_cache_unlink_tag(generation)  ((generation) & 0x1f)
+
+
+/*
+ * forced expiration also runs in workers when a node cannot be allocated,
+ * so a call gives a second chance to a limited number of referenced nodes
+ */
+
+#define NGX_HTTP_FILE_CACHE_FORCED_NODES      128
+
+
+/* the interval to check that the worker writing a streamed response lives */
+
+#define NGX_HTTP_FILE_CACHE_FILL_CHECK        1000
+
+
+/* the number of objects in memory evicted to allocate a node */
+
+#define NGX_HTTP_FILE_CACHE_MEMORY_SHRINK     16
+
+
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_http_file_cache_node_t      *node;
+    ngx_shm_shard_t                 *shard;
+    u_char                          *name;
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_file_uniq_t                  uniq;
+    off_t                            fs_size;
+    uint64_t                         time;
+    ngx_err_t                        err;
+    ngx_uint_t                       tag;
+    ngx_uint_t                       unverified;  /* unsigned unverified:1; */
+} ngx_http_file_cache_unlink_file_t;
+
+
+typedef struct {
+    ngx_http_file_cache_t           *cache;
+    ngx_uint_t                       nfiles;
+    ngx_http_file_cache_unlink_file_t  files[NGX_HTTP_FILE_CACHE_UNLINK_BATCH];
+} ngx_http_file_cache_unlink_t;
+
+#endif
 
 
 static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
@@ -18,6 +144,27 @@ static void ngx_http_file_cache_lock_wait(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_stream_open(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_stream_wait_handler(ngx_event_t *ev);
+static void ngx_http_file_cache_stream(ngx_http_request_t *r);
+static void ngx_http_file_cache_stream_finalize(ngx_http_request_t *r,
+    ngx_int_t rc);
+static ngx_http_file_cache_fill_t *ngx_http_file_cache_fill_lookup(
+    ngx_http_file_cache_t *cache, ngx_http_file_cache_shard_t *fcs,
+    u_char *key, ngx_msec_t lock_time, ngx_uint_t *dead);
+static ngx_uint_t ngx_http_file_cache_fill_dead(
+    ngx_http_file_cache_fill_t *fill);
+static void ngx_http_file_cache_fill_reap(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_fill_t *fill);
+static ngx_int_t ngx_http_file_cache_fill_check(ngx_http_cache_t *c);
+static void ngx_http_file_cache_fill_release(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_fill_t *fill);
+static void ngx_http_file_cache_wait(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_notify(ngx_http_file_cache_t *cache,
+    u_char *key);
+static void ngx_http_file_cache_notify_handler(ngx_event_t *ev);
 static ssize_t ngx_http_file_cache_aio_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 #if (NGX_HAVE_FILE_AIO)
@@ -33,13 +180,19 @@ static ngx_int_t ngx_http_file_cache_exists(ngx_http_file_cache_t *cache,
 static ngx_int_t ngx_http_file_cache_name(ngx_http_request_t *r,
     ngx_path_t *path);
 static ngx_http_file_cache_node_t *
-    ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key);
+    ngx_http_file_cache_lookup(ngx_http_file_cache_shard_t *fcs, u_char *key);
 static void ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 static void ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary,
     size_t len, u_char *hash);
 static void ngx_http_file_cache_vary_header(ngx_http_request_t *r,
-    ngx_md5_t *md5, ngx_str_t *name);
+    ngx_http_file_cache_hash_t *hash, ngx_str_t *name);
+static ngx_inline void ngx_http_file_cache_hash_init(
+    ngx_http_file_cache_hash_t *hash, ngx_uint_t type);
+static ngx_inline void ngx_http_file_cache_hash_update(
+    ngx_http_file_cache_hash_t *hash, u_char *data, size_t len);
+static ngx_inline void ngx_http_file_cache_hash_final(
+    ngx_http_file_cache_hash_t *hash, u_char *result);
 static ngx_int_t ngx_http_file_cache_reopen(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
@@ -47,8 +200,22 @@ static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
 static void ngx_http_file_cache_cleanup(void *data);
 static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
+static time_t ngx_http_file_cache_expire_shard(ngx_http_file_cache_t *cache,
+    ngx_shm_shard_t *shard, u_char *name, time_t now);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
-    ngx_queue_t *q, u_char *name);
+    ngx_shm_shard_t *shard, ngx_queue_t *q, u_char *name);
+static void ngx_http_file_cache_unlink_stat(ngx_http_file_cache_t *cache,
+    uint64_t time);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_file_cache_unlink_add(ngx_http_file_cache_t *cache,
+    ngx_shm_shard_t *shard, ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_unlink_post(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_unlink_handler(void *data, ngx_log_t *log);
+static void ngx_http_file_cache_unlink_event_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_file_cache_unlink_own(ngx_http_file_cache_t *cache);
+#endif
+static ngx_uint_t ngx_http_file_cache_unlinking(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
 static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache);
 static ngx_int_t ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
@@ -63,6 +230,32 @@ static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static void ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_snapshot_load(
+    ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_snapshot_add(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_snapshot_entry_t *entry);
+static ngx_int_t ngx_http_file_cache_snapshot_write(
+    ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_snapshot_close(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_snapshot_verify(ngx_http_file_cache_t *cache);
+static ngx_rbtree_node_t *
+    ngx_http_file_cache_snapshot_next(ngx_http_file_cache_shard_t *fcs,
+    u_char *key);
+static ngx_uint_t ngx_http_file_cache_snapshot_dir(ngx_http_file_cache_t *cache,
+    u_char *key);
+static ngx_int_t ngx_http_file_cache_memory_init(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_memory_count(ngx_http_file_cache_t *cache,
+    u_char *key);
+static ngx_uint_t ngx_http_file_cache_memory_frequency(
+    ngx_http_file_cache_t *cache, u_char *key);
+static void ngx_http_file_cache_memory_admit(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
+static ngx_uint_t ngx_http_file_cache_memory_shrink(
+    ngx_http_file_cache_t *cache, ngx_shm_shard_t *shard);
+static void ngx_http_file_cache_memory_drop(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static void ngx_http_file_cache_memory_release(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_object_t *obj);
 
 
 ngx_str_t  ngx_http_cache_status[] = {
@@ -79,14 +272,29 @@ ngx_str_t  ngx_http_cache_status[] = {
 static u_char  ngx_http_file_cache_key[] = { LF, 'K', 'E', 'Y', ':', ' ' };
 
 
+/*
+ * the keys zone index is split into shards by the node key, each shard
+ * has its own rbtree, inactive queue and lock; the total size and number
+ * of nodes are updated atomically
+ */
+
+#define ngx_http_file_cache_shard(cache, key)                                 \
+    ngx_shm_shard((cache)->shm_zone, (key) % (cache)->nshards)
+
+#define ngx_http_file_cache_shard_data(shard)                                 \
+    ((ngx_http_file_cache_shard_t *) ngx_shm_shard_data(shard))
+
+
 static ngx_int_t
 ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_file_cache_t  *ocache = data;
 
-    size_t                  len;
-    ngx_uint_t              n;
-    ngx_http_file_cache_t  *cache;
+    size_t                        len;
+    u_char                       *shards;
+    ngx_uint_t                    n;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *fcs;
 
     cache = shm_zone->data;
 
@@ -110,13 +318,32 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             }
         }
 
+        if (cache->nshards != ocache->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "cache \"%V\" uses %ui shards "
+                          "while previously it used %ui shards",
+                          &shm_zone->shm.name, cache->nshards,
+                          ocache->nshards);
+            return NGX_ERROR;
+        }
+
         cache->sh = ocache->sh;
 
         cache->shpool = ocache->shpool;
         cache->bsize = ocache->bsize;
 
+        (void) ngx_shm_shards_init(shm_zone, cache->nshards,
+                                   sizeof(ngx_http_file_cache_shard_t),
+                                   cache->sh->shards);
+
         cache->max_size /= cache->bsize;
 
+        if (cache->memory && cache->sh->sketch == NULL) {
+            if (ngx_http_file_cache_memory_init(cache) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
         if (!cache->sh->cold || cache->sh->loading) {
             cache->path->loader = NULL;
         }
@@ -128,6 +355,11 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     if (shm_zone->shm.exists) {
         cache->sh = cache->shpool->data;
+
+        (void) ngx_shm_shards_init(shm_zone, cache->nshards,
+                                   sizeof(ngx_http_file_cache_shard_t),
+                                   cache->sh->shards);
+
         cache->bsize = ngx_fs_bsize(cache->path->name.data);
         cache->max_size /= cache->bsize;
 
@@ -141,16 +373,65 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     cache->shpool->data = cache->sh;
 
-    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
-                    ngx_http_file_cache_rbtree_insert_value);
+    shards = ngx_shm_shards_init(shm_zone, cache->nshards,
+                                 sizeof(ngx_http_file_cache_shard_t), NULL);
+    if (shards == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->sh->shards = shards;
+
+    for (n = 0; n < cache->nshards; n++) {
+        fcs = ngx_http_file_cache_shard_data(ngx_shm_shard(shm_zone, n));
+
+        ngx_rbtree_init(&fcs->rbtree, &fcs->sentinel,
+                        ngx_http_file_cache_rbtree_insert_value);
 
-    ngx_queue_init(&cache->sh->queue);
+        ngx_queue_init(&fcs->queue);
+        ngx_queue_init(&fcs->fills);
+        fcs->generation = 0;
+    }
 
     cache->sh->cold = 1;
     cache->sh->loading = 0;
     cache->sh->size = 0;
     cache->sh->count = 0;
     cache->sh->watermark = (ngx_uint_t) -1;
+    cache->sh->snapshot = 0;
+    cache->sh->unverified = 0;
+    cache->sh->restoring = cache->snapshot ? 1 : 0;
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    if (ngx_shmtx_create(&cache->sh->memory_mutex, &cache->sh->memory_lock,
+                         NULL)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+#endif
+
+    ngx_queue_init(&cache->sh->memory);
+    cache->sh->memory_size = 0;
+    cache->sh->sketch = NULL;
+
+    cache->sh->unlinker = 0;
+    cache->sh->unlink_generation = 0;
+    cache->sh->unlink_heartbeat = 0;
+    cache->sh->unlink_backlog = 0;
+    cache->sh->unlink_backlog_size = 0;
+    cache->sh->unlink_time = 0;
+
+    for (n = 0; n < NGX_HTTP_FILE_CACHE_UNLINK_BUCKETS; n++) {
+        cache->sh->unlink_buckets[n] = 0;
+    }
+
+    if (cache->memory) {
+        if (ngx_http_file_cache_memory_init(cache) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
 
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
 
@@ -227,18 +508,19 @@ ngx_http_file_cache_create(ngx_http_request_t *r)
 void
 ngx_http_file_cache_create_key(ngx_http_request_t *r)
 {
-    size_t             len;
-    ngx_str_t         *key;
-    ngx_uint_t         i;
-    ngx_md5_t          md5;
-    ngx_http_cache_t  *c;
+    size_t                       len;
+    ngx_str_t                   *key;
+    ngx_uint_t                   i, md5;
+    ngx_http_cache_t            *c;
+    ngx_http_file_cache_hash_t   hash;
 
     c = r->cache;
 
     len = 0;
+    md5 = (c->file_cache->key_hash == NGX_HTTP_CACHE_KEY_MD5);
 
     ngx_crc32_init(c->crc32);
-    ngx_md5_init(&md5);
+    ngx_http_file_cache_hash_init(&hash, c->file_cache->key_hash);
 
     key = c->keys.elts;
     for (i = 0; i < c->keys.nelts; i++) {
@@ -247,15 +529,33 @@ ngx_http_file_cache_create_key(ngx_http_request_t *r)
 
         len += key[i].len;
 
-        ngx_crc32_update(&c->crc32, key[i].data, key[i].len);
-        ngx_md5_update(&md5, key[i].data, key[i].len);
+        if (md5) {
+            ngx_crc32_update(&c->crc32, key[i].data, key[i].len);
+        }
+
+        ngx_http_file_cache_hash_update(&hash, key[i].data, key[i].len);
     }
 
     c->header_start = sizeof(ngx_http_file_cache_header_t)
                       + sizeof(ngx_http_file_cache_key) + len + 1;
 
-    ngx_crc32_final(c->crc32);
-    ngx_md5_final(c->key, &md5);
+    ngx_http_file_cache_hash_final(&hash, c->key);
+
+    if (md5) {
+        ngx_crc32_final(c->crc32);
+
+    } else {
+
+        /*
+         * the keys are compared in full on open, so the header checksum
+         * is taken from the 128-bit hash rather than computed separately
+         */
+
+        c->crc32 = ((uint32_t) c->key[12] << 24)
+                   | ((uint32_t) c->key[13] << 16)
+                   | ((uint32_t) c->key[14] << 8)
+                   | (uint32_t) c->key[15];
+    }
 
     ngx_memcpy(c->main, c->key, NGX_HTTP_CACHE_KEY_LEN);
 }
@@ -264,6 +564,7 @@ ngx_http_file_cache_create_key(ngx_http_request_t *r)
 ngx_int_t
 ngx_http_file_cache_open(ngx_http_request_t *r)
 {
+    size_t                     size;
     ngx_int_t                  rc, rv;
     ngx_uint_t                 test;
     ngx_http_cache_t          *c;
@@ -282,6 +583,14 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         return ngx_http_file_cache_read(r, c);
     }
 
+    if (c->stream) {
+        rc = ngx_http_file_cache_stream_open(r, c);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
     cache = c->file_cache;
 
     if (c->node == NULL) {
@@ -345,6 +654,20 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         goto done;
     }
 
+    if (c->object) {
+
+        /* the object is served from memory, no file is opened */
+
+        c->length = c->object->length;
+
+        c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+        if (c->buf == NULL) {
+            return NGX_ERROR;
+        }
+
+        return ngx_http_file_cache_read(r, c);
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
@@ -384,7 +707,21 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
     c->length = of.size;
     c->fs_size = (of.fs_size + cache->bsize - 1) / cache->bsize;
 
-    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    /*
+     * a small file is read as a whole to be admitted to memory,
+     * its body is then sent from the buffer
+     */
+
+    size = c->body_start;
+
+    if (cache->memory
+        && of.size > (off_t) size
+        && of.size <= (off_t) cache->memory_max_object)
+    {
+        size = (size_t) of.size;
+    }
+
+    c->buf = ngx_create_temp_buf(r->pool, size);
     if (c->buf == NULL) {
         return NGX_ERROR;
     }
@@ -404,8 +741,12 @@ done:
 static ngx_int_t
 ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_msec_t                 now, timer;
-    ngx_http_file_cache_t     *cache;
+    ngx_uint_t                    stream, dead;
+    ngx_msec_t                    now, timer;
+    ngx_shm_shard_t              *shard;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_fill_t   *fill;
+    ngx_http_file_cache_shard_t  *fcs;
 
     if (!c->lock) {
         return NGX_DECLINED;
@@ -415,18 +756,35 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     cache = c->file_cache;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
+    fcs = ngx_http_file_cache_shard_data(shard);
+
+    stream = 0;
+    dead = 0;
+    fill = NULL;
+
+    ngx_shm_shard_lock(shard);
 
     timer = c->node->lock_time - now;
 
-    if (!c->node->updating || (ngx_msec_int_t) timer <= 0) {
+    if (c->node->updating && (ngx_msec_int_t) timer > 0 && r == r->main) {
+        fill = ngx_http_file_cache_fill_lookup(cache, fcs, c->key,
+                                               c->node->lock_time, &dead);
+    }
+
+    /* the lock of a worker which exited abnormally is taken over */
+
+    if (!c->node->updating || (ngx_msec_int_t) timer <= 0 || dead) {
         c->node->updating = 1;
         c->node->lock_time = now + c->lock_age;
         c->updating = 1;
         c->lock_time = c->node->lock_time;
+
+    } else if (fill) {
+        stream = 1;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shm_shard_unlock(shard);
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache lock u:%d wt:%M",
@@ -450,9 +808,22 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->wait_event.log = r->connection->log;
     }
 
-    timer = c->wait_time - now;
+    /*
+     * the timer only limits the wait, the request is woken up
+     * as soon as the lock is released or the response is being cached
+     */
+
+    if ((ngx_msec_int_t) (c->wait_time - now) < (ngx_msec_int_t) timer) {
+        timer = c->wait_time - now;
+    }
 
-    ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
+    ngx_add_timer(&c->wait_event, timer);
+
+    ngx_http_file_cache_wait(cache, c);
+
+    if (stream) {
+        ngx_post_event(&c->wait_event, &ngx_posted_events);
+    }
 
     r->main->blocked++;
 
@@ -483,9 +854,12 @@ ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev)
 static void
 ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_uint_t              wait;
-    ngx_msec_t              now, timer;
-    ngx_http_file_cache_t  *cache;
+    ngx_uint_t                    wait, dead;
+    ngx_msec_t                    now, timer, lock;
+    ngx_shm_shard_t              *shard;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_fill_t   *fill;
+    ngx_http_file_cache_shard_t  *fcs;
 
     now = ngx_current_msec;
 
@@ -501,29 +875,139 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
     cache = c->file_cache;
     wait = 0;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
+    fcs = ngx_http_file_cache_shard_data(shard);
 
-    timer = c->node->lock_time - now;
+    ngx_shm_shard_lock(shard);
+
+    lock = c->node->lock_time - now;
 
-    if (c->node->updating && (ngx_msec_int_t) timer > 0) {
+    if (c->node->updating && (ngx_msec_int_t) lock > 0) {
         wait = 1;
+
+        /* the response being cached is streamed as it is written */
+
+        if (r == r->main) {
+            dead = 0;
+            fill = ngx_http_file_cache_fill_lookup(cache, fcs, c->key,
+                                                   c->node->lock_time, &dead);
+
+            if (fill) {
+                (void) ngx_atomic_fetch_add(&fill->count, 1);
+                c->fill = fill;
+                c->stream = 1;
+                wait = 0;
+
+            } else if (dead) {
+
+                /* the lock is expired to be taken over on the next lookup */
+
+                c->node->lock_time = now;
+                wait = 0;
+            }
+        }
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shm_shard_unlock(shard);
 
     if (wait) {
-        ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
+        ngx_add_timer(&c->wait_event, (lock < timer) ? lock : timer);
         return;
     }
 
 wakeup:
 
+    if (c->notify) {
+        ngx_queue_remove(&c->queue);
+        c->notify = 0;
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+
     c->waiting = 0;
     r->main->blocked--;
     r->write_event_handler(r);
 }
 
 
+static ngx_int_t
+ngx_http_file_cache_stream_open(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_fd_t                  fd;
+    ngx_uint_t                failed;
+    ngx_shm_shard_t          *shard;
+    ngx_pool_cleanup_t       *cln;
+    ngx_http_file_cache_t    *cache;
+    ngx_pool_cleanup_file_t  *clnf;
+
+    cache = c->file_cache;
+
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
+
+    ngx_shm_shard_lock(shard);
+    failed = c->fill->failed;
+    ngx_shm_shard_unlock(shard);
+
+    if (failed) {
+        fd = NGX_INVALID_FILE;
+
+    } else {
+        fd = ngx_open_file(c->fill->name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    }
+
+    if (fd == NGX_INVALID_FILE) {
+
+        /*
+         * the temporary file has been already renamed or deleted,
+         * or the worker writing it has exited, the cache is looked up again
+         */
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, ngx_errno,
+                       "http file cache stream \"%s\" for \"%s\" failed",
+                       c->fill->name, c->file.name.data);
+
+        ngx_http_file_cache_fill_release(cache, c->fill);
+        c->fill = NULL;
+        c->stream = 0;
+
+        return NGX_DECLINED;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        (void) ngx_close_file(fd);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = fd;
+    clnf->name = c->file.name.data;
+    clnf->log = r->pool->log;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache stream: \"%s\" %d",
+                   c->fill->name, fd);
+
+    c->file.fd = fd;
+    c->file.log = r->connection->log;
+
+    ngx_shm_shard_lock(shard);
+    c->length = c->fill->written;
+    ngx_shm_shard_unlock(shard);
+
+    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    if (c->buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_file_cache_read(r, c);
+}
+
+
 static ngx_int_t
 ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
@@ -533,6 +1017,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     ngx_str_t                     *key;
     ngx_int_t                      rc;
     ngx_uint_t                     i;
+    ngx_shm_shard_t               *shard;
     ngx_http_file_cache_t         *cache;
     ngx_http_file_cache_header_t  *h;
 
@@ -550,7 +1035,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     h = (ngx_http_file_cache_header_t *) c->buf->pos;
 
-    if (h->version != NGX_HTTP_CACHE_VERSION) {
+    if (h->version != c->file_cache->version) {
         ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
                       "cache file \"%s\" version mismatch", c->file.name.data);
         return NGX_DECLINED;
@@ -616,10 +1101,11 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     r->cached = 1;
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
 
-    if (cache->sh->cold) {
+    if (cache->sh->cold && !c->stream) {
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shm_shard_lock(shard);
 
         if (!c->node->exists) {
             c->node->uses = 1;
@@ -628,10 +1114,10 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             c->node->uniq = c->uniq;
             c->node->fs_size = c->fs_size;
 
-            cache->sh->size += c->fs_size;
+            (void) ngx_atomic_fetch_add(&cache->sh->size, c->fs_size);
         }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shm_shard_unlock(shard);
     }
 
     now = ngx_time();
@@ -640,7 +1126,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->stale_updating = c->valid_sec + c->updating_sec >= now;
         c->stale_error = c->valid_sec + c->error_sec >= now;
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shm_shard_lock(shard);
 
         if (c->node->updating) {
             rc = NGX_HTTP_CACHE_UPDATING;
@@ -652,7 +1138,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             rc = NGX_HTTP_CACHE_STALE;
         }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shm_shard_unlock(shard);
 
         ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "http file cache expired: %i %T %T",
@@ -661,6 +1147,15 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         return rc;
     }
 
+    if (cache->memory
+        && c->object == NULL
+        && !c->stream
+        && (off_t) n == c->length
+        && c->length <= (off_t) cache->memory_max_object)
+    {
+        ngx_http_file_cache_memory_admit(cache, c);
+    }
+
     return NGX_OK;
 }
 
@@ -668,17 +1163,28 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 static ssize_t
 ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
+    size_t                     size;
 #if (NGX_HAVE_FILE_AIO || NGX_THREADS)
     ssize_t                    n;
     ngx_http_core_loc_conf_t  *clcf;
+#endif
 
+    size = c->buf->end - c->buf->pos;
+
+    if (c->object) {
+        size = ngx_min(size, c->object->length);
+        ngx_memcpy(c->buf->pos, c->object + 1, size);
+        return size;
+    }
+
+#if (NGX_HAVE_FILE_AIO || NGX_THREADS)
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 #endif
 
 #if (NGX_HAVE_FILE_AIO)
 
     if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
-        n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+        n = ngx_file_aio_read(&c->file, c->buf->pos, size, 0, r->pool);
 
         if (n != NGX_AGAIN) {
             c->reading = 0;
@@ -705,7 +1211,7 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->file.thread_handler = ngx_http_cache_thread_handler;
         c->file.thread_ctx = r;
 
-        n = ngx_thread_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+        n = ngx_thread_read(&c->file, c->buf->pos, size, 0, r->pool);
 
         c->thread_task = c->file.thread_task;
         c->reading = (n == NGX_AGAIN);
@@ -715,7 +1221,7 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
 #endif
 
-    return ngx_read_file(&c->file, c->buf->pos, c->body_start, 0);
+    return ngx_read_file(&c->file, c->buf->pos, size, 0);
 }
 
 
@@ -821,19 +1327,38 @@ ngx_http_cache_thread_event_handler(ngx_event_t *ev)
 static ngx_int_t
 ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
-    ngx_int_t                    rc;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_int_t                     rc;
+    ngx_uint_t                    n;
+    ngx_shm_shard_t              *shard;
+    ngx_rbtree_key_t              node_key;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *fcs;
+
+    ngx_memcpy((u_char *) &node_key, c->key, sizeof(ngx_rbtree_key_t));
+
+    if (cache->memory && c->node == NULL) {
+        ngx_http_file_cache_memory_count(cache, c->key);
+    }
+
+    shard = ngx_http_file_cache_shard(cache, node_key);
+    fcs = ngx_http_file_cache_shard_data(shard);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shm_shard_lock(shard);
 
     fcn = c->node;
 
     if (fcn == NULL) {
-        fcn = ngx_http_file_cache_lookup(cache, c->key);
+        fcn = ngx_http_file_cache_lookup(fcs, c->key);
     }
 
     if (fcn) {
-        ngx_queue_remove(&fcn->queue);
+
+        /*
+         * the node is not moved in the inactive queue on hits, it is
+         * given a second chance when it reaches the tail of the queue
+         */
+
+        fcn->referenced = 1;
 
         if (c->node == NULL) {
             fcn->uses++;
@@ -858,6 +1383,12 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
                 c->body_start = fcn->body_start;
             }
 
+            if (fcn->object && c->object == NULL && !c->update_variant) {
+                c->object = fcn->object;
+                c->object->referenced = 1;
+                (void) ngx_atomic_fetch_add(&c->object->count, 1);
+            }
+
             rc = NGX_OK;
 
             goto done;
@@ -870,14 +1401,30 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 
     fcn = ngx_slab_calloc_locked(cache->shpool,
                                  sizeof(ngx_http_file_cache_node_t));
+
+    /*
+     * the objects in memory share the keys zone with the nodes,
+     * so they are evicted before files
+     */
+
+    for (n = 0;
+         fcn == NULL
+         && n < NGX_HTTP_FILE_CACHE_MEMORY_SHRINK
+         && ngx_http_file_cache_memory_shrink(cache, shard);
+         n++)
+    {
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+    }
+
     if (fcn == NULL) {
         ngx_http_file_cache_set_watermark(cache);
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shm_shard_unlock(shard);
 
         (void) ngx_http_file_cache_forced_expire(cache);
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shm_shard_lock(shard);
 
         fcn = ngx_slab_calloc_locked(cache->shpool,
                                      sizeof(ngx_http_file_cache_node_t));
@@ -889,14 +1436,16 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         }
     }
 
-    cache->sh->count++;
+    (void) ngx_atomic_fetch_add(&cache->sh->count, 1);
 
-    ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+    fcn->node.key = node_key;
 
     ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
                NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+    ngx_rbtree_insert(&fcs->rbtree, &fcn->node);
+
+    ngx_queue_insert_head(&fcs->queue, &fcn->queue);
 
     fcn->uses = 1;
     fcn->count = 1;
@@ -905,6 +1454,8 @@ renew:
 
     rc = NGX_DECLINED;
 
+    ngx_http_file_cache_memory_drop(cache, fcn);
+
     fcn->valid_msec = 0;
     fcn->error = 0;
     fcn->exists = 0;
@@ -917,15 +1468,13 @@ done:
 
     fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
-
     c->uniq = fcn->uniq;
     c->error = fcn->error;
     c->node = fcn;
 
 failed:
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shm_shard_unlock(shard);
 
     return rc;
 }
@@ -967,7 +1516,7 @@ ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
 
 
 static ngx_http_file_cache_node_t *
-ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+ngx_http_file_cache_lookup(ngx_http_file_cache_shard_t *fcs, u_char *key)
 {
     ngx_int_t                    rc;
     ngx_rbtree_key_t             node_key;
@@ -976,8 +1525,8 @@ ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
 
     ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
-    node = cache->sh->rbtree.root;
-    sentinel = cache->sh->rbtree.sentinel;
+    node = fcs->rbtree.root;
+    sentinel = fcs->rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -1058,16 +1607,17 @@ static void
 ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
     u_char *hash)
 {
-    u_char     *p, *last;
-    ngx_str_t   name;
-    ngx_md5_t   md5;
-    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+    u_char                      *p, *last;
+    ngx_str_t                    name;
+    ngx_http_file_cache_hash_t   h;
+    u_char                       buf[NGX_HTTP_CACHE_VARY_LEN];
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache vary: \"%*s\"", len, vary);
 
-    ngx_md5_init(&md5);
-    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+    ngx_http_file_cache_hash_init(&h, r->cache->file_cache->key_hash);
+    ngx_http_file_cache_hash_update(&h, r->cache->main,
+                                    NGX_HTTP_CACHE_KEY_LEN);
 
     ngx_strlow(buf, vary, len);
 
@@ -1091,21 +1641,22 @@ ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "http file cache vary: %V", &name);
 
-        ngx_md5_update(&md5, name.data, name.len);
-        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+        ngx_http_file_cache_hash_update(&h, name.data, name.len);
+        ngx_http_file_cache_hash_update(&h, (u_char *) ":", sizeof(":") - 1);
 
-        ngx_http_file_cache_vary_header(r, &md5, &name);
+        ngx_http_file_cache_vary_header(r, &h, &name);
 
-        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
+        ngx_http_file_cache_hash_update(&h, (u_char *) CRLF,
+                                        sizeof(CRLF) - 1);
     }
 
-    ngx_md5_final(hash, &md5);
+    ngx_http_file_cache_hash_final(&h, hash);
 }
 
 
 static void
-ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
-    ngx_str_t *name)
+ngx_http_file_cache_vary_header(ngx_http_request_t *r,
+    ngx_http_file_cache_hash_t *hash, ngx_str_t *name)
 {
     size_t            len;
     u_char           *p, *start, *last;
@@ -1165,10 +1716,12 @@ ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
         if (!normalize) {
 
             if (multiple) {
-                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
+                ngx_http_file_cache_hash_update(hash, (u_char *) ",",
+                                                sizeof(",") - 1);
             }
 
-            ngx_md5_update(md5, header[i].value.data, header[i].value.len);
+            ngx_http_file_cache_hash_update(hash, header[i].value.data,
+                                            header[i].value.len);
 
             multiple = 1;
 
@@ -1195,10 +1748,11 @@ ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
             }
 
             if (multiple) {
-                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
+                ngx_http_file_cache_hash_update(hash, (u_char *) ",",
+                                                sizeof(",") - 1);
             }
 
-            ngx_md5_update(md5, start, len);
+            ngx_http_file_cache_hash_update(hash, start, len);
 
             multiple = 1;
         }
@@ -1206,9 +1760,51 @@ ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
 }
 
 
+static ngx_inline void
+ngx_http_file_cache_hash_init(ngx_http_file_cache_hash_t *hash,
+    ngx_uint_t type)
+{
+    hash->type = type;
+
+    if (type == NGX_HTTP_CACHE_KEY_XXH3) {
+        ngx_xxh3_init(&hash->u.xxh3);
+
+    } else {
+        ngx_md5_init(&hash->u.md5);
+    }
+}
+
+
+static ngx_inline void
+ngx_http_file_cache_hash_update(ngx_http_file_cache_hash_t *hash,
+    u_char *data, size_t len)
+{
+    if (hash->type == NGX_HTTP_CACHE_KEY_XXH3) {
+        ngx_xxh3_update(&hash->u.xxh3, data, len);
+
+    } else {
+        ngx_md5_update(&hash->u.md5, data, len);
+    }
+}
+
+
+static ngx_inline void
+ngx_http_file_cache_hash_final(ngx_http_file_cache_hash_t *hash,
+    u_char *result)
+{
+    if (hash->type == NGX_HTTP_CACHE_KEY_XXH3) {
+        ngx_xxh3_final(result, &hash->u.xxh3);
+
+    } else {
+        ngx_md5_final(result, &hash->u.md5);
+    }
+}
+
+
 static ngx_int_t
 ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
+    ngx_shm_shard_t        *shard;
     ngx_http_file_cache_t  *cache;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
@@ -1223,12 +1819,19 @@ ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     cache = c->file_cache;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
+
+    ngx_shm_shard_lock(shard);
 
     c->node->count--;
     c->node = NULL;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shm_shard_unlock(shard);
+
+    if (c->object) {
+        ngx_http_file_cache_memory_release(cache, c->object);
+        c->object = NULL;
+    }
 
     c->secondary = 1;
     c->file.name.len = 0;
@@ -1257,7 +1860,7 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
 
     ngx_memzero(h, sizeof(ngx_http_file_cache_header_t));
 
-    h->version = NGX_HTTP_CACHE_VERSION;
+    h->version = c->file_cache->version;
     h->valid_sec = c->valid_sec;
     h->updating_sec = c->updating_sec;
     h->error_sec = c->error_sec;
@@ -1308,6 +1911,7 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
 static ngx_int_t
 ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
+    ngx_shm_shard_t        *shard;
     ngx_http_file_cache_t  *cache;
 
     if (!c->secondary) {
@@ -1330,13 +1934,15 @@ ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache main key");
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
+
+    ngx_shm_shard_lock(shard);
 
     c->node->count--;
     c->node->updating = 0;
     c->node = NULL;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shm_shard_unlock(shard);
 
     c->file.name.len = 0;
     c->update_variant = 1;
@@ -1358,13 +1964,15 @@ ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 void
 ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 {
-    off_t                   fs_size;
-    ngx_int_t               rc;
-    ngx_file_uniq_t         uniq;
-    ngx_file_info_t         fi;
-    ngx_http_cache_t        *c;
-    ngx_ext_rename_file_t   ext;
-    ngx_http_file_cache_t  *cache;
+    off_t                        fs_size;
+    ngx_int_t                    rc;
+    ngx_file_uniq_t              uniq;
+    ngx_file_info_t              fi;
+    ngx_shm_shard_t             *shard;
+    ngx_http_cache_t            *c;
+    ngx_ext_rename_file_t        ext;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_fill_t  *fill;
 
     c = r->cache;
 
@@ -1410,14 +2018,17 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
         }
     }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
+
+    ngx_shm_shard_lock(shard);
 
     c->node->count--;
     c->node->error = 0;
     c->node->uniq = uniq;
     c->node->body_start = c->body_start;
 
-    cache->sh->size += fs_size - c->node->fs_size;
+    (void) ngx_atomic_fetch_add(&cache->sh->size,
+                                (ngx_atomic_int_t) fs_size - c->node->fs_size);
     c->node->fs_size = fs_size;
 
     if (rc == NGX_OK) {
@@ -1425,8 +2036,119 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
     }
 
     c->node->updating = 0;
+    c->node->unverified = 0;
+
+    ngx_http_file_cache_memory_drop(cache, c->node);
+
+    fill = c->fill;
+
+    if (fill) {
+        fill->written = tf->offset;
+
+        if (rc == NGX_OK) {
+            fill->done = 1;
+
+        } else {
+            fill->failed = 1;
+        }
+
+        if (!fill->detached) {
+            ngx_queue_remove(&fill->queue);
+            fill->detached = 1;
+        }
+
+        c->fill = NULL;
+    }
+
+    ngx_shm_shard_unlock(shard);
+
+    if (fill) {
+        ngx_http_file_cache_fill_release(cache, fill);
+    }
+
+    ngx_http_file_cache_notify(cache, c->key);
+}
+
+
+void
+ngx_http_file_cache_fill(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    size_t                        len;
+    ngx_shm_shard_t              *shard;
+    ngx_http_cache_t             *c;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_fill_t   *fill;
+    ngx_http_file_cache_shard_t  *fcs;
+
+    c = r->cache;
+
+    /*
+     * a new cache element being written under the cache lock is
+     * published for streaming once its header is written; responses
+     * with variants are not streamed as they may not match the waiters
+     */
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (!c->lock
+        || !c->updating
+        || c->exists
+        || c->vary.len
+        || c->valid_sec < ngx_time()
+        || tf->file.fd == NGX_INVALID_FILE
+        || tf->offset < (off_t) c->body_start)
+    {
+        return;
+    }
+
+    fill = c->fill;
+
+    if (fill && fill->written == tf->offset) {
+        return;
+    }
+
+    cache = c->file_cache;
+
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
+
+    if (fill == NULL) {
+        len = tf->file.name.len;
+
+        fill = ngx_slab_alloc(cache->shpool,
+                              sizeof(ngx_http_file_cache_fill_t) + len);
+        if (fill == NULL) {
+            return;
+        }
+
+        fill->count = 1;
+        fill->pid = ngx_pid;
+        fill->lock_time = c->lock_time;
+        fill->done = 0;
+        fill->failed = 0;
+        fill->detached = 0;
+        ngx_memcpy(fill->key, c->key, NGX_HTTP_CACHE_KEY_LEN);
+        ngx_memcpy(fill->name, tf->file.name.data, len);
+        fill->name[len] = '\0';
+
+        fcs = ngx_http_file_cache_shard_data(shard);
+
+        ngx_shm_shard_lock(shard);
+
+        fill->written = tf->offset;
+        ngx_queue_insert_tail(&fcs->fills, &fill->queue);
+
+        ngx_shm_shard_unlock(shard);
+
+        c->fill = fill;
+
+    } else {
+        ngx_shm_shard_lock(shard);
+        fill->written = tf->offset;
+        ngx_shm_shard_unlock(shard);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache fill: %O", tf->offset);
+
+    ngx_http_file_cache_notify(cache, c->key);
 }
 
 
@@ -1437,7 +2159,9 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
     ngx_err_t                      err;
     ngx_file_t                     file;
     ngx_file_info_t                fi;
+    ngx_shm_shard_t               *shard;
     ngx_http_cache_t              *c;
+    ngx_http_file_cache_t         *cache;
     ngx_http_file_cache_header_t   h;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -1502,7 +2226,7 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
         goto done;
     }
 
-    if (h.version != NGX_HTTP_CACHE_VERSION
+    if (h.version != c->file_cache->version
         || h.last_modified != c->last_modified
         || h.crc32 != c->crc32
         || (size_t) h.header_start != c->header_start
@@ -1521,7 +2245,7 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
 
     ngx_memzero(&h, sizeof(ngx_http_file_cache_header_t));
 
-    h.version = NGX_HTTP_CACHE_VERSION;
+    h.version = c->file_cache->version;
     h.valid_sec = c->valid_sec;
     h.updating_sec = c->updating_sec;
     h.error_sec = c->error_sec;
@@ -1553,6 +2277,17 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
     (void) ngx_write_file(&file, (u_char *) &h,
                           sizeof(ngx_http_file_cache_header_t), 0);
 
+    /* the object in memory has the old header */
+
+    if (c->node) {
+        cache = c->file_cache;
+        shard = ngx_http_file_cache_shard(cache, c->node->node.key);
+
+        ngx_shm_shard_lock(shard);
+        ngx_http_file_cache_memory_drop(cache, c->node);
+        ngx_shm_shard_unlock(shard);
+    }
+
 done:
 
     if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
@@ -1575,6 +2310,28 @@ ngx_http_cache_send(ngx_http_request_t *r)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache send: %s", c->file.name.data);
 
+    if (c->stream) {
+
+        /* multipart ranges need the whole body in a single buffer */
+
+        r->single_range = 1;
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+
+        c->length = c->body_start;
+        c->wait_event.handler = ngx_http_file_cache_stream_wait_handler;
+
+        r->write_event_handler = ngx_http_file_cache_stream;
+
+        ngx_http_file_cache_stream(r);
+
+        return NGX_DONE;
+    }
+
     if (r != r->main && c->length - c->body_start == 0) {
         return ngx_http_send_header(r);
     }
@@ -1586,9 +2343,19 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (c->object) {
+        b->pos = (u_char *) (c->object + 1) + c->body_start;
+        b->last = (u_char *) (c->object + 1) + c->length;
+
+    } else if (c->buf && c->buf->last - c->buf->pos == c->length) {
+        b->pos = c->buf->pos + c->body_start;
+        b->last = c->buf->last;
+
+    } else {
+        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+        if (b->file == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
     }
 
     rc = ngx_http_send_header(r);
@@ -1597,12 +2364,25 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return rc;
     }
 
+    b->last_buf = (r == r->main) ? 1: 0;
+    b->last_in_chain = 1;
+
+    if (b->file == NULL) {
+
+        /* the body is sent from memory */
+
+        b->memory = (c->length - c->body_start) ? 1: 0;
+
+        out.buf = b;
+        out.next = NULL;
+
+        return ngx_http_output_filter(r, &out);
+    }
+
     b->file_pos = c->body_start;
     b->file_last = c->length;
 
     b->in_file = (c->length - c->body_start) ? 1: 0;
-    b->last_buf = (r == r->main) ? 1: 0;
-    b->last_in_chain = 1;
 
     b->file->fd = c->file.fd;
     b->file->name = c->file.name;
@@ -1615,676 +2395,2816 @@ ngx_http_cache_send(ngx_http_request_t *r)
 }
 
 
-void
-ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+static void
+ngx_http_file_cache_stream_wait_handler(ngx_event_t *ev)
 {
-    ngx_http_file_cache_t       *cache;
-    ngx_http_file_cache_node_t  *fcn;
-
-    if (c->updated || c->node == NULL) {
-        return;
-    }
-
-    cache = c->file_cache;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache free, fd: %d", c->file.fd);
+    r = ev->data;
+    c = r->connection;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_http_set_log_request(c->log, r);
 
-    fcn = c->node;
-    fcn->count--;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache stream wait: \"%V?%V\"",
+                   &r->uri, &r->args);
 
-    if (c->updating && fcn->lock_time == c->lock_time) {
-        fcn->updating = 0;
-    }
+    if (ev->timedout) {
+        ev->timedout = 0;
 
-    if (c->error) {
-        fcn->error = c->error;
+        if (ngx_http_file_cache_fill_check(r->cache) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "cache file \"%s\" is not written, lock aged",
+                          r->cache->file.name.data);
 
-        if (c->valid_sec) {
-            fcn->valid_sec = c->valid_sec;
-            fcn->valid_msec = c->valid_msec;
+            ngx_http_file_cache_stream_finalize(r, NGX_ERROR);
+            ngx_http_run_posted_requests(c);
+            return;
         }
-
-    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
-        ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
-        c->node = NULL;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
-
-    c->updated = 1;
-    c->updating = 0;
-
-    if (c->temp_file) {
-        if (tf && tf->file.fd != NGX_INVALID_FILE) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                           "http file cache incomplete: \"%s\"",
-                           tf->file.name.data);
-
-            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
-                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
-                              ngx_delete_file_n " \"%s\" failed",
-                              tf->file.name.data);
-            }
-        }
-    }
+    ngx_http_file_cache_stream(r);
 
-    if (c->wait_event.timer_set) {
-        ngx_del_timer(&c->wait_event);
-    }
+    ngx_http_run_posted_requests(c);
 }
 
 
 static void
-ngx_http_file_cache_cleanup(void *data)
+ngx_http_file_cache_stream(ngx_http_request_t *r)
 {
-    ngx_http_cache_t  *c = data;
+    off_t                      written;
+    ngx_int_t                  rc;
+    ngx_buf_t                 *b;
+    ngx_uint_t                 done, failed;
+    ngx_chain_t               *cl;
+    ngx_event_t               *wev;
+    ngx_shm_shard_t           *shard;
+    ngx_http_cache_t          *c;
+    ngx_http_file_cache_t     *cache;
+    ngx_http_core_loc_conf_t  *clcf;
 
-    if (c->updated) {
+    c = r->cache;
+    cache = c->file_cache;
+    wev = r->connection->write;
+
+    clcf = ngx_http_get_module_loc_conf(r->main, ngx_http_core_module);
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        r->connection->timedout = 1;
+
+        ngx_http_file_cache_stream_finalize(r, NGX_HTTP_REQUEST_TIME_OUT);
         return;
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache cleanup");
-
-    if (c->updating && !c->background) {
-        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
-                      "stalled cache updating, error:%ui", c->error);
+    if (wev->delayed || r->aio) {
+        return;
     }
 
-    ngx_http_file_cache_free(c, NULL);
-}
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
 
+    ngx_shm_shard_lock(shard);
 
-static time_t
-ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
-{
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       wait;
-    ngx_uint_t                   tries;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+    written = c->fill->written;
+    done = c->fill->done;
+    failed = c->fill->failed;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache forced expire");
+    ngx_shm_shard_unlock(shard);
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache stream: %O of %O d:%ui",
+                   c->length, written, done);
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
-    }
+    if (failed) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "cache file \"%s\" was not completed",
+                      c->file.name.data);
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+        ngx_http_file_cache_stream_finalize(r, NGX_ERROR);
+        return;
+    }
 
-    wait = 10;
-    tries = 20;
-    sentinel = NULL;
+    cl = NULL;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    /* while the client is slow, new data are not queued */
 
-    for ( ;; ) {
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            break;
+    if (done
+        || (written > c->length
+            && !r->buffered && !r->connection->buffered))
+    {
+        cl = ngx_chain_get_free_buf(r->pool, &c->free);
+        if (cl == NULL) {
+            ngx_http_file_cache_stream_finalize(r, NGX_ERROR);
+            return;
         }
 
-        q = ngx_queue_last(&cache->sh->queue);
+        b = cl->buf;
 
-        if (q == sentinel) {
-            break;
-        }
+        ngx_memzero(b, sizeof(ngx_buf_t));
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+        b->tag = (ngx_buf_tag_t) cache;
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
-                  fcn->count, fcn->exists,
-                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+        if (written > c->length) {
+            b->in_file = 1;
+            b->file = &c->file;
+            b->file_pos = c->length;
+            b->file_last = written;
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            wait = 0;
-            break;
+            c->length = written;
         }
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+        if (done) {
+            b->last_buf = 1;
+            b->last_in_chain = 1;
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
+        } else {
+            b->flush = 1;
+        }
+    }
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    rc = ngx_http_output_filter(r, cl);
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    if (rc == NGX_ERROR || done) {
+        ngx_http_file_cache_stream_finalize(r, rc);
+        return;
+    }
+
+    ngx_chain_update_chains(r->pool, &c->free, &c->busy, &cl,
+                            (ngx_buf_tag_t) cache);
 
-        if (sentinel == NULL) {
-            sentinel = q;
+    if (r->buffered || r->connection->buffered) {
+
+        if (!wev->delayed) {
+            ngx_add_timer(wev, clcf->send_timeout);
         }
 
-        if (--tries) {
-            continue;
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_file_cache_stream_finalize(r, NGX_ERROR);
+            return;
         }
 
-        wait = 1;
-        break;
+    } else if (wev->timer_set) {
+        ngx_del_timer(wev);
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_http_file_cache_wait(cache, c);
 
-    ngx_free(name);
+    /* the worker writing the response is checked to be alive */
 
-    return wait;
+    if (!c->wait_event.timer_set) {
+        ngx_add_timer(&c->wait_event, NGX_HTTP_FILE_CACHE_FILL_CHECK);
+    }
 }
 
 
-static time_t
-ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+static void
+ngx_http_file_cache_stream_finalize(ngx_http_request_t *r, ngx_int_t rc)
 {
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       now, wait;
-    ngx_path_t                  *path;
-    ngx_msec_t                   elapsed;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+    ngx_http_cache_t  *c;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache expire");
+    c = r->cache;
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    if (c->notify) {
+        ngx_queue_remove(&c->queue);
+        c->notify = 0;
+    }
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
+    if (c->wait_event.posted) {
+        ngx_delete_posted_event(&c->wait_event);
     }
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
 
-    now = ngx_time();
+    r->write_event_handler = ngx_http_request_empty_handler;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_http_finalize_request(r, rc);
+}
 
-    for ( ;; ) {
 
-        if (ngx_quit || ngx_terminate) {
-            wait = 1;
-            break;
-        }
+static ngx_http_file_cache_fill_t *
+ngx_http_file_cache_fill_lookup(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *fcs, u_char *key, ngx_msec_t lock_time,
+    ngx_uint_t *dead)
+{
+    ngx_queue_t                 *q, *next;
+    ngx_http_file_cache_fill_t  *fill, *found;
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            wait = 10;
-            break;
+    /*
+     * called with the shard locked; only the record of the current lock
+     * is used, the records of the locks which aged are detached, and
+     * the records of the workers which exited abnormally are reaped;
+     * "dead" is set if the worker holding the current lock has exited
+     */
+
+    found = NULL;
+
+    for (q = ngx_queue_head(&fcs->fills);
+         q != ngx_queue_sentinel(&fcs->fills);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        fill = ngx_queue_data(q, ngx_http_file_cache_fill_t, queue);
+
+        if (ngx_memcmp(fill->key, key, NGX_HTTP_CACHE_KEY_LEN) != 0) {
+            continue;
+        }
+
+        if (ngx_http_file_cache_fill_dead(fill)) {
+
+            if (fill->lock_time == lock_time) {
+                *dead = 1;
+            }
+
+            ngx_http_file_cache_fill_reap(cache, fill);
+            continue;
+        }
+
+        if (fill->lock_time != lock_time) {
+            ngx_queue_remove(q);
+            fill->detached = 1;
+            continue;
+        }
+
+        found = fill;
+    }
+
+    return found;
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_fill_dead(ngx_http_file_cache_fill_t *fill)
+{
+    if (fill->pid == ngx_pid) {
+        return 0;
+    }
+
+    return (kill(fill->pid, 0) == -1 && ngx_errno == NGX_ESRCH);
+}
+
+
+static void
+ngx_http_file_cache_fill_reap(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_fill_t *fill)
+{
+    /* called with the shard locked, the reference of the writer is freed */
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache fill reap: %P", fill->pid);
+
+    fill->failed = 1;
+
+    if (!fill->detached) {
+        ngx_queue_remove(&fill->queue);
+        fill->detached = 1;
+    }
+
+    ngx_http_file_cache_fill_release(cache, fill);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_fill_check(ngx_http_cache_t *c)
+{
+    ngx_int_t                    rc;
+    ngx_uint_t                   reaped;
+    ngx_shm_shard_t             *shard;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_fill_t  *fill;
+
+    cache = c->file_cache;
+    fill = c->fill;
+
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
+
+    ngx_shm_shard_lock(shard);
+
+    rc = NGX_OK;
+    reaped = 0;
+
+    if (!fill->done && !fill->failed) {
+
+        if (ngx_http_file_cache_fill_dead(fill)) {
+
+            /* the lock of the writer is expired to be taken over */
+
+            if (c->node->lock_time == fill->lock_time) {
+                c->node->lock_time = ngx_current_msec;
+            }
+
+            ngx_http_file_cache_fill_reap(cache, fill);
+            reaped = 1;
+
+        } else if (fill->written <= c->length
+                   && (ngx_msec_int_t) (fill->lock_time - ngx_current_msec)
+                      <= 0)
+        {
+            /* the writer stalled with nothing new written after lock_age */
+            rc = NGX_DECLINED;
+        }
+    }
+
+    ngx_shm_shard_unlock(shard);
+
+    if (reaped) {
+        ngx_http_file_cache_notify(cache, c->key);
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_file_cache_fill_release(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_fill_t *fill)
+{
+    if (ngx_atomic_fetch_add(&fill->count, -1) == 1) {
+        ngx_slab_free(cache->shpool, fill);
+    }
+}
+
+
+/*
+ * requests waiting for the cache lock or streaming a response being
+ * cached are woken up by the worker which writes the response; other
+ * workers notice the change of the generation counter of the shard
+ * in shared memory with a single timer per worker
+ */
+
+static void
+ngx_http_file_cache_wait(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    if (!c->notify) {
+        ngx_queue_insert_tail(&cache->waiters, &c->queue);
+        c->notify = 1;
+    }
+
+    if (cache->notify.timer_set) {
+        return;
+    }
+
+    cache->notify.handler = ngx_http_file_cache_notify_handler;
+    cache->notify.data = cache;
+    cache->notify.log = ngx_cycle->log;
+    cache->notify.cancelable = 1;
+
+    ngx_add_timer(&cache->notify, 10);
+}
+
+
+static void
+ngx_http_file_cache_notify(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_queue_t                  *q;
+    ngx_rbtree_key_t              node_key;
+    ngx_http_cache_t             *c;
+    ngx_http_file_cache_shard_t  *fcs;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    fcs = ngx_http_file_cache_shard_data(
+                                  ngx_http_file_cache_shard(cache, node_key));
+
+    (void) ngx_atomic_fetch_add(&fcs->generation, 1);
+
+    for (q = ngx_queue_head(&cache->waiters);
+         q != ngx_queue_sentinel(&cache->waiters);
+         q = ngx_queue_next(q))
+    {
+        c = ngx_queue_data(q, ngx_http_cache_t, queue);
+
+        if (ngx_memcmp(c->key, key, NGX_HTTP_CACHE_KEY_LEN) == 0) {
+            ngx_post_event(&c->wait_event, &ngx_posted_events);
+        }
+    }
+}
+
+
+static void
+ngx_http_file_cache_notify_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                    n;
+    ngx_queue_t                  *q;
+    ngx_rbtree_key_t              node_key;
+    ngx_atomic_uint_t            *seen, *current;
+    ngx_http_cache_t             *c;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *fcs;
+
+    cache = ev->data;
+
+    /* only the waiters of the shards changed are woken up */
+
+    seen = cache->generations;
+    current = &cache->generations[cache->nshards];
+
+    for (n = 0; n < cache->nshards; n++) {
+        fcs = ngx_http_file_cache_shard_data(
+                                          ngx_shm_shard(cache->shm_zone, n));
+        current[n] = fcs->generation;
+    }
+
+    for (q = ngx_queue_head(&cache->waiters);
+         q != ngx_queue_sentinel(&cache->waiters);
+         q = ngx_queue_next(q))
+    {
+        c = ngx_queue_data(q, ngx_http_cache_t, queue);
+
+        ngx_memcpy((u_char *) &node_key, c->key, sizeof(ngx_rbtree_key_t));
+        n = node_key % cache->nshards;
+
+        if (current[n] != seen[n]) {
+            ngx_post_event(&c->wait_event, &ngx_posted_events);
+        }
+    }
+
+    ngx_memcpy(seen, current, cache->nshards * sizeof(ngx_atomic_uint_t));
+
+    if (!ngx_queue_empty(&cache->waiters)) {
+        ngx_add_timer(ev, 10);
+    }
+}
+
+
+void
+ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+{
+    ngx_uint_t                    notify;
+    ngx_shm_shard_t              *shard;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_fill_t   *fill;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *fcs;
+
+    if (c->updated || c->node == NULL) {
+        return;
+    }
+
+    cache = c->file_cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache free, fd: %d", c->file.fd);
+
+    fcn = c->node;
+    shard = ngx_http_file_cache_shard(cache, fcn->node.key);
+
+    ngx_shm_shard_lock(shard);
+
+    fcn->count--;
+
+    notify = 0;
+
+    if (c->updating && fcn->lock_time == c->lock_time) {
+        fcn->updating = 0;
+        notify = 1;
+    }
+
+    fill = NULL;
+
+    if (c->fill && !c->stream) {
+        fill = c->fill;
+        fill->failed = 1;
+
+        if (!fill->detached) {
+            ngx_queue_remove(&fill->queue);
+            fill->detached = 1;
+        }
+
+        c->fill = NULL;
+        notify = 1;
+    }
+
+    if (c->error) {
+        fcn->error = c->error;
+
+        if (c->valid_sec) {
+            fcn->valid_sec = c->valid_sec;
+            fcn->valid_msec = c->valid_msec;
+        }
+
+    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
+        fcs = ngx_http_file_cache_shard_data(shard);
+
+        ngx_queue_remove(&fcn->queue);
+        ngx_rbtree_delete(&fcs->rbtree, &fcn->node);
+        ngx_slab_free_locked(cache->shpool, fcn);
+        (void) ngx_atomic_fetch_add(&cache->sh->count, -1);
+        c->node = NULL;
+    }
+
+    ngx_shm_shard_unlock(shard);
+
+    if (fill) {
+        ngx_http_file_cache_fill_release(cache, fill);
+    }
+
+    if (notify) {
+        ngx_http_file_cache_notify(cache, c->key);
+    }
+
+    c->updated = 1;
+    c->updating = 0;
+
+    if (c->temp_file) {
+        if (tf && tf->file.fd != NGX_INVALID_FILE) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                           "http file cache incomplete: \"%s\"",
+                           tf->file.name.data);
+
+            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
+                              ngx_delete_file_n " \"%s\" failed",
+                              tf->file.name.data);
+            }
+        }
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+}
+
+
+static void
+ngx_http_file_cache_cleanup(void *data)
+{
+    ngx_http_cache_t  *c = data;
+
+    if (c->notify) {
+        ngx_queue_remove(&c->queue);
+        c->notify = 0;
+    }
+
+    if (c->wait_event.posted) {
+        ngx_delete_posted_event(&c->wait_event);
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+
+    if (c->object) {
+        ngx_http_file_cache_memory_release(c->file_cache, c->object);
+        c->object = NULL;
+    }
+
+    if (c->stream && c->fill) {
+        ngx_http_file_cache_fill_release(c->file_cache, c->fill);
+        c->fill = NULL;
+    }
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache cleanup");
+
+    if (c->updating && !c->background) {
+        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
+                      "stalled cache updating, error:%ui", c->error);
+    }
+
+    ngx_http_file_cache_free(c, NULL);
+}
+
+
+static time_t
+ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
+{
+    u_char                       *name, *p;
+    size_t                        len;
+    time_t                        wait;
+    ngx_uint_t                    n, tries, nodes;
+    ngx_path_t                   *path;
+    ngx_queue_t                  *q, *sentinel;
+    ngx_shm_shard_t              *shard;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *fcs;
+    u_char                        key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache forced expire");
+
+    path = cache->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
+
+    ngx_memcpy(name, path->name.data, path->name.len);
+
+    wait = 10;
+    nodes = NGX_HTTP_FILE_CACHE_FORCED_NODES;
+
+    /* the shards are expired in turn to approximate the global LRU */
+
+    for (n = 0; n < cache->nshards; n++) {
+
+        shard = ngx_shm_shard(cache->shm_zone, cache->shard);
+        fcs = ngx_http_file_cache_shard_data(shard);
+
+        cache->shard = (cache->shard + 1) % cache->nshards;
+
+        tries = 20;
+        sentinel = NULL;
+
+        ngx_shm_shard_lock(shard);
+
+        for ( ;; ) {
+            if (ngx_queue_empty(&fcs->queue)) {
+                break;
+            }
+
+            q = ngx_queue_last(&fcs->queue);
+
+            if (q == sentinel) {
+                break;
+            }
+
+            fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+            ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
+                  fcn->count, fcn->exists,
+                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+            /*
+             * a limited number of referenced nodes is given a second
+             * chance, the rest are expired unless they are in use
+             */
+
+            if (fcn->referenced && (nodes || fcn->count)) {
+                fcn->referenced = 0;
+                ngx_queue_remove(q);
+                ngx_queue_insert_head(&fcs->queue, q);
+
+                if (nodes) {
+                    nodes--;
+                }
+
+                continue;
+            }
+
+            if (ngx_http_file_cache_unlinking(cache, fcn)) {
+
+                /* the file is being deleted in a thread */
+
+                ngx_queue_remove(q);
+                ngx_queue_insert_head(&fcs->queue, q);
+
+                if (sentinel == NULL) {
+                    sentinel = q;
+                }
+
+                wait = 1;
+                continue;
+            }
+
+            if (fcn->count == 0) {
+                ngx_http_file_cache_delete(cache, shard, q, name);
+                wait = 0;
+                break;
+            }
+
+            p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                             sizeof(ngx_rbtree_key_t));
+            len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+            (void) ngx_hex_dump(p, fcn->key, len);
+
+            /*
+             * abnormally exited workers may leave locked cache entries,
+             * and although it may be safe to remove them completely,
+             * we prefer to just move them to the top of the inactive queue
+             */
+
+            ngx_queue_remove(q);
+            fcn->expire = ngx_time() + cache->inactive;
+            ngx_queue_insert_head(&fcs->queue, &fcn->queue);
+
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                        "ignore long locked inactive cache entry %*s, count:%d",
+                        (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+            if (sentinel == NULL) {
+                sentinel = q;
+            }
+
+            if (--tries) {
+                continue;
+            }
+
+            wait = 1;
+            break;
+        }
+
+        ngx_shm_shard_unlock(shard);
+
+        if (wait == 0) {
+            break;
+        }
+    }
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static time_t
+ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+{
+    u_char           *name;
+    size_t            len;
+    time_t            now, wait, next;
+    ngx_uint_t        n;
+    ngx_path_t       *path;
+    ngx_shm_shard_t  *shard;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire");
+
+    path = cache->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
+
+    ngx_memcpy(name, path->name.data, path->name.len);
+
+    now = ngx_time();
+    wait = 10;
+
+    for (n = 0; n < cache->nshards; n++) {
+
+        shard = ngx_shm_shard(cache->shm_zone, cache->shard);
+
+        next = ngx_http_file_cache_expire_shard(cache, shard, name, now);
+
+        if (next < wait) {
+            wait = next;
+        }
+
+        if (wait == 0) {
+
+            /* the next run continues with this shard */
+            break;
+        }
+
+        cache->shard = (cache->shard + 1) % cache->nshards;
+    }
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static time_t
+ngx_http_file_cache_expire_shard(ngx_http_file_cache_t *cache,
+    ngx_shm_shard_t *shard, u_char *name, time_t now)
+{
+    u_char                       *p;
+    size_t                        len;
+    time_t                        wait;
+    ngx_msec_t                    elapsed;
+    ngx_queue_t                  *q;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *fcs;
+    u_char                        key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    fcs = ngx_http_file_cache_shard_data(shard);
+
+    ngx_shm_shard_lock(shard);
+
+    for ( ;; ) {
+
+        if (ngx_quit || ngx_terminate) {
+            wait = 1;
+            break;
+        }
+
+        if (cache->unlinking >= NGX_HTTP_FILE_CACHE_UNLINK_BACKLOG) {
+            wait = 1;
+            break;
+        }
+
+        if (ngx_queue_empty(&fcs->queue)) {
+            wait = 10;
+            break;
+        }
+
+        q = ngx_queue_last(&fcs->queue);
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        if (fcn->referenced) {
+
+            /* the node was used since it was queued, its expire is updated */
+
+            fcn->referenced = 0;
+            ngx_queue_remove(q);
+            ngx_queue_insert_head(&fcs->queue, q);
+            goto next;
+        }
+
+        if (ngx_http_file_cache_unlinking(cache, fcn)) {
+
+            /* the file is being deleted in a thread */
+
+            ngx_queue_remove(q);
+            ngx_queue_insert_head(&fcs->queue, q);
+            goto next;
+        }
+
+        wait = fcn->expire - now;
+
+        if (wait > 0) {
+            wait = wait > 10 ? 10 : wait;
+            break;
+        }
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
+                       fcn->count, fcn->exists,
+                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            ngx_http_file_cache_delete(cache, shard, q, name);
+            goto next;
+        }
+
+        if (fcn->deleting) {
+            wait = 1;
+            break;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+
+        ngx_queue_remove(q);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_queue_insert_head(&fcs->queue, &fcn->queue);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+next:
+
+        if (++cache->files >= cache->manager_files) {
+            wait = 0;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            wait = 0;
+            break;
+        }
+    }
+
+    ngx_shm_shard_unlock(shard);
+
+    return wait;
+}
+
+
+static void
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
+    ngx_shm_shard_t *shard, ngx_queue_t *q, u_char *name)
+{
+    u_char                       *p;
+    size_t                        len;
+    uint64_t                      start;
+    ngx_path_t                   *path;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *fcs;
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    ngx_http_file_cache_memory_drop(cache, fcn);
+
+    if (fcn->exists) {
+
+#if (NGX_THREADS)
+        if (cache->thread_pool
+            && ngx_http_file_cache_unlink_add(cache, shard, fcn) == NGX_OK)
+        {
+            return;
+        }
+#endif
+
+        (void) ngx_atomic_fetch_add(&cache->sh->size,
+                                    -(ngx_atomic_int_t) fcn->fs_size);
+
+        path = cache->path;
+        p = name + path->name.len + 1 + path->len;
+        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        p = ngx_hex_dump(p, fcn->key, len);
+        *p = '\0';
+
+        fcn->count++;
+        fcn->deleting = 1;
+        ngx_shm_shard_unlock(shard);
+
+        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+        ngx_create_hashed_filename(path, name, len);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: \"%s\"", name);
+
+        start = ngx_monotonic_usec();
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR
+            && !(fcn->unverified && ngx_errno == NGX_ENOENT))
+        {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
+        }
+
+        ngx_http_file_cache_unlink_stat(cache, ngx_monotonic_usec() - start);
+
+        ngx_shm_shard_lock(shard);
+        fcn->count--;
+        fcn->deleting = 0;
+    }
+
+    if (fcn->count == 0) {
+        fcs = ngx_http_file_cache_shard_data(shard);
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&fcs->rbtree, &fcn->node);
+        ngx_slab_free_locked(cache->shpool, fcn);
+        (void) ngx_atomic_fetch_add(&cache->sh->count, -1);
+    }
+}
+
+
+static void
+ngx_http_file_cache_unlink_stat(ngx_http_file_cache_t *cache, uint64_t time)
+{
+    ngx_uint_t  n;
+
+    for (n = 0; n < NGX_HTTP_FILE_CACHE_UNLINK_BUCKETS - 1; n++) {
+        if (time <= (uint64_t) 1 << (2 * n)) {
+            break;
+        }
+    }
+
+    (void) ngx_atomic_fetch_add(&cache->sh->unlink_buckets[n], 1);
+    (void) ngx_atomic_fetch_add(&cache->sh->unlink_time,
+                                (ngx_atomic_int_t) time);
+}
+
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_file_cache_unlink_add(ngx_http_file_cache_t *cache,
+    ngx_shm_shard_t *shard, ngx_http_file_cache_node_t *fcn)
+{
+    u_char                             *p;
+    size_t                              len;
+    ngx_path_t                         *path;
+    ngx_thread_task_t                  *task;
+    ngx_http_file_cache_unlink_t       *u;
+    ngx_http_file_cache_unlink_file_t  *f;
+
+    if (ngx_process != NGX_PROCESS_HELPER
+        || cache->unlinking >= NGX_HTTP_FILE_CACHE_UNLINK_BACKLOG
+        || ngx_http_file_cache_unlink_own(cache) != NGX_OK)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (cache->unlink) {
+        u = cache->unlink->ctx;
+
+        if (u->nfiles == NGX_HTTP_FILE_CACHE_UNLINK_BATCH) {
+
+            /* the previous attempt to post the batch failed */
+
+            ngx_http_file_cache_unlink_post(cache);
+
+            if (cache->unlink) {
+                return NGX_DECLINED;
+            }
+        }
+    }
+
+    path = cache->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    task = cache->unlink;
+
+    if (task == NULL) {
+        task = ngx_calloc(sizeof(ngx_thread_task_t)
+                          + sizeof(ngx_http_file_cache_unlink_t)
+                          + NGX_HTTP_FILE_CACHE_UNLINK_BATCH * (len + 1),
+                          ngx_cycle->log);
+        if (task == NULL) {
+            return NGX_DECLINED;
+        }
+
+        u = (ngx_http_file_cache_unlink_t *) (task + 1);
+        u->cache = cache;
+
+        task->ctx = u;
+        task->handler = ngx_http_file_cache_unlink_handler;
+        task->event.data = task;
+        task->event.handler = ngx_http_file_cache_unlink_event_handler;
+        task->event.log = ngx_cycle->log;
+
+        cache->unlink = task;
+    }
+
+    u = task->ctx;
+    f = &u->files[u->nfiles];
+
+    f->name = (u_char *) (u + 1) + u->nfiles * (len + 1);
+
+    p = ngx_cpymem(f->name, path->name.data, path->name.len);
+    p += 1 + path->len;
+    p = ngx_hex_dump(p, (u_char *) &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    p = ngx_hex_dump(p, fcn->key,
+                     NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    *p = '\0';
+
+    ngx_create_hashed_filename(path, f->name, len);
+
+    ngx_memcpy(f->key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(&f->key[sizeof(ngx_rbtree_key_t)], fcn->key,
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    f->node = fcn;
+    f->shard = shard;
+    f->uniq = fcn->uniq;
+    f->fs_size = fcn->fs_size;
+    f->tag = ngx_http_file_cache_unlink_tag(cache->unlink_generation);
+    f->unverified = fcn->unverified;
+
+    fcn->count++;
+    fcn->deleting = 1;
+    fcn->unlinking = 1;
+    fcn->unlink_tag = f->tag;
+
+    u->nfiles++;
+
+    cache->unlinking++;
+    cache->unlink_size += fcn->fs_size;
+
+    (void) ngx_atomic_fetch_add(&cache->sh->unlink_backlog, 1);
+    (void) ngx_atomic_fetch_add(&cache->sh->unlink_backlog_size,
+                                (ngx_atomic_int_t) (fcn->fs_size
+                                                    * cache->bsize));
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache unlink: \"%s\"", f->name);
+
+    if (u->nfiles == NGX_HTTP_FILE_CACHE_UNLINK_BATCH) {
+        ngx_http_file_cache_unlink_post(cache);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_unlink_post(ngx_http_file_cache_t *cache)
+{
+    ngx_thread_task_t  *task;
+
+    task = cache->unlink;
+
+    if (task == NULL) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache unlink post: %ui",
+                   ((ngx_http_file_cache_unlink_t *) task->ctx)->nfiles);
+
+    if (ngx_thread_task_post(cache->thread_pool, task) != NGX_OK) {
+        return;
+    }
+
+    cache->unlink = NULL;
+}
+
+
+static void
+ngx_http_file_cache_unlink_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_file_cache_unlink_t *u = data;
+
+    uint64_t                            start;
+    ngx_uint_t                          i;
+    ngx_file_info_t                     fi;
+    ngx_http_file_cache_unlink_file_t  *f;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                   "http file cache unlink thread: %ui", u->nfiles);
+
+    for (i = 0; i < u->nfiles; i++) {
+        f = &u->files[i];
+
+        start = ngx_monotonic_usec();
+
+        if (ngx_file_info(f->name, &fi) != NGX_FILE_ERROR
+            && ngx_file_uniq(&fi) != f->uniq)
+        {
+            /* the file was replaced by a worker after it was queued */
+
+            f->err = 0;
+
+        } else if (ngx_delete_file(f->name) == NGX_FILE_ERROR) {
+            f->err = ngx_errno;
+
+        } else {
+            f->err = 0;
+        }
+
+        f->time = ngx_monotonic_usec() - start;
+    }
+}
+
+
+static void
+ngx_http_file_cache_unlink_event_handler(ngx_event_t *ev)
+{
+    off_t                               size, backlog_size;
+    ngx_uint_t                          i, backlog;
+    ngx_thread_task_t                  *task;
+    ngx_http_file_cache_t              *cache;
+    ngx_http_file_cache_node_t         *fcn;
+    ngx_http_file_cache_shard_t        *fcs;
+    ngx_http_file_cache_unlink_t       *u;
+    ngx_http_file_cache_unlink_file_t  *f;
+
+    task = ev->data;
+    u = task->ctx;
+    cache = u->cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http file cache unlink done: %ui", u->nfiles);
+
+    size = 0;
+    backlog = 0;
+    backlog_size = 0;
+
+    for (i = 0; i < u->nfiles; i++) {
+        f = &u->files[i];
+
+        if (f->err && !(f->unverified && f->err == NGX_ENOENT)) {
+            ngx_log_error(NGX_LOG_CRIT, ev->log, f->err,
+                          ngx_delete_file_n " \"%s\" failed", f->name);
+        }
+
+        ngx_http_file_cache_unlink_stat(cache, f->time);
+
+        fcs = ngx_http_file_cache_shard_data(f->shard);
+
+        ngx_shm_shard_lock(f->shard);
+
+        fcn = ngx_http_file_cache_lookup(fcs, f->key);
+
+        /* the nodes recovered by another owner are not accounted again */
+
+        if (fcn == f->node && fcn->unlinking && fcn->unlink_tag == f->tag) {
+            fcn->unlinking = 0;
+            fcn->deleting = 0;
+            fcn->count--;
+
+            backlog++;
+            backlog_size += f->fs_size;
+
+            if (fcn->exists && fcn->uniq == f->uniq) {
+                (void) ngx_atomic_fetch_add(&cache->sh->size,
+                                            -(ngx_atomic_int_t) fcn->fs_size);
+                fcn->exists = 0;
+            }
+
+            if (fcn->count == 0 && !fcn->exists) {
+                ngx_queue_remove(&fcn->queue);
+                ngx_rbtree_delete(&fcs->rbtree, &fcn->node);
+                ngx_slab_free_locked(cache->shpool, fcn);
+                (void) ngx_atomic_fetch_add(&cache->sh->count, -1);
+            }
+        }
+
+        ngx_shm_shard_unlock(f->shard);
+
+        size += f->fs_size;
+    }
+
+    cache->unlinking -= u->nfiles;
+    cache->unlink_size -= size;
+
+    (void) ngx_atomic_fetch_add(&cache->sh->unlink_backlog,
+                                -(ngx_atomic_int_t) backlog);
+    (void) ngx_atomic_fetch_add(&cache->sh->unlink_backlog_size,
+                                -(ngx_atomic_int_t) (backlog_size
+                                                     * cache->bsize));
+
+    ngx_free(task);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_unlink_own(ngx_http_file_cache_t *cache)
+{
+    time_t                     now;
+    ngx_pid_t                  pid;
+    ngx_http_file_cache_sh_t  *sh;
+
+    sh = cache->sh;
+    now = ngx_time();
+
+    pid = (ngx_pid_t) sh->unlinker;
+
+    if (pid == ngx_pid
+        && cache->unlink_generation
+        && cache->unlink_generation == sh->unlink_generation)
+    {
+        sh->unlink_heartbeat = now;
+        return NGX_OK;
+    }
+
+    /*
+     * only one cache manager process deletes files in threads; the owner
+     * is replaced if it has exited or its pid belongs to another user,
+     * or if it did not queue files for a long time, as its pid may have
+     * been reused by a process of the same user
+     */
+
+    if (pid && pid != ngx_pid
+        && now - (time_t) sh->unlink_heartbeat
+           < NGX_HTTP_FILE_CACHE_UNLINK_STALE
+        && kill(pid, 0) == 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (!ngx_atomic_cmp_set(&sh->unlinker, pid, ngx_pid)) {
+        return NGX_DECLINED;
+    }
+
+    cache->unlink_generation = ngx_atomic_fetch_add(&sh->unlink_generation, 1)
+                               + 1;
+    sh->unlink_heartbeat = now;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache unlink owner: %P, generation: %ui",
+                   pid, cache->unlink_generation);
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_uint_t
+ngx_http_file_cache_unlinking(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    if (!fcn->unlinking) {
+        return 0;
+    }
+
+#if (NGX_THREADS)
+
+    if (ngx_process == NGX_PROCESS_HELPER
+        && ngx_http_file_cache_unlink_own(cache) == NGX_OK
+        && (cache->unlinking == 0
+            || fcn->unlink_tag
+               != ngx_http_file_cache_unlink_tag(cache->unlink_generation)))
+    {
+        /*
+         * the file was queued by a previous owner, which exited
+         * or was replaced before the file was deleted
+         */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache unlink orphan: %ui",
+                       (ngx_uint_t) fcn->unlink_tag);
+
+        fcn->unlinking = 0;
+        fcn->deleting = 0;
+        fcn->count--;
+        fcn->unverified = 1;
+
+        (void) ngx_atomic_fetch_add(&cache->sh->unlink_backlog, -1);
+        (void) ngx_atomic_fetch_add(&cache->sh->unlink_backlog_size,
+                                    -(ngx_atomic_int_t) (fcn->fs_size
+                                                         * cache->bsize));
+
+        return 0;
+    }
+
+#endif
+
+    return 1;
+}
+
+
+static ngx_msec_t
+ngx_http_file_cache_manager(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    off_t       size, free;
+    time_t      wait;
+    ngx_msec_t  elapsed, next;
+    ngx_uint_t  count, watermark;
+
+    if (cache->sh->restoring) {
+        if (ngx_http_file_cache_snapshot_load(cache) == NGX_AGAIN) {
+            return cache->manager_sleep;
+        }
+
+        ngx_time_update();
+    }
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+
+    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
+
+    if (next == 0) {
+        next = cache->manager_sleep;
+        goto done;
+    }
+
+    for ( ;; ) {
+        /* the files being deleted in threads are not accounted */
+
+        size = cache->sh->size - cache->unlink_size;
+        count = cache->sh->count - cache->unlinking;
+        watermark = cache->sh->watermark;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache size: %O c:%ui w:%i",
+                       size, count, (ngx_int_t) watermark);
+
+        if (size < cache->max_size && count < watermark) {
+
+            if (!cache->min_free) {
+                break;
+            }
+
+            free = ngx_fs_available(cache->path->name.data)
+                   + cache->unlink_size * cache->bsize;
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                           "http file cache free: %O", free);
+
+            if (free > cache->min_free) {
+                break;
+            }
+        }
+
+        if (cache->unlinking >= NGX_HTTP_FILE_CACHE_UNLINK_BACKLOG) {
+            next = cache->manager_sleep;
+            break;
+        }
+
+        wait = ngx_http_file_cache_forced_expire(cache);
+
+        if (wait > 0) {
+            next = (ngx_msec_t) wait * 1000;
+            break;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            break;
+        }
+
+        if (++cache->files >= cache->manager_files) {
+            next = cache->manager_sleep;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            next = cache->manager_sleep;
+            break;
+        }
+    }
+
+done:
+
+#if (NGX_THREADS)
+    ngx_http_file_cache_unlink_post(cache);
+#endif
+
+    if (cache->snapshot_state
+        || (cache->snapshot
+            && !cache->sh->cold
+            && ngx_time() - cache->sh->snapshot >= cache->snapshot))
+    {
+        if (ngx_http_file_cache_snapshot_write(cache) == NGX_AGAIN
+            && next > cache->manager_sleep)
+        {
+            next = cache->manager_sleep;
+        }
+    }
+
+    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache manager: %ui e:%M n:%M",
+                   cache->files, elapsed, next);
+
+    return next;
+}
+
+
+static void
+ngx_http_file_cache_loader(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    size_t          len;
+    ngx_uint_t      n;
+    ngx_tree_ctx_t  tree;
+
+    if (!cache->sh->cold || cache->sh->loading) {
+        return;
+    }
+
+    /* the snapshot is restored by the cache manager */
+
+    while (cache->sh->restoring) {
+
+        if (ngx_quit || ngx_terminate) {
+            return;
+        }
+
+        ngx_http_file_cache_loader_sleep(cache);
+    }
+
+    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache loader");
+
+    tree.init_handler = NULL;
+    tree.file_handler = ngx_http_file_cache_manage_file;
+    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
+    tree.post_tree_handler = ngx_http_file_cache_noop;
+    tree.spec_handler = ngx_http_file_cache_delete_file;
+    tree.data = cache;
+    tree.alloc = 0;
+    tree.log = ngx_cycle->log;
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+
+    if (cache->sh->snapshot && cache->path->level[0]) {
+
+        /* a bit for each directory of the last level */
+
+        len = 1;
+
+        for (n = 0; n < NGX_MAX_PATH_LEVEL; n++) {
+            len <<= 4 * cache->path->level[n];
+        }
+
+        cache->unmodified = ngx_calloc(len / 8 + 1, ngx_cycle->log);
+    }
+
+    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
+        cache->sh->loading = 0;
+        goto done;
+    }
+
+    if (cache->sh->unverified) {
+        ngx_http_file_cache_snapshot_verify(cache);
+        cache->sh->unverified = 0;
+    }
+
+    cache->sh->cold = 0;
+    cache->sh->loading = 0;
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %.3fM, bsize: %uz",
+                  &cache->path->name,
+                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
+                  cache->bsize);
+
+done:
+
+    if (cache->unmodified) {
+        ngx_free(cache->unmodified);
+        cache->unmodified = NULL;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_msec_t              elapsed;
+    ngx_http_file_cache_t  *cache;
+
+    cache = ctx->data;
+
+    if (path->len == cache->snapshot_name.len
+        && ngx_strcmp(path->data, cache->snapshot_name.data) == 0)
+    {
+        return NGX_OK;
+    }
+
+    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
+        (void) ngx_http_file_cache_delete_file(ctx, path);
+    }
+
+    if (++cache->files >= cache->loader_files) {
+        ngx_http_file_cache_loader_sleep(cache);
+
+    } else {
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache loader time elapsed: %M", elapsed);
+
+        if (elapsed >= cache->loader_threshold) {
+            ngx_http_file_cache_loader_sleep(cache);
+        }
+    }
+
+    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    u_char                 *p;
+    size_t                  level;
+    ngx_int_t               n;
+    ngx_uint_t              i, dir;
+    ngx_http_file_cache_t  *cache;
+
+    if (path->len >= 5
+        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    cache = ctx->data;
+
+    if (cache->unmodified == NULL
+        || path->len != cache->path->name.len + cache->path->len)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * the directories of the last level not modified after the snapshot
+     * have no files besides those already loaded from the snapshot
+     */
+
+    p = path->data + cache->path->name.len;
+    dir = 0;
+
+    for (i = 0; i < NGX_MAX_PATH_LEVEL; i++) {
+        level = cache->path->level[i];
+
+        if (level == 0) {
+            break;
+        }
+
+        n = ngx_hextoi(p + 1, level);
+
+        if (n == NGX_ERROR) {
+            return NGX_OK;
+        }
+
+        dir = (dir << (4 * level)) | n;
+        p += 1 + level;
+    }
+
+    if (ctx->mtime >= cache->sh->snapshot) {
+        return NGX_OK;
+    }
+
+    cache->unmodified[dir / 8] |= 1 << (dir % 8);
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
+{
+    ngx_msleep(cache->loader_sleep);
+
+    ngx_time_update();
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+{
+    u_char                 *p;
+    ngx_int_t               n;
+    ngx_uint_t              i;
+    ngx_http_cache_t        c;
+    ngx_http_file_cache_t  *cache;
+
+    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * Temporary files in cache have a suffix consisting of a dot
+     * followed by 10 digits.
+     */
+
+    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
+        && name->data[name->len - 10 - 1] == '.')
+    {
+        return NGX_OK;
+    }
+
+    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
+                      "cache file \"%s\" is too small", name->data);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
+    cache = ctx->data;
+
+    c.length = ctx->size;
+    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+
+    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
+        n = ngx_hextoi(p, 2);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        p += 2;
+
+        c.key[i] = (u_char) n;
+    }
+
+    return ngx_http_file_cache_add(cache, &c);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    ngx_shm_shard_t              *shard;
+    ngx_rbtree_key_t              node_key;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *fcs;
+
+    ngx_memcpy((u_char *) &node_key, c->key, sizeof(ngx_rbtree_key_t));
+
+    shard = ngx_http_file_cache_shard(cache, node_key);
+    fcs = ngx_http_file_cache_shard_data(shard);
+
+    ngx_shm_shard_lock(shard);
+
+    fcn = ngx_http_file_cache_lookup(fcs, c->key);
+
+    if (fcn == NULL) {
+
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_http_file_cache_set_watermark(cache);
+
+            if (cache->fail_time != ngx_time()) {
+                cache->fail_time = ngx_time();
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                           "could not allocate node%s", cache->shpool->log_ctx);
+            }
+
+            ngx_shm_shard_unlock(shard);
+            return NGX_ERROR;
+        }
+
+        (void) ngx_atomic_fetch_add(&cache->sh->count, 1);
+
+        fcn->node.key = node_key;
+
+        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        ngx_rbtree_insert(&fcs->rbtree, &fcn->node);
+
+        fcn->uses = 1;
+        fcn->exists = 1;
+        fcn->fs_size = c->fs_size;
+
+        (void) ngx_atomic_fetch_add(&cache->sh->size, c->fs_size);
+
+    } else {
+        if (fcn->unverified) {
+
+            /* the file may be replaced after the snapshot */
+
+            fcn->unverified = 0;
+            fcn->uniq = 0;
+
+            if (fcn->exists) {
+                (void) ngx_atomic_fetch_add(&cache->sh->size,
+                                            c->fs_size - fcn->fs_size);
+                fcn->fs_size = c->fs_size;
+            }
         }
 
-        q = ngx_queue_last(&cache->sh->queue);
+        ngx_queue_remove(&fcn->queue);
+    }
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    fcn->expire = ngx_time() + cache->inactive;
 
-        wait = fcn->expire - now;
+    ngx_queue_insert_head(&fcs->queue, &fcn->queue);
 
-        if (wait > 0) {
-            wait = wait > 10 ? 10 : wait;
-            break;
+    ngx_shm_shard_unlock(shard);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "http file cache delete: \"%s\"", path->data);
+
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", path->data);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
+{
+    ngx_uint_t  count;
+
+    count = cache->sh->count;
+
+    cache->sh->watermark = count - count / 8;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache watermark: %ui", cache->sh->watermark);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_snapshot_load(ngx_http_file_cache_t *cache)
+{
+    size_t                                  size;
+    ssize_t                                 n;
+    uint32_t                                crc32;
+    ngx_msec_t                              start, elapsed;
+    ngx_uint_t                              i, valid;
+    ngx_http_file_cache_snapshot_t         *ss;
+    ngx_http_file_cache_snapshot_entry_t   *entry;
+    ngx_http_file_cache_snapshot_block_t    block;
+    ngx_http_file_cache_snapshot_header_t   header;
+
+    if (cache->snapshot == 0) {
+        cache->sh->restoring = 0;
+        return NGX_OK;
+    }
+
+    valid = 0;
+    ss = cache->snapshot_state;
+
+    if (ss == NULL) {
+        ss = ngx_calloc(sizeof(ngx_http_file_cache_snapshot_t), ngx_cycle->log);
+        if (ss == NULL) {
+            cache->sh->restoring = 0;
+            return NGX_OK;
         }
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
-                       fcn->count, fcn->exists,
-                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+        ss->file.name = cache->snapshot_name;
+        ss->file.log = ngx_cycle->log;
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            goto next;
+        ss->file.fd = ngx_open_file(ss->file.name.data, NGX_FILE_RDONLY,
+                                    NGX_FILE_OPEN, 0);
+
+        if (ss->file.fd == NGX_INVALID_FILE) {
+            if (ngx_errno != NGX_ENOENT) {
+                ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                              ngx_open_file_n " \"%s\" failed",
+                              ss->file.name.data);
+            }
+
+            ngx_free(ss);
+            cache->sh->restoring = 0;
+            return NGX_OK;
         }
 
-        if (fcn->deleting) {
-            wait = 1;
+        cache->snapshot_state = ss;
+
+        n = ngx_read_file(&ss->file, (u_char *) &header, sizeof(header), 0);
+
+        if (n != (ssize_t) sizeof(header)) {
+            goto invalid;
+        }
+
+        crc32 = header.crc32;
+        header.crc32 = 0;
+
+        if (header.magic != NGX_HTTP_FILE_CACHE_SNAPSHOT_MAGIC
+            || header.version != NGX_HTTP_FILE_CACHE_SNAPSHOT_VERSION
+            || header.entry_size != sizeof(ngx_http_file_cache_snapshot_entry_t)
+            || header.bsize != cache->bsize
+            || crc32 != ngx_crc32_short((u_char *) &header, sizeof(header)))
+        {
+            goto invalid;
+        }
+
+        ss->time = (time_t) header.time;
+        ss->offset = sizeof(header);
+
+        ss->buf = ngx_alloc(NGX_HTTP_FILE_CACHE_SNAPSHOT_BLOCK
+                            * sizeof(ngx_http_file_cache_snapshot_entry_t),
+                            ngx_cycle->log);
+        if (ss->buf == NULL) {
+            goto done;
+        }
+    }
+
+    start = ngx_current_msec;
+
+    for ( ;; ) {
+
+        if (ngx_quit || ngx_terminate) {
+
+            /* the next cache manager starts anew */
+
+            ngx_http_file_cache_snapshot_close(cache);
+            return NGX_AGAIN;
+        }
+
+        n = ngx_read_file(&ss->file, (u_char *) &block, sizeof(block),
+                          ss->offset);
+
+        if (n == 0) {
+            valid = 1;
             break;
         }
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+        if (n != (ssize_t) sizeof(block)
+            || block.entries == 0
+            || block.entries > NGX_HTTP_FILE_CACHE_SNAPSHOT_BLOCK)
+        {
+            goto invalid;
+        }
+
+        size = block.entries * sizeof(ngx_http_file_cache_snapshot_entry_t);
+
+        n = ngx_read_file(&ss->file, ss->buf, size,
+                          ss->offset + sizeof(block));
+
+        if (n != (ssize_t) size
+            || block.crc32 != ngx_crc32_long(ss->buf, size))
+        {
+            goto invalid;
+        }
+
+        ss->offset += sizeof(block) + size;
+
+        entry = (ngx_http_file_cache_snapshot_entry_t *) ss->buf;
+
+        for (i = 0; i < block.entries; i++) {
+            if (ngx_http_file_cache_snapshot_add(cache, &entry[i]) != NGX_OK) {
+
+                /* the entries left are to be found by the loader */
+                goto done;
+            }
+
+            ss->entries++;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - start));
+
+        if (elapsed >= cache->manager_threshold) {
+            return NGX_AGAIN;
+        }
+    }
+
+    goto done;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0,
+                  "cache snapshot \"%s\" is invalid", ss->file.name.data);
+
+done:
+
+    /*
+     * the loader only walks the directories modified after the snapshot
+     * if all entries of the snapshot are loaded, and otherwise walks
+     * the whole cache
+     */
+
+    if (valid) {
+        cache->sh->snapshot = ss->time;
+    }
+
+    if (ss->entries) {
+        cache->sh->unverified = 1;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V snapshot %ui entries",
+                  &cache->path->name, ss->entries);
+
+    ngx_http_file_cache_snapshot_close(cache);
+
+    cache->sh->restoring = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_snapshot_add(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_snapshot_entry_t *entry)
+{
+    ngx_shm_shard_t              *shard;
+    ngx_rbtree_key_t              node_key;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *fcs;
+
+    ngx_memcpy((u_char *) &node_key, entry->key, sizeof(ngx_rbtree_key_t));
+
+    shard = ngx_http_file_cache_shard(cache, node_key);
+    fcs = ngx_http_file_cache_shard_data(shard);
+
+    ngx_shm_shard_lock(shard);
+
+    /* the entry may be already added by a worker */
+
+    if (ngx_http_file_cache_lookup(fcs, entry->key)) {
+        ngx_shm_shard_unlock(shard);
+        return NGX_OK;
+    }
+
+    fcn = ngx_slab_calloc_locked(cache->shpool,
+                                 sizeof(ngx_http_file_cache_node_t));
+    if (fcn == NULL) {
+        ngx_http_file_cache_set_watermark(cache);
+        ngx_shm_shard_unlock(shard);
+        return NGX_ERROR;
+    }
+
+    (void) ngx_atomic_fetch_add(&cache->sh->count, 1);
+    (void) ngx_atomic_fetch_add(&cache->sh->size, entry->fs_size);
+
+    fcn->node.key = node_key;
+
+    ngx_memcpy(fcn->key, &entry->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    ngx_rbtree_insert(&fcs->rbtree, &fcn->node);
+
+    fcn->uses = 1;
+    fcn->exists = 1;
+    fcn->unverified = 1;
+    fcn->uniq = entry->uniq;
+    fcn->expire = entry->expire;
+    fcn->fs_size = entry->fs_size;
+    fcn->body_start = entry->body_start;
+
+    /* entries already expired are queued to be removed first */
+
+    if (fcn->expire <= ngx_time()) {
+        ngx_queue_insert_tail(&fcs->queue, &fcn->queue);
+
+    } else {
+        ngx_queue_insert_head(&fcs->queue, &fcn->queue);
+    }
+
+    ngx_shm_shard_unlock(shard);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_snapshot_write(ngx_http_file_cache_t *cache)
+{
+    size_t                                  size;
+    time_t                                  snapshot;
+    ngx_uint_t                              n, visited, entries;
+    ngx_msec_t                              start, elapsed;
+    ngx_shm_shard_t                        *shard;
+    ngx_rbtree_node_t                      *node, *sentinel;
+    ngx_http_file_cache_node_t             *fcn;
+    ngx_http_file_cache_shard_t            *fcs;
+    ngx_http_file_cache_snapshot_t         *ss;
+    ngx_http_file_cache_snapshot_entry_t   *entry;
+    ngx_http_file_cache_snapshot_block_t   *block;
+    ngx_http_file_cache_snapshot_header_t   header;
+
+    ss = cache->snapshot_state;
+
+    if (ss == NULL) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache snapshot: \"%s\"",
+                       cache->snapshot_name.data);
+
+        ss = ngx_calloc(sizeof(ngx_http_file_cache_snapshot_t), ngx_cycle->log);
+        if (ss == NULL) {
+            return NGX_ERROR;
+        }
+
+        ss->buf = ngx_alloc(sizeof(ngx_http_file_cache_snapshot_block_t)
+                            + NGX_HTTP_FILE_CACHE_SNAPSHOT_BLOCK
+                              * sizeof(ngx_http_file_cache_snapshot_entry_t),
+                            ngx_cycle->log);
+        if (ss->buf == NULL) {
+            ngx_free(ss);
+            return NGX_ERROR;
+        }
+
+        ss->file.name = cache->snapshot_temp;
+        ss->file.log = ngx_cycle->log;
+
+        ss->file.fd = ngx_open_file(ss->file.name.data, NGX_FILE_WRONLY,
+                                    NGX_FILE_TRUNCATE,
+                                    NGX_FILE_DEFAULT_ACCESS);
+
+        if (ss->file.fd == NGX_INVALID_FILE) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed",
+                          ss->file.name.data);
+            ngx_free(ss->buf);
+            ngx_free(ss);
+            return NGX_ERROR;
+        }
+
+        cache->snapshot_state = ss;
+
+        /* the directories modified after this time are walked on start */
+
+        ss->time = ngx_time();
+        ss->offset = sizeof(ngx_http_file_cache_snapshot_header_t);
+    }
+
+    block = (ngx_http_file_cache_snapshot_block_t *) ss->buf;
+    entry = (ngx_http_file_cache_snapshot_entry_t *) (block + 1);
+
+    start = ngx_current_msec;
+
+    while (ss->shard < cache->nshards) {
+
+        if (ngx_quit || ngx_terminate) {
+            goto failed;
+        }
+
+        shard = ngx_shm_shard(cache->shm_zone, ss->shard);
+        fcs = ngx_http_file_cache_shard_data(shard);
+
+        sentinel = fcs->rbtree.sentinel;
 
         /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
+         * the shard is copied in parts, each part continues
+         * with the node following the last one copied
          */
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        n = 0;
+
+        ngx_shm_shard_lock(shard);
+
+        if (ss->next) {
+            node = ngx_http_file_cache_snapshot_next(fcs, ss->key);
+
+        } else {
+            node = fcs->rbtree.root;
+
+            if (node != sentinel) {
+                node = ngx_rbtree_min(node, sentinel);
+            }
+        }
+
+        for (visited = 0;
+             node != sentinel && visited < NGX_HTTP_FILE_CACHE_SNAPSHOT_BLOCK;
+             visited++)
+        {
+            fcn = (ngx_http_file_cache_node_t *) node;
+
+            ngx_memcpy(ss->key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(&ss->key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+            if (fcn->exists && !fcn->deleting) {
+                ngx_memcpy(entry[n].key, ss->key, NGX_HTTP_CACHE_KEY_LEN);
+                entry[n].uniq = fcn->uniq;
+                entry[n].expire = fcn->expire;
+                entry[n].fs_size = fcn->fs_size;
+                entry[n].body_start = fcn->body_start;
+                n++;
+            }
+
+            node = ngx_rbtree_next(&fcs->rbtree, node);
+
+            if (node == NULL) {
+                node = sentinel;
+            }
+        }
+
+        ngx_shm_shard_unlock(shard);
+
+        if (node == sentinel) {
+            ss->shard++;
+            ss->next = 0;
+
+        } else {
+            ss->next = 1;
+        }
+
+        if (n) {
+            size = n * sizeof(ngx_http_file_cache_snapshot_entry_t);
+
+            block->entries = n;
+            block->crc32 = ngx_crc32_long((u_char *) entry, size);
+
+            size += sizeof(ngx_http_file_cache_snapshot_block_t);
+
+            if (ngx_write_file(&ss->file, ss->buf, size, ss->offset)
+                == NGX_ERROR)
+            {
+                goto failed;
+            }
+
+            ss->offset += size;
+            ss->entries += n;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - start));
+
+        if (elapsed >= cache->manager_threshold) {
+            return NGX_AGAIN;
+        }
+    }
+
+    ngx_memzero(&header, sizeof(header));
+
+    header.magic = NGX_HTTP_FILE_CACHE_SNAPSHOT_MAGIC;
+    header.version = NGX_HTTP_FILE_CACHE_SNAPSHOT_VERSION;
+    header.entry_size = sizeof(ngx_http_file_cache_snapshot_entry_t);
+    header.bsize = cache->bsize;
+    header.time = ss->time;
+
+    header.crc32 = ngx_crc32_short((u_char *) &header, sizeof(header));
+
+    if (ngx_write_file(&ss->file, (u_char *) &header, sizeof(header), 0)
+        == NGX_ERROR)
+    {
+        goto failed;
+    }
+
+    snapshot = ss->time;
+    entries = ss->entries;
+
+    ngx_http_file_cache_snapshot_close(cache);
+
+    if (ngx_rename_file(cache->snapshot_temp.data, cache->snapshot_name.data)
+        == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      cache->snapshot_temp.data, cache->snapshot_name.data);
+        return NGX_ERROR;
+    }
+
+    cache->sh->snapshot = snapshot;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache snapshot: %ui entries", entries);
+
+    return NGX_OK;
+
+failed:
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    ngx_http_file_cache_snapshot_close(cache);
 
-next:
+    if (ngx_delete_file(cache->snapshot_temp.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed",
+                      cache->snapshot_temp.data);
+    }
 
-        if (++cache->files >= cache->manager_files) {
-            wait = 0;
-            break;
-        }
+    return NGX_ERROR;
+}
 
-        ngx_time_update();
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+static void
+ngx_http_file_cache_snapshot_close(ngx_http_file_cache_t *cache)
+{
+    ngx_http_file_cache_snapshot_t  *ss;
 
-        if (elapsed >= cache->manager_threshold) {
-            wait = 0;
-            break;
-        }
+    ss = cache->snapshot_state;
+
+    if (ngx_close_file(ss->file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", ss->file.name.data);
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (ss->buf) {
+        ngx_free(ss->buf);
+    }
 
-    ngx_free(name);
+    ngx_free(ss);
 
-    return wait;
+    cache->snapshot_state = NULL;
 }
 
 
 static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
+ngx_http_file_cache_snapshot_verify(ngx_http_file_cache_t *cache)
 {
-    u_char                      *p;
-    size_t                       len;
-    ngx_path_t                  *path;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_uint_t                    i, dir, visited, removed;
+    ngx_shm_shard_t              *shard;
+    ngx_rbtree_node_t            *node, *next, *sentinel;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *fcs;
+    u_char                        key[NGX_HTTP_CACHE_KEY_LEN];
 
-    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    /*
+     * the nodes loaded from the snapshot and not found by the loader
+     * have no files anymore unless their directories were skipped
+     * as not modified; a directory which does not exist is not skipped
+     */
 
-    if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
+    removed = 0;
 
-        path = cache->path;
-        p = name + path->name.len + 1 + path->len;
-        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        p = ngx_hex_dump(p, fcn->key, len);
-        *p = '\0';
+    for (i = 0; i < cache->nshards; i++) {
 
-        fcn->count++;
-        fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        shard = ngx_shm_shard(cache->shm_zone, i);
+        fcs = ngx_http_file_cache_shard_data(shard);
 
-        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
-        ngx_create_hashed_filename(path, name, len);
+        sentinel = fcs->rbtree.sentinel;
+        node = NULL;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: \"%s\"", name);
+        do {
+            ngx_shm_shard_lock(shard);
 
-        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                          ngx_delete_file_n " \"%s\" failed", name);
-        }
+            if (node == NULL) {
+                node = fcs->rbtree.root;
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
-        fcn->count--;
-        fcn->deleting = 0;
-    }
+                if (node != sentinel) {
+                    node = ngx_rbtree_min(node, sentinel);
+                }
 
-    if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
-    }
-}
+            } else {
+                node = ngx_http_file_cache_snapshot_next(fcs, key);
+            }
 
+            for (visited = 0;
+                 node != sentinel
+                 && visited < NGX_HTTP_FILE_CACHE_SNAPSHOT_BLOCK;
+                 visited++)
+            {
+                fcn = (ngx_http_file_cache_node_t *) node;
+                next = ngx_rbtree_next(&fcs->rbtree, node);
 
-static ngx_msec_t
-ngx_http_file_cache_manager(void *data)
-{
-    ngx_http_file_cache_t  *cache = data;
+                if (next == NULL) {
+                    next = sentinel;
+                }
 
-    off_t       size, free;
-    time_t      wait;
-    ngx_msec_t  elapsed, next;
-    ngx_uint_t  count, watermark;
+                ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+                ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                           NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+                if (!fcn->unverified) {
+                    node = next;
+                    continue;
+                }
 
-    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
+                fcn->unverified = 0;
 
-    if (next == 0) {
-        next = cache->manager_sleep;
-        goto done;
-    }
+                if (cache->unmodified) {
+                    dir = ngx_http_file_cache_snapshot_dir(cache, key);
 
-    for ( ;; ) {
-        ngx_shmtx_lock(&cache->shpool->mutex);
+                    if (cache->unmodified[dir / 8] & (1 << (dir % 8))) {
+                        node = next;
+                        continue;
+                    }
+                }
 
-        size = cache->sh->size;
-        count = cache->sh->count;
-        watermark = cache->sh->watermark;
+                if (fcn->count == 0) {
+                    if (fcn->exists) {
+                        (void) ngx_atomic_fetch_add(&cache->sh->size,
+                                                    -fcn->fs_size);
+                    }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+                    ngx_http_file_cache_memory_drop(cache, fcn);
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache size: %O c:%ui w:%i",
-                       size, count, (ngx_int_t) watermark);
+                    ngx_queue_remove(&fcn->queue);
+                    ngx_rbtree_delete(&fcs->rbtree, &fcn->node);
+                    ngx_slab_free_locked(cache->shpool, fcn);
+                    (void) ngx_atomic_fetch_add(&cache->sh->count, -1);
 
-        if (size < cache->max_size && count < watermark) {
+                    removed++;
+                }
 
-            if (!cache->min_free) {
-                break;
+                node = next;
             }
 
-            free = ngx_fs_available(cache->path->name.data);
+            ngx_shm_shard_unlock(shard);
 
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                           "http file cache free: %O", free);
+        } while (node != sentinel);
+    }
 
-            if (free > cache->min_free) {
-                break;
-            }
-        }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache snapshot verify: %ui removed", removed);
+}
 
-        wait = ngx_http_file_cache_forced_expire(cache);
 
-        if (wait > 0) {
-            next = (ngx_msec_t) wait * 1000;
-            break;
+static ngx_rbtree_node_t *
+ngx_http_file_cache_snapshot_next(ngx_http_file_cache_shard_t *fcs,
+    u_char *key)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *next, *sentinel;
+    ngx_http_file_cache_node_t  *fcn;
+
+    /* the first node with the key greater than the given one */
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = fcs->rbtree.root;
+    sentinel = fcs->rbtree.sentinel;
+    next = sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            next = node;
+            node = node->left;
+            continue;
         }
 
-        if (ngx_quit || ngx_terminate) {
-            break;
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
         }
 
-        if (++cache->files >= cache->manager_files) {
-            next = cache->manager_sleep;
-            break;
+        /* node_key == node->key */
+
+        fcn = (ngx_http_file_cache_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc < 0) {
+            next = node;
+            node = node->left;
+
+        } else {
+            node = node->right;
         }
+    }
 
-        ngx_time_update();
+    return next;
+}
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
 
-        if (elapsed >= cache->manager_threshold) {
-            next = cache->manager_sleep;
+static ngx_uint_t
+ngx_http_file_cache_snapshot_dir(ngx_http_file_cache_t *cache, u_char *key)
+{
+    size_t      len, level;
+    ngx_uint_t  n, dir;
+    u_char      hex[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    /* the directory of the key, see ngx_create_hashed_filename() */
+
+    (void) ngx_hex_dump(hex, key, NGX_HTTP_CACHE_KEY_LEN);
+
+    len = 2 * NGX_HTTP_CACHE_KEY_LEN;
+    dir = 0;
+
+    for (n = 0; n < NGX_MAX_PATH_LEVEL; n++) {
+        level = cache->path->level[n];
+
+        if (level == 0) {
             break;
         }
+
+        len -= level;
+        dir = (dir << (4 * level)) | ngx_hextoi(&hex[len], level);
     }
 
-done:
+    return dir;
+}
 
-    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache manager: %ui e:%M n:%M",
-                   cache->files, elapsed, next);
+static ngx_int_t
+ngx_http_file_cache_memory_init(ngx_http_file_cache_t *cache)
+{
+    u_char      *sketch;
+    ngx_uint_t   width;
 
-    return next;
+    /*
+     * the frequency sketch has 4 rows of 8-bit counters, about 4 counters
+     * per an average object of 4 kilobytes
+     */
+
+    width = 1024;
+
+    while (width < cache->memory / 1024) {
+        width *= 2;
+    }
+
+    sketch = ngx_slab_calloc(cache->shpool, 4 * width);
+    if (sketch == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->sh->samples = 0;
+    cache->sh->sketch_mask = width - 1;
+
+    ngx_memory_barrier();
+
+    cache->sh->sketch = sketch;
+
+    return NGX_OK;
 }
 
 
 static void
-ngx_http_file_cache_loader(void *data)
+ngx_http_file_cache_memory_count(ngx_http_file_cache_t *cache, u_char *key)
 {
-    ngx_http_file_cache_t  *cache = data;
+    u_char      *sketch, *p;
+    uint32_t     hash;
+    ngx_uint_t   i, width;
 
-    ngx_tree_ctx_t  tree;
+    sketch = cache->sh->sketch;
 
-    if (!cache->sh->cold || cache->sh->loading) {
+    if (sketch == NULL) {
         return;
     }
 
-    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
-        return;
-    }
+    /*
+     * the counters are updated without locks, a lost increment
+     * does not matter for a frequency estimate
+     */
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache loader");
+    width = cache->sh->sketch_mask + 1;
 
-    tree.init_handler = NULL;
-    tree.file_handler = ngx_http_file_cache_manage_file;
-    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
-    tree.post_tree_handler = ngx_http_file_cache_noop;
-    tree.spec_handler = ngx_http_file_cache_delete_file;
-    tree.data = cache;
-    tree.alloc = 0;
-    tree.log = ngx_cycle->log;
+    for (i = 0; i < 4; i++) {
+        ngx_memcpy(&hash, &key[i * sizeof(uint32_t)], sizeof(uint32_t));
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+        p = &sketch[i * width + (hash & (width - 1))];
 
-    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
-        cache->sh->loading = 0;
-        return;
+        if (*p < 255) {
+            (*p)++;
+        }
     }
 
-    cache->sh->cold = 0;
-    cache->sh->loading = 0;
+    if (ngx_atomic_fetch_add(&cache->sh->samples, 1) != 10 * width) {
+        return;
+    }
 
-    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
-                  "http file cache: %V %.3fM, bsize: %uz",
-                  &cache->path->name,
-                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
-                  cache->bsize);
-}
+    /* aging: halve all counters to forget old popularity */
 
+    for (i = 0; i < 4 * width; i++) {
+        sketch[i] >>= 1;
+    }
 
-static ngx_int_t
-ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    return NGX_OK;
+    cache->sh->samples = 0;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+static ngx_uint_t
+ngx_http_file_cache_memory_frequency(ngx_http_file_cache_t *cache,
+    u_char *key)
 {
-    ngx_msec_t              elapsed;
-    ngx_http_file_cache_t  *cache;
+    u_char      *sketch;
+    uint32_t     hash;
+    ngx_uint_t   i, width, n, min;
 
-    cache = ctx->data;
+    sketch = cache->sh->sketch;
 
-    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
-        (void) ngx_http_file_cache_delete_file(ctx, path);
+    if (sketch == NULL) {
+        return 0;
     }
 
-    if (++cache->files >= cache->loader_files) {
-        ngx_http_file_cache_loader_sleep(cache);
-
-    } else {
-        ngx_time_update();
+    width = cache->sh->sketch_mask + 1;
+    min = 255;
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    for (i = 0; i < 4; i++) {
+        ngx_memcpy(&hash, &key[i * sizeof(uint32_t)], sizeof(uint32_t));
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache loader time elapsed: %M", elapsed);
+        n = sketch[i * width + (hash & (width - 1))];
 
-        if (elapsed >= cache->loader_threshold) {
-            ngx_http_file_cache_loader_sleep(cache);
+        if (n < min) {
+            min = n;
         }
     }
 
-    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+    return min;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+static void
+ngx_http_file_cache_memory_admit(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c)
 {
-    if (path->len >= 5
-        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
+    size_t                         size;
+    ngx_uint_t                     tries, frequency;
+    ngx_queue_t                   *q;
+    ngx_shm_shard_t               *shard, *vshard;
+    ngx_http_file_cache_sh_t      *sh;
+    ngx_http_file_cache_node_t    *fcn;
+    ngx_http_file_cache_object_t  *obj, *victim;
+
+    sh = cache->sh;
+
+    if (sh->sketch == NULL) {
+        return;
+    }
+
+    /* the object is copied before locking, it is freed if not admitted */
+
+    size = sizeof(ngx_http_file_cache_object_t) + (size_t) c->length;
+
+    obj = ngx_slab_alloc(cache->shpool, size);
+    if (obj == NULL) {
+        return;
+    }
+
+    obj->node = NULL;
+    obj->count = 1;
+    obj->length = (size_t) c->length;
+    obj->referenced = 0;
+    ngx_memcpy(obj->key, c->key, NGX_HTTP_CACHE_KEY_LEN);
+    ngx_memcpy(obj + 1, c->buf->pos, obj->length);
+
+    frequency = ngx_http_file_cache_memory_frequency(cache, c->key);
+
+    fcn = c->node;
+    shard = ngx_http_file_cache_shard(cache, fcn->node.key);
+
+    ngx_shm_shard_lock(shard);
+
+    /* the file may have been replaced or deleted since it was read */
+
+    if (fcn->object
+        || !fcn->exists
+        || fcn->deleting
+        || (fcn->uniq && fcn->uniq != c->uniq))
     {
-        return NGX_DECLINED;
+        goto failed;
     }
 
-    return NGX_OK;
-}
+    ngx_shmtx_lock(&sh->memory_mutex);
+
+    /*
+     * TinyLFU admission: the least recently used objects are evicted
+     * to make room only if the new object is used more frequently;
+     * the objects used since they were queued are given a second chance
+     */
+
+    for (tries = 0; sh->memory_size + size > cache->memory; tries++) {
+
+        if (tries == 16 || ngx_queue_empty(&sh->memory)) {
+            goto rejected;
+        }
+
+        q = ngx_queue_last(&sh->memory);
+        victim = ngx_queue_data(q, ngx_http_file_cache_object_t, queue);
+
+        if (victim->referenced) {
+            victim->referenced = 0;
+            ngx_queue_remove(q);
+            ngx_queue_insert_head(&sh->memory, q);
+            continue;
+        }
 
+        if (frequency <= ngx_http_file_cache_memory_frequency(cache,
+                                                              victim->key))
+        {
+            goto rejected;
+        }
 
-static void
-ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
-{
-    ngx_msleep(cache->loader_sleep);
+        /* the node of the victim is locked to detach it from pinning */
 
-    ngx_time_update();
+        vshard = ngx_http_file_cache_shard(cache, victim->node->node.key);
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
-}
+        if (vshard != shard && !ngx_shmtx_trylock(&vshard->mutex)) {
+            ngx_queue_remove(q);
+            ngx_queue_insert_head(&sh->memory, q);
+            continue;
+        }
 
+        ngx_queue_remove(q);
+        victim->node->object = NULL;
 
-static ngx_int_t
-ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
-{
-    u_char                 *p;
-    ngx_int_t               n;
-    ngx_uint_t              i;
-    ngx_http_cache_t        c;
-    ngx_http_file_cache_t  *cache;
+        if (vshard != shard) {
+            ngx_shm_shard_unlock(vshard);
+        }
 
-    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
-        return NGX_ERROR;
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache memory evict: %uz", victim->length);
+
+        ngx_http_file_cache_memory_release(cache, victim);
     }
 
-    /*
-     * Temporary files in cache have a suffix consisting of a dot
-     * followed by 10 digits.
-     */
+    obj->node = fcn;
+    fcn->object = obj;
 
-    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
-        && name->data[name->len - 10 - 1] == '.')
-    {
-        return NGX_OK;
-    }
+    ngx_queue_insert_head(&sh->memory, &obj->queue);
 
-    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
-                      "cache file \"%s\" is too small", name->data);
-        return NGX_ERROR;
-    }
+    (void) ngx_atomic_fetch_add(&sh->memory_size, size);
 
-    ngx_memzero(&c, sizeof(ngx_http_cache_t));
-    cache = ctx->data;
+    ngx_shmtx_unlock(&sh->memory_mutex);
 
-    c.length = ctx->size;
-    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+    ngx_shm_shard_unlock(shard);
 
-    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache memory admit: %uz f:%ui",
+                   obj->length, frequency);
 
-    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
-        n = ngx_hextoi(p, 2);
+    return;
 
-        if (n == NGX_ERROR) {
-            return NGX_ERROR;
-        }
+rejected:
 
-        p += 2;
+    ngx_shmtx_unlock(&sh->memory_mutex);
 
-        c.key[i] = (u_char) n;
-    }
+failed:
 
-    return ngx_http_file_cache_add(cache, &c);
+    ngx_shm_shard_unlock(shard);
+
+    ngx_slab_free(cache->shpool, obj);
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+static ngx_uint_t
+ngx_http_file_cache_memory_shrink(ngx_http_file_cache_t *cache,
+    ngx_shm_shard_t *shard)
 {
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_uint_t                     tries;
+    ngx_queue_t                   *q;
+    ngx_shm_shard_t               *vshard;
+    ngx_http_file_cache_sh_t      *sh;
+    ngx_http_file_cache_object_t  *victim;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    /*
+     * called with the shard locked when no node can be allocated,
+     * the least recently used object is evicted regardless of its frequency
+     */
 
-    fcn = ngx_http_file_cache_lookup(cache, c->key);
+    sh = cache->sh;
 
-    if (fcn == NULL) {
+    if (sh->sketch == NULL) {
+        return 0;
+    }
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_http_file_cache_set_watermark(cache);
+    ngx_shmtx_lock(&sh->memory_mutex);
 
-            if (cache->fail_time != ngx_time()) {
-                cache->fail_time = ngx_time();
-                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                           "could not allocate node%s", cache->shpool->log_ctx);
-            }
+    for (tries = 0; tries < 16; tries++) {
 
-            ngx_shmtx_unlock(&cache->shpool->mutex);
-            return NGX_ERROR;
+        if (ngx_queue_empty(&sh->memory)) {
+            break;
         }
 
-        cache->sh->count++;
+        q = ngx_queue_last(&sh->memory);
+        victim = ngx_queue_data(q, ngx_http_file_cache_object_t, queue);
 
-        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+        vshard = ngx_http_file_cache_shard(cache, victim->node->node.key);
 
-        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        if (vshard != shard && !ngx_shmtx_trylock(&vshard->mutex)) {
+            ngx_queue_remove(q);
+            ngx_queue_insert_head(&sh->memory, q);
+            continue;
+        }
 
-        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+        ngx_queue_remove(q);
+        victim->node->object = NULL;
 
-        fcn->uses = 1;
-        fcn->exists = 1;
-        fcn->fs_size = c->fs_size;
+        if (vshard != shard) {
+            ngx_shm_shard_unlock(vshard);
+        }
 
-        cache->sh->size += c->fs_size;
+        ngx_shmtx_unlock(&sh->memory_mutex);
 
-    } else {
-        ngx_queue_remove(&fcn->queue);
-    }
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache memory shrink: %uz", victim->length);
 
-    fcn->expire = ngx_time() + cache->inactive;
+        ngx_http_file_cache_memory_release(cache, victim);
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        return 1;
+    }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&sh->memory_mutex);
 
-    return NGX_OK;
+    return 0;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+static void
+ngx_http_file_cache_memory_drop(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
 {
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "http file cache delete: \"%s\"", path->data);
+    ngx_http_file_cache_object_t  *obj;
 
-    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
-                      ngx_delete_file_n " \"%s\" failed", path->data);
+    /* called with the shard of the node locked */
+
+    obj = fcn->object;
+
+    if (obj == NULL) {
+        return;
     }
 
-    return NGX_OK;
+    ngx_shmtx_lock(&cache->sh->memory_mutex);
+
+    ngx_queue_remove(&obj->queue);
+
+    ngx_shmtx_unlock(&cache->sh->memory_mutex);
+
+    fcn->object = NULL;
+
+    ngx_http_file_cache_memory_release(cache, obj);
 }
 
 
 static void
-ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
+ngx_http_file_cache_memory_release(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_object_t *obj)
 {
-    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+    size_t  size;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache watermark: %ui", cache->sh->watermark);
+    /*
+     * the node holds a reference to its object, and each request
+     * serving the object holds another one
+     */
+
+    if (ngx_atomic_fetch_add(&obj->count, -1) != 1) {
+        return;
+    }
+
+    size = sizeof(ngx_http_file_cache_object_t) + obj->length;
+
+    (void) ngx_atomic_fetch_add(&cache->sh->memory_size,
+                                -(ngx_atomic_int_t) size);
+
+    ngx_slab_free(cache->shpool, obj);
 }
 
 
@@ -2314,6 +5234,53 @@ ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status)
 }
 
 
+ngx_int_t
+ngx_http_file_cache_stat(ngx_cycle_t *cycle, ngx_uint_t n,
+    ngx_http_file_cache_stat_t *stat)
+{
+    ngx_uint_t                 i, k;
+    ngx_path_t               **path;
+    ngx_http_file_cache_t     *cache;
+    ngx_http_file_cache_sh_t  *sh;
+
+    path = cycle->paths.elts;
+
+    for (i = 0; i < cycle->paths.nelts; i++) {
+
+        if (path[i]->manager != ngx_http_file_cache_manager) {
+            continue;
+        }
+
+        if (n--) {
+            continue;
+        }
+
+        cache = path[i]->data;
+        sh = cache->sh;
+
+        ngx_memzero(stat, sizeof(ngx_http_file_cache_stat_t));
+
+        stat->name = &cache->shm_zone->shm.name;
+
+        if (sh == NULL) {
+            return NGX_OK;
+        }
+
+        stat->backlog = sh->unlink_backlog;
+        stat->backlog_size = sh->unlink_backlog_size;
+        stat->unlink_time = sh->unlink_time;
+
+        for (k = 0; k < NGX_HTTP_FILE_CACHE_UNLINK_BUCKETS; k++) {
+            stat->buckets[k] = sh->unlink_buckets[k];
+        }
+
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+
 char *
 ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -2321,13 +5288,13 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     off_t                   max_size, min_free;
     u_char                 *last, *p;
-    time_t                  inactive;
-    ssize_t                 size;
+    time_t                  inactive, snapshot;
+    ssize_t                 size, memory, memory_max_object;
     ngx_str_t               s, name, *value;
-    ngx_int_t               loader_files, manager_files;
+    ngx_int_t               loader_files, manager_files, shards;
     ngx_msec_t              loader_sleep, manager_sleep, loader_threshold,
                             manager_threshold;
-    ngx_uint_t              i, n, use_temp_path;
+    ngx_uint_t              i, n, use_temp_path, hugepages, key_hash;
     ngx_array_t            *caches;
     ngx_http_file_cache_t  *cache, **ce;
 
@@ -2342,8 +5309,12 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     use_temp_path = 1;
+    hugepages = 0;
+    shards = 1;
+    key_hash = NGX_HTTP_CACHE_KEY_MD5;
 
     inactive = 600;
+    snapshot = 0;
 
     loader_files = 100;
     loader_sleep = 50;
@@ -2358,6 +5329,9 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     max_size = NGX_MAX_OFF_T_VALUE;
     min_free = 0;
 
+    memory = 0;
+    memory_max_object = 16384;
+
     value = cf->args->elts;
 
     cache->path->name = value[1];
@@ -2428,6 +5402,60 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "key_hash=", 9) == 0) {
+
+            if (ngx_strcmp(&value[i].data[9], "md5") == 0) {
+                key_hash = NGX_HTTP_CACHE_KEY_MD5;
+
+            } else if (ngx_strcmp(&value[i].data[9], "xxh3") == 0) {
+                key_hash = NGX_HTTP_CACHE_KEY_XXH3;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid key_hash value \"%V\", "
+                                   "it must be \"md5\" or \"xxh3\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "unlink=threads", 14) == 0
+            && (value[i].len == 14 || value[i].data[14] == '='))
+        {
+#if (NGX_THREADS)
+            ngx_thread_pool_t  *tp;
+
+            if (value[i].len > 15) {
+                s.len = value[i].len - 15;
+                s.data = value[i].data + 15;
+
+                tp = ngx_thread_pool_add(cf, &s);
+
+            } else {
+                tp = ngx_thread_pool_add(cf, NULL);
+            }
+
+            if (tp == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            /* the pool is started in the cache manager process */
+
+            ngx_thread_pool_use_in_helpers(tp);
+
+            cache->thread_pool = tp;
+
+            continue;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"unlink=threads\" "
+                               "is unsupported on this platform");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
         if (ngx_strncmp(value[i].data, "keys_zone=", 10) == 0) {
 
             name.data = value[i].data + 10;
@@ -2477,6 +5505,21 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "snapshot=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            snapshot = ngx_parse_time(&s, 1);
+            if (snapshot == (time_t) NGX_ERROR || snapshot == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid snapshot value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "max_size=", 9) == 0) {
 
             s.len = value[i].len - 9;
@@ -2515,6 +5558,44 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "memory=", 7) == 0) {
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            memory = ngx_parse_size(&s);
+            if (memory == NGX_ERROR || memory == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid memory value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+#else
+            ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                               "memory is not supported "
+                               "on this platform, ignored");
+#endif
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory_max_object=", 18) == 0) {
+
+            s.len = value[i].len - 18;
+            s.data = value[i].data + 18;
+
+            memory_max_object = ngx_parse_size(&s);
+            if (memory_max_object == NGX_ERROR || memory_max_object == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid memory_max_object value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "loader_files=", 13) == 0) {
 
             loader_files = ngx_atoi(value[i].data + 13, value[i].len - 13);
@@ -2599,6 +5680,24 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (shards <= 0 || shards > 1024) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid number of shards \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "hugepages") == 0) {
+            hugepages = 1;
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -2611,6 +5710,12 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (memory >= size) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "memory must be less than keys zone size");
+        return NGX_CONF_ERROR;
+    }
+
     cache->path->manager = ngx_http_file_cache_manager;
     cache->path->loader = ngx_http_file_cache_loader;
     cache->path->data = cache;
@@ -2638,16 +5743,64 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (snapshot) {
+        cache->snapshot = snapshot;
+
+        n = cache->path->name.len + sizeof("/snapshot") - 1;
+
+        cache->snapshot_name.len = n;
+        cache->snapshot_name.data = ngx_pnalloc(cf->pool, n + 1);
+        if (cache->snapshot_name.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(cache->snapshot_name.data, "%V/snapshot%Z",
+                    &cache->path->name);
+
+        cache->snapshot_temp.len = n + sizeof(".tmp") - 1;
+        cache->snapshot_temp.data = ngx_pnalloc(cf->pool,
+                                                cache->snapshot_temp.len + 1);
+        if (cache->snapshot_temp.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(cache->snapshot_temp.data, "%V.tmp%Z",
+                    &cache->snapshot_name);
+    }
 
+    cache->shm_zone->shm.hugepages = hugepages;
+    cache->nshards = shards;
     cache->shm_zone->init = ngx_http_file_cache_init;
     cache->shm_zone->data = cache;
 
+    ngx_queue_init(&cache->waiters);
+
+    /* the generations of the shards seen by the worker, and the current */
+
+    cache->generations = ngx_pcalloc(cf->pool,
+                                     2 * shards * sizeof(ngx_atomic_uint_t));
+    if (cache->generations == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
     cache->use_temp_path = use_temp_path;
 
+    /*
+     * the header version identifies the key hash, so files keyed with
+     * md5 keep the format older versions read and write
+     */
+
+    cache->key_hash = key_hash;
+    cache->version = (key_hash == NGX_HTTP_CACHE_KEY_XXH3)
+                     ? NGX_HTTP_CACHE_XXH3_VERSION : NGX_HTTP_CACHE_VERSION;
+
     cache->inactive = inactive;
     cache->max_size = max_size;
     cache->min_free = min_free;
 
+    cache->memory = memory;
+    cache->memory_max_object = memory_max_object;
+
     caches = (ngx_array_t *) (confp + cmd->offset);
 
     ce = ngx_array_push(caches);
@@ -12,6 +12,7 @@
 ngx_uint_t  ngx_pagesize;
 ngx_uint_t  ngx_pagesize_shift;
 ngx_uint_t  ngx_cacheline_size;
+ngx_uint_t  ngx_hugepage_size;
 
 
 void *
@@ -88,3 +89,55 @@ ngx_memalign(size_t alignment, size_t size, ngx_log_t *log)
 }
 
 #endif
+
+
+#if (NGX_HAVE_HUGEPAGES)
+
+/*
+ * the memory is never freed: it is used for arrays which live as long
+ * as the worker process
+ */
+
+void *
+ngx_alloc_huge(size_t size, ngx_log_t *log)
+{
+    void  *p;
+
+    if (ngx_hugepage_size) {
+        size = ngx_align(size, ngx_hugepage_size);
+
+        p = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                 MAP_ANON|MAP_PRIVATE|MAP_HUGETLB, -1, 0);
+
+        if (p != MAP_FAILED) {
+            ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, log, 0,
+                           "mmap(MAP_HUGETLB): %p:%uz", p, size);
+            return p;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, log, ngx_errno,
+                       "mmap(MAP_HUGETLB, %uz) failed", size);
+    }
+
+    /* no reserved huge pages, fall back to transparent huge pages */
+
+    p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
+
+    if (p == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+                      "mmap(MAP_ANON|MAP_PRIVATE, %uz) failed", size);
+        return NULL;
+    }
+
+    if (madvise(p, size, MADV_HUGEPAGE) == -1) {
+        ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, log, ngx_errno,
+                       "madvise(MADV_HUGEPAGE, %uz) failed", size);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, log, 0,
+                   "mmap(MADV_HUGEPAGE): %p:%uz", p, size);
+
+    return p;
+}
+
+#endif
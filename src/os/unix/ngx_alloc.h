@@ -37,9 +37,21 @@ void *ngx_memalign(size_t alignment, size_t size, ngx_log_t *log);
 #endif
 
 
+#if (NGX_HAVE_HUGEPAGES)
+
+void *ngx_alloc_huge(size_t size, ngx_log_t *log);
+
+#else
+
+#define ngx_alloc_huge(size, log)  ngx_alloc(size, log)
+
+#endif
+
+
 extern ngx_uint_t  ngx_pagesize;
 extern ngx_uint_t  ngx_pagesize_shift;
 extern ngx_uint_t  ngx_cacheline_size;
+extern ngx_uint_t  ngx_hugepage_size;
 
 
 #endif /* _NGX_ALLOC_H_INCLUDED_ */
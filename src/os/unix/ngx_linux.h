@@ -13,4 +13,37 @@ ngx_chain_t *ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in,
     off_t limit);
 
 
+#if (NGX_HAVE_MSG_ZEROCOPY)
+
+#define NGX_LINUX_ZEROCOPY_SENDS  64
+
+
+typedef struct {
+    off_t                       size;
+    uint32_t                    seq;
+    unsigned                    done:1;
+} ngx_linux_zerocopy_send_t;
+
+
+typedef struct {
+    off_t                       pending;
+    size_t                      threshold;
+
+    uint32_t                    seq;
+    ngx_uint_t                  head;
+    ngx_uint_t                  nsends;
+    ngx_linux_zerocopy_send_t   sends[NGX_LINUX_ZEROCOPY_SENDS];
+
+    unsigned                    copied:1;
+} ngx_linux_zerocopy_t;
+
+
+ngx_int_t ngx_linux_zerocopy(ngx_connection_t *c, size_t threshold);
+ngx_chain_t *ngx_linux_zerocopy_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit);
+void ngx_linux_zerocopy_close(ngx_connection_t *c);
+
+#endif
+
+
 #endif /* _NGX_LINUX_H_INCLUDED_ */
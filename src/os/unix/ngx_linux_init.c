@@ -13,6 +13,11 @@ u_char  ngx_linux_kern_ostype[50];
 u_char  ngx_linux_kern_osrelease[50];
 
 
+#if (NGX_HAVE_HUGEPAGES)
+static void ngx_linux_hugepage_size(ngx_log_t *log);
+#endif
+
+
 static ngx_os_io_t ngx_linux_io = {
     ngx_unix_recv,
     ngx_readv_chain,
@@ -48,6 +53,10 @@ ngx_os_specific_init(ngx_log_t *log)
 
     ngx_os_io = ngx_linux_io;
 
+#if (NGX_HAVE_HUGEPAGES)
+    ngx_linux_hugepage_size(log);
+#endif
+
     return NGX_OK;
 }
 
@@ -58,3 +67,55 @@ ngx_os_specific_status(ngx_log_t *log)
     ngx_log_error(NGX_LOG_NOTICE, log, 0, "OS: %s %s",
                   ngx_linux_kern_ostype, ngx_linux_kern_osrelease);
 }
+
+
+#if (NGX_HAVE_HUGEPAGES)
+
+static void
+ngx_linux_hugepage_size(ngx_log_t *log)
+{
+    u_char    *p, *last, buf[4096];
+    ssize_t    n;
+    ngx_fd_t   fd;
+
+    fd = ngx_open_file("/proc/meminfo", NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        return;
+    }
+
+    n = ngx_read_fd(fd, buf, sizeof(buf) - 1);
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"/proc/meminfo\" failed");
+    }
+
+    if (n <= 0) {
+        return;
+    }
+
+    buf[n] = '\0';
+
+    /* "Hugepagesize:       2048 kB" */
+
+    p = (u_char *) ngx_strstr(buf, "Hugepagesize:");
+    if (p == NULL) {
+        return;
+    }
+
+    p += sizeof("Hugepagesize:") - 1;
+    last = buf + n;
+
+    while (p < last && *p == ' ') {
+        p++;
+    }
+
+    for (n = 0; p < last && *p >= '0' && *p <= '9'; p++) {
+        n = n * 10 + *p - '0';
+    }
+
+    ngx_hugepage_size = n * 1024;
+}
+
+#endif
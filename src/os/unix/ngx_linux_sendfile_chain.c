@@ -25,6 +25,14 @@ static ssize_t ngx_linux_sendfile_thread(ngx_connection_t *c, ngx_buf_t *file,
 static void ngx_linux_sendfile_thread_handler(void *data, ngx_log_t *log);
 #endif
 
+static ngx_int_t ngx_linux_tcp_nopush(ngx_connection_t *c);
+
+#if (NGX_HAVE_MSG_ZEROCOPY)
+static off_t ngx_linux_zerocopy_release(ngx_connection_t *c);
+
+static ngx_uint_t  ngx_linux_zerocopy_disabled;
+#endif
+
 
 /*
  * On Linux up to 2.4.21 sendfile() (syscall #187) works with 32-bit
@@ -49,11 +57,9 @@ static void ngx_linux_sendfile_thread_handler(void *data, ngx_log_t *log);
 ngx_chain_t *
 ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 {
-    int            tcp_nodelay;
     off_t          send, prev_send;
     size_t         file_size, sent;
     ssize_t        n;
-    ngx_err_t      err;
     ngx_buf_t     *file;
     ngx_event_t   *wev;
     ngx_chain_t   *cl;
@@ -99,61 +105,8 @@ ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
             && cl
             && cl->buf->in_file)
         {
-            /* the TCP_CORK and TCP_NODELAY are mutually exclusive */
-
-            if (c->tcp_nodelay == NGX_TCP_NODELAY_SET) {
-
-                tcp_nodelay = 0;
-
-                if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
-                               (const void *) &tcp_nodelay, sizeof(int)) == -1)
-                {
-                    err = ngx_socket_errno;
-
-                    /*
-                     * there is a tiny chance to be interrupted, however,
-                     * we continue a processing with the TCP_NODELAY
-                     * and without the TCP_CORK
-                     */
-
-                    if (err != NGX_EINTR) {
-                        wev->error = 1;
-                        ngx_connection_error(c, err,
-                                             "setsockopt(TCP_NODELAY) failed");
-                        return NGX_CHAIN_ERROR;
-                    }
-
-                } else {
-                    c->tcp_nodelay = NGX_TCP_NODELAY_UNSET;
-
-                    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                                   "no tcp_nodelay");
-                }
-            }
-
-            if (c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
-
-                if (ngx_tcp_nopush(c->fd) == -1) {
-                    err = ngx_socket_errno;
-
-                    /*
-                     * there is a tiny chance to be interrupted, however,
-                     * we continue a processing without the TCP_CORK
-                     */
-
-                    if (err != NGX_EINTR) {
-                        wev->error = 1;
-                        ngx_connection_error(c, err,
-                                             ngx_tcp_nopush_n " failed");
-                        return NGX_CHAIN_ERROR;
-                    }
-
-                } else {
-                    c->tcp_nopush = NGX_TCP_NOPUSH_SET;
-
-                    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                                   "tcp_nopush");
-                }
+            if (ngx_linux_tcp_nopush(c) != NGX_OK) {
+                return NGX_CHAIN_ERROR;
             }
         }
 
@@ -442,3 +395,547 @@ again:
 }
 
 #endif /* NGX_THREADS */
+
+
+static ngx_int_t
+ngx_linux_tcp_nopush(ngx_connection_t *c)
+{
+    int           tcp_nodelay;
+    ngx_err_t     err;
+    ngx_event_t  *wev;
+
+    wev = c->write;
+
+    /* the TCP_CORK and TCP_NODELAY are mutually exclusive */
+
+    if (c->tcp_nodelay == NGX_TCP_NODELAY_SET) {
+
+        tcp_nodelay = 0;
+
+        if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
+                       (const void *) &tcp_nodelay, sizeof(int)) == -1)
+        {
+            err = ngx_socket_errno;
+
+            /*
+             * there is a tiny chance to be interrupted, however,
+             * we continue a processing with the TCP_NODELAY
+             * and without the TCP_CORK
+             */
+
+            if (err != NGX_EINTR) {
+                wev->error = 1;
+                ngx_connection_error(c, err, "setsockopt(TCP_NODELAY) failed");
+                return NGX_ERROR;
+            }
+
+        } else {
+            c->tcp_nodelay = NGX_TCP_NODELAY_UNSET;
+
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0, "no tcp_nodelay");
+        }
+    }
+
+    if (c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
+
+        if (ngx_tcp_nopush(c->fd) == -1) {
+            err = ngx_socket_errno;
+
+            /*
+             * there is a tiny chance to be interrupted, however,
+             * we continue a processing without the TCP_CORK
+             */
+
+            if (err != NGX_EINTR) {
+                wev->error = 1;
+                ngx_connection_error(c, err, ngx_tcp_nopush_n " failed");
+                return NGX_ERROR;
+            }
+
+        } else {
+            c->tcp_nopush = NGX_TCP_NOPUSH_SET;
+
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0, "tcp_nopush");
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_MSG_ZEROCOPY)
+
+/*
+ * Data sent with MSG_ZEROCOPY are not copied to the socket buffer, so
+ * the memory must not be reused until the kernel reports it is released
+ * via the socket error queue.  The bufs are advanced only when the data
+ * are released, so for the callers the data remain unsent and the bufs
+ * are not reused.  The data already passed to the kernel are skipped when
+ * the chain is sent again.
+ */
+
+ngx_int_t
+ngx_linux_zerocopy(ngx_connection_t *c, size_t threshold)
+{
+    int                    zerocopy;
+    ngx_err_t              err;
+    ngx_linux_zerocopy_t  *zc;
+
+    zc = c->zerocopy;
+
+    if (zc) {
+        zc->threshold = threshold;
+        return NGX_OK;
+    }
+
+    if (threshold == 0
+        || c->send_chain != ngx_linux_sendfile_chain
+        || (c->sockaddr->sa_family != AF_INET
+#if (NGX_HAVE_INET6)
+            && c->sockaddr->sa_family != AF_INET6
+#endif
+           ))
+    {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_linux_zerocopy_disabled) {
+        return NGX_DECLINED;
+    }
+
+    zerocopy = 1;
+
+    if (setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY,
+                   (const void *) &zerocopy, sizeof(int))
+        == -1)
+    {
+        err = ngx_socket_errno;
+
+        if (err == NGX_ENOPROTOOPT || err == NGX_EINVAL) {
+
+            /* not supported by the kernel, do not try again */
+
+            ngx_linux_zerocopy_disabled = 1;
+
+            ngx_log_error(NGX_LOG_WARN, c->log, err,
+                          "setsockopt(SO_ZEROCOPY) failed, "
+                          "zerocopy is disabled");
+            return NGX_DECLINED;
+        }
+
+        ngx_connection_error(c, err, "setsockopt(SO_ZEROCOPY) failed");
+        return NGX_ERROR;
+    }
+
+    zc = ngx_pcalloc(c->pool, sizeof(ngx_linux_zerocopy_t));
+    if (zc == NULL) {
+        return NGX_ERROR;
+    }
+
+    zc->threshold = threshold;
+
+    c->zerocopy = zc;
+    c->send_chain = ngx_linux_zerocopy_chain;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0, "zerocopy");
+
+    return NGX_OK;
+}
+
+
+/*
+ * a connection may be closed while the kernel still references the data
+ * sent, and the memory is reused as soon as the pool is destroyed; the
+ * connection is reset, so the kernel drops the data instead of sending
+ * them later, possibly with the contents of another response
+ */
+
+void
+ngx_linux_zerocopy_close(ngx_connection_t *c)
+{
+    struct linger  linger;
+
+    if (c->zerocopy == NULL || c->zerocopy->nsends == 0) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "zerocopy reset, %ui sends not released",
+                   c->zerocopy->nsends);
+
+    linger.l_onoff = 1;
+    linger.l_linger = 0;
+
+    if (setsockopt(c->fd, SOL_SOCKET, SO_LINGER,
+                   (const void *) &linger, sizeof(struct linger)) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_socket_errno,
+                      "setsockopt(SO_LINGER) failed");
+    }
+}
+
+
+ngx_chain_t *
+ngx_linux_zerocopy_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
+{
+    int                         flags;
+    off_t                       send, skip, size, released;
+    u_char                     *p;
+    ssize_t                     n;
+    ngx_err_t                   err;
+    ngx_buf_t                  *b;
+    ngx_uint_t                  niovs;
+    ngx_chain_t                *cl;
+    ngx_event_t                *wev;
+    struct msghdr               msg;
+    struct iovec                iovs[NGX_IOVS_PREALLOCATE];
+    ngx_linux_zerocopy_t       *zc;
+    ngx_linux_zerocopy_send_t  *s;
+
+    wev = c->write;
+
+    if (!wev->ready) {
+        return in;
+    }
+
+    zc = c->zerocopy;
+
+    if (zc->nsends) {
+        released = ngx_linux_zerocopy_release(c);
+
+        if (released == NGX_ERROR) {
+            return NGX_CHAIN_ERROR;
+        }
+
+        in = ngx_chain_update_sent(in, released);
+    }
+
+    if (zc->nsends == 0) {
+
+        if (zc->threshold == 0 || zc->copied) {
+            return ngx_linux_sendfile_chain(c, in, limit);
+        }
+
+        /* the header before a file is sent as usual */
+
+        size = 0;
+
+        for (cl = in; cl; cl = cl->next) {
+            if (cl->buf->in_file) {
+                break;
+            }
+
+            size += ngx_buf_size(cl->buf);
+
+            if (size >= (off_t) zc->threshold) {
+                break;
+            }
+        }
+
+        if (size < (off_t) zc->threshold) {
+            return ngx_linux_sendfile_chain(c, in, limit);
+        }
+    }
+
+    if (limit == 0 || limit > (off_t) (NGX_SENDFILE_MAXSIZE - ngx_pagesize)) {
+        limit = NGX_SENDFILE_MAXSIZE - ngx_pagesize;
+    }
+
+    ngx_memzero(&msg, sizeof(struct msghdr));
+    msg.msg_iov = iovs;
+
+    send = 0;
+
+    for ( ;; ) {
+
+        /* skip the data passed to the kernel and not yet released */
+
+        skip = zc->pending;
+        size = 0;
+        niovs = 0;
+
+        for (cl = in;
+             cl && niovs < NGX_IOVS_PREALLOCATE && send + size < limit;
+             cl = cl->next)
+        {
+            b = cl->buf;
+
+            if (ngx_buf_special(b)) {
+                continue;
+            }
+
+            if (b->in_file) {
+                break;
+            }
+
+            if (!ngx_buf_in_memory(b)) {
+                ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                              "bad buf in zerocopy chain "
+                              "t:%d r:%d f:%d %p %p-%p %p %O-%O",
+                              b->temporary, b->recycled, b->in_file,
+                              b->start, b->pos, b->last, b->file,
+                              b->file_pos, b->file_last);
+
+                ngx_debug_point();
+
+                return NGX_CHAIN_ERROR;
+            }
+
+            n = b->last - b->pos;
+
+            if (skip >= n) {
+                skip -= n;
+                continue;
+            }
+
+            p = b->pos + skip;
+            n -= skip;
+            skip = 0;
+
+            if (n > limit - send - size) {
+                n = limit - send - size;
+            }
+
+            if (niovs
+                && p == (u_char *) iovs[niovs - 1].iov_base
+                        + iovs[niovs - 1].iov_len)
+            {
+                iovs[niovs - 1].iov_len += n;
+
+            } else {
+                iovs[niovs].iov_base = (void *) p;
+                iovs[niovs].iov_len = n;
+                niovs++;
+            }
+
+            size += n;
+        }
+
+        if (size == 0) {
+            break;
+        }
+
+        /* set TCP_CORK if the data are followed by a file */
+
+        if (c->tcp_nopush == NGX_TCP_NOPUSH_UNSET
+            && cl
+            && cl->buf->in_file)
+        {
+            if (ngx_linux_tcp_nopush(c) != NGX_OK) {
+                return NGX_CHAIN_ERROR;
+            }
+        }
+
+        msg.msg_iovlen = niovs;
+
+        flags = 0;
+
+        if (size >= (off_t) zc->threshold
+            && zc->threshold
+            && !zc->copied
+            && zc->nsends < NGX_LINUX_ZEROCOPY_SENDS)
+        {
+            flags = MSG_ZEROCOPY;
+        }
+
+    eintr:
+
+        n = sendmsg(c->fd, &msg, flags);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "sendmsg: %z of %O zerocopy:%d",
+                       n, size, flags == MSG_ZEROCOPY);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            switch (err) {
+            case NGX_EAGAIN:
+                ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                               "sendmsg() not ready");
+                wev->ready = 0;
+                return in;
+
+            case NGX_EINTR:
+                ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                               "sendmsg() was interrupted");
+                goto eintr;
+
+            case ENOBUFS:
+                if (flags) {
+                    /* the optmem limit is reached, send with copying */
+                    flags = 0;
+                    goto eintr;
+                }
+
+                /* fall through */
+
+            default:
+                wev->error = 1;
+                ngx_connection_error(c, err, "sendmsg() failed");
+                return NGX_CHAIN_ERROR;
+            }
+        }
+
+        c->sent += n;
+        send += n;
+
+        if (flags) {
+            s = &zc->sends[(zc->head + zc->nsends++)
+                           % NGX_LINUX_ZEROCOPY_SENDS];
+
+            s->size = n;
+            s->seq = zc->seq++;
+            s->done = 0;
+
+            zc->pending += n;
+
+        } else if (zc->nsends) {
+
+            /* released together with the preceding zerocopy send */
+
+            s = &zc->sends[(zc->head + zc->nsends - 1)
+                           % NGX_LINUX_ZEROCOPY_SENDS];
+
+            s->size += n;
+
+            zc->pending += n;
+
+        } else {
+            in = ngx_chain_update_sent(in, n);
+        }
+
+        if (n < size) {
+            wev->ready = 0;
+            return in;
+        }
+
+        if (send >= limit) {
+            return in;
+        }
+    }
+
+    if (zc->nsends) {
+
+        /* wait for the release notification, it is reported as an error */
+
+        wev->ready = 0;
+        return in;
+    }
+
+    if (in) {
+        return ngx_linux_sendfile_chain(c, in, limit - send);
+    }
+
+    return NULL;
+}
+
+
+static off_t
+ngx_linux_zerocopy_release(ngx_connection_t *c)
+{
+    u_char                      control[CMSG_SPACE(
+                                    sizeof(struct sock_extended_err)
+                                    + sizeof(ngx_sockaddr_t))];
+    off_t                       released;
+    ssize_t                     n;
+    uint32_t                    lo, hi;
+    ngx_err_t                   err;
+    ngx_uint_t                  i;
+    struct msghdr               msg;
+    struct cmsghdr             *cmsg;
+    struct sock_extended_err   *ee;
+    ngx_linux_zerocopy_t       *zc;
+    ngx_linux_zerocopy_send_t  *s;
+
+    zc = c->zerocopy;
+
+    for ( ;; ) {
+        ngx_memzero(&msg, sizeof(struct msghdr));
+
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        n = recvmsg(c->fd, &msg, MSG_ERRQUEUE);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EAGAIN) {
+                break;
+            }
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            c->write->error = 1;
+            ngx_connection_error(c, err, "recvmsg(MSG_ERRQUEUE) failed");
+            return NGX_ERROR;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg);
+             cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!(cmsg->cmsg_level == IPPROTO_IP
+                  && cmsg->cmsg_type == IP_RECVERR)
+#if (NGX_HAVE_INET6)
+                && !(cmsg->cmsg_level == IPPROTO_IPV6
+                     && cmsg->cmsg_type == IPV6_RECVERR)
+#endif
+               )
+            {
+                continue;
+            }
+
+            ee = (struct sock_extended_err *) CMSG_DATA(cmsg);
+
+            if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee->ee_errno != 0) {
+                continue;
+            }
+
+            lo = ee->ee_info;
+            hi = ee->ee_data;
+
+            ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "zerocopy released: %uD-%uD copied:%d",
+                           lo, hi,
+                           (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0);
+
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                /* the kernel copied the data anyway, e.g., on loopback */
+                zc->copied = 1;
+            }
+
+            for (i = 0; i < zc->nsends; i++) {
+                s = &zc->sends[(zc->head + i) % NGX_LINUX_ZEROCOPY_SENDS];
+
+                if ((uint32_t) (s->seq - lo) <= (uint32_t) (hi - lo)) {
+                    s->done = 1;
+                }
+            }
+        }
+    }
+
+    released = 0;
+
+    while (zc->nsends) {
+        s = &zc->sends[zc->head];
+
+        if (!s->done) {
+            break;
+        }
+
+        released += s->size;
+
+        zc->head = (zc->head + 1) % NGX_LINUX_ZEROCOPY_SENDS;
+        zc->nsends--;
+    }
+
+    zc->pending -= released;
+
+    return released;
+}
+
+#endif /* NGX_HAVE_MSG_ZEROCOPY */
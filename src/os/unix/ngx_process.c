@@ -564,8 +564,9 @@ ngx_process_get_status(void)
 static void
 ngx_unlock_mutexes(ngx_pid_t pid)
 {
-    ngx_uint_t        i;
+    ngx_uint_t        i, n;
     ngx_shm_zone_t   *shm_zone;
+    ngx_shm_shard_t  *shard;
     ngx_list_part_t  *part;
     ngx_slab_pool_t  *sp;
 
@@ -604,6 +605,31 @@ ngx_unlock_mutexes(ngx_pid_t pid)
                           "shared memory zone \"%V\" was locked by %P",
                           &shm_zone[i].shm.name, pid);
         }
+
+        if (ngx_slab_force_unlock(sp, pid)) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "shared memory zone \"%V\" allocator was locked "
+                          "by %P", &shm_zone[i].shm.name, pid);
+        }
+
+        n = ngx_slab_reclaim_magazines(sp, pid);
+
+        if (n) {
+            ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                          "shared memory zone \"%V\": %ui chunks cached "
+                          "by %P returned", &shm_zone[i].shm.name, n, pid);
+        }
+
+        for (n = 0; n < shm_zone[i].nshards; n++) {
+            shard = ngx_shm_shard(&shm_zone[i], n);
+
+            if (ngx_shmtx_force_unlock(&shard->mutex, pid)) {
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                              "shared memory zone \"%V\" shard %ui "
+                              "was locked by %P",
+                              &shm_zone[i].shm.name, n, pid);
+            }
+        }
     }
 }
 
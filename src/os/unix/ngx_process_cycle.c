@@ -21,6 +21,10 @@ static ngx_uint_t ngx_reap_children(ngx_cycle_t *cycle);
 static void ngx_master_process_exit(ngx_cycle_t *cycle);
 static void ngx_worker_process_cycle(ngx_cycle_t *cycle, void *data);
 static void ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker);
+#if (NGX_HAVE_NUMA && NGX_HAVE_INCOMING_CPU)
+static void ngx_set_incoming_cpu(ngx_cycle_t *cycle, ngx_int_t worker,
+    ngx_cpuset_t *cpu_affinity);
+#endif
 static void ngx_worker_process_exit(ngx_cycle_t *cycle);
 static void ngx_channel_handler(ngx_event_t *ev);
 static void ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data);
@@ -856,6 +860,26 @@ ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker)
         if (cpu_affinity) {
             ngx_setaffinity(cpu_affinity, cycle->log);
         }
+
+#if (NGX_HAVE_NUMA)
+
+        n = ngx_get_numa_node(worker);
+
+        if (n != NGX_ERROR) {
+
+            /*
+             * the memory allocated by the worker from now on, including
+             * pools and buffers, comes from the node it runs on
+             */
+
+            ngx_set_numa_node(n, cycle->log);
+
+#if (NGX_HAVE_INCOMING_CPU)
+            ngx_set_incoming_cpu(cycle, worker, cpu_affinity);
+#endif
+        }
+
+#endif
     }
 
 #if (NGX_HAVE_PR_SET_DUMPABLE)
@@ -945,6 +969,49 @@ ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker)
 }
 
 
+#if (NGX_HAVE_NUMA && NGX_HAVE_INCOMING_CPU)
+
+static void
+ngx_set_incoming_cpu(ngx_cycle_t *cycle, ngx_int_t worker,
+    ngx_cpuset_t *cpu_affinity)
+{
+    int               cpu;
+    ngx_uint_t        i;
+    ngx_listening_t  *ls;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, cpu_affinity)) {
+            break;
+        }
+    }
+
+    /*
+     * the kernel prefers a reuseport socket bound to the CPU which
+     * received the packet, so with RSS queues steered to the worker
+     * CPUs connections stay on the node of the NIC queue
+     */
+
+    ls = cycle->listening.elts;
+    for (i = 0; i < cycle->listening.nelts; i++) {
+
+        if (!ls[i].reuseport || ls[i].worker != (ngx_uint_t) worker) {
+            continue;
+        }
+
+        if (setsockopt(ls[i].fd, SOL_SOCKET, SO_INCOMING_CPU,
+                       (const void *) &cpu, sizeof(int))
+            == -1)
+        {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                          "setsockopt(SO_INCOMING_CPU, %d) for %V failed",
+                          cpu, &ls[i].addr_text);
+        }
+    }
+}
+
+#endif
+
+
 static void
 ngx_worker_process_exit(ngx_cycle_t *cycle)
 {
@@ -979,6 +1046,10 @@ ngx_worker_process_exit(ngx_cycle_t *cycle)
         }
     }
 
+    /* return chunks cached by the worker to shared memory zones */
+
+    ngx_slab_flush_magazines();
+
     /*
      * Copy ngx_cycle->log related data to the special static exit cycle,
      * log, and log file structures enough to allow a signal handler to log.
@@ -51,3 +51,174 @@ ngx_setaffinity(ngx_cpuset_t *cpu_affinity, ngx_log_t *log)
 }
 
 #endif
+
+
+#if (NGX_HAVE_NUMA)
+
+static ngx_int_t ngx_numa_read_list(char *name, ngx_cpuset_t *set,
+    ngx_log_t *log);
+
+
+unsigned long  ngx_numa_interleave;
+
+
+ngx_int_t
+ngx_numa_topology(ngx_pool_t *pool, ngx_cpuset_t **masks, ngx_uint_t **nodes,
+    ngx_log_t *log)
+{
+    char           name[64];
+    ngx_uint_t     i, n;
+    ngx_cpuset_t   online;
+
+    if (ngx_numa_read_list("/sys/devices/system/node/online", &online, log)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    n = CPU_COUNT(&online);
+
+    if (n == 0) {
+        return NGX_ERROR;
+    }
+
+    *masks = ngx_palloc(pool, n * sizeof(ngx_cpuset_t));
+    if (*masks == NULL) {
+        return NGX_ERROR;
+    }
+
+    *nodes = ngx_palloc(pool, n * sizeof(ngx_uint_t));
+    if (*nodes == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0, n = 0; i < CPU_SETSIZE; i++) {
+
+        if (!CPU_ISSET(i, &online)) {
+            continue;
+        }
+
+        ngx_sprintf((u_char *) name,
+                    "/sys/devices/system/node/node%ui/cpulist%Z", i);
+
+        if (ngx_numa_read_list(name, &(*masks)[n], log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        /* memory-only nodes have no CPUs to run workers on */
+
+        if (CPU_COUNT(&(*masks)[n]) == 0) {
+            continue;
+        }
+
+        (*nodes)[n++] = i;
+    }
+
+    return n ? (ngx_int_t) n : NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_numa_read_list(char *name, ngx_cpuset_t *set, ngx_log_t *log)
+{
+    u_char      *p, *last, buf[4096];
+    ssize_t      n;
+    ngx_fd_t     fd;
+    ngx_uint_t   from, to;
+
+    fd = ngx_open_file(name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", name);
+        return NGX_ERROR;
+    }
+
+    n = ngx_read_fd(fd, buf, sizeof(buf));
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+                      ngx_read_fd_n " \"%s\" failed", name);
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name);
+    }
+
+    if (n == -1) {
+        return NGX_ERROR;
+    }
+
+    /* a list of ranges like "0-15,32-47" */
+
+    CPU_ZERO(set);
+
+    p = buf;
+    last = buf + n;
+
+    while (p < last && *p >= '0' && *p <= '9') {
+
+        for (from = 0; p < last && *p >= '0' && *p <= '9'; p++) {
+            from = from * 10 + *p - '0';
+        }
+
+        to = from;
+
+        if (p < last && *p == '-') {
+            for (p++, to = 0; p < last && *p >= '0' && *p <= '9'; p++) {
+                to = to * 10 + *p - '0';
+            }
+        }
+
+        while (from <= to && from < CPU_SETSIZE) {
+            CPU_SET(from++, set);
+        }
+
+        if (p < last && *p == ',') {
+            p++;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_set_numa_node(ngx_uint_t node, ngx_log_t *log)
+{
+    unsigned long  mask;
+
+    if (node >= 8 * sizeof(unsigned long)) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "set_mempolicy(): using numa node #%ui", node);
+
+    mask = 1UL << node;
+
+    /* the memory of the node is preferred, others are used if it is full */
+
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, 8 * sizeof(mask))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "set_mempolicy() failed");
+    }
+}
+
+
+void
+ngx_numa_interleave_memory(void *addr, size_t size, ngx_log_t *log)
+{
+    if (syscall(SYS_mbind, addr, size, MPOL_INTERLEAVE, &ngx_numa_interleave,
+                8 * sizeof(ngx_numa_interleave), 0)
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "mbind(MPOL_INTERLEAVE, %uz) failed", size);
+    }
+}
+
+#endif
@@ -25,6 +25,17 @@ typedef cpuset_t  ngx_cpuset_t;
 
 void ngx_setaffinity(ngx_cpuset_t *cpu_affinity, ngx_log_t *log);
 
+#if (NGX_HAVE_NUMA)
+
+ngx_int_t ngx_numa_topology(ngx_pool_t *pool, ngx_cpuset_t **masks,
+    ngx_uint_t **nodes, ngx_log_t *log);
+void ngx_set_numa_node(ngx_uint_t node, ngx_log_t *log);
+void ngx_numa_interleave_memory(void *addr, size_t size, ngx_log_t *log);
+
+extern unsigned long  ngx_numa_interleave;
+
+#endif
+
 #else
 
 #define ngx_setaffinity(cpu_affinity, log)
@@ -11,19 +11,85 @@
 
 #if (NGX_HAVE_MAP_ANON)
 
+#if (NGX_HAVE_HUGEPAGES)
+
+/* huge page mappings are rounded up to the huge page size */
+
+#define ngx_shm_length(shm)                                                   \
+    (((shm)->hugepages && ngx_hugepage_size)                                  \
+         ? ngx_align((shm)->size, ngx_hugepage_size) : (shm)->size)
+
+#else
+
+#define ngx_shm_length(shm)  (shm)->size
+
+#endif
+
+
 ngx_int_t
 ngx_shm_alloc(ngx_shm_t *shm)
 {
-    shm->addr = (u_char *) mmap(NULL, shm->size,
+    size_t  size;
+
+    size = ngx_shm_length(shm);
+
+#if (NGX_HAVE_HUGEPAGES)
+
+    if (shm->hugepages && ngx_hugepage_size) {
+        shm->addr = (u_char *) mmap(NULL, size,
+                                    PROT_READ|PROT_WRITE,
+                                    MAP_ANON|MAP_SHARED|MAP_HUGETLB, -1, 0);
+
+        if (shm->addr != MAP_FAILED) {
+            ngx_log_error(NGX_LOG_NOTICE, shm->log, 0,
+                          "shared memory zone \"%V\" uses %uzK huge pages",
+                          &shm->name, ngx_hugepage_size >> 10);
+            goto done;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, shm->log, ngx_errno,
+                      "mmap(MAP_HUGETLB, %uz) for shared memory zone \"%V\" "
+                      "failed, trying transparent huge pages",
+                      size, &shm->name);
+    }
+
+#endif
+
+    shm->addr = (u_char *) mmap(NULL, size,
                                 PROT_READ|PROT_WRITE,
                                 MAP_ANON|MAP_SHARED, -1, 0);
 
     if (shm->addr == MAP_FAILED) {
         ngx_log_error(NGX_LOG_ALERT, shm->log, ngx_errno,
-                      "mmap(MAP_ANON|MAP_SHARED, %uz) failed", shm->size);
+                      "mmap(MAP_ANON|MAP_SHARED, %uz) failed", size);
         return NGX_ERROR;
     }
 
+#if (NGX_HAVE_HUGEPAGES)
+
+    if (shm->hugepages) {
+        if (madvise(shm->addr, size, MADV_HUGEPAGE) == -1) {
+            ngx_log_error(NGX_LOG_WARN, shm->log, ngx_errno,
+                          "madvise(MADV_HUGEPAGE) for shared memory zone "
+                          "\"%V\" failed", &shm->name);
+
+        } else {
+            ngx_log_error(NGX_LOG_NOTICE, shm->log, 0,
+                          "shared memory zone \"%V\" uses "
+                          "transparent huge pages", &shm->name);
+        }
+    }
+
+done:
+
+#endif
+
+#if (NGX_HAVE_NUMA)
+    if (ngx_numa_interleave) {
+        ngx_numa_interleave_memory(shm->addr, size, shm->log);
+    }
+#endif
+
     return NGX_OK;
 }
 
@@ -31,7 +97,7 @@ ngx_shm_alloc(ngx_shm_t *shm)
 void
 ngx_shm_free(ngx_shm_t *shm)
 {
-    if (munmap((void *) shm->addr, shm->size) == -1) {
+    if (munmap((void *) shm->addr, ngx_shm_length(shm)) == -1) {
         ngx_log_error(NGX_LOG_ALERT, shm->log, ngx_errno,
                       "munmap(%p, %uz) failed", shm->addr, shm->size);
     }
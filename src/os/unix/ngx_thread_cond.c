@@ -54,6 +54,21 @@ ngx_thread_cond_signal(ngx_thread_cond_t *cond, ngx_log_t *log)
 }
 
 
+ngx_int_t
+ngx_thread_cond_broadcast(ngx_thread_cond_t *cond, ngx_log_t *log)
+{
+    ngx_err_t  err;
+
+    err = pthread_cond_broadcast(cond);
+    if (err == 0) {
+        return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_EMERG, log, err, "pthread_cond_broadcast() failed");
+    return NGX_ERROR;
+}
+
+
 ngx_int_t
 ngx_thread_cond_wait(ngx_thread_cond_t *cond, ngx_thread_mutex_t *mtx,
     ngx_log_t *log)
@@ -32,6 +32,9 @@ typedef struct {
     ngx_flag_t                       next_upstream;
     ngx_flag_t                       proxy_protocol;
     ngx_flag_t                       half_close;
+#if (NGX_HAVE_SPLICE)
+    ngx_flag_t                       splice;
+#endif
     ngx_stream_upstream_local_t     *local;
     ngx_flag_t                       socket_keepalive;
 
@@ -78,6 +81,15 @@ static void ngx_stream_proxy_process(ngx_stream_session_t *s,
     ngx_uint_t from_upstream, ngx_uint_t do_write);
 static ngx_int_t ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
     ngx_uint_t from_upstream);
+#if (NGX_HAVE_SPLICE)
+static ngx_int_t ngx_stream_proxy_splice(ngx_stream_session_t *s,
+    ngx_uint_t from_upstream);
+static ngx_int_t ngx_stream_proxy_splice_test(ngx_connection_t *src,
+    ngx_connection_t *dst);
+static ngx_stream_upstream_splice_t *ngx_stream_proxy_splice_init(
+    ngx_stream_session_t *s);
+static void ngx_stream_proxy_splice_cleanup(void *data);
+#endif
 static void ngx_stream_proxy_next_upstream(ngx_stream_session_t *s);
 static void ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc);
 static u_char *ngx_stream_proxy_log_error(ngx_log_t *log, u_char *buf,
@@ -253,6 +265,17 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, half_close),
       NULL },
 
+#if (NGX_HAVE_SPLICE)
+
+    { ngx_string("proxy_splice"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, splice),
+      NULL },
+
+#endif
+
 #if (NGX_STREAM_SSL)
 
     { ngx_string("proxy_ssl"),
@@ -1647,7 +1670,9 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
 
         if (do_write && dst) {
 
-            if (*out || *busy || dst->buffered) {
+            if (*out || *busy
+                || (dst->buffered & ~NGX_STREAM_SPLICE_BUFFERED))
+            {
                 c->log->action = send_action;
 
                 rc = ngx_stream_top_filter(s, *out, from_upstream);
@@ -1667,6 +1692,24 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
             }
         }
 
+#if (NGX_HAVE_SPLICE)
+
+        if (pscf->splice && dst) {
+
+            rc = ngx_stream_proxy_splice(s, from_upstream);
+
+            if (rc == NGX_ERROR) {
+                ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+                return;
+            }
+
+            if (rc == NGX_OK) {
+                break;
+            }
+        }
+
+#endif
+
         size = b->end - b->last;
 
         if (size && src->read->ready && !src->read->delayed
@@ -1899,6 +1942,290 @@ ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
 }
 
 
+#if (NGX_HAVE_SPLICE)
+
+/*
+ * Once the data read into the buffers are sent, plain TCP data may be
+ * relayed through a pipe with splice(), without copying them to userspace.
+ */
+
+static ngx_int_t
+ngx_stream_proxy_splice(ngx_stream_session_t *s, ngx_uint_t from_upstream)
+{
+    off_t                         *received;
+    size_t                         limit_rate;
+    ssize_t                        n;
+    ngx_err_t                      err;
+    ngx_uint_t                     progress;
+    ngx_chain_t                  **out, **busy;
+    ngx_connection_t              *c, *pc, *src, *dst;
+    ngx_stream_upstream_t         *u;
+    ngx_stream_upstream_splice_t  *sp, **spp;
+
+    u = s->upstream;
+
+    c = s->connection;
+    pc = u->peer.connection;
+
+    if (from_upstream) {
+        src = pc;
+        dst = c;
+        limit_rate = u->download_rate;
+        received = &u->received;
+        out = &u->downstream_out;
+        busy = &u->downstream_busy;
+        spp = &u->upstream_splice;
+
+    } else {
+        src = c;
+        dst = pc;
+        limit_rate = u->upload_rate;
+        received = &s->received;
+        out = &u->upstream_out;
+        busy = &u->upstream_busy;
+        spp = &u->downstream_splice;
+    }
+
+    sp = *spp;
+
+    if (sp == NULL || sp->size == 0) {
+
+        /* the data in the buffers are sent first */
+
+        if (c->type != SOCK_STREAM
+            || *out || *busy || dst->buffered
+            || limit_rate
+            || src->read->eof
+            || ngx_stream_proxy_splice_test(src, dst) != NGX_OK)
+        {
+            return NGX_DECLINED;
+        }
+    }
+
+    if (sp == NULL) {
+        sp = ngx_stream_proxy_splice_init(s);
+        if (sp == NULL) {
+            return NGX_ERROR;
+        }
+
+        *spp = sp;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "stream proxy splice from %s",
+                       from_upstream ? "upstream" : "client");
+    }
+
+    do {
+        progress = 0;
+
+        if (sp->size && dst->write->ready) {
+
+            n = splice(sp->fd[0], NULL, dst->fd, NULL, sp->size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                           "splice to %d: %z", dst->fd, n);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err == NGX_EAGAIN) {
+                    dst->write->ready = 0;
+
+                } else if (err != NGX_EINTR) {
+                    dst->write->error = 1;
+                    ngx_connection_error(dst, err, "splice() failed");
+                    return NGX_ERROR;
+                }
+
+            } else {
+                sp->size -= n;
+                dst->sent += n;
+                progress = 1;
+            }
+        }
+
+        if (sp->size < sp->capacity && !sp->control
+            && src->read->ready && !src->read->eof && !src->read->error)
+        {
+            c->log->action = from_upstream
+                             ? "proxying and reading from upstream"
+                             : "proxying and reading from client";
+
+            n = splice(src->fd, NULL, sp->fd[1], NULL,
+                       sp->capacity - sp->size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                           "splice from %d: %z", src->fd, n);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err == NGX_EAGAIN) {
+
+                    /*
+                     * an empty socket and a pipe out of its buffers
+                     * are not distinguished, so the read event is not
+                     * reset until the pipe is empty
+                     */
+
+                    if (sp->size == 0) {
+                        src->read->ready = 0;
+                    }
+
+#if (NGX_STREAM_SSL)
+
+                } else if (err == NGX_EINVAL && src->ssl) {
+
+                    /* kernel TLS does not splice TLS control records */
+
+                    sp->control = 1;
+
+#endif
+
+                } else if (err != NGX_EINTR) {
+                    src->read->eof = 1;
+                    src->read->error = 1;
+                    ngx_connection_error(src, err, "splice() failed");
+                }
+
+            } else if (n == 0) {
+                src->read->ready = 0;
+                src->read->eof = 1;
+
+            } else {
+                if (from_upstream
+                    && u->state->first_byte_time == (ngx_msec_t) -1)
+                {
+                    u->state->first_byte_time = ngx_current_msec
+                                                - u->start_time;
+                }
+
+                sp->size += n;
+                *received += n;
+                progress = 1;
+            }
+        }
+
+    } while (progress);
+
+    if (sp->size) {
+        dst->buffered |= NGX_STREAM_SPLICE_BUFFERED;
+        return NGX_OK;
+    }
+
+    dst->buffered &= ~NGX_STREAM_SPLICE_BUFFERED;
+
+    if (sp->control) {
+
+        /* the pipe is empty, the control record is read by OpenSSL */
+
+        sp->control = 0;
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_splice_test(ngx_connection_t *src, ngx_connection_t *dst)
+{
+    /*
+     * SSL connections are spliced only with kernel TLS, while nothing is
+     * buffered by OpenSSL; QUIC streams have their own I/O methods
+     */
+
+    if (src->recv != ngx_recv) {
+#if (NGX_STREAM_SSL)
+        if (src->recv != ngx_ssl_recv
+            || !src->ssl->ktls_recv
+            || SSL_pending(src->ssl->connection))
+        {
+            return NGX_DECLINED;
+        }
+#else
+        return NGX_DECLINED;
+#endif
+    }
+
+    if (dst->send_chain != ngx_send_chain) {
+#if (NGX_STREAM_SSL)
+        if (dst->send_chain != ngx_ssl_send_chain || !dst->ssl->sendfile) {
+            return NGX_DECLINED;
+        }
+#else
+        return NGX_DECLINED;
+#endif
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_stream_upstream_splice_t *
+ngx_stream_proxy_splice_init(ngx_stream_session_t *s)
+{
+    int                            size;
+    ngx_connection_t              *c;
+    ngx_pool_cleanup_t            *cln;
+    ngx_stream_proxy_srv_conf_t   *pscf;
+    ngx_stream_upstream_splice_t  *sp;
+
+    c = s->connection;
+
+    cln = ngx_pool_cleanup_add(c->pool, sizeof(ngx_stream_upstream_splice_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    sp = cln->data;
+
+    if (pipe2(sp->fd, O_NONBLOCK|O_CLOEXEC) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_errno, "pipe2() failed");
+        return NULL;
+    }
+
+    cln->handler = ngx_stream_proxy_splice_cleanup;
+
+    sp->size = 0;
+    sp->control = 0;
+
+    /* the pipe holds as much data as the buffer would */
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    size = fcntl(sp->fd[1], F_SETPIPE_SZ, (int) pscf->buffer_size);
+
+    if (size == -1) {
+        size = fcntl(sp->fd[1], F_GETPIPE_SZ);
+
+        if (size == -1) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, ngx_errno,
+                          "fcntl(F_GETPIPE_SZ) failed");
+            return NULL;
+        }
+    }
+
+    sp->capacity = size;
+
+    return sp;
+}
+
+
+static void
+ngx_stream_proxy_splice_cleanup(void *data)
+{
+    ngx_stream_upstream_splice_t  *sp = data;
+
+    (void) close(sp->fd[0]);
+    (void) close(sp->fd[1]);
+}
+
+#endif
+
+
 static void
 ngx_stream_proxy_next_upstream(ngx_stream_session_t *s)
 {
@@ -2101,6 +2428,9 @@ ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
     conf->local = NGX_CONF_UNSET_PTR;
     conf->socket_keepalive = NGX_CONF_UNSET;
     conf->half_close = NGX_CONF_UNSET;
+#if (NGX_HAVE_SPLICE)
+    conf->splice = NGX_CONF_UNSET;
+#endif
 
 #if (NGX_STREAM_SSL)
     conf->ssl_enable = NGX_CONF_UNSET;
@@ -2161,6 +2491,10 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_value(conf->half_close, prev->half_close, 0);
 
+#if (NGX_HAVE_SPLICE)
+    ngx_conf_merge_value(conf->splice, prev->splice, 0);
+#endif
+
 #if (NGX_STREAM_SSL)
 
     ngx_conf_merge_value(conf->ssl_enable, prev->ssl_enable, 0);
@@ -114,6 +114,18 @@ typedef struct {
 } ngx_stream_upstream_resolved_t;
 
 
+#if (NGX_HAVE_SPLICE)
+
+typedef struct {
+    ngx_fd_t                           fd[2];
+    size_t                             size;
+    size_t                             capacity;
+    unsigned                           control:1;
+} ngx_stream_upstream_splice_t;
+
+#endif
+
+
 typedef struct {
     ngx_peer_connection_t              peer;
 
@@ -126,6 +138,11 @@ typedef struct {
     ngx_chain_t                       *downstream_out;
     ngx_chain_t                       *downstream_busy;
 
+#if (NGX_HAVE_SPLICE)
+    ngx_stream_upstream_splice_t      *downstream_splice;
+    ngx_stream_upstream_splice_t      *upstream_splice;
+#endif
+
     off_t                              received;
     time_t                             start_sec;
     ngx_uint_t                         requests;